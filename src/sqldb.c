@@ -4,11 +4,20 @@
 #include <stdarg.h>
 #include <inttypes.h>
 #include <time.h>
+#include <stdatomic.h>
 
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
 
+#ifdef PLATFORM_Windows
+#include <winsock2.h>
+#define poll            WSAPoll
+#else
+#include <poll.h>
+#include <sys/mman.h>
+#endif
+
 // TODO: The blob type was not tested!
 
 #include "sqlite3.h"
@@ -28,6 +37,206 @@
 #endif
 
 
+/* *****************************************************************
+ * Memory allocation. Every allocation made by the library goes through
+ * sqldb_malloc() and friends, so that the caller can substitute their own
+ * allocator with sqldb_set_allocator(). Sqlite is given the same
+ * allocator.
+ */
+
+static void *default_malloc (void *ctx, size_t len)
+{
+   (void)ctx;
+   return malloc (len);
+}
+
+static void *default_realloc (void *ctx, void *ptr, size_t len)
+{
+   (void)ctx;
+   return realloc (ptr, len);
+}
+
+static void default_free (void *ctx, void *ptr)
+{
+   (void)ctx;
+   free (ptr);
+}
+
+static struct {
+   sqldb_malloc_fn_t  *malloc_fn;
+   sqldb_realloc_fn_t *realloc_fn;
+   sqldb_free_fn_t    *free_fn;
+   void               *ctx;
+} g_alloc = { default_malloc, default_realloc, default_free, NULL };
+
+// The allocator cannot be replaced while memory from the current one is
+// still in use, so the library's outstanding allocations and its open
+// connections are counted. Sqlite's own allocations are not counted: they
+// are released by sqlite3_shutdown(), which is safe once every connection
+// is closed.
+static atomic_size_t g_nallocs;
+static atomic_size_t g_nconns;
+
+void *sqldb_malloc (size_t len)
+{
+   void *ret = g_alloc.malloc_fn (g_alloc.ctx, len);
+   if (ret)
+      atomic_fetch_add_explicit (&g_nallocs, 1, memory_order_relaxed);
+
+   return ret;
+}
+
+void *sqldb_calloc (size_t nmemb, size_t len)
+{
+   if (len && nmemb > SIZE_MAX / len)
+      return NULL;
+
+   void *ret = sqldb_malloc (nmemb * len);
+   if (ret)
+      memset (ret, 0, nmemb * len);
+
+   return ret;
+}
+
+void *sqldb_realloc (void *ptr, size_t len)
+{
+   void *ret = g_alloc.realloc_fn (g_alloc.ctx, ptr, len);
+   if (ret && !ptr)
+      atomic_fetch_add_explicit (&g_nallocs, 1, memory_order_relaxed);
+
+   return ret;
+}
+
+void sqldb_free (void *ptr)
+{
+   if (!ptr)
+      return;
+
+   g_alloc.free_fn (g_alloc.ctx, ptr);
+   atomic_fetch_sub_explicit (&g_nallocs, 1, memory_order_relaxed);
+}
+
+// Sqlite must be able to find the size of an allocation, so the size is
+// stored in a header in front of each allocation that it makes.
+#define SQLITE_MEM_HDR        (16)
+
+static void *sqlite_mem_malloc (int len)
+{
+   unsigned char *ret = NULL;
+
+   if (len < 0 || !(ret = g_alloc.malloc_fn (g_alloc.ctx,
+                                             (size_t)len + SQLITE_MEM_HDR)))
+      return NULL;
+
+   *(uint64_t *)ret = len;
+   return ret + SQLITE_MEM_HDR;
+}
+
+static void sqlite_mem_free (void *ptr)
+{
+   if (ptr)
+      g_alloc.free_fn (g_alloc.ctx, (unsigned char *)ptr - SQLITE_MEM_HDR);
+}
+
+static void *sqlite_mem_realloc (void *ptr, int len)
+{
+   unsigned char *ret = NULL;
+
+   if (!ptr)
+      return sqlite_mem_malloc (len);
+
+   if (len < 0 || !(ret = g_alloc.realloc_fn (g_alloc.ctx,
+                                    (unsigned char *)ptr - SQLITE_MEM_HDR,
+                                    (size_t)len + SQLITE_MEM_HDR)))
+      return NULL;
+
+   *(uint64_t *)ret = len;
+   return ret + SQLITE_MEM_HDR;
+}
+
+static int sqlite_mem_size (void *ptr)
+{
+   return ptr ? *(uint64_t *)((unsigned char *)ptr - SQLITE_MEM_HDR) : 0;
+}
+
+static int sqlite_mem_roundup (int len)
+{
+   return (len + 7) & ~7;
+}
+
+static int sqlite_mem_init (void *ctx)
+{
+   (void)ctx;
+   return SQLITE_OK;
+}
+
+static void sqlite_mem_shutdown (void *ctx)
+{
+   (void)ctx;
+}
+
+bool sqldb_set_allocator (sqldb_malloc_fn_t *malloc_fn,
+                          sqldb_realloc_fn_t *realloc_fn,
+                          sqldb_free_fn_t *free_fn,
+                          void *ctx)
+{
+   // The allocator that sqlite was built with, restored when the caller
+   // restores the system allocator.
+   static sqlite3_mem_methods sqlite_default;
+   static bool saved = false;
+
+   static const sqlite3_mem_methods methods = {
+      sqlite_mem_malloc,
+      sqlite_mem_free,
+      sqlite_mem_realloc,
+      sqlite_mem_size,
+      sqlite_mem_roundup,
+      sqlite_mem_init,
+      sqlite_mem_shutdown,
+      NULL,
+   };
+
+   bool restore = !malloc_fn && !realloc_fn && !free_fn;
+
+   if (!restore && (!malloc_fn || !realloc_fn || !free_fn)) {
+      PROG_ERR ("Incomplete allocator specified\n");
+      return false;
+   }
+
+   size_t nconns = atomic_load (&g_nconns);
+   size_t nallocs = atomic_load (&g_nallocs);
+   if (nconns || nallocs) {
+      PROG_ERR ("Allocator in use [%zu connections, %zu allocations]\n",
+                  nconns, nallocs);
+      return false;
+   }
+
+   // Sqlite can only be configured while it is not initialised.
+   sqlite3_shutdown ();
+
+   if (!saved) {
+      if ((sqlite3_config (SQLITE_CONFIG_GETMALLOC, &sqlite_default))
+               !=SQLITE_OK) {
+         PROG_ERR ("Failed to retrieve the sqlite allocator\n");
+         return false;
+      }
+      saved = true;
+   }
+
+   if ((sqlite3_config (SQLITE_CONFIG_MALLOC,
+                        restore ? &sqlite_default : &methods))!=SQLITE_OK) {
+      PROG_ERR ("Failed to set the sqlite allocator\n");
+      return false;
+   }
+
+   g_alloc.malloc_fn = restore ? default_malloc : malloc_fn;
+   g_alloc.realloc_fn = restore ? default_realloc : realloc_fn;
+   g_alloc.free_fn = restore ? default_free : free_fn;
+   g_alloc.ctx = restore ? NULL : ctx;
+
+   return true;
+}
+
 static char *lstr_dup (const char *src)
 {
    if (!src)
@@ -35,7 +244,7 @@ static char *lstr_dup (const char *src)
 
    size_t len = strlen (src) + 1;
 
-   char *ret = malloc (len);
+   char *ret = sqldb_malloc (len);
    if (!ret)
       return NULL;
 
@@ -54,7 +263,7 @@ static char *lstr_cat (const char *s1, const char *s2)
 
    nbytes++;
 
-   char *ret = malloc (nbytes);
+   char *ret = sqldb_malloc (nbytes);
    if (!ret) {
       return NULL;
    }
@@ -254,7 +463,7 @@ static bool pgdb_create (sqldb_t *db, const char *dbname)
 
    char *qstring = lstr_cat ("CREATE DATABASE ", dbname);
    bool rc = sqldb_batch (db, qstring, NULL);
-   free (qstring);
+   sqldb_free (qstring);
    return rc;
 }
 
@@ -276,32 +485,249 @@ bool sqldb_create (sqldb_t *db, const char *dbname, sqldb_dbtype_t type)
    }
 }
 
+// The default number of prepared statements kept open per connection.
+#define STMT_CACHE_DEFAULT       (32)
+
+// The length of the name of a postgres prepared statement, "sqldb_sN".
+#define PG_STMT_NAME_LEN         (24)
+
+// A single entry in the per-connection prepared statement cache. Entries
+// are keyed on the query string exactly as the caller passed it in, so
+// that a cache hit requires no rewriting of the query string, together
+// with the signature of the postgres parameter types (always 0 for
+// sqlite), so that a query executed with different parameter types has a
+// statement prepared for each.
+struct stmt_cache_t {
+   char          *query;
+   size_t         qlen;
+   uint64_t       hash;
+   uint64_t       last_used;
+
+   // The result object currently using this statement, if any. A
+   // statement that is in use is never handed out or evicted.
+   sqldb_res_t   *user;
+
+   // For sqlite
+   sqlite3_stmt  *sqlite_stmt;
+
+   // For postgres
+   char           pg_name[PG_STMT_NAME_LEN];
+   uint64_t       pg_sig;
+};
+
 // TODO: Do we need a lockfile for SQLITE?
+#define PIPELINE_NONE         (0)
+#define PIPELINE_IMMEDIATE    (1)
+#define PIPELINE_PG           (2)
+
+#define ASYNC_NONE            (0)
+#define ASYNC_SENT            (1)   // Sent, not yet completely received
+#define ASYNC_READY           (2)   // Ready for sqldb_result()
+
+// The outcome of a single statement queued in a pipeline.
+struct pipeline_item_t {
+   bool      ok;
+   uint64_t  nchanges;
+   char     *errmsg;
+};
+
+// A message sent to the server in a postgres pipeline, in the order in
+// which the results will arrive: either the preparation of a cached
+// statement or the execution of the statement for a pipeline item.
+struct pipeline_op_t {
+   struct stmt_cache_t *prepare;
+   size_t               item;
+};
+
+// Statement counters; see the statement statistics further below.
+struct counters_t {
+   atomic_uint_fast64_t nqueries;
+   atomic_uint_fast64_t nerrors;
+   atomic_uint_fast64_t nprepares;
+   atomic_uint_fast64_t nrows;
+   atomic_uint_fast64_t nbytes;
+};
+
 struct sqldb_t {
    sqldb_dbtype_t type;
    char *lasterr;
+   uint32_t flags;
 
    // Used for sqlite only
    sqlite3 *sqlite_db;
 
    // Used for postgres only
    PGconn *pg_db;
+   PostgresPollingStatusType pg_poll;
    uint64_t nchanges;
+   sqldb_res_t *stream_res;
+   uint32_t pg_stmt_counter;
+   char pg_sqlstate[6];
+
+   // Statements evicted from the cache that are still to be deallocated
+   // on the server, see pgdb_dealloc_flush()
+   char (*pg_dealloc)[PG_STMT_NAME_LEN];
+   size_t pg_dealloc_len;
+   size_t pg_dealloc_max;
+
+   // The number of nested sqldb_tx_begin() calls that are still open
+   uint32_t tx_depth;
+
+   // The state of a query sent with sqldb_send(), and its result once it
+   // has been received
+   int async;
+   PGresult *async_pgr;
+   sqldb_res_t *async_res;
+
+   // The active pipeline, if any, and the results of the last one
+   int pipeline;
+   bool pipe_own_tx;
+   bool pipe_failed;
+   struct pipeline_item_t *pipe_items;
+   size_t pipe_nitems;
+   size_t pipe_items_max;
+   struct pipeline_op_t *pipe_ops;
+   size_t pipe_nops;
+   size_t pipe_ops_max;
+
+   // The prepared statement cache
+   struct stmt_cache_t **cache;
+   size_t cache_len;
+   size_t cache_max;
+   uint64_t cache_tick;
+   uint64_t cache_hits;
+   uint64_t cache_misses;
+
+   struct counters_t stats;
+
+   // The statistics of this connection's statements are recorded under
+   // this tag instead of under their query strings, see sqldb_stats_tag()
+   char *stats_tag;
+
+   // The slow statement trace, see sqldb_set_trace()
+   sqldb_trace_fn_t *trace_fn;
+   void *trace_ctx;
+   uint64_t trace_threshold_us;
+   bool trace_redact;
+};
+
+/* *****************************************************************
+ * Result arenas. With sqldb_FLAG_ARENA set a result and the values that
+ * are scanned from it are allocated from a bump allocator, which is
+ * released in one go when the result is reset or deleted.
+ */
+
+// The first block is allocated together with the result; once it is full
+// each new block is twice the size of the previous one.
+#define ARENA_INLINE          (512)
+#define ARENA_BLOCK_MIN       (4096)
+#define ARENA_ALIGN           (sizeof (uint64_t))
+
+struct arena_block_t {
+   struct arena_block_t *next;
+   size_t                len;
+   size_t                used;
+   bool                  owned;         // False for the inline block
+   uint64_t              data[];
+};
+
+struct arena_t {
+   bool                  enabled;
+   struct arena_block_t *blocks;        // The newest (and largest) first
 };
 
+static void *arena_alloc (struct arena_t *arena, size_t len)
+{
+   struct arena_block_t *block = arena->blocks;
+
+   len = (len + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+
+   if (!block || block->len - block->used < len) {
+      size_t blen = block ? block->len * 2 : ARENA_BLOCK_MIN;
+      if (blen < ARENA_BLOCK_MIN)
+         blen = ARENA_BLOCK_MIN;
+      if (blen < len)
+         blen = len;
+
+      if (!(block = sqldb_malloc (sizeof *block + blen)))
+         return NULL;
+
+      block->next = arena->blocks;
+      block->len = blen;
+      block->used = 0;
+      block->owned = true;
+      arena->blocks = block;
+   }
+
+   void *ret = (unsigned char *)block->data + block->used;
+   block->used += len;
+   return ret;
+}
+
+// Keeps only the newest block, which is the largest, for reuse.
+static void arena_reset (struct arena_t *arena)
+{
+   struct arena_block_t *block = arena->blocks;
+
+   if (!block)
+      return;
+
+   while (block->next) {
+      struct arena_block_t *next = block->next->next;
+      if (block->next->owned)
+         sqldb_free (block->next);
+      block->next = next;
+   }
+
+   block->used = 0;
+}
+
+static void arena_free (struct arena_t *arena)
+{
+   arena_reset (arena);
+
+   if (arena->blocks && arena->blocks->owned)
+      sqldb_free (arena->blocks);
+
+   arena->blocks = NULL;
+}
+
 struct sqldb_res_t {
    sqldb_dbtype_t type;
    sqldb_t       *dbcon;
    char          *lasterr;
 
-   // For sqlite
+   // The values scanned from the result when sqldb_FLAG_ARENA was set at
+   // the time that it was created.
+   struct arena_t arena;
+
+   // The statistics entry for the query and the time at which execution
+   // started, which is zero when statistics are not being collected. The
+   // rows and bytes are added to the entry when the result is released.
+   struct stats_entry_t *stats;
+   uint64_t       stats_start;
+   bool           stats_stepped;
+   bool           stats_drained;
+   uint64_t       stats_rows;
+   uint64_t       stats_bytes;
+
+   // The current row was stepped to by sqldb_res_fetch_batch() but did not
+   // fit in the batch; it is returned by the next fetch or step.
+   bool           row_pending;
+
+   // For sqlite. Stepping a completed statement would restart it, so
+   // completion is recorded.
    sqlite3_stmt *sqlite_stmt;
+   struct stmt_cache_t *cached;
+   bool sqlite_done;
 
-   // For postgres
+   // For postgres. In streaming mode pgr holds only the most recently
+   // received rows and the remainder are read from the connection.
    PGresult *pgr;
    int current_row;
    int nrows;
    uint64_t last_id;
+   bool streaming;
 };
 
 
@@ -319,7 +745,7 @@ static void err_printf (char **dst, const char *fmts, va_list ap)
    if (!(len = vsnprintf (tmp, 0, fmts, apc)))
       return;
 
-   if (!(tmp = malloc (len + 1))) {
+   if (!(tmp = sqldb_malloc (len + 1))) {
       PROG_ERR ("FATAL ERROR: Out of memory in err_printf()\n");
       return;
    }
@@ -327,7 +753,7 @@ static void err_printf (char **dst, const char *fmts, va_list ap)
    memset (tmp, 0, len + 1);
 
    vsnprintf (tmp, len, fmts, ap);
-   free (*dst);
+   sqldb_free (*dst);
    (*dst) = tmp;
 
    va_end (apc);
@@ -355,1040 +781,6435 @@ static void res_err_printf (sqldb_res_t *res, const char *fmts, ...)
    va_end (ap);
 }
 
-// A lot of the following functions will be refactored only when working
-// on the postgresql integration
-static sqldb_t *sqlitedb_open (sqldb_t *ret, const char *dbname)
-{
-   bool error = true;
-   int mode = SQLITE_OPEN_READWRITE;
-   int rc = sqlite3_open_v2 (dbname, &ret->sqlite_db, mode, NULL);
-   if (rc!=SQLITE_OK) {
-      const char *tmp =  sqlite3_errstr (rc);
-      PROG_ERR ("(%s) Unable to open database: %s\n", dbname, tmp);
-      goto errorexit;
-   }
+/* *****************************************************************
+ * The prepared statement cache. Each connection holds up to cache_max
+ * prepared statements, evicted in least-recently-used order. For sqlite
+ * the entry holds the sqlite3_stmt itself, which is reset and reused on
+ * every hit. For postgres the entry holds the name of a server-side
+ * prepared statement.
+ */
 
-   if (!(sqldb_batch (ret, "PRAGMA foreign_keys = ON", NULL))) {
-      const char *tmp =  sqlite3_errstr (rc);
-      PROG_ERR ("(%s) Unable to open database: %s\n", dbname, tmp);
-      goto errorexit;
-   }
+// A query as passed to the backends. The key is the string as given by
+// the caller and is used to look the statement up in the cache. The
+// native string is the query rewritten for the backend, if it is
+// already known (i.e. the query was compiled into a template).
+struct query_t {
+   const char *key;
+   size_t      klen;
+   uint64_t    hash;
+   const sqldb_tmpl_t *tmpl;
+};
 
-   error = false;
+static uint64_t stmt_hash (const char *query, size_t *len)
+{
+   uint64_t ret = 0xcbf29ce484222325;
+   size_t i = 0;
 
-errorexit:
-   if (error) {
-      sqldb_close (ret);
-      ret = NULL;
+   for (i=0; query[i]; i++) {
+      ret ^= (uint8_t)query[i];
+      ret *= 0x100000001b3;
    }
+
+   *len = i;
    return ret;
 }
 
-static sqldb_t *pgdb_open (sqldb_t *ret, const char *dbname)
+// A DEALLOCATE is rejected by a transaction that has already failed, and
+// costs a round trip of its own, so the names of evicted statements are
+// kept until pgdb_dealloc_flush() finds the connection idle. A name that
+// cannot be kept is dropped; the statement then lasts until the
+// connection is closed.
+static void pgdb_dealloc_defer (sqldb_t *db, const char *name)
 {
-   bool error = false;
-
-   if (!(ret->pg_db = PQconnectdb (dbname))) {
-      SQLDB_OOM (dbname);
-      goto errorexit;
-   }
-
-   if ((PQstatus (ret->pg_db))==CONNECTION_BAD) {
-      PROG_ERR ("[%s] Connection failure: [%s]\n",
-                       dbname,
-                       PQerrorMessage (ret->pg_db));
-      goto errorexit;
-   }
-
-   error = false;
-
-errorexit:
-   if (error) {
-      sqldb_close (ret);
-      ret = NULL;
+   if (db->pg_dealloc_len >= db->pg_dealloc_max) {
+      size_t newmax = db->pg_dealloc_max ? db->pg_dealloc_max * 2 : 8;
+      char (*tmp)[PG_STMT_NAME_LEN] =
+         sqldb_realloc (db->pg_dealloc, newmax * sizeof *tmp);
+      if (!tmp)
+         return;
+      db->pg_dealloc = tmp;
+      db->pg_dealloc_max = newmax;
    }
 
-   return ret;
+   snprintf (db->pg_dealloc[db->pg_dealloc_len++], PG_STMT_NAME_LEN,
+             "%s", name);
 }
 
-sqldb_t *sqldb_open (const char *dbname, sqldb_dbtype_t type)
+// Deallocates the evicted statements in a single round trip, but only
+// when the connection is idle and outside of a transaction.
+static void pgdb_dealloc_flush (sqldb_t *db)
 {
-   sqldb_t *ret = malloc (sizeof *ret);
-   if (!ret) {
-      SQLDB_OOM (dbname);
-      goto errorexit;
-   }
-
-   memset (ret, 0, sizeof *ret);
+   char *qstring = NULL;
+   size_t len = 0;
 
-   ret->type = type;
+   if (!db->pg_dealloc_len || !db->pg_db || db->tx_depth
+         || db->async!=ASYNC_NONE || db->pipeline!=PIPELINE_NONE
+         || db->stream_res
+         || PQtransactionStatus (db->pg_db)!=PQTRANS_IDLE)
+      return;
 
-   if (!dbname)
-      goto errorexit;
+   if (!(qstring = sqldb_malloc (db->pg_dealloc_len
+                                 * (PG_STMT_NAME_LEN + 13) + 1)))
+      return;
 
-   switch (type) {
-      case sqldb_SQLITE:   return sqlitedb_open (ret, dbname);
-      case sqldb_POSTGRES: return pgdb_open (ret, dbname);
-      default:             PROG_ERR ("Error: dbtype [%u] is unknown\n",
-                                            type);
-                           goto errorexit;
+   qstring[0] = 0;
+   for (size_t i=0; i<db->pg_dealloc_len; i++) {
+      len += sprintf (&qstring[len], "DEALLOCATE %s;", db->pg_dealloc[i]);
    }
 
-errorexit:
-   free (ret);
-   return NULL;
-}
+   // The statements run in one implicit transaction, so should one of
+   // them fail those after it are not deallocated; that only happens
+   // when the server has already dropped them.
+   PQclear (PQexec (db->pg_db, qstring));
+   sqldb_free (qstring);
 
-sqldb_dbtype_t sqldb_type (sqldb_t *db)
-{
-   return db ? db->type : sqldb_UNKNOWN;
+   db->pg_dealloc_len = 0;
 }
 
-void sqldb_close (sqldb_t *db)
+static void stmt_cache_entry_del (sqldb_t *db, struct stmt_cache_t *entry)
 {
-   if (!db)
+   if (!entry)
       return;
 
+   if (entry->user) {
+      // A result is still using this statement; the result now owns
+      // the statement and will finalize it when it is deleted.
+      entry->user->cached = NULL;
+      entry->sqlite_stmt = NULL;
+   }
+
    switch (db->type) {
-      case sqldb_SQLITE:   sqlite3_close (db->sqlite_db);               break;
-      case sqldb_POSTGRES: PQfinish (db->pg_db);                        break;
-      default:             db_err_printf (db, "Unknown type %i\n", db->type);
+      case sqldb_SQLITE:   sqlite3_finalize (entry->sqlite_stmt);
+                           break;
+
+      case sqldb_POSTGRES: if (db->pg_db && entry->pg_name[0])
+                              pgdb_dealloc_defer (db, entry->pg_name);
                            break;
+
+      default:             break;
    }
 
-   free (db->lasterr);
-   memset (db, 0, sizeof *db);
-   free (db);
+   sqldb_free (entry->query);
+   sqldb_free (entry);
 }
 
-const char *sqldb_lasterr (sqldb_t *db)
+static struct stmt_cache_t *stmt_cache_find (sqldb_t *db,
+                                             const struct query_t *query,
+                                             uint64_t sig)
 {
-   return db ? db->lasterr : "(NULL SQLDB OBJECT)";
+   for (size_t i=0; i<db->cache_len; i++) {
+      struct stmt_cache_t *entry = db->cache[i];
+      if (entry->hash == query->hash &&
+          entry->pg_sig == sig &&
+          entry->qlen == query->klen &&
+          (memcmp (entry->query, query->key, query->klen))==0) {
+         entry->last_used = ++db->cache_tick;
+         return entry;
+      }
+   }
+
+   return NULL;
 }
 
-void sqldb_clearerr (sqldb_t *db)
+// Removes entry at index from the cache, keeping the array compact.
+static void stmt_cache_remove (sqldb_t *db, size_t index)
 {
-   if (!db)
-      return;
+   stmt_cache_entry_del (db, db->cache[index]);
+   db->cache_len--;
+   db->cache[index] = db->cache[db->cache_len];
+   db->cache[db->cache_len] = NULL;
+}
 
-   free (db->lasterr);
-   db->lasterr = NULL;
+static void stmt_cache_evict (sqldb_t *db, struct stmt_cache_t *entry)
+{
+   for (size_t i=0; i<db->cache_len; i++) {
+      if (db->cache[i] == entry) {
+         stmt_cache_remove (db, i);
+         return;
+      }
+   }
 }
 
-static char *fix_string (sqldb_dbtype_t type, const char *string)
+// Creates a new, empty, entry for the query and places it in the cache,
+// evicting the least-recently-used idle entry if the cache is full.
+// Returns NULL if the cache is disabled, full of busy entries, or if
+// memory could not be allocated.
+static struct stmt_cache_t *stmt_cache_new (sqldb_t *db,
+                                            const struct query_t *query,
+                                            uint64_t sig)
 {
-   char *ret = NULL;
-   char r = 0;
+   struct stmt_cache_t *ret = NULL;
 
-   switch (type) {
-      case sqldb_SQLITE:      r = '?'; break;
-      case sqldb_POSTGRES:    r = '$'; break;
-      default:                r = 0;   break;
+   if (!db->cache_max)
+      return NULL;
+
+   if (db->cache_len >= db->cache_max) {
+      // The operations of a pipeline refer to the entries prepared
+      // earlier in it, so none are evicted until it has ended.
+      if (db->pipeline==PIPELINE_PG)
+         return NULL;
+
+      size_t victim = (size_t)-1;
+      for (size_t i=0; i<db->cache_len; i++) {
+         if (db->cache[i]->user)
+            continue;
+         if (victim==(size_t)-1 ||
+             db->cache[i]->last_used < db->cache[victim]->last_used)
+            victim = i;
+      }
+      if (victim==(size_t)-1)
+         return NULL;
+      stmt_cache_remove (db, victim);
    }
 
-   if (!r) {
-      PROG_ERR ("(%i) Unknown type\n", type);
-      return NULL;
+   if (!db->cache) {
+      if (!(db->cache = sqldb_malloc ((sizeof *db->cache) * db->cache_max)))
+         return NULL;
    }
 
-   ret = lstr_dup (string);
-   if (!ret) {
-      SQLDB_OOM (string);
+   if (!(ret = sqldb_malloc (sizeof *ret)))
       return NULL;
-   }
 
-   char *tmp = ret;
-   while (*tmp) {
-      if (*tmp=='#')
-         *tmp = r;
-      tmp++;
+   memset (ret, 0, sizeof *ret);
+
+   if (!(ret->query = sqldb_malloc (query->klen + 1))) {
+      sqldb_free (ret);
+      return NULL;
    }
 
+   memcpy (ret->query, query->key, query->klen + 1);
+   ret->qlen = query->klen;
+   ret->hash = query->hash;
+   ret->pg_sig = sig;
+   ret->last_used = ++db->cache_tick;
+
+   db->cache[db->cache_len++] = ret;
+
    return ret;
 }
 
-static void res_seterr (sqldb_res_t *res, const char *msg)
+static void stmt_cache_clear (sqldb_t *db)
 {
-   if (!res || !msg)
-      return;
+   while (db->cache_len)
+      stmt_cache_remove (db, db->cache_len - 1);
 
-   free (res->lasterr);
-   res->lasterr = lstr_dup (msg);
+   sqldb_free (db->cache);
+   db->cache = NULL;
 }
 
-const char *sqldb_res_lasterr (sqldb_res_t *res)
+size_t sqldb_stmt_cache_size (sqldb_t *db, size_t nstmts)
 {
-   if (!res)
-      return NULL;
-
-   return res->lasterr;
+   if (!db)
+      return 0;
+
+   size_t ret = db->cache_max;
+
+   stmt_cache_clear (db);
+   db->cache_max = nstmts;
+
+   return ret;
 }
 
-void sqldb_res_clearerr (sqldb_res_t *res)
+void sqldb_stmt_cache_stats (sqldb_t *db, uint64_t *hits,
+                                          uint64_t *misses,
+                                          size_t   *nstmts)
 {
-   if (!res)
-      return;
+   if (hits)
+      *hits = db ? db->cache_hits : 0;
 
-   free (res->lasterr);
-   res->lasterr = NULL;
+   if (misses)
+      *misses = db ? db->cache_misses : 0;
+
+   if (nstmts)
+      *nstmts = db ? db->cache_len : 0;
 }
 
-uint64_t sqldb_count_changes (sqldb_t *db)
+/* *****************************************************************
+ * Statement statistics. Every query string that is executed gets an
+ * entry in a global table, which holds its counters and a latency
+ * histogram for each phase of its execution. Entries are added without
+ * locking and are never removed, and all the values are atomic so that
+ * snapshots can be taken from any thread while statements are executing.
+ */
+
+// The size of the global table; must be a power of two.
+#define STATS_SLOTS           (512)
+
+// Each power of two from 2^3 to 2^35 is split into 8 buckets; values
+// below 8 have a bucket each.
+#define HIST_SUB_BITS         (3)
+#define HIST_MAX_EXP          (35)
+
+struct hist_t {
+   atomic_uint_fast64_t count;
+   atomic_uint_fast64_t total_us;
+   atomic_uint_fast64_t max_us;
+   atomic_uint_fast64_t buckets[sqldb_HIST_NBUCKETS];
+};
+
+struct stats_entry_t {
+   uint64_t             hash;
+   size_t               qlen;
+   char                *query;     // The tag, for tagged entries
+   bool                 tagged;
+   _Atomic (char *)     label;
+   struct counters_t    counters;
+   struct hist_t        timings[sqldb_TIMING_COUNT];
+};
+
+static struct {
+   atomic_bool                      enabled;
+   struct counters_t                totals;
+   _Atomic (struct stats_entry_t *) slots[STATS_SLOTS];
+} g_stats;
+
+static uint64_t clock_us (void)
 {
-   uint64_t ret = 0;
+   struct timespec ts;
+   clock_gettime (CLOCK_MONOTONIC, &ts);
+   return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
 
-   if (!db)
-      return 0;
+static uint32_t hist_bucket (uint64_t value)
+{
+   if (value < (1 << HIST_SUB_BITS))
+      return value;
 
-   switch (db->type) {
-      case sqldb_SQLITE:   ret = sqlite3_changes (db->sqlite_db);
-                           break;
+   uint32_t exp = 63 - __builtin_clzll (value);
+   if (exp > HIST_MAX_EXP)
+      return sqldb_HIST_NBUCKETS - 1;
 
-      case sqldb_POSTGRES: ret = db->nchanges;
-                           break;
+   uint32_t sub = (value >> (exp - HIST_SUB_BITS)) & ((1 << HIST_SUB_BITS) - 1);
+   return ((exp - HIST_SUB_BITS + 1) << HIST_SUB_BITS) + sub;
+}
 
-      default:             ret = 0;
-                           break;
+// The largest value that is recorded in the bucket.
+static uint64_t hist_bucket_max (uint32_t bucket)
+{
+   if (bucket < (1 << HIST_SUB_BITS))
+      return bucket;
+
+   uint32_t exp = (bucket >> HIST_SUB_BITS) + HIST_SUB_BITS - 1;
+   uint64_t sub = bucket & ((1 << HIST_SUB_BITS) - 1);
+   uint64_t width = (uint64_t)1 << (exp - HIST_SUB_BITS);
+
+   return (((uint64_t)1 << exp) + sub * width) + width - 1;
+}
+
+static void hist_record (struct hist_t *hist, uint64_t us)
+{
+   atomic_fetch_add_explicit (&hist->count, 1, memory_order_relaxed);
+   atomic_fetch_add_explicit (&hist->total_us, us, memory_order_relaxed);
+   atomic_fetch_add_explicit (&hist->buckets[hist_bucket (us)], 1,
+                              memory_order_relaxed);
+
+   uint64_t max = atomic_load_explicit (&hist->max_us, memory_order_relaxed);
+   while (us > max
+            && !atomic_compare_exchange_weak_explicit (&hist->max_us, &max, us,
+                                                       memory_order_relaxed,
+                                                       memory_order_relaxed))
+      ;
+}
+
+static void counter_add (atomic_uint_fast64_t *counter, uint64_t n)
+{
+   atomic_fetch_add_explicit (counter, n, memory_order_relaxed);
+}
+
+static void counters_load (struct counters_t *src, sqldb_counters_t *dst)
+{
+   dst->nqueries = atomic_load_explicit (&src->nqueries, memory_order_relaxed);
+   dst->nerrors = atomic_load_explicit (&src->nerrors, memory_order_relaxed);
+   dst->nprepares = atomic_load_explicit (&src->nprepares,
+                                          memory_order_relaxed);
+   dst->nrows = atomic_load_explicit (&src->nrows, memory_order_relaxed);
+   dst->nbytes = atomic_load_explicit (&src->nbytes, memory_order_relaxed);
+}
+
+static void counters_reset (struct counters_t *counters)
+{
+   atomic_store (&counters->nqueries, 0);
+   atomic_store (&counters->nerrors, 0);
+   atomic_store (&counters->nprepares, 0);
+   atomic_store (&counters->nrows, 0);
+   atomic_store (&counters->nbytes, 0);
+}
+
+// Finds the entry for the query (or for the tag, if tagged is set),
+// adding it if create is set. Returns NULL if the entry does not exist or
+// the table is full.
+static struct stats_entry_t *stats_entry (uint64_t hash, const char *query,
+                                          size_t qlen, bool tagged,
+                                          bool create)
+{
+   for (size_t i=0; i<STATS_SLOTS; i++) {
+      size_t slot = (hash + i) & (STATS_SLOTS - 1);
+      struct stats_entry_t *entry = atomic_load (&g_stats.slots[slot]);
+
+      if (!entry) {
+         if (!create)
+            return NULL;
+
+         if (!(entry = sqldb_calloc (1, sizeof *entry))
+               || !(entry->query = sqldb_malloc (qlen + 1))) {
+            SQLDB_OOM (query);
+            sqldb_free (entry);
+            return NULL;
+         }
+         memcpy (entry->query, query, qlen + 1);
+         entry->qlen = qlen;
+         entry->hash = hash;
+         entry->tagged = tagged;
+
+         struct stats_entry_t *existing = NULL;
+         if ((atomic_compare_exchange_strong (&g_stats.slots[slot],
+                                              &existing, entry)))
+            return entry;
+
+         // Another thread took the slot first.
+         sqldb_free (entry->query);
+         sqldb_free (entry);
+         entry = existing;
+      }
+
+      if (entry->hash==hash && entry->qlen==qlen && entry->tagged==tagged
+            && (memcmp (entry->query, query, qlen))==0)
+         return entry;
    }
 
-   return ret;
+   return NULL;
 }
 
-uint64_t sqldb_res_last_id (sqldb_res_t *res)
+bool sqldb_stats_enable (bool enable)
 {
-   uint64_t ret = 0;
+   return atomic_exchange (&g_stats.enabled, enable);
+}
 
-   if (!res)
-      return 0;
+bool sqldb_stats_label (const char *query, const char *label)
+{
+   struct stats_entry_t *entry = NULL;
+   char *copy = NULL;
+   char *existing = NULL;
+   size_t qlen = 0;
 
-   switch (res->type) {
-      case sqldb_SQLITE:   ret = sqlite3_last_insert_rowid (res->dbcon->sqlite_db);
-                           break;
+   if (!query || !label)
+      return false;
 
-      case sqldb_POSTGRES: ret = res->last_id;
-                           break;
+   // The entry is not created while nothing would be recorded in it.
+   if (!(atomic_load_explicit (&g_stats.enabled, memory_order_relaxed)))
+      return false;
 
-      default:             ret = 0;
-                           break;
+   uint64_t hash = stmt_hash (query, &qlen);
+   if (!(entry = stats_entry (hash, query, qlen, false, true)))
+      return false;
+
+   if (atomic_load (&entry->label))
+      return true;
+
+   if (!(copy = lstr_dup (label))) {
+      SQLDB_OOM (label);
+      return false;
    }
 
-   return ret;
+   if (!(atomic_compare_exchange_strong (&entry->label, &existing, copy)))
+      sqldb_free (copy);
+
+   return true;
 }
 
-uint32_t sqldb_res_num_columns (sqldb_res_t *res)
+bool sqldb_stats_tag (sqldb_t *db, const char *tag)
 {
-   if (!res)
-      return 0;
+   char *copy = NULL;
 
-   uint32_t ret = 0;
+   if (!db)
+      return false;
 
-   switch (res->type) {
-      case  sqldb_SQLITE:  ret = sqlite3_column_count (res->sqlite_stmt);
-                           break;
+   if (tag && !(copy = lstr_dup (tag))) {
+      SQLDB_OOM (tag);
+      return false;
+   }
 
-      case sqldb_POSTGRES: ret = PQnfields (res->pgr);
-                           break;
+   sqldb_free (db->stats_tag);
+   db->stats_tag = copy;
+   return true;
+}
 
-      default:             ret = 0;
-                           break;
+void sqldb_stats_counters (sqldb_t *db, sqldb_counters_t *dst)
+{
+   if (!dst)
+      return;
+
+   counters_load (db ? &db->stats : &g_stats.totals, dst);
+}
+
+sqldb_stats_t *sqldb_stats_snapshot (void)
+{
+   sqldb_stats_t *ret = NULL;
+   struct stats_entry_t *entries[STATS_SLOTS];
+   char *labels[STATS_SLOTS];
+   size_t nentries = 0;
+   size_t slen = 0;
+
+   // The strings are measured first; entries and labels added after this
+   // point are left out of the snapshot.
+   for (size_t i=0; i<STATS_SLOTS; i++) {
+      struct stats_entry_t *entry = atomic_load (&g_stats.slots[i]);
+      if (!entry)
+         continue;
+
+      labels[nentries] = atomic_load (&entry->label);
+      slen += entry->qlen + 1;
+      if (labels[nentries])
+         slen += strlen (labels[nentries]) + 1;
+      entries[nentries++] = entry;
+   }
+
+   size_t len = sizeof *ret + nentries * sizeof *ret->entries + slen;
+   if (!(ret = sqldb_calloc (1, len))) {
+      SQLDB_OOM ("Statistics snapshot");
+      return NULL;
+   }
+
+   ret->entries = (sqldb_stats_entry_t *)(ret + 1);
+   ret->nentries = nentries;
+   char *strings = (char *)(ret->entries + nentries);
+
+   counters_load (&g_stats.totals, &ret->totals);
+
+   for (size_t i=0; i<nentries; i++) {
+      sqldb_stats_entry_t *dst = &ret->entries[i];
+      char *label = labels[i];
+
+      dst->query = strcpy (strings, entries[i]->query);
+      strings += entries[i]->qlen + 1;
+      dst->label = dst->query;
+      if (label) {
+         dst->label = strcpy (strings, label);
+         strings += strlen (label) + 1;
+      }
+
+      counters_load (&entries[i]->counters, &dst->counters);
+
+      for (size_t t=0; t<sqldb_TIMING_COUNT; t++) {
+         struct hist_t *src = &entries[i]->timings[t];
+         dst->timings[t].count = atomic_load (&src->count);
+         dst->timings[t].total_us = atomic_load (&src->total_us);
+         dst->timings[t].max_us = atomic_load (&src->max_us);
+         for (size_t b=0; b<sqldb_HIST_NBUCKETS; b++) {
+            dst->timings[t].buckets[b] = atomic_load_explicit (
+                                                &src->buckets[b],
+                                                memory_order_relaxed);
+         }
+      }
    }
 
    return ret;
 }
 
-char **sqldb_res_column_names (sqldb_res_t *res)
+void sqldb_stats_reset (sqldb_t *db)
 {
-   bool error = true;
-   char **ret = NULL;
-   uint32_t ncols = 0;
+   if (db) {
+      counters_reset (&db->stats);
+      return;
+   }
 
-   if (!res)
-      goto errorexit;
+   counters_reset (&g_stats.totals);
+
+   for (size_t i=0; i<STATS_SLOTS; i++) {
+      struct stats_entry_t *entry = atomic_load (&g_stats.slots[i]);
+      if (!entry)
+         continue;
+
+      counters_reset (&entry->counters);
+      for (size_t t=0; t<sqldb_TIMING_COUNT; t++) {
+         struct hist_t *hist = &entry->timings[t];
+         atomic_store (&hist->count, 0);
+         atomic_store (&hist->total_us, 0);
+         atomic_store (&hist->max_us, 0);
+         for (size_t b=0; b<sqldb_HIST_NBUCKETS; b++) {
+            atomic_store_explicit (&hist->buckets[b], 0,
+                                   memory_order_relaxed);
+         }
+      }
+   }
+}
 
-   if (!(ncols = sqldb_res_num_columns (res)))
-      goto errorexit;
+uint64_t sqldb_hist_percentile (const sqldb_hist_t *hist, double pct)
+{
+   if (!hist || !hist->count)
+      return 0;
 
-   if (!(ret = malloc ((sizeof *ret) * (ncols + 1))))
-      goto errorexit;
+   // The rank of the value, counting from one.
+   uint64_t rank = (uint64_t)(pct / 100.0 * hist->count + 0.5);
+   if (rank < 1)
+      rank = 1;
 
-   memset (ret, 0, (sizeof *ret) * (ncols + 1));
+   uint64_t seen = 0;
+   for (uint32_t i=0; i<sqldb_HIST_NBUCKETS; i++) {
+      if ((seen += hist->buckets[i]) >= rank) {
+         uint64_t ret = hist_bucket_max (i);
+         return ret < hist->max_us ? ret : hist->max_us;
+      }
+   }
 
-   for (uint32_t i=0; i<ncols; i++) {
-      const char *tmp = NULL;
-      switch (res->type) {
-         case  sqldb_SQLITE:  tmp = sqlite3_column_name (res->sqlite_stmt, i);
-                              break;
+   return hist->max_us;
+}
 
-         case sqldb_POSTGRES: tmp = PQfname (res->pgr, i);
-                              break;
+void sqldb_stats_dump (const sqldb_stats_t *stats, FILE *outf)
+{
+   static const char *names[] = {
+      "prepare", "execute", "first_row", "drain",
+   };
 
-         default:             tmp = NULL;
-                              break;
+   if (!stats)
+      return;
+
+   if (!outf)
+      outf = stdout;
+
+   const sqldb_counters_t *c = &stats->totals;
+   fprintf (outf, "TOTAL queries=%" PRIu64 " errors=%" PRIu64
+                  " prepares=%" PRIu64 " rows=%" PRIu64 " bytes=%" PRIu64 "\n",
+                  c->nqueries, c->nerrors, c->nprepares, c->nrows, c->nbytes);
+
+   for (size_t i=0; i<stats->nentries; i++) {
+      const sqldb_stats_entry_t *entry = &stats->entries[i];
+
+      c = &entry->counters;
+      fprintf (outf, "[%s]\n", entry->label);
+      fprintf (outf, "   queries=%" PRIu64 " errors=%" PRIu64
+                     " prepares=%" PRIu64 " rows=%" PRIu64
+                     " bytes=%" PRIu64 "\n",
+                     c->nqueries, c->nerrors, c->nprepares, c->nrows,
+                     c->nbytes);
+
+      for (size_t t=0; t<sqldb_TIMING_COUNT; t++) {
+         const sqldb_hist_t *hist = &entry->timings[t];
+         if (!hist->count)
+            continue;
+
+         fprintf (outf, "   %-10s n=%" PRIu64 " mean=%" PRIu64 "us"
+                        " p50=%" PRIu64 "us p90=%" PRIu64 "us"
+                        " p99=%" PRIu64 "us max=%" PRIu64 "us\n",
+                        names[t], hist->count, hist->total_us / hist->count,
+                        sqldb_hist_percentile (hist, 50),
+                        sqldb_hist_percentile (hist, 90),
+                        sqldb_hist_percentile (hist, 99),
+                        hist->max_us);
       }
-      if (!(ret[i] = lstr_dup (tmp)))
-         goto errorexit;
    }
+}
 
-   error = false;
+// Starts timing the execution of the query into res.
+static void stats_begin (sqldb_res_t *res, const struct query_t *query)
+{
+   if (!(atomic_load_explicit (&g_stats.enabled, memory_order_relaxed)))
+      return;
 
-errorexit:
-   if (error) {
-      for (size_t i=0; ret && ret[i]; i++)
-         free (ret[i]);
+   const char *tag = res->dbcon ? res->dbcon->stats_tag : NULL;
+   if (tag) {
+      size_t tlen = 0;
+      uint64_t hash = stmt_hash (tag, &tlen);
+      res->stats = stats_entry (hash, tag, tlen, true, true);
+   } else {
+      res->stats = stats_entry (query->hash, query->key, query->klen,
+                                false, true);
+   }
+   res->stats_start = clock_us ();
+}
 
-      free (ret);
-      ret = NULL;
+// Records a statement that had to be prepared, which took from start
+// until now.
+static void stats_prepared (sqldb_t *db, sqldb_res_t *res, uint64_t start)
+{
+   if (!res->stats_start)
+      return;
+
+   counter_add (&db->stats.nprepares, 1);
+   counter_add (&g_stats.totals.nprepares, 1);
+
+   if (res->stats) {
+      counter_add (&res->stats->counters.nprepares, 1);
+      hist_record (&res->stats->timings[sqldb_TIMING_PREPARE],
+                   clock_us () - start);
    }
+}
 
-   return ret;
+static void stats_executed (sqldb_t *db, sqldb_res_t *res, bool ok)
+{
+   if (!res->stats_start)
+      return;
+
+   counter_add (&db->stats.nqueries, 1);
+   counter_add (&g_stats.totals.nqueries, 1);
+   if (!ok) {
+      counter_add (&db->stats.nerrors, 1);
+      counter_add (&g_stats.totals.nerrors, 1);
+   }
+
+   if (res->stats) {
+      counter_add (&res->stats->counters.nqueries, 1);
+      if (!ok)
+         counter_add (&res->stats->counters.nerrors, 1);
+      hist_record (&res->stats->timings[sqldb_TIMING_EXECUTE],
+                   clock_us () - res->stats_start);
+   }
 }
 
-static sqldb_res_t *sqlitedb_exec (sqldb_t *db, char *qstring, va_list *ap)
+// Records nrows rows returned to the caller; drained is set when there
+// are no more rows. Only the first and last steps read the clock.
+static void stats_step (sqldb_res_t *res, uint64_t nrows, bool drained)
 {
-   int counter = 0;
-   bool error = true;
-   sqldb_res_t *ret = malloc (sizeof *ret);
-   if (!ret)
-      return NULL;
-   memset (ret, 0, sizeof *ret);
+   if (!res->stats_start || res->stats_drained)
+      return;
 
-   ret->type = sqldb_SQLITE;
+   res->stats_rows += nrows;
 
-   int rc = sqlite3_prepare_v2 (db->sqlite_db, qstring, -1,
-                                &ret->sqlite_stmt, NULL);
-   if (rc!=SQLITE_OK) {
-      const char *tmp = sqlite3_errstr (rc);
-      const char *tmp2 = sqlite3_errmsg (db->sqlite_db);
-      db_err_printf (db, "Fatal error: %s/%i\n%s\n[%s]\n", tmp,
-                                                           rc,
-                                                           tmp2,
-                                                           qstring);
-      goto errorexit;
+   if (res->stats_stepped && !drained)
+      return;
+
+   uint64_t elapsed = clock_us () - res->stats_start;
+
+   if (!res->stats_stepped) {
+      res->stats_stepped = true;
+      if (res->stats)
+         hist_record (&res->stats->timings[sqldb_TIMING_FIRST_ROW], elapsed);
    }
 
-   sqlite3_stmt *stmt = ret->sqlite_stmt;
-   sqldb_coltype_t coltype = va_arg (*ap, sqldb_coltype_t);
-   while (coltype!=sqldb_col_UNKNOWN) {
-      int32_t *v_int;
-      int64_t *v_int64;
-      char **v_text;
-      void *v_blob;
-      void *v_ptr;
-      uint32_t *v_bloblen;
-      int err = 0;
-      int index = counter + 1;
+   if (drained) {
+      res->stats_drained = true;
+      if (res->stats)
+         hist_record (&res->stats->timings[sqldb_TIMING_DRAIN], elapsed);
+   }
+}
 
-      switch (coltype) {
-         case sqldb_col_UNKNOWN:
-            db_err_printf (db, "Impossible error\n");
-            goto errorexit;
+// The rows and bytes are counted in the result and added when it is
+// released.
+static void stats_release (sqldb_res_t *res)
+{
+   if (!res->stats_start)
+      return;
 
-         case sqldb_col_UINT32:
+   counter_add (&g_stats.totals.nrows, res->stats_rows);
+   counter_add (&g_stats.totals.nbytes, res->stats_bytes);
+
+   if (res->stats) {
+      counter_add (&res->stats->counters.nrows, res->stats_rows);
+      counter_add (&res->stats->counters.nbytes, res->stats_bytes);
+   }
+}
+
+/* *****************************************************************
+ * Slow statement trace. Sqlite times its own statements and reports them
+ * through its profile callback; the postgres statements are timed around
+ * their execution in pgdb_exec().
+ */
+
+// TEXT parameters are truncated to this many bytes in a trace, and the
+// whole list of parameters to TRACE_PARAMS_LEN - 1 bytes.
+#define TRACE_TEXT_MAX        (64)
+#define TRACE_PARAMS_LEN      (1024)
+
+static void trace_params (char *dst, size_t len, bool redact,
+                          const sqldb_param_t *params, size_t nparams)
+{
+   static const char *types[] = {
+      "UNKNOWN", "INT32", "INT64", "UINT32", "UINT64", "DATETIME", "TEXT",
+      "BLOB", "NULL",
+   };
+
+   size_t used = 0;
+
+   dst[0] = 0;
+
+   for (size_t i=0; i<nparams && used < len; i++) {
+      const sqldb_param_t *param = &params[i];
+      const char *sep = i ? " " : "";
+      const char *text = param->v.ptr;
+      int n = 0;
+
+      if (redact) {
+         n = snprintf (&dst[used], len - used, "%s$%zu=%s", sep, i + 1,
+                       param->type < sizeof types / sizeof types[0]
+                           ? types[param->type] : types[0]);
+         used += n < 0 ? len : (size_t)n;
+         continue;
+      }
+
+      switch (param->type) {
          case sqldb_col_INT32:
-            v_int = va_arg (*ap, int32_t *);
-            err = sqlite3_bind_int (stmt, index, *v_int);
+            n = snprintf (&dst[used], len - used, "%s$%zu=%" PRIi32,
+                          sep, i + 1, param->v.i32);
+            break;
+
+         case sqldb_col_UINT32:
+            n = snprintf (&dst[used], len - used, "%s$%zu=%" PRIu32,
+                          sep, i + 1, param->v.u32);
             break;
 
          case sqldb_col_DATETIME:
-         case sqldb_col_UINT64:
          case sqldb_col_INT64:
-            v_int64 = va_arg (*ap, int64_t *);
-            err = sqlite3_bind_int64 (stmt, index, *v_int64);
+            n = snprintf (&dst[used], len - used, "%s$%zu=%" PRIi64,
+                          sep, i + 1, param->v.i64);
             break;
 
-         case sqldb_col_TEXT:
-            v_text = va_arg (*ap, char **);
-            err = sqlite3_bind_text (stmt, index, (*v_text),
-                                     -1, SQLITE_TRANSIENT);
+         case sqldb_col_UINT64:
+            n = snprintf (&dst[used], len - used, "%s$%zu=%" PRIu64,
+                          sep, i + 1, param->v.u64);
             break;
 
-         case sqldb_col_BLOB:
-            v_blob = va_arg (*ap, void *);
-            v_bloblen = va_arg (*ap, uint32_t *);
-            err = sqlite3_bind_blob (stmt, index, *(uint8_t **)v_blob,
-                                     *v_bloblen, SQLITE_TRANSIENT);
+         case sqldb_col_TEXT:
+            if (!text) {
+               n = snprintf (&dst[used], len - used, "%s$%zu=NULL",
+                             sep, i + 1);
+               break;
+            }
+            n = snprintf (&dst[used], len - used, "%s$%zu='%.*s%s'",
+                          sep, i + 1, TRACE_TEXT_MAX, text,
+                          strlen (text) > TRACE_TEXT_MAX ? "..." : "");
             break;
 
-         case sqldb_col_NULL:
-            v_ptr = va_arg (*ap, void *); // Discard the next argument
-            v_ptr = v_ptr;
-            err = sqlite3_bind_null (stmt, index);
+         case sqldb_col_BLOB:
+            n = snprintf (&dst[used], len - used, "%s$%zu=<%" PRIu32
+                          " bytes>", sep, i + 1, param->len);
             break;
 
          default:
-            db_err_printf (db, "Unknown column type: %u\n", coltype);
+            n = snprintf (&dst[used], len - used, "%s$%zu=NULL", sep, i + 1);
             break;
       }
 
-      if (err!=SQLITE_OK) {
-         db_err_printf (db, "Unable to bind %i\n", index);
-         goto errorexit;
+      used += n < 0 ? len : (size_t)n;
+   }
+}
+
+static int sqlitedb_trace (unsigned int type, void *ctx, void *p, void *x)
+{
+   sqldb_t *db = ctx;
+   sqlite3_stmt *stmt = p;
+
+   if (type!=SQLITE_TRACE_PROFILE || !db->trace_fn)
+      return 0;
+
+   uint64_t elapsed_us = *(sqlite3_int64 *)x / 1000;
+   if (elapsed_us < db->trace_threshold_us)
+      return 0;
+
+   char *expanded = db->trace_redact ? NULL : sqlite3_expanded_sql (stmt);
+   sqldb_trace_t trace = {
+      expanded ? expanded : sqlite3_sql (stmt), NULL, elapsed_us,
+   };
+
+   db->trace_fn (db, &trace, db->trace_ctx);
+
+   sqlite3_free (expanded);
+   return 0;
+}
+
+// Reports a postgres statement that started at start if it was slow.
+static void pgdb_trace (sqldb_t *db, const struct query_t *query,
+                        const sqldb_param_t *params, size_t nparams,
+                        uint64_t start)
+{
+   if (!db->trace_fn)
+      return;
+
+   uint64_t elapsed_us = clock_us () - start;
+   if (elapsed_us < db->trace_threshold_us)
+      return;
+
+   char tmp[TRACE_PARAMS_LEN];
+   trace_params (tmp, sizeof tmp, db->trace_redact, params, nparams);
+
+   sqldb_trace_t trace = { query->key, tmp, elapsed_us };
+   db->trace_fn (db, &trace, db->trace_ctx);
+}
+
+bool sqldb_set_trace (sqldb_t *db, sqldb_trace_fn_t *fn, void *ctx,
+                                   uint64_t threshold_us, bool redact)
+{
+   if (!db)
+      return false;
+
+   if (db->type==sqldb_SQLITE) {
+      int rc = sqlite3_trace_v2 (db->sqlite_db,
+                                 fn ? SQLITE_TRACE_PROFILE : 0,
+                                 fn ? sqlitedb_trace : NULL,
+                                 db);
+      if (rc!=SQLITE_OK) {
+         db_err_printf (db, "Failed to set trace: %s\n",
+                            sqlite3_errstr (rc));
+         return false;
       }
-      counter++;
-      coltype = va_arg (*ap, sqldb_coltype_t);
    }
 
-   error = false;
+   db->trace_fn = fn;
+   db->trace_ctx = ctx;
+   db->trace_threshold_us = threshold_us;
+   db->trace_redact = redact;
+
+   return true;
+}
+
+/* *****************************************************************
+ * Timeline. Every span is written into the next slot of a global ring
+ * buffer. The sequence number of a slot is cleared while the span is
+ * being written, so that sqldb_timeline_dump() can skip (rather than
+ * lock out) the slots that are changing underneath it.
+ */
+
+#define TIMELINE_MAX_SPANS    (1024 * 1024 * 16)
+
+struct span_t {
+   atomic_uint_fast64_t    seq;     // The index of the span plus one
+   _Atomic (const char *)  cat;
+   _Atomic (const char *)  name;
+   _Atomic (const char *)  detail;  // The query, or NULL
+   atomic_uint_fast64_t    start_ns;
+   atomic_uint_fast64_t    dur_ns;
+   atomic_uint_fast32_t    tid;
+};
+
+static struct {
+   _Atomic (struct span_t *)  spans;
+   size_t                     nspans;
+   atomic_uint_fast64_t       next;
+   atomic_uint_fast32_t       ntids;
+} g_timeline;
+
+// A small number for each thread, given out as threads record spans.
+static _Thread_local uint32_t t_tid;
+
+static uint64_t clock_ns (void)
+{
+   struct timespec ts;
+   clock_gettime (CLOCK_MONOTONIC, &ts);
+   return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void span_record (const char *cat, const char *name,
+                         const char *detail, uint64_t start)
+{
+   if (!start)
+      return;
+
+   struct span_t *spans = atomic_load_explicit (&g_timeline.spans,
+                                                memory_order_acquire);
+   if (!spans)
+      return;
+
+   uint64_t end = clock_ns ();
+
+   if (!t_tid)
+      t_tid = atomic_fetch_add (&g_timeline.ntids, 1) + 1;
+
+   uint64_t index = atomic_fetch_add_explicit (&g_timeline.next, 1,
+                                               memory_order_relaxed);
+   struct span_t *span = &spans[index % g_timeline.nspans];
+
+   atomic_store_explicit (&span->seq, 0, memory_order_relaxed);
+   atomic_thread_fence (memory_order_release);
+
+   atomic_store_explicit (&span->cat, cat, memory_order_relaxed);
+   atomic_store_explicit (&span->name, name, memory_order_relaxed);
+   atomic_store_explicit (&span->detail, detail, memory_order_relaxed);
+   atomic_store_explicit (&span->start_ns, start, memory_order_relaxed);
+   atomic_store_explicit (&span->dur_ns, end - start, memory_order_relaxed);
+   atomic_store_explicit (&span->tid, t_tid, memory_order_relaxed);
+
+   atomic_store_explicit (&span->seq, index + 1, memory_order_release);
+}
+
+// Returns the query (or its label) that the result is executing, for the
+// spans of the result.
+static const char *span_detail (sqldb_res_t *res)
+{
+   if (!res->stats)
+      return NULL;
+
+   const char *label = atomic_load_explicit (&res->stats->label,
+                                             memory_order_acquire);
+   return label ? label : res->stats->query;
+}
+
+uint64_t sqldb_span_begin (void)
+{
+   if (!(atomic_load_explicit (&g_timeline.spans, memory_order_relaxed)))
+      return 0;
+
+   return clock_ns ();
+}
+
+void sqldb_span_end (const char *cat, const char *name, uint64_t start)
+{
+   span_record (cat, name, NULL, start);
+}
+
+bool sqldb_timeline_enable (size_t nspans)
+{
+   struct span_t *spans = atomic_exchange (&g_timeline.spans, NULL);
+
+   sqldb_free (spans);
+   g_timeline.nspans = 0;
+   atomic_store (&g_timeline.next, 0);
+
+   if (!nspans)
+      return true;
+
+   if (nspans > TIMELINE_MAX_SPANS) {
+      PROG_ERR ("Too many spans for the timeline: %zu\n", nspans);
+      return false;
+   }
+
+   if (!(spans = sqldb_calloc (nspans, sizeof *spans))) {
+      SQLDB_OOM ("timeline");
+      return false;
+   }
+
+   g_timeline.nspans = nspans;
+   atomic_store_explicit (&g_timeline.spans, spans, memory_order_release);
+
+   return true;
+}
+
+static void json_string (FILE *outf, const char *src)
+{
+   fputc ('"', outf);
+   for (const unsigned char *s=(const unsigned char *)src; *s; s++) {
+      if (*s=='"' || *s=='\\')
+         fprintf (outf, "\\%c", *s);
+      else if (*s < 0x20)
+         fprintf (outf, "\\u%04x", *s);
+      else
+         fputc (*s, outf);
+   }
+   fputc ('"', outf);
+}
+
+bool sqldb_timeline_dump (FILE *outf)
+{
+   struct span_t *spans = atomic_load_explicit (&g_timeline.spans,
+                                                memory_order_acquire);
+   if (!outf)
+      outf = stdout;
+
+   uint64_t end = atomic_load (&g_timeline.next);
+   uint64_t begin = end > g_timeline.nspans ? end - g_timeline.nspans : 0;
+   const char *sep = "\n";
+
+   fprintf (outf, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+
+   for (uint64_t i=begin; spans && i<end; i++) {
+      struct span_t *span = &spans[i % g_timeline.nspans];
+
+      uint64_t seq = atomic_load_explicit (&span->seq, memory_order_acquire);
+      const char *cat = atomic_load_explicit (&span->cat,
+                                              memory_order_relaxed);
+      const char *name = atomic_load_explicit (&span->name,
+                                               memory_order_relaxed);
+      const char *detail = atomic_load_explicit (&span->detail,
+                                                 memory_order_relaxed);
+      uint64_t start = atomic_load_explicit (&span->start_ns,
+                                             memory_order_relaxed);
+      uint64_t dur = atomic_load_explicit (&span->dur_ns,
+                                           memory_order_relaxed);
+      uint32_t tid = atomic_load_explicit (&span->tid, memory_order_relaxed);
+      atomic_thread_fence (memory_order_acquire);
+
+      if (seq!=i + 1
+            || atomic_load_explicit (&span->seq, memory_order_relaxed)!=seq)
+         continue;
+
+      // The trace-event times are in microseconds.
+      fprintf (outf, "%s{\"ph\":\"X\",\"cat\":", sep);
+      json_string (outf, cat);
+      fprintf (outf, ",\"name\":");
+      json_string (outf, name);
+      fprintf (outf, ",\"pid\":%li,\"tid\":%" PRIu32
+                     ",\"ts\":%" PRIu64 ".%03" PRIu64
+                     ",\"dur\":%" PRIu64 ".%03" PRIu64,
+                     (long)getpid (), tid,
+                     start / 1000, start % 1000, dur / 1000, dur % 1000);
+      if (detail) {
+         fprintf (outf, ",\"args\":{\"query\":");
+         json_string (outf, detail);
+         fputc ('}', outf);
+      }
+      fputc ('}', outf);
+      sep = ",\n";
+   }
+
+   fprintf (outf, "\n]}\n");
+
+   return !ferror (outf);
+}
+
+// Frees the outcome of the previous pipeline; the pipeline functions are
+// further below.
+static void pipeline_clear (sqldb_t *db)
+{
+   for (size_t i=0; i<db->pipe_nitems; i++) {
+      sqldb_free (db->pipe_items[i].errmsg);
+   }
+   db->pipe_nitems = 0;
+   db->pipe_nops = 0;
+}
+
+static void pipeline_free (sqldb_t *db)
+{
+   pipeline_clear (db);
+   sqldb_free (db->pipe_items);
+   sqldb_free (db->pipe_ops);
+   db->pipe_items = NULL;
+   db->pipe_ops = NULL;
+   db->pipe_items_max = 0;
+   db->pipe_ops_max = 0;
+}
+
+// Discards an asynchronous result that was never retrieved.
+static void async_clear (sqldb_t *db)
+{
+   PQclear (db->async_pgr);
+   sqldb_res_del (db->async_res);
+   db->async_pgr = NULL;
+   db->async_res = NULL;
+   db->async = ASYNC_NONE;
+}
+
+void sqldb_opts_default (sqldb_opts_t *opts)
+{
+   if (!opts)
+      return;
+
+   memset (opts, 0, sizeof *opts);
+
+   // Readers and the writer do not block each other in WAL mode, and in
+   // WAL mode a synchronous level of NORMAL is safe from corruption (a
+   // power loss may lose only the most recent commits).
+   opts->journal_mode = "WAL";
+   opts->synchronous = "NORMAL";
+   opts->temp_store = "MEMORY";
+   opts->mmap_size = 256 * 1024 * 1024;
+   opts->cache_size = -64 * 1024;
+   opts->busy_timeout_ms = 5000;
+}
+
+static bool sqlitedb_pragma (sqldb_t *db, const char *name, const char *value)
+{
+   char pragma[96];
+
+   if (!value)
+      return true;
+
+   // Values are keywords or (possibly negative) numbers.
+   if (!(valid_db_identifier (value[0]=='-' ? &value[1] : value))) {
+      PROG_ERR ("Invalid value for PRAGMA %s [%s]\n", name, value);
+      return false;
+   }
+
+   snprintf (pragma, sizeof pragma, "PRAGMA %s = %s;", name, value);
+   if (!(sqldb_batch (db, pragma, NULL))) {
+      PROG_ERR ("Failed to set PRAGMA %s [%s]: %s\n", name, value,
+                  sqlite3_errmsg (db->sqlite_db));
+      return false;
+   }
+   return true;
+}
+
+// Every connection is allocated and freed by these, so that
+// sqldb_set_allocator() can tell whether any are open.
+static sqldb_t *conn_new (sqldb_dbtype_t type)
+{
+   sqldb_t *ret = sqldb_malloc (sizeof *ret);
+   if (!ret)
+      return NULL;
+
+   memset (ret, 0, sizeof *ret);
+
+   ret->type = type;
+   ret->cache_max = STMT_CACHE_DEFAULT;
+
+   atomic_fetch_add (&g_nconns, 1);
+   return ret;
+}
+
+static void conn_del (sqldb_t *db)
+{
+   if (!db)
+      return;
+
+   sqldb_free (db);
+   atomic_fetch_sub (&g_nconns, 1);
+}
+
+// A lot of the following functions will be refactored only when working
+// on the postgresql integration
+static sqldb_t *sqlitedb_open (sqldb_t *ret, const char *dbname,
+                               const sqldb_opts_t *opts)
+{
+   bool error = true;
+   char value[32];
+   int mode = opts->readonly ? SQLITE_OPEN_READONLY : SQLITE_OPEN_READWRITE;
+
+   if (opts->nomutex)
+      mode |= SQLITE_OPEN_NOMUTEX;
+
+   int rc = sqlite3_open_v2 (dbname, &ret->sqlite_db, mode, NULL);
+   if (rc!=SQLITE_OK) {
+      const char *tmp =  sqlite3_errstr (rc);
+      PROG_ERR ("(%s) Unable to open database: %s\n", dbname, tmp);
+      goto errorexit;
+   }
+
+   // The busy timeout is set first so that changing the journal mode
+   // waits for other connections.
+   if (opts->busy_timeout_ms)
+      sqlite3_busy_timeout (ret->sqlite_db, opts->busy_timeout_ms);
+
+   if (!(sqldb_batch (ret, "PRAGMA foreign_keys = ON", NULL))) {
+      PROG_ERR ("(%s) Unable to open database: %s\n", dbname,
+                  sqlite3_errmsg (ret->sqlite_db));
+      goto errorexit;
+   }
+
+   // The journal mode is persistent and cannot be changed by a read-only
+   // connection.
+   if (!opts->readonly
+         && !(sqlitedb_pragma (ret, "journal_mode", opts->journal_mode)))
+      goto errorexit;
+
+   if (!(sqlitedb_pragma (ret, "synchronous", opts->synchronous))
+         || !(sqlitedb_pragma (ret, "temp_store", opts->temp_store)))
+      goto errorexit;
+
+   if (opts->mmap_size) {
+      snprintf (value, sizeof value, "%" PRIi64, opts->mmap_size);
+      if (!(sqlitedb_pragma (ret, "mmap_size", value)))
+         goto errorexit;
+   }
+
+   if (opts->cache_size) {
+      snprintf (value, sizeof value, "%" PRIi64, opts->cache_size);
+      if (!(sqlitedb_pragma (ret, "cache_size", value)))
+         goto errorexit;
+   }
+
+   error = false;
+
+errorexit:
+   if (error) {
+      sqldb_close (ret);
+      ret = NULL;
+   }
+   return ret;
+}
+
+static sqldb_t *pgdb_open (sqldb_t *ret, const char *dbname)
+{
+   bool error = true;
+
+   ret->pg_poll = PGRES_POLLING_OK;
+
+   if (!(ret->pg_db = PQconnectdb (dbname))) {
+      SQLDB_OOM (dbname);
+      goto errorexit;
+   }
+
+   if ((PQstatus (ret->pg_db))==CONNECTION_BAD) {
+      PROG_ERR ("[%s] Connection failure: [%s]\n",
+                       dbname,
+                       PQerrorMessage (ret->pg_db));
+      goto errorexit;
+   }
+
+   error = false;
+
+errorexit:
+   if (error) {
+      sqldb_close (ret);
+      ret = NULL;
+   }
+
+   return ret;
+}
+
+sqldb_t *sqldb_open (const char *dbname, sqldb_dbtype_t type)
+{
+   return sqldb_open_ex (dbname, type, NULL);
+}
+
+sqldb_t *sqldb_open_ex (const char *dbname, sqldb_dbtype_t type,
+                        const sqldb_opts_t *opts)
+{
+   sqldb_opts_t defaults;
+   sqldb_t *ret = conn_new (type);
+   if (!ret) {
+      SQLDB_OOM (dbname);
+      goto errorexit;
+   }
+
+   if (!dbname)
+      goto errorexit;
+
+   if (!opts) {
+      sqldb_opts_default (&defaults);
+      opts = &defaults;
+   }
+
+   uint64_t span = sqldb_span_begin ();
+
+   switch (type) {
+      case sqldb_SQLITE:   ret = sqlitedb_open (ret, dbname, opts);  break;
+      case sqldb_POSTGRES: ret = pgdb_open (ret, dbname);            break;
+      default:             PROG_ERR ("Error: dbtype [%u] is unknown\n",
+                                            type);
+                           goto errorexit;
+   }
+
+   span_record ("sqldb", "open", NULL, span);
+   return ret;
+
+errorexit:
+   conn_del (ret);
+   return NULL;
+}
+
+sqldb_t *sqldb_open_start (const char *dbname, sqldb_dbtype_t type)
+{
+   if (type!=sqldb_POSTGRES)
+      return sqldb_open (dbname, type);
+
+   sqldb_t *ret = NULL;
+
+   if (!dbname)
+      goto errorexit;
+
+   if (!(ret = conn_new (type))) {
+      SQLDB_OOM (dbname);
+      goto errorexit;
+   }
+
+   if (!(ret->pg_db = PQconnectStart (dbname))) {
+      SQLDB_OOM (dbname);
+      goto errorexit;
+   }
+
+   if ((PQstatus (ret->pg_db))==CONNECTION_BAD) {
+      PROG_ERR ("[%s] Connection failure: [%s]\n",
+                       dbname,
+                       PQerrorMessage (ret->pg_db));
+      goto errorexit;
+   }
+
+   // As per the libpq documentation, the socket must be writable before
+   // the first call to PQconnectPoll().
+   ret->pg_poll = PGRES_POLLING_WRITING;
+
+   return ret;
+
+errorexit:
+   sqldb_close (ret);
+   return NULL;
+}
+
+sqldb_poll_t sqldb_open_poll (sqldb_t *db)
+{
+   if (!db)
+      return sqldb_poll_FAILED;
+
+   if (db->type!=sqldb_POSTGRES || db->pg_poll==PGRES_POLLING_OK)
+      return sqldb_poll_OK;
+
+   if (db->pg_poll==PGRES_POLLING_FAILED)
+      return sqldb_poll_FAILED;
+
+   // Only advance the connection when the socket is ready for the event
+   // that libpq asked for, so that this function may be called at any
+   // time without blocking.
+   struct pollfd pfd = {
+      .fd = PQsocket (db->pg_db),
+      .events = db->pg_poll==PGRES_POLLING_READING ? POLLIN : POLLOUT,
+   };
+
+   int rc = poll (&pfd, 1, 0);
+   if (rc < 0) {
+      db_err_printf (db, "poll() failed: %m\n");
+      db->pg_poll = PGRES_POLLING_FAILED;
+      return sqldb_poll_FAILED;
+   }
+
+   if (rc > 0)
+      db->pg_poll = PQconnectPoll (db->pg_db);
+
+   switch (db->pg_poll) {
+      case PGRES_POLLING_OK:        return sqldb_poll_OK;
+      case PGRES_POLLING_READING:   return sqldb_poll_READ;
+      case PGRES_POLLING_WRITING:   return sqldb_poll_WRITE;
+      default:                      break;
+   }
+
+   db->pg_poll = PGRES_POLLING_FAILED;
+   db_err_printf (db, "Connection failure: [%s]\n",
+                      PQerrorMessage (db->pg_db));
+   return sqldb_poll_FAILED;
+}
+
+int sqldb_socket (sqldb_t *db)
+{
+   if (!db || db->type!=sqldb_POSTGRES)
+      return -1;
+
+   return PQsocket (db->pg_db);
+}
+
+bool sqldb_healthcheck (sqldb_t *db)
+{
+   if (!db)
+      return false;
+
+   sqldb_clearerr (db);
+
+   // Whatever was queued in an abandoned pipeline must not be committed,
+   // and a query that is still running cannot be interrupted.
+   if (db->pipeline || db->async==ASYNC_SENT)
+      return false;
+
+   async_clear (db);
+
+   db->tx_depth = 0;
+
+   switch (db->type) {
+      case sqldb_SQLITE:
+         if ((sqlite3_get_autocommit (db->sqlite_db))==0) {
+            return sqldb_batch (db, "ROLLBACK;", NULL);
+         }
+         return true;
+
+      case sqldb_POSTGRES:
+         if (db->pg_poll!=PGRES_POLLING_OK
+               || (PQstatus (db->pg_db))!=CONNECTION_OK)
+            return false;
+
+         switch (PQtransactionStatus (db->pg_db)) {
+            case PQTRANS_IDLE:      return true;
+            case PQTRANS_INTRANS:
+            case PQTRANS_INERROR:   return sqldb_batch (db, "ROLLBACK;", NULL);
+            default:                return false;
+         }
+
+      default:
+         return false;
+   }
+}
+
+sqldb_dbtype_t sqldb_type (sqldb_t *db)
+{
+   return db ? db->type : sqldb_UNKNOWN;
+}
+
+uint32_t sqldb_flags (sqldb_t *db)
+{
+   return db ? db->flags : 0;
+}
+
+uint32_t sqldb_flags_set (sqldb_t *db, uint32_t flags)
+{
+   if (!db)
+      return 0;
+
+   uint32_t ret = db->flags;
+   db->flags |= flags;
+   return ret;
+}
+
+uint32_t sqldb_flags_clear (sqldb_t *db, uint32_t flags)
+{
+   if (!db)
+      return 0;
+
+   uint32_t ret = db->flags;
+   db->flags &= ~flags;
+   return ret;
+}
+
+void sqldb_close (sqldb_t *db)
+{
+   if (!db)
+      return;
+
+   async_clear (db);
+   stmt_cache_clear (db);
+   pipeline_free (db);
+
+   // A streaming result that outlives the connection keeps the rows that
+   // it has already received.
+   if (db->stream_res)
+      db->stream_res->streaming = false;
+
+   switch (db->type) {
+      case sqldb_SQLITE:   sqlite3_close (db->sqlite_db);               break;
+      case sqldb_POSTGRES: PQfinish (db->pg_db);                        break;
+      default:             db_err_printf (db, "Unknown type %i\n", db->type);
+                           break;
+   }
+
+   sqldb_free (db->pg_dealloc);
+   sqldb_free (db->stats_tag);
+   sqldb_free (db->lasterr);
+   memset (db, 0, sizeof *db);
+   conn_del (db);
+}
+
+const char *sqldb_lasterr (sqldb_t *db)
+{
+   return db ? db->lasterr : "(NULL SQLDB OBJECT)";
+}
+
+void sqldb_clearerr (sqldb_t *db)
+{
+   if (!db)
+      return;
+
+   sqldb_free (db->lasterr);
+   db->lasterr = NULL;
+   db->pg_sqlstate[0] = 0;
+}
+
+/* *****************************************************************
+ * Query templates. A query string is scanned once to find the parameter
+ * references (#1, #2, ... or #name) that lie outside of string literals,
+ * quoted identifiers, dollar-quoted strings and comments. The query for
+ * each backend is then produced from the list of references.
+ */
+
+struct tmpl_ref_t {
+   size_t   offset;     // Offset of the '#' in the source string
+   size_t   len;        // Length of the reference, including the '#'
+   uint32_t index;      // Parameter number; named references use the
+                        // position of the name in names[] until the
+                        // scan is complete.
+   bool     named;
+};
+
+struct sqldb_tmpl_t {
+   char              *source;
+   size_t             slen;
+   uint64_t           hash;
+
+   struct tmpl_ref_t *refs;
+   size_t             nrefs;
+
+   // names[i] is the name of parameter (i + 1), or NULL if that
+   // parameter is a numbered one.
+   uint32_t           nparams;
+   char             **names;
+
+   char              *sqlite_query;
+   char              *pg_query;
+};
+
+#define TMPL_MAX_PARAMS       (32767)
+
+static bool is_ident_start (char c)
+{
+   return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_';
+}
+
+static bool is_ident_char (char c)
+{
+   return is_ident_start (c) || (c >= '0' && c <= '9');
+}
+
+// Returns the length of the dollar-quote tag (including both '$'
+// characters) that starts at src[i], or zero if there is none.
+static size_t dollar_tag_len (const char *src, size_t len, size_t i)
+{
+   size_t j = i + 1;
+
+   if (src[i]!='$' || (i && is_ident_char (src[i-1])))
+      return 0;
+
+   if (j < len && src[j]=='$')
+      return 2;
+
+   if (j >= len || !is_ident_start (src[j]))
+      return 0;
+
+   while (j < len && is_ident_char (src[j]))
+      j++;
+
+   return j < len && src[j]=='$' ? j - i + 1 : 0;
+}
+
+// Returns the offset of the first character after the literal, quoted
+// identifier or comment that starts at src[i]. If there is none at
+// src[i] then i is returned. The source need not be nul-terminated; a
+// construct that is not terminated within len characters ends at len.
+static size_t skip_non_sql (const char *src, size_t len, size_t i)
+{
+   size_t taglen = 0;
+
+   if (src[i]=='\'' || src[i]=='"') {
+      char q = src[i];
+      // Postgres escape strings (E'...') allow backslash escapes.
+      bool esc = q=='\'' && i && (src[i-1]=='E' || src[i-1]=='e') &&
+                 (i < 2 || !is_ident_char (src[i-2]));
+      i++;
+      while (i < len) {
+         if (esc && src[i]=='\\' && i + 1 < len) {
+            i += 2;
+            continue;
+         }
+         if (src[i]==q) {
+            if (i + 1 >= len || src[i+1]!=q)
+               return i + 1;
+            i++;
+         }
+         i++;
+      }
+      return len;
+   }
+
+   if (src[i]=='-' && i + 1 < len && src[i+1]=='-') {
+      while (i < len && src[i]!='\n')
+         i++;
+      return i;
+   }
+
+   if (src[i]=='/' && i + 1 < len && src[i+1]=='*') {
+      size_t depth = 1;
+      i += 2;
+      while (i < len && depth) {
+         if (src[i]=='/' && i + 1 < len && src[i+1]=='*') {
+            depth++;
+            i++;
+         } else if (src[i]=='*' && i + 1 < len && src[i+1]=='/') {
+            depth--;
+            i++;
+         }
+         i++;
+      }
+      return i;
+   }
+
+   if ((taglen = dollar_tag_len (src, len, i))) {
+      const char *tag = &src[i];
+      for (i += taglen; i + taglen <= len; i++) {
+         if ((memcmp (&src[i], tag, taglen))==0)
+            return i + taglen;
+      }
+      return len;
+   }
+
+   return i;
+}
+
+static bool tmpl_addref (sqldb_tmpl_t *tmpl, size_t *nalloc,
+                         size_t offset, size_t len,
+                         uint32_t index, bool named)
+{
+   if (tmpl->nrefs >= *nalloc) {
+      size_t newlen = (*nalloc) ? (*nalloc) * 2 : 8;
+      struct tmpl_ref_t *tmp = sqldb_realloc (tmpl->refs,
+                                              newlen * sizeof *tmp);
+      if (!tmp)
+         return false;
+      tmpl->refs = tmp;
+      *nalloc = newlen;
+   }
+
+   tmpl->refs[tmpl->nrefs].offset = offset;
+   tmpl->refs[tmpl->nrefs].len = len;
+   tmpl->refs[tmpl->nrefs].index = index;
+   tmpl->refs[tmpl->nrefs].named = named;
+   tmpl->nrefs++;
+
+   return true;
+}
+
+static bool tmpl_scan (sqldb_tmpl_t *tmpl)
+{
+   bool error = true;
+   const char *src = tmpl->source;
+   size_t nalloc = 0;
+   size_t i = 0;
+
+   char **names = NULL;
+   uint32_t nnames = 0;
+   uint32_t max_index = 0;
+
+   while (src[i]) {
+      size_t next = skip_non_sql (src, tmpl->slen, i);
+      if (next != i) {
+         i = next;
+         continue;
+      }
+
+      if (src[i]!='#') {
+         i++;
+         continue;
+      }
+
+      size_t start = i++;
+
+      if (src[i] >= '0' && src[i] <= '9') {
+         uint32_t index = 0;
+         while (src[i] >= '0' && src[i] <= '9') {
+            index = index * 10 + (src[i] - '0');
+            if (index > TMPL_MAX_PARAMS) {
+               PROG_ERR ("Parameter number too large in [%s]\n", src);
+               goto errorexit;
+            }
+            i++;
+         }
+         if (!index) {
+            PROG_ERR ("Parameter #0 is invalid in [%s]\n", src);
+            goto errorexit;
+         }
+         if (index > max_index)
+            max_index = index;
+         if (!(tmpl_addref (tmpl, &nalloc, start, i - start, index, false)))
+            goto errorexit;
+         continue;
+      }
+
+      if (is_ident_start (src[i])) {
+         while (is_ident_char (src[i]))
+            i++;
+
+         size_t namelen = i - start - 1;
+         uint32_t pos = 0;
+         for (pos=0; pos<nnames; pos++) {
+            if ((strncmp (names[pos], &src[start + 1], namelen))==0 &&
+                  names[pos][namelen]==0)
+               break;
+         }
+
+         if (pos==nnames) {
+            char **tmp = sqldb_realloc (names, (nnames + 1) * sizeof *tmp);
+            if (!tmp)
+               goto errorexit;
+            names = tmp;
+            if (!(names[nnames] = sqldb_malloc (namelen + 1)))
+               goto errorexit;
+            memcpy (names[nnames], &src[start + 1], namelen);
+            names[nnames][namelen] = 0;
+            nnames++;
+         }
+
+         if (!(tmpl_addref (tmpl, &nalloc, start, i - start, pos, true)))
+            goto errorexit;
+         continue;
+      }
+
+      // A lone '#' is not a parameter; leave it as it is.
+   }
+
+   // Named parameters are numbered after all of the numbered ones, in
+   // the order in which they first appear.
+   tmpl->nparams = max_index + nnames;
+   if (tmpl->nparams > TMPL_MAX_PARAMS)
+      goto errorexit;
+
+   if (tmpl->nparams) {
+      if (!(tmpl->names = sqldb_malloc (tmpl->nparams * sizeof *tmpl->names)))
+         goto errorexit;
+      memset (tmpl->names, 0, tmpl->nparams * sizeof *tmpl->names);
+   }
+
+   for (uint32_t j=0; j<nnames; j++) {
+      tmpl->names[max_index + j] = names[j];
+      names[j] = NULL;
+   }
+
+   for (size_t j=0; j<tmpl->nrefs; j++) {
+      if (tmpl->refs[j].named) {
+         tmpl->refs[j].index += max_index + 1;
+      }
+   }
+
+   error = false;
+
+errorexit:
+   for (uint32_t j=0; j<nnames; j++) {
+      sqldb_free (names[j]);
+   }
+   sqldb_free (names);
+
+   return !error;
+}
+
+// Produce the query string for a backend by replacing each parameter
+// reference with the prefix character followed by the parameter number.
+static char *tmpl_emit (const sqldb_tmpl_t *tmpl, char prefix)
+{
+   size_t src = 0, dst = 0;
+   char *ret = sqldb_malloc (tmpl->slen + (tmpl->nrefs * 8) + 1);
+
+   if (!ret)
+      return NULL;
+
+   for (size_t i=0; i<tmpl->nrefs; i++) {
+      const struct tmpl_ref_t *ref = &tmpl->refs[i];
+      memcpy (&ret[dst], &tmpl->source[src], ref->offset - src);
+      dst += ref->offset - src;
+      dst += sprintf (&ret[dst], "%c%" PRIu32, prefix, ref->index);
+      src = ref->offset + ref->len;
+   }
+
+   strcpy (&ret[dst], &tmpl->source[src]);
+
+   return ret;
+}
+
+sqldb_tmpl_t *sqldb_tmpl_new (const char *query)
+{
+   bool error = true;
+   sqldb_tmpl_t *ret = NULL;
+
+   if (!query)
+      return NULL;
+
+   if (!(ret = sqldb_malloc (sizeof *ret)))
+      goto errorexit;
+
+   memset (ret, 0, sizeof *ret);
+
+   if (!(ret->source = lstr_dup (query)))
+      goto errorexit;
+
+   ret->hash = stmt_hash (ret->source, &ret->slen);
+
+   if (!(tmpl_scan (ret)))
+      goto errorexit;
+
+   if (!(ret->sqlite_query = tmpl_emit (ret, '?')) ||
+       !(ret->pg_query = tmpl_emit (ret, '$')))
+      goto errorexit;
+
+   error = false;
+
+errorexit:
+   if (error) {
+      PROG_ERR ("Failed to compile query [%s]\n", query);
+      sqldb_tmpl_del (ret);
+      ret = NULL;
+   }
+
+   return ret;
+}
+
+void sqldb_tmpl_del (sqldb_tmpl_t *tmpl)
+{
+   if (!tmpl)
+      return;
+
+   for (uint32_t i=0; tmpl->names && i<tmpl->nparams; i++) {
+      sqldb_free (tmpl->names[i]);
+   }
+   sqldb_free (tmpl->names);
+   sqldb_free (tmpl->refs);
+   sqldb_free (tmpl->sqlite_query);
+   sqldb_free (tmpl->pg_query);
+   sqldb_free (tmpl->source);
+   sqldb_free (tmpl);
+}
+
+uint32_t sqldb_tmpl_nparams (const sqldb_tmpl_t *tmpl)
+{
+   return tmpl ? tmpl->nparams : 0;
+}
+
+uint32_t sqldb_tmpl_param_index (const sqldb_tmpl_t *tmpl, const char *name)
+{
+   if (!tmpl || !name)
+      return 0;
+
+   for (uint32_t i=0; tmpl->names && i<tmpl->nparams; i++) {
+      if (tmpl->names[i] && (strcmp (tmpl->names[i], name))==0)
+         return i + 1;
+   }
+
+   return 0;
+}
+
+const char *sqldb_tmpl_query (const sqldb_tmpl_t *tmpl, sqldb_dbtype_t type)
+{
+   if (!tmpl)
+      return NULL;
+
+   switch (type) {
+      case sqldb_SQLITE:      return tmpl->sqlite_query;
+      case sqldb_POSTGRES:    return tmpl->pg_query;
+      default:                return NULL;
+   }
+}
+
+// Used on the uncompiled execution path: compiles the query, keeps only
+// the string for the specified backend and discards the rest.
+static char *fix_string (sqldb_dbtype_t type, const char *string)
+{
+   char *ret = NULL;
+   sqldb_tmpl_t *tmpl = NULL;
+
+   if (type!=sqldb_SQLITE && type!=sqldb_POSTGRES) {
+      PROG_ERR ("(%i) Unknown type\n", type);
+      return NULL;
+   }
+
+   if (!(tmpl = sqldb_tmpl_new (string)))
+      return NULL;
+
+   if (type==sqldb_SQLITE) {
+      ret = tmpl->sqlite_query;
+      tmpl->sqlite_query = NULL;
+   } else {
+      ret = tmpl->pg_query;
+      tmpl->pg_query = NULL;
+   }
+
+   sqldb_tmpl_del (tmpl);
+
+   return ret;
+}
+
+static void res_seterr (sqldb_res_t *res, const char *msg)
+{
+   if (!res || !msg)
+      return;
+
+   sqldb_free (res->lasterr);
+   res->lasterr = lstr_dup (msg);
+}
+
+const char *sqldb_res_lasterr (sqldb_res_t *res)
+{
+   if (!res)
+      return NULL;
+
+   return res->lasterr;
+}
+
+void sqldb_res_clearerr (sqldb_res_t *res)
+{
+   if (!res)
+      return;
+
+   sqldb_free (res->lasterr);
+   res->lasterr = NULL;
+}
+
+// Values scanned from a result are copied into its arena when it has
+// one, and are otherwise malloced for the caller to free.
+static void *res_malloc (sqldb_res_t *res, size_t len)
+{
+   return res->arena.enabled ? arena_alloc (&res->arena, len)
+                             : sqldb_malloc (len);
+}
+
+static char *res_strdup (sqldb_res_t *res, const char *src)
+{
+   if (!res->arena.enabled)
+      return lstr_dup (src);
+
+   if (!src)
+      src = "";
+
+   size_t len = strlen (src) + 1;
+   char *ret = arena_alloc (&res->arena, len);
+   return ret ? memcpy (ret, src, len) : NULL;
+}
+
+uint64_t sqldb_count_changes (sqldb_t *db)
+{
+   uint64_t ret = 0;
+
+   if (!db)
+      return 0;
+
+   switch (db->type) {
+      case sqldb_SQLITE:   ret = sqlite3_changes (db->sqlite_db);
+                           break;
+
+      case sqldb_POSTGRES: ret = db->nchanges;
+                           break;
+
+      default:             ret = 0;
+                           break;
+   }
+
+   return ret;
+}
+
+uint64_t sqldb_res_last_id (sqldb_res_t *res)
+{
+   uint64_t ret = 0;
+
+   if (!res)
+      return 0;
+
+   switch (res->type) {
+      case sqldb_SQLITE:   ret = sqlite3_last_insert_rowid (res->dbcon->sqlite_db);
+                           break;
+
+      case sqldb_POSTGRES: ret = res->last_id;
+                           break;
+
+      default:             ret = 0;
+                           break;
+   }
+
+   return ret;
+}
+
+uint32_t sqldb_res_num_columns (sqldb_res_t *res)
+{
+   if (!res)
+      return 0;
+
+   uint32_t ret = 0;
+
+   switch (res->type) {
+      case  sqldb_SQLITE:  ret = sqlite3_column_count (res->sqlite_stmt);
+                           break;
+
+      case sqldb_POSTGRES: ret = PQnfields (res->pgr);
+                           break;
+
+      default:             ret = 0;
+                           break;
+   }
+
+   return ret;
+}
+
+char **sqldb_res_column_names (sqldb_res_t *res)
+{
+   bool error = true;
+   char **ret = NULL;
+   uint32_t ncols = 0;
+
+   if (!res)
+      goto errorexit;
+
+   if (!(ncols = sqldb_res_num_columns (res)))
+      goto errorexit;
+
+   if (!(ret = sqldb_malloc ((sizeof *ret) * (ncols + 1))))
+      goto errorexit;
+
+   memset (ret, 0, (sizeof *ret) * (ncols + 1));
+
+   for (uint32_t i=0; i<ncols; i++) {
+      const char *tmp = NULL;
+      switch (res->type) {
+         case  sqldb_SQLITE:  tmp = sqlite3_column_name (res->sqlite_stmt, i);
+                              break;
+
+         case sqldb_POSTGRES: tmp = PQfname (res->pgr, i);
+                              break;
+
+         default:             tmp = NULL;
+                              break;
+      }
+      if (!(ret[i] = lstr_dup (tmp)))
+         goto errorexit;
+   }
+
+   error = false;
+
+errorexit:
+   if (error) {
+      for (size_t i=0; ret && ret[i]; i++)
+         sqldb_free (ret[i]);
+
+      sqldb_free (ret);
+      ret = NULL;
+   }
+
+   return ret;
+}
+
+// Returns the query rewritten for the backend. If the query was not
+// compiled beforehand it is compiled now and the caller must free the
+// string returned in tofree.
+static const char *query_native (sqldb_dbtype_t type,
+                                 const struct query_t *query,
+                                 char **tofree)
+{
+   *tofree = NULL;
+
+   if (query->tmpl)
+      return sqldb_tmpl_query (query->tmpl, type);
+
+   if (!(*tofree = fix_string (type, query->key)))
+      SQLDB_OOM (query->key);
+
+   return *tofree;
+}
+
+static bool sqlitedb_prepare (sqldb_t *db, sqldb_res_t *res,
+                              const struct query_t *query)
+{
+   bool error = true;
+   char *tofree = NULL;
+   const char *qstring = NULL;
+   struct stmt_cache_t *entry = stmt_cache_find (db, query, 0);
+
+   if (entry && !entry->user) {
+      db->cache_hits++;
+      entry->user = res;
+      res->cached = entry;
+      res->sqlite_stmt = entry->sqlite_stmt;
+      return true;
+   }
+
+   db->cache_misses++;
+
+   if (!(qstring = query_native (db->type, query, &tofree)))
+      goto errorexit;
+
+   // If an identical statement is already in use by another result we
+   // prepare a private copy for this result rather than caching it.
+   entry = entry ? NULL : stmt_cache_new (db, query, 0);
+
+   unsigned int flags = entry ? SQLITE_PREPARE_PERSISTENT : 0;
+   uint64_t start = res->stats_start ? clock_us () : 0;
+   uint64_t span = sqldb_span_begin ();
+   int rc = sqlite3_prepare_v3 (db->sqlite_db, qstring, -1, flags,
+                                &res->sqlite_stmt, NULL);
+   span_record ("sqldb", "prepare", span_detail (res), span);
+   stats_prepared (db, res, start);
+   if (rc!=SQLITE_OK) {
+      const char *tmp = sqlite3_errstr (rc);
+      const char *tmp2 = sqlite3_errmsg (db->sqlite_db);
+      db_err_printf (db, "Fatal error: %s/%i\n%s\n[%s]\n", tmp,
+                                                           rc,
+                                                           tmp2,
+                                                           qstring);
+      if (entry)
+         stmt_cache_evict (db, entry);
+      goto errorexit;
+   }
+
+   if (entry) {
+      entry->sqlite_stmt = res->sqlite_stmt;
+      entry->user = res;
+      res->cached = entry;
+   }
+
+   error = false;
+
+errorexit:
+   sqldb_free (tofree);
+   return !error;
+}
+
+/* *****************************************************************
+ * Parameter arrays. Statements are always executed with an array of
+ * sqldb_param_t; the variadic functions first collect their tuples into
+ * an array, which is on the stack unless there are very many parameters.
+ */
+
+#define PARAMS_LOCAL       (32)
+
+struct params_t {
+   sqldb_param_t  *p;
+   size_t          n;
+   sqldb_param_t   local[PARAMS_LOCAL];
+};
+
+static void params_free (struct params_t *params)
+{
+   if (params->p!=params->local)
+      sqldb_free (params->p);
+   params->p = NULL;
+   params->n = 0;
+}
+
+// Collects the variadic parameter tuples, up to and including the
+// terminating sqldb_col_UNKNOWN, into dst. The caller of a variadic
+// function makes no promise about the lifetime of its strings and blobs,
+// so none of the values are borrowed.
+static bool params_collect (sqldb_t *db, va_list *ap, struct params_t *dst)
+{
+   size_t max = PARAMS_LOCAL;
+   sqldb_coltype_t type;
+
+   dst->p = dst->local;
+   dst->n = 0;
+
+   while ((type = va_arg (*ap, sqldb_coltype_t))!=sqldb_col_UNKNOWN) {
+      const void *value = va_arg (*ap, const void *);
+      const uint32_t *bloblen = type==sqldb_col_BLOB
+                              ? va_arg (*ap, const uint32_t *)
+                              : NULL;
+
+      if (dst->n >= max) {
+         size_t newmax = max * 2;
+         sqldb_param_t *tmp = dst->p==dst->local
+                            ? sqldb_malloc (newmax * sizeof *tmp)
+                            : sqldb_realloc (dst->p, newmax * sizeof *tmp);
+         if (!tmp) {
+            db_err_printf (db, "OOM collecting %zu parameters\n", newmax);
+            params_free (dst);
+            return false;
+         }
+         if (dst->p==dst->local)
+            memcpy (tmp, dst->local, sizeof dst->local);
+         dst->p = tmp;
+         max = newmax;
+      }
+
+      sqldb_param_t *param = &dst->p[dst->n++];
+      param->type = type;
+      param->flags = 0;
+      param->len = 0;
+      param->v.u64 = 0;
+
+      switch (type) {
+         case sqldb_col_UINT32:
+         case sqldb_col_INT32:
+            param->v.u32 = *(const uint32_t *)value;
+            break;
+
+         case sqldb_col_DATETIME:
+         case sqldb_col_UINT64:
+         case sqldb_col_INT64:
+            param->v.u64 = *(const uint64_t *)value;
+            break;
+
+         case sqldb_col_TEXT:
+            param->v.ptr = *(const char * const *)value;
+            break;
+
+         case sqldb_col_BLOB:
+            param->v.ptr = *(const void * const *)value;
+            param->len = *bloblen;
+            break;
+
+         default:
+            break;
+      }
+   }
+
+   return true;
+}
+
+// Binds a single parameter. The value points to the value of the
+// parameter (for TEXT and BLOB, to the pointer to the data); bloblen is
+// only used for blobs.
+static int sqlitedb_bind (sqlite3_stmt *stmt, int index,
+                          sqldb_coltype_t type,
+                          const void *value,
+                          const uint32_t *bloblen,
+                          sqlite3_destructor_type destructor)
+{
+   switch (type) {
+      case sqldb_col_INT32:
+         return sqlite3_bind_int (stmt, index, *(const int32_t *)value);
+
+      // Values above INT32_MAX must not become negative.
+      case sqldb_col_UINT32:
+         return sqlite3_bind_int64 (stmt, index, *(const uint32_t *)value);
+
+      case sqldb_col_DATETIME:
+      case sqldb_col_UINT64:
+      case sqldb_col_INT64:
+         return sqlite3_bind_int64 (stmt, index, *(const int64_t *)value);
+
+      case sqldb_col_TEXT:
+         return sqlite3_bind_text (stmt, index, *(const char **)value,
+                                   -1, destructor);
+
+      case sqldb_col_BLOB:
+         return sqlite3_bind_blob (stmt, index, *(const uint8_t **)value,
+                                   *bloblen, destructor);
+
+      case sqldb_col_NULL:
+         return sqlite3_bind_null (stmt, index);
+
+      default:
+         return SQLITE_MISUSE;
+   }
+}
+
+static bool sqlitedb_exec (sqldb_t *db, sqldb_res_t *res,
+                           const struct query_t *query,
+                           const sqldb_param_t *params,
+                           size_t nparams)
+{
+   if (!(sqlitedb_prepare (db, res, query)))
+      return false;
+
+   sqlite3_stmt *stmt = res->sqlite_stmt;
+   uint64_t span = sqldb_span_begin ();
+   for (size_t i=0; i<nparams; i++) {
+      int index = i + 1;
+      sqlite3_destructor_type destructor =
+         (params[i].flags & sqldb_PARAM_BORROWED) ? SQLITE_STATIC
+                                                  : SQLITE_TRANSIENT;
+
+      int err = sqlitedb_bind (stmt, index, params[i].type, &params[i].v,
+                               &params[i].len, destructor);
+      if (err!=SQLITE_OK) {
+         db_err_printf (db, "Unable to bind %i\n", index);
+         return false;
+      }
+   }
+   span_record ("sqldb", "bind", span_detail (res), span);
+
+   return true;
+}
+
+/* *****************************************************************
+ * Postgres parameters. Integers, timestamps and blobs are sent in the
+ * binary format with their types specified, so that the server neither
+ * parses them nor infers their types. Text is passed through to libpq
+ * without being copied and is typed by the server, as before.
+ */
+
+// Type OIDs from the postgres catalog (pg_type.dat); these are fixed.
+#define PG_OID_BOOL           (16)
+#define PG_OID_BYTEA          (17)
+#define PG_OID_NAME           (19)
+#define PG_OID_INT8           (20)
+#define PG_OID_INT2           (21)
+#define PG_OID_INT4           (23)
+#define PG_OID_TEXT           (25)
+#define PG_OID_OID            (26)
+#define PG_OID_BPCHAR         (1042)
+#define PG_OID_VARCHAR        (1043)
+#define PG_OID_TIMESTAMP      (1114)
+#define PG_OID_TIMESTAMPTZ    (1184)
+
+// Seconds between the unix epoch and the postgres epoch (2000-01-01).
+#define PG_EPOCH_OFFSET       (946684800)
+
+// Statements with up to this many parameters need no allocation.
+#define PG_PARAMS_LOCAL       (16)
+
+struct pg_params_t {
+   int             n;
+   const char    **values;
+   int            *lengths;
+   int            *formats;
+   Oid            *types;
+
+   // Storage for the binary values, 8 bytes per parameter.
+   unsigned char  *bin;
+
+   // A hash of the parameter types; a statement prepared with one set of
+   // types cannot be executed with another.
+   uint64_t        sig;
+
+   // Storage for the arrays above when there are few parameters; each
+   // parameter needs 28 bytes.
+   uint64_t        local[(PG_PARAMS_LOCAL + 1) * 4];
+};
+
+static void pg_put_u64 (unsigned char *dst, uint64_t value, int len)
+{
+   for (int i=len - 1; i>=0; i--) {
+      dst[i] = value & 0xff;
+      value >>= 8;
+   }
+}
+
+static void pg_params_free (struct pg_params_t *params)
+{
+   // All the arrays are in a single block.
+   if ((void *)params->values!=(void *)params->local)
+      sqldb_free (params->values);
+   params->values = NULL;
+   params->n = 0;
+}
+
+static bool pg_params_alloc (struct pg_params_t *dst, int nParams)
+{
+   unsigned char *block = NULL;
+
+   size_t n = nParams + 1;
+   size_t blocklen = n * (sizeof *dst->values + 8
+                        + sizeof *dst->lengths
+                        + sizeof *dst->formats
+                        + sizeof *dst->types);
+   if (blocklen <= sizeof dst->local) {
+      block = (unsigned char *)dst->local;
+      memset (block, 0, blocklen);
+   } else if (!(block = sqldb_calloc (1, blocklen))) {
+      SQLDB_OOM ("pg parameters");
+      return false;
+   }
+
+   dst->values = (const char **)block;
+   dst->bin = block + n * sizeof *dst->values;
+   dst->lengths = (int *)(dst->bin + n * 8);
+   dst->formats = dst->lengths + n;
+   dst->types = (Oid *)(dst->formats + n);
+   dst->n = nParams;
+
+   return true;
+}
+
+static void pg_params_sign (struct pg_params_t *dst)
+{
+   dst->sig = 14695981039346656037ULL;
+   for (int i=0; i<dst->n; i++) {
+      dst->sig = (dst->sig ^ dst->types[i]) * 1099511628211ULL;
+   }
+}
+
+// Sets the parameter at index. The value points to the value of the
+// parameter (for TEXT and BLOB, to the pointer to the data, which must
+// remain valid until the statement has been sent); bloblen is only used
+// for blobs.
+static bool pg_param (struct pg_params_t *dst, int index,
+                      sqldb_coltype_t type,
+                      const void *value,
+                      const uint32_t *bloblen)
+{
+   unsigned char *bin = &dst->bin[index * 8];
+
+   dst->values[index] = NULL;
+   dst->lengths[index] = 0;
+   dst->formats[index] = 0;
+   dst->types[index] = 0;
+
+   switch (type) {
+      case sqldb_col_INT32:
+         pg_put_u64 (bin, *(const uint32_t *)value, 4);
+         dst->types[index] = PG_OID_INT4;
+         dst->lengths[index] = 4;
+         break;
+
+      // There is no unsigned int4, so values above INT32_MAX would arrive
+      // as negative numbers; the value is zero-extended to an int8.
+      case sqldb_col_UINT32:
+         pg_put_u64 (bin, *(const uint32_t *)value, 8);
+         dst->types[index] = PG_OID_INT8;
+         dst->lengths[index] = 8;
+         break;
+
+      case sqldb_col_UINT64:
+      case sqldb_col_INT64:
+         pg_put_u64 (bin, *(const uint64_t *)value, 8);
+         dst->types[index] = PG_OID_INT8;
+         dst->lengths[index] = 8;
+         break;
+
+      // As with sqlite, a datetime parameter is the number of seconds
+      // since the epoch.
+      case sqldb_col_DATETIME:
+         pg_put_u64 (bin, (uint64_t)((*(const int64_t *)value
+                                       - PG_EPOCH_OFFSET) * 1000000), 8);
+         dst->types[index] = PG_OID_TIMESTAMPTZ;
+         dst->lengths[index] = 8;
+         break;
+
+      case sqldb_col_TEXT:
+         dst->values[index] = *(const char **)value;
+         return true;
+
+      case sqldb_col_BLOB:
+         dst->values[index] = *(const char **)value;
+         dst->lengths[index] = *bloblen;
+         dst->formats[index] = 1;
+         dst->types[index] = PG_OID_BYTEA;
+         return true;
+
+      case sqldb_col_NULL:
+         return true;
+
+      default:
+         return false;
+   }
+
+   dst->values[index] = (const char *)bin;
+   dst->formats[index] = 1;
+   return true;
+}
+
+// Fills in the parameters for libpq from the parameter array. The values
+// reference the caller's strings and blobs, which are never copied and
+// must remain valid until the statement has been sent.
+static bool pgdb_params (sqldb_t *db, const sqldb_param_t *params,
+                                      size_t nparams,
+                                      struct pg_params_t *dst)
+{
+   if (!(pg_params_alloc (dst, nparams)))
+      return false;
+
+   for (size_t i=0; i<nparams; i++) {
+      if (!(pg_param (dst, i, params[i].type, &params[i].v,
+                                              &params[i].len))) {
+         db_err_printf (db, "Unknown column type: %u\n", params[i].type);
+         pg_params_free (dst);
+         return false;
+      }
+   }
+
+   pg_params_sign (dst);
+   return true;
+}
+
+// Prepares the query as a server-side prepared statement and places it
+// in the cache. Returns NULL if the statement could not be cached, in
+// which case the caller must execute the query unprepared.
+static struct stmt_cache_t *pgdb_prepare (sqldb_t *db,
+                                          const struct query_t *query,
+                                          const char *qstring,
+                                          const struct pg_params_t *params)
+{
+   struct stmt_cache_t *entry = NULL;
+
+   if (!(entry = stmt_cache_new (db, query, params->sig)))
+      return NULL;
+
+   snprintf (entry->pg_name, sizeof entry->pg_name, "sqldb_s%" PRIu32,
+             ++db->pg_stmt_counter);
+
+   PGresult *res = PQprepare (db->pg_db, entry->pg_name, qstring,
+                              params->n, params->types);
+
+   if (!res || PQresultStatus (res) != PGRES_COMMAND_OK) {
+      // Let the unprepared execution report the error to the caller.
+      entry->pg_name[0] = 0;
+      stmt_cache_evict (db, entry);
+      PQclear (res);
+      return NULL;
+   }
+
+   PQclear (res);
+
+   return entry;
+}
+
+/* *****************************************************************
+ * Streaming results. When sqldb_FLAG_STREAMING is set, postgres rows are
+ * received one at a time (or one chunk at a time, when libpq supports it)
+ * as the result is stepped through, instead of the entire result being
+ * buffered by libpq before sqldb_exec() returns.
+ */
+
+#define PG_STREAM_CHUNK       (256)
+
+static void pgdb_stream_mode (sqldb_t *db)
+{
+#ifdef LIBPQ_HAS_CHUNK_MODE
+   PQsetChunkedRowsMode (db->pg_db, PG_STREAM_CHUNK);
+#else
+   PQsetSingleRowMode (db->pg_db);
+#endif
+}
+
+// Returns true if the status is that of a partial result, which is
+// followed by further results.
+static bool pgdb_status_partial (ExecStatusType rs)
+{
+#ifdef LIBPQ_HAS_CHUNK_MODE
+   if (rs==PGRES_TUPLES_CHUNK)
+      return true;
+#endif
+   return rs==PGRES_SINGLE_TUPLE;
+}
+
+static bool pgdb_status_ok (ExecStatusType rs)
+{
+   return rs==PGRES_COMMAND_OK || rs==PGRES_TUPLES_OK
+                               || pgdb_status_partial (rs);
+}
+
+// Records the SQLSTATE of a failed result, see tx_retryable().
+static void pgdb_sqlstate (sqldb_t *db, const PGresult *r)
+{
+   const char *state = r ? PQresultErrorField (r, PG_DIAG_SQLSTATE) : NULL;
+   snprintf (db->pg_sqlstate, sizeof db->pg_sqlstate, "%s",
+                              state ? state : "");
+}
+
+// True if the last error means that the prepared statement can no longer
+// be used: "cached plan must not change result type" (0A000) or the
+// statement no longer existing on the server (26000).
+static bool pgdb_plan_invalid (sqldb_t *db)
+{
+   return (strcmp (db->pg_sqlstate, "0A000"))==0
+       || (strcmp (db->pg_sqlstate, "26000"))==0;
+}
+
+// Discards any results still to be received for a streaming result and
+// releases the connection for the next statement.
+static void pgdb_stream_end (sqldb_t *db, sqldb_res_t *res)
+{
+   PGresult *r = NULL;
+
+   while ((r = PQgetResult (db->pg_db)))
+      PQclear (r);
+
+   res->streaming = false;
+   if (db->stream_res==res)
+      db->stream_res = NULL;
+}
+
+// Replaces the rows held by a streaming result with the next rows from
+// the server. Returns 1 if rows are available, 0 if the result is
+// complete and -1 on error.
+static int pgdb_stream_next (sqldb_res_t *res)
+{
+   sqldb_t *db = res->dbcon;
+   PGresult *r = PQgetResult (db->pg_db);
+   ExecStatusType rs = r ? PQresultStatus (r) : PGRES_FATAL_ERROR;
+
+   if (pgdb_status_partial (rs)) {
+      PQclear (res->pgr);
+      res->pgr = r;
+      res->nrows = PQntuples (r);
+      res->current_row = 0;
+      return 1;
+   }
+
+   pgdb_stream_end (db, res);
+
+   if (rs==PGRES_TUPLES_OK) {
+      // The final result holds no rows but still describes the columns.
+      PQclear (res->pgr);
+      res->pgr = r;
+      res->nrows = 0;
+      res->current_row = 0;
+      return 0;
+   }
+
+   res_err_printf (res, "%s", r ? PQresultErrorMessage (r)
+                                : PQerrorMessage (db->pg_db));
+   PQclear (r);
+   return -1;
+}
+
+// Records the number of rows, the changes and the inserted OID of a
+// successful result.
+static void pgdb_res_counts (sqldb_t *db, sqldb_res_t *res)
+{
+   res->current_row = -1;
+   res->nrows = PQntuples (res->pgr);
+   const char *tmp = PQcmdTuples (res->pgr);
+   db->nchanges = 0;
+   if (tmp) {
+      sscanf (tmp, "%" PRIu64, &db->nchanges);
+   }
+
+   Oid last_id = PQoidValue (res->pgr);
+   res->last_id = last_id == InvalidOid ? (uint64_t)-1 : last_id;
+}
+
+static bool pgdb_exec (sqldb_t *db, sqldb_res_t *ret,
+                       const struct query_t *query,
+                       const sqldb_param_t *args,
+                       size_t nargs)
+{
+   bool error = true;
+
+   struct pg_params_t params = { 0 };
+   char *tofree = NULL;
+   const char *qstring = NULL;
+   struct stmt_cache_t *entry = NULL;
+
+   int resultFormat = (db->flags & sqldb_FLAG_BINARY) ? 1 : 0;
+
+   pgdb_dealloc_flush (db);
+
+   uint64_t span = sqldb_span_begin ();
+   if (!(pgdb_params (db, args, nargs, &params)))
+      goto errorexit;
+   span_record ("sqldb", "bind", span_detail (ret), span);
+
+   if ((entry = stmt_cache_find (db, query, params.sig))) {
+      db->cache_hits++;
+   } else {
+      db->cache_misses++;
+      if (!(qstring = query_native (db->type, query, &tofree)))
+         goto errorexit;
+      uint64_t start = ret->stats_start ? clock_us () : 0;
+      span = sqldb_span_begin ();
+      entry = pgdb_prepare (db, query, qstring, &params);
+      span_record ("sqldb", "prepare", span_detail (ret), span);
+      stats_prepared (db, ret, start);
+   }
+
+   uint64_t exec_start = db->trace_fn ? clock_us () : 0;
+
+   if (db->flags & sqldb_FLAG_STREAMING) {
+      int sent = entry
+         ? PQsendQueryPrepared (db->pg_db, entry->pg_name, params.n,
+                                                params.values,
+                                                params.lengths,
+                                                params.formats,
+                                                resultFormat)
+         : PQsendQueryParams (db->pg_db, qstring, params.n,
+                                                params.types,
+                                                params.values,
+                                                params.lengths,
+                                                params.formats,
+                                                resultFormat);
+      if (sent) {
+         pgdb_stream_mode (db);
+         ret->pgr = PQgetResult (db->pg_db);
+         ret->streaming = true;
+      }
+   } else if (entry) {
+      ret->pgr = PQexecPrepared (db->pg_db, entry->pg_name, params.n,
+                                                params.values,
+                                                params.lengths,
+                                                params.formats,
+                                                resultFormat);
+   } else {
+      ret->pgr = PQexecParams (db->pg_db, qstring, params.n,
+                                                params.types,
+                                                params.values,
+                                                params.lengths,
+                                                params.formats,
+                                                resultFormat);
+   }
+
+   pgdb_trace (db, query, args, nargs, exec_start);
+
+   if (!ret->pgr) {
+      db_err_printf (db, "Possible OOM error (pg)\n[%s]\n[%s]\n",
+                         query->key, PQerrorMessage (db->pg_db));
+      goto errorexit;
+   }
+
+   ExecStatusType rs = PQresultStatus (ret->pgr);
+   if (!(pgdb_status_ok (rs))) {
+      pgdb_sqlstate (db, ret->pgr);
+      db_err_printf (db, "Bad postgres return status [%s]\n[%s]\n",
+                          PQresultErrorMessage (ret->pgr),
+                          query->key);
+      // The cached plan may have been invalidated by a schema change, or
+      // dropped by the server; prepare it afresh on the next execution.
+      // Any other error leaves the statement valid.
+      if (entry && pgdb_plan_invalid (db))
+         stmt_cache_evict (db, entry);
+      goto errorexit;
+   }
+
+   // Only a result that has more rows to come keeps the connection busy.
+   if (ret->streaming && !(pgdb_status_partial (rs)))
+      pgdb_stream_end (db, ret);
+
+   if (ret->streaming)
+      db->stream_res = ret;
+
+   pgdb_res_counts (db, ret);
+
+   error = false;
+
+errorexit:
+
+   pg_params_free (&params);
+   sqldb_free (tofree);
+
+   return !error;
+}
+
+// Allocates a result for a query on db. With sqldb_FLAG_ARENA set the
+// first block of the arena is part of the same allocation.
+static sqldb_res_t *res_new (sqldb_t *db)
+{
+   bool arena = db->flags & sqldb_FLAG_ARENA;
+   sqldb_res_t *ret = NULL;
+
+   size_t len = sizeof *ret;
+   if (arena)
+      len += sizeof (struct arena_block_t) + ARENA_INLINE;
+
+   if (!(ret = sqldb_malloc (len))) {
+      db_err_printf (db, "OOM allocating result\n");
+      return NULL;
+   }
+   memset (ret, 0, sizeof *ret);
+
+   ret->type = db->type;
+   ret->dbcon = db;
+
+   if (arena) {
+      struct arena_block_t *block = (struct arena_block_t *)(ret + 1);
+      block->next = NULL;
+      block->len = ARENA_INLINE;
+      block->used = 0;
+      block->owned = false;
+      ret->arena.enabled = true;
+      ret->arena.blocks = block;
+   }
+
+   return ret;
+}
+
+// Releases the statement or postgres result held by res and everything
+// allocated in its arena, leaving res as though it had just been created.
+static void res_release (sqldb_res_t *res)
+{
+   struct arena_t arena = res->arena;
+
+   stats_release (res);
+   sqldb_res_clearerr (res);
+
+   switch (res->type) {
+      case sqldb_SQLITE:   if (res->cached) {
+                              // Return the statement to the cache
+                              sqlite3_reset (res->sqlite_stmt);
+                              sqlite3_clear_bindings (res->sqlite_stmt);
+                              res->cached->user = NULL;
+                           } else {
+                              sqlite3_finalize (res->sqlite_stmt);
+                           }
+                           break;
+      case sqldb_POSTGRES: if (res->streaming)
+                              pgdb_stream_end (res->dbcon, res);
+                           PQclear (res->pgr);
+                           break;
+      default:             break;
+   }
+
+   arena_reset (&arena);
+   memset (res, 0, sizeof *res);
+   res->arena = arena;
+}
+
+sqldb_res_t *sqldb_exec (sqldb_t *db, const char *query, ...)
+{
+   sqldb_res_t *ret = NULL;
+   va_list ap;
+
+   va_start (ap, query);
+   ret = sqldb_execv (db, query, &ap);
+   va_end (ap);
+
+   return ret;
+}
+
+// Executes the query into res, which must be new or released. On failure
+// res is released again.
+static bool exec_query_res (sqldb_t *db, sqldb_res_t *res,
+                            const struct query_t *query,
+                            const sqldb_param_t *params,
+                            size_t nparams)
+{
+   bool error = true;
+
+   sqldb_clearerr (db);
+
+   if (db->pipeline==PIPELINE_PG) {
+      db_err_printf (db, "Cannot execute [%s] while a pipeline is active; "
+                         "use sqldb_pipeline_queue()\n", query->key);
+      goto errorexit;
+   }
+
+   if (db->stream_res) {
+      db_err_printf (db, "Cannot execute [%s] while a streaming result is "
+                         "still being read on this connection\n",
+                         query->key);
+      goto errorexit;
+   }
+
+   if (db->async==ASYNC_SENT) {
+      db_err_printf (db, "Cannot execute [%s] while an asynchronous query "
+                         "is outstanding\n", query->key);
+      goto errorexit;
+   }
+
+   res->type = db->type;
+   res->dbcon = db;
+
+   uint64_t span = sqldb_span_begin ();
+   stats_begin (res, query);
+
+   switch (db->type) {
+      case sqldb_SQLITE:   error = !sqlitedb_exec (db, res, query, params,
+                                                                  nparams);
+                           break;
+      case sqldb_POSTGRES: error = !pgdb_exec (db, res, query, params,
+                                                              nparams);
+                           break;
+      default:             db_err_printf (db, "(%i) Unknown type\n", db->type);
+                           goto errorexit;
+   }
+
+   stats_executed (db, res, !error);
+   span_record ("sqldb", "exec", span_detail (res), span);
+
+errorexit:
+   if (error)
+      res_release (res);
+
+   return !error;
+}
+
+static sqldb_res_t *exec_query (sqldb_t *db, const struct query_t *query,
+                                const sqldb_param_t *params,
+                                size_t nparams)
+{
+   sqldb_res_t *ret = NULL;
+
+   if (!(ret = res_new (db)))
+      return NULL;
+
+   if (!(exec_query_res (db, ret, query, params, nparams))) {
+      sqldb_res_del (ret);
+      ret = NULL;
+   }
+
+   return ret;
+}
+
+static sqldb_res_t *exec_query_va (sqldb_t *db, const struct query_t *query,
+                                   va_list *ap)
+{
+   struct params_t params;
+
+   if (!(params_collect (db, ap, &params)))
+      return NULL;
+
+   sqldb_res_t *ret = exec_query (db, query, params.p, params.n);
+
+   params_free (&params);
+   return ret;
+}
+
+static void query_init (struct query_t *q, const char *query)
+{
+   q->key = query;
+   q->hash = stmt_hash (query, &q->klen);
+   q->tmpl = NULL;
+}
+
+static void query_init_tmpl (struct query_t *q, const sqldb_tmpl_t *tmpl)
+{
+   q->key = tmpl->source;
+   q->klen = tmpl->slen;
+   q->hash = tmpl->hash;
+   q->tmpl = tmpl;
+}
+
+sqldb_res_t *sqldb_execv (sqldb_t *db, const char *query, va_list *ap)
+{
+   struct query_t q;
+
+   if (!db || !query)
+      return NULL;
+
+   query_init (&q, query);
+   return exec_query_va (db, &q, ap);
+}
+
+sqldb_res_t *sqldb_exec_params (sqldb_t *db, const char *query,
+                                const sqldb_param_t *params, size_t nparams)
+{
+   struct query_t q;
+
+   if (!db || !query || (nparams && !params))
+      return NULL;
+
+   query_init (&q, query);
+   return exec_query (db, &q, params, nparams);
+}
+
+bool sqldb_res_exec (sqldb_t *db, sqldb_res_t *res, const char *query, ...)
+{
+   bool ret = false;
+   va_list ap;
+
+   va_start (ap, query);
+   ret = sqldb_res_execv (db, res, query, &ap);
+   va_end (ap);
+
+   return ret;
+}
+
+bool sqldb_res_execv (sqldb_t *db, sqldb_res_t *res, const char *query,
+                      va_list *ap)
+{
+   struct query_t q;
+   struct params_t params;
+
+   if (!db || !res || !query)
+      return false;
+
+   res_release (res);
+
+   if (!(params_collect (db, ap, &params)))
+      return false;
+
+   query_init (&q, query);
+   bool ret = exec_query_res (db, res, &q, params.p, params.n);
+
+   params_free (&params);
+   return ret;
+}
+
+bool sqldb_res_exec_params (sqldb_t *db, sqldb_res_t *res, const char *query,
+                            const sqldb_param_t *params, size_t nparams)
+{
+   struct query_t q;
+
+   if (!db || !res || !query || (nparams && !params))
+      return false;
+
+   res_release (res);
+
+   query_init (&q, query);
+   return exec_query_res (db, res, &q, params, nparams);
+}
+
+sqldb_res_t *sqldb_exec_tmpl (sqldb_t *db, const sqldb_tmpl_t *tmpl, ...)
+{
+   sqldb_res_t *ret = NULL;
+   va_list ap;
+
+   va_start (ap, tmpl);
+   ret = sqldb_exec_tmplv (db, tmpl, &ap);
+   va_end (ap);
+
+   return ret;
+}
+
+sqldb_res_t *sqldb_exec_tmplv (sqldb_t *db, const sqldb_tmpl_t *tmpl,
+                                            va_list *ap)
+{
+   struct query_t q;
+
+   if (!db || !tmpl)
+      return NULL;
+
+   query_init_tmpl (&q, tmpl);
+   return exec_query_va (db, &q, ap);
+}
+
+sqldb_res_t *sqldb_exec_tmpl_params (sqldb_t *db, const sqldb_tmpl_t *tmpl,
+                                     const sqldb_param_t *params,
+                                     size_t nparams)
+{
+   struct query_t q;
+
+   if (!db || !tmpl || (nparams && !params))
+      return NULL;
+
+   query_init_tmpl (&q, tmpl);
+   return exec_query (db, &q, params, nparams);
+}
+
+uint64_t sqldb_exec_ignore (sqldb_t *db, const char *query, ...)
+{
+   va_list ap;
+
+   va_start (ap, query);
+   uint64_t ret = sqldb_exec_ignorev (db, query, &ap);
+   va_end (ap);
+
+   return ret;
+}
+
+static uint64_t exec_ignore_res (sqldb_res_t *res, const char *query)
+{
+   uint64_t ret = (uint64_t)-1;
+
+   if (!res)
+      goto errorexit;
+
+   if ((sqldb_res_step (res))==-1)
+      goto errorexit;
+
+   ret = sqldb_res_last_id (res);
+
+errorexit:
+   if (res && res->lasterr) {
+      db_err_printf (res->dbcon, "Error in [%s]: %s\n", query, res->lasterr);
+   }
+   sqldb_res_del (res);
+
+   return ret;
+
+}
+
+uint64_t sqldb_exec_ignorev (sqldb_t *db, const char *query, va_list *ap)
+{
+   return exec_ignore_res (sqldb_execv (db, query, ap), query);
+}
+
+uint64_t sqldb_exec_tmpl_ignore (sqldb_t *db, const sqldb_tmpl_t *tmpl, ...)
+{
+   va_list ap;
+
+   va_start (ap, tmpl);
+   uint64_t ret = sqldb_exec_tmpl_ignorev (db, tmpl, &ap);
+   va_end (ap);
+
+   return ret;
+}
+
+uint64_t sqldb_exec_tmpl_ignorev (sqldb_t *db, const sqldb_tmpl_t *tmpl,
+                                               va_list *ap)
+{
+   return exec_ignore_res (sqldb_exec_tmplv (db, tmpl, ap),
+                           tmpl ? tmpl->source : NULL);
+}
+
+uint64_t sqldb_exec_params_ignore (sqldb_t *db, const char *query,
+                                   const sqldb_param_t *params,
+                                   size_t nparams)
+{
+   return exec_ignore_res (sqldb_exec_params (db, query, params, nparams),
+                           query);
+}
+
+uint64_t sqldb_exec_tmpl_params_ignore (sqldb_t *db,
+                                        const sqldb_tmpl_t *tmpl,
+                                        const sqldb_param_t *params,
+                                        size_t nparams)
+{
+   return exec_ignore_res (sqldb_exec_tmpl_params (db, tmpl, params,
+                                                   nparams),
+                           tmpl ? tmpl->source : NULL);
+}
+
+
+static bool sqlitedb_batch_one (sqldb_t *db, const char *qstring)
+{
+   bool ret = true;
+   char *errmsg = NULL;
+   int rc = sqlite3_exec (db->sqlite_db, qstring, NULL, NULL, &errmsg);
+
+   if (rc!=SQLITE_OK) {
+      ret = false;
+      db_err_printf (db, "DB exec failure [%s]\n[%s]\n", qstring, errmsg);
+   }
+
+   sqlite3_free (errmsg);
+   return ret;
+}
+
+static bool sqlitedb_batch (sqldb_t *db, va_list ap)
+{
+   bool ret = true;
+   if (!db->sqlite_db)
+      return false;
+
+   char *qstring = va_arg (ap, char *);
+
+   while (ret && qstring) {
+      ret = sqlitedb_batch_one (db, qstring);
+      qstring = va_arg (ap, char *);
+   }
+
+   return ret;
+}
+
+static bool pgdb_batch_one (sqldb_t *db, const char *qstring)
+{
+   bool ret = true;
+   PGresult *result = PQexec (db->pg_db, qstring);
+   if (!result) {
+      db_err_printf (db, "PGSQL - OOM error\n[%s]\n", qstring);
+      return false;
+   }
+   ExecStatusType rc = PQresultStatus (result);
+   if (rc == PGRES_BAD_RESPONSE || rc == PGRES_FATAL_ERROR) {
+      const char *rc_msg = PQresStatus (rc),
+                 *res_msg = PQresultErrorMessage (result);
+
+      pgdb_sqlstate (db, result);
+
+      db_err_printf (db, "pgdb_batch: Bad postgres result[%s]\n[%s]\n[%s]\n",
+                         rc_msg,
+                         res_msg,
+                         qstring);
+      ret = false;
+   } else {
+      const char *tmp = PQcmdTuples (result);
+      db->nchanges = 0;
+      if (tmp)
+         sscanf (tmp, "%" PRIu64, &db->nchanges);
+   }
+
+   PQclear (result);
+   return ret;
+}
+
+static bool pgdb_batch (sqldb_t *db, va_list ap)
+{
+   bool ret = true;
+
+   if (!db->pg_db)
+      return false;
+
+   char *qstring = va_arg (ap, char *);
+
+   while (ret && qstring) {
+      ret = pgdb_batch_one (db, qstring);
+      qstring =  va_arg (ap, char *);
+   }
+
+   return ret;
+}
+
+
+/* *****************************************************************
+ * Pipelines. On postgres the statements are sent without waiting for
+ * each result, and all the results are read after a single sync, so a
+ * pipeline of N statements costs a single round trip. Every other backend
+ * executes each statement as it is queued, inside a transaction so that
+ * the all-or-nothing behaviour matches that of a postgres pipeline.
+ */
+
+// Appends a new item for a queued statement, returning its index or
+// (size_t)-1 on OOM.
+static size_t pipeline_item_new (sqldb_t *db)
+{
+   if (db->pipe_nitems >= db->pipe_items_max) {
+      size_t newmax = db->pipe_items_max ? db->pipe_items_max * 2 : 16;
+      struct pipeline_item_t *tmp = sqldb_realloc (db->pipe_items,
+                                                   newmax * sizeof *tmp);
+      if (!tmp) {
+         SQLDB_OOM ("pipeline items");
+         return (size_t)-1;
+      }
+      db->pipe_items = tmp;
+      db->pipe_items_max = newmax;
+   }
+
+   memset (&db->pipe_items[db->pipe_nitems], 0, sizeof *db->pipe_items);
+   return db->pipe_nitems++;
+}
+
+static void pipeline_item_fail (sqldb_t *db, size_t item, const char *msg)
+{
+   sqldb_free (db->pipe_items[item].errmsg);
+   db->pipe_items[item].errmsg = lstr_dup (msg);
+   db->pipe_items[item].ok = false;
+   db->pipe_failed = true;
+}
+
+static bool pipeline_in_transaction (sqldb_t *db)
+{
+   switch (db->type) {
+      case sqldb_SQLITE:   return !sqlite3_get_autocommit (db->sqlite_db);
+      case sqldb_POSTGRES: return PQtransactionStatus (db->pg_db)
+                                    != PQTRANS_IDLE;
+      default:             return false;
+   }
+}
+
+static bool immediate_batch_one (sqldb_t *db, const char *qstring)
+{
+   return db->type==sqldb_SQLITE ? sqlitedb_batch_one (db, qstring)
+                                 : pgdb_batch_one (db, qstring);
+}
+
+// Executes a single statement immediately and records the outcome as the
+// next pipeline item. The statement is either the query (with the
+// parameters in args) or, when query is NULL, the raw batch statement.
+static bool immediate_queue (sqldb_t *db, const struct query_t *query,
+                             const sqldb_param_t *args, size_t nargs,
+                             const char *raw)
+{
+   size_t item = pipeline_item_new (db);
+   if (item==(size_t)-1)
+      return false;
+
+   if (db->pipe_failed) {
+      pipeline_item_fail (db, item, "Not executed: an earlier statement "
+                                    "in the pipeline failed");
+      return true;
+   }
+
+   bool ok = false;
+   if (query) {
+      ok = exec_ignore_res (exec_query (db, query, args, nargs),
+                            query->key)!=(uint64_t)-1;
+   } else {
+      ok = immediate_batch_one (db, raw);
+   }
+
+   if (!ok) {
+      pipeline_item_fail (db, item, db->lasterr);
+      return true;
+   }
+
+   db->pipe_items[item].ok = true;
+   db->pipe_items[item].nchanges = sqldb_count_changes (db);
+   return true;
+}
+
+static bool immediate_end (sqldb_t *db)
+{
+   if (!db->pipe_own_tx)
+      return !db->pipe_failed;
+
+   // Keep the first error rather than that of the rollback.
+   char *errmsg = db->lasterr;
+   db->lasterr = NULL;
+
+   // The pipeline is still active, so sqldb_batch() cannot be used here.
+   if (db->pipe_failed) {
+      immediate_batch_one (db, "ROLLBACK;");
+   } else if (!(immediate_batch_one (db, "COMMIT;"))) {
+      for (size_t i=0; i<db->pipe_nitems; i++) {
+         pipeline_item_fail (db, i, db->lasterr);
+      }
+   }
+
+   if (errmsg) {
+      sqldb_free (db->lasterr);
+      db->lasterr = errmsg;
+   }
+
+   return !db->pipe_failed;
+}
+
+#ifdef LIBPQ_HAS_PIPELINING
+
+// Reserves space for the ops that a single queued statement may need,
+// so that nothing is sent to the server that cannot be recorded.
+static bool pgdb_pipeline_reserve (sqldb_t *db)
+{
+   if (db->pipe_nops + 2 <= db->pipe_ops_max)
+      return true;
+
+   size_t newmax = db->pipe_ops_max ? db->pipe_ops_max * 2 : 32;
+   struct pipeline_op_t *tmp = sqldb_realloc (db->pipe_ops,
+                                              newmax * sizeof *tmp);
+   if (!tmp) {
+      SQLDB_OOM ("pipeline ops");
+      return false;
+   }
+
+   db->pipe_ops = tmp;
+   db->pipe_ops_max = newmax;
+   return true;
+}
+
+static void pgdb_pipeline_op (sqldb_t *db, struct stmt_cache_t *prepare,
+                                           size_t item)
+{
+   db->pipe_ops[db->pipe_nops].prepare = prepare;
+   db->pipe_ops[db->pipe_nops].item = item;
+   db->pipe_nops++;
+}
+
+static bool pgdb_pipeline_queue (sqldb_t *db, const struct query_t *query,
+                                 const sqldb_param_t *args, size_t nargs,
+                                 const char *raw)
+{
+   bool error = true;
+   struct pg_params_t params = { 0 };
+   char *tofree = NULL;
+   const char *qstring = raw;
+   struct stmt_cache_t *entry = NULL;
+   size_t item = (size_t)-1;
+
+   if (!(pgdb_pipeline_reserve (db)))
+      goto errorexit;
+
+   if ((item = pipeline_item_new (db))==(size_t)-1)
+      goto errorexit;
+
+   if (query) {
+      if (!(pgdb_params (db, args, nargs, &params)))
+         goto errorexit;
+
+      if ((entry = stmt_cache_find (db, query, params.sig))) {
+         db->cache_hits++;
+      } else {
+         db->cache_misses++;
+         if (!(qstring = query_native (db->type, query, &tofree)))
+            goto errorexit;
+
+         if ((entry = stmt_cache_new (db, query, params.sig))) {
+            snprintf (entry->pg_name, sizeof entry->pg_name,
+                      "sqldb_s%" PRIu32, ++db->pg_stmt_counter);
+            if (!(PQsendPrepare (db->pg_db, entry->pg_name, qstring,
+                                 params.n, params.types))) {
+               entry->pg_name[0] = 0;
+               stmt_cache_evict (db, entry);
+               entry = NULL;
+            } else {
+               pgdb_pipeline_op (db, entry, (size_t)-1);
+            }
+         }
+      }
+   }
+
+   int rc = entry
+      ? PQsendQueryPrepared (db->pg_db, entry->pg_name, params.n,
+                             params.values, params.lengths, params.formats, 0)
+      : PQsendQueryParams (db->pg_db, qstring, params.n, params.types,
+                           params.values, params.lengths, params.formats, 0);
+   if (!rc) {
+      db_err_printf (db, "Failed to queue statement [%s]\n[%s]\n",
+                         query ? query->key : raw,
+                         PQerrorMessage (db->pg_db));
+      goto errorexit;
+   }
+
+   pgdb_pipeline_op (db, NULL, item);
+
+   error = false;
+
+errorexit:
+   if (error && item!=(size_t)-1)
+      pipeline_item_fail (db, item, db->lasterr);
+
+   pg_params_free (&params);
+   sqldb_free (tofree);
+
+   return !error;
+}
+
+static bool pgdb_pipeline_end (sqldb_t *db)
+{
+   PGconn *pg = db->pg_db;
+   size_t op = 0;
+   bool have_result = false;
+   bool synced = false;
+
+   // Switching back to blocking mode flushes everything that is still
+   // buffered; libpq reads incoming results while it waits to write.
+   if (!(PQpipelineSync (pg)) || (PQsetnonblocking (pg, 0))!=0) {
+      db_err_printf (db, "Failed to send pipeline [%s]\n",
+                         PQerrorMessage (pg));
+   } else {
+      while (!synced) {
+         PGresult *r = PQgetResult (pg);
+
+         // Each op produces one or more results followed by a NULL; the
+         // sync produces a single result.
+         if (!r) {
+            if (!have_result)
+               break;
+            have_result = false;
+            op++;
+            continue;
+         }
+
+         ExecStatusType rs = PQresultStatus (r);
+         if (rs==PGRES_PIPELINE_SYNC) {
+            synced = true;
+         } else if (!have_result && op < db->pipe_nops) {
+            struct pipeline_op_t *o = &db->pipe_ops[op];
+            bool ok = rs==PGRES_COMMAND_OK || rs==PGRES_TUPLES_OK;
+            const char *msg = rs==PGRES_PIPELINE_ABORTED
+               ? "Not executed: an earlier statement in the pipeline failed"
+               : PQresultErrorMessage (r);
+
+            if (o->prepare) {
+               // The statements using this prepared statement will fail
+               // on their own; only the cache entry must be dropped.
+               if (!ok)
+                  o->prepare->pg_name[0] = 0;
+            } else if (ok) {
+               const char *tmp = PQcmdTuples (r);
+               db->pipe_items[o->item].ok = true;
+               if (tmp)
+                  sscanf (tmp, "%" PRIu64, &db->pipe_items[o->item].nchanges);
+            } else {
+               if (!db->pipe_failed)
+                  db_err_printf (db, "Pipeline statement %zu failed [%s]\n",
+                                     o->item, msg);
+               pipeline_item_fail (db, o->item, msg);
+            }
+         }
+         have_result = !synced;
+         PQclear (r);
+      }
+   }
+
+   if (!synced) {
+      for (; op < db->pipe_nops; op++) {
+         if (!db->pipe_ops[op].prepare)
+            pipeline_item_fail (db, db->pipe_ops[op].item, db->lasterr);
+      }
+      db->pipe_failed = true;
+   }
+
+   if (!(PQexitPipelineMode (pg))) {
+      db_err_printf (db, "Failed to exit pipeline mode [%s]\n",
+                         PQerrorMessage (pg));
+      db->pipe_failed = true;
+   }
+   PQsetnonblocking (pg, 0);
+
+   for (size_t i=0; i<db->pipe_nops; i++) {
+      struct stmt_cache_t *entry = db->pipe_ops[i].prepare;
+      if (entry && !entry->pg_name[0])
+         stmt_cache_evict (db, entry);
+   }
+
+   return !db->pipe_failed;
+}
+
+#endif
+
+bool sqldb_pipeline_begin (sqldb_t *db)
+{
+   if (!db)
+      return false;
+
+   if (db->pipeline) {
+      db_err_printf (db, "A pipeline is already active\n");
+      return false;
+   }
+
+   if (db->stream_res) {
+      db_err_printf (db, "A streaming result is still being read\n");
+      return false;
+   }
+
+   sqldb_clearerr (db);
+   pipeline_clear (db);
+   db->pipe_failed = false;
+   db->pipe_own_tx = false;
+
+#ifdef LIBPQ_HAS_PIPELINING
+   if (db->type==sqldb_POSTGRES) {
+      if (!(PQenterPipelineMode (db->pg_db))) {
+         db_err_printf (db, "Failed to enter pipeline mode [%s]\n",
+                            PQerrorMessage (db->pg_db));
+         return false;
+      }
+      // Queued statements are buffered until the pipeline ends.
+      PQsetnonblocking (db->pg_db, 1);
+      db->pipeline = PIPELINE_PG;
+      return true;
+   }
+#endif
+
+   if (!(pipeline_in_transaction (db))) {
+      if (!(sqldb_batch (db, "BEGIN;", NULL)))
+         return false;
+      db->pipe_own_tx = true;
+   }
+
+   db->pipeline = PIPELINE_IMMEDIATE;
+   return true;
+}
+
+bool sqldb_pipeline_queue (sqldb_t *db, const char *query, ...)
+{
+   va_list ap;
+
+   va_start (ap, query);
+   bool ret = sqldb_pipeline_queuev (db, query, &ap);
+   va_end (ap);
+
+   return ret;
+}
+
+static bool pipeline_queue (sqldb_t *db, const struct query_t *query,
+                            const sqldb_param_t *args, size_t nargs)
+{
+   switch (db->pipeline) {
+#ifdef LIBPQ_HAS_PIPELINING
+      case PIPELINE_PG:
+         return pgdb_pipeline_queue (db, query, args, nargs, NULL);
+#endif
+      case PIPELINE_IMMEDIATE:
+         return immediate_queue (db, query, args, nargs, NULL);
+      default:
+         break;
+   }
+
+   db_err_printf (db, "No pipeline is active\n");
+   return false;
+}
+
+bool sqldb_pipeline_queuev (sqldb_t *db, const char *query, va_list *ap)
+{
+   struct query_t q;
+   struct params_t params;
+
+   if (!db || !query)
+      return false;
+
+   query_init (&q, query);
+
+   if (!(params_collect (db, ap, &params)))
+      return false;
+
+   bool ret = pipeline_queue (db, &q, params.p, params.n);
+
+   params_free (&params);
+   return ret;
+}
+
+bool sqldb_pipeline_queue_params (sqldb_t *db, const char *query,
+                                  const sqldb_param_t *params,
+                                  size_t nparams)
+{
+   struct query_t q;
+
+   if (!db || !query || (nparams && !params))
+      return false;
+
+   query_init (&q, query);
+   return pipeline_queue (db, &q, params, nparams);
+}
+
+// Queues a single statement from sqldb_batch() while a pipeline is
+// active.
+static bool pipeline_batch_one (sqldb_t *db, const char *qstring)
+{
+   switch (db->pipeline) {
+#ifdef LIBPQ_HAS_PIPELINING
+      case PIPELINE_PG:    return pgdb_pipeline_queue (db, NULL, NULL, 0,
+                                                        qstring);
+#endif
+      default:             return immediate_queue (db, NULL, NULL, 0, qstring);
+   }
+}
+
+bool sqldb_pipeline_end (sqldb_t *db)
+{
+   bool ret = false;
+
+   if (!db)
+      return false;
+
+   switch (db->pipeline) {
+#ifdef LIBPQ_HAS_PIPELINING
+      case PIPELINE_PG:          ret = pgdb_pipeline_end (db);    break;
+#endif
+      case PIPELINE_IMMEDIATE:   ret = immediate_end (db);        break;
+      default:                   db_err_printf (db, "No pipeline is active\n");
+                                 return false;
+   }
+
+   db->pipeline = PIPELINE_NONE;
+   return ret;
+}
+
+size_t sqldb_pipeline_count (sqldb_t *db)
+{
+   return db ? db->pipe_nitems : 0;
+}
+
+bool sqldb_pipeline_result (sqldb_t *db, size_t index,
+                            uint64_t *nchanges, const char **errmsg)
+{
+   if (nchanges)
+      *nchanges = 0;
+
+   if (errmsg)
+      *errmsg = NULL;
+
+   if (!db || index >= db->pipe_nitems)
+      return false;
+
+   if (nchanges)
+      *nchanges = db->pipe_items[index].nchanges;
+
+   if (errmsg)
+      *errmsg = db->pipe_items[index].errmsg;
+
+   return db->pipe_items[index].ok;
+}
+
+/* *****************************************************************
+ * Asynchronous execution. On postgres the query is sent with the
+ * connection in nonblocking mode and the result is read as the socket
+ * becomes readable, so that a single thread can service many connections
+ * from an event loop. A sqlite query has no socket to wait on and is
+ * executed when it is sent.
+ */
+
+static bool pgdb_send (sqldb_t *db, const struct query_t *query,
+                                    const sqldb_param_t *args,
+                                    size_t nargs)
+{
+   bool error = true;
+   struct pg_params_t params = { 0 };
+   char *tofree = NULL;
+   const char *qstring = NULL;
+   struct stmt_cache_t *entry = NULL;
+
+   int resultFormat = (db->flags & sqldb_FLAG_BINARY) ? 1 : 0;
+
+   if (!(pgdb_params (db, args, nargs, &params)))
+      goto errorexit;
+
+   // Preparing a statement costs a round trip of its own, so only those
+   // statements that are already prepared are executed as prepared.
+   if ((entry = stmt_cache_find (db, query, params.sig))) {
+      db->cache_hits++;
+   } else {
+      db->cache_misses++;
+      if (!(qstring = query_native (db->type, query, &tofree)))
+         goto errorexit;
+   }
+
+   if ((PQsetnonblocking (db->pg_db, 1))!=0) {
+      db_err_printf (db, "Failed to set nonblocking mode: %s\n",
+                         PQerrorMessage (db->pg_db));
+      goto errorexit;
+   }
+
+   int sent = entry
+      ? PQsendQueryPrepared (db->pg_db, entry->pg_name, params.n,
+                                             params.values,
+                                             params.lengths,
+                                             params.formats,
+                                             resultFormat)
+      : PQsendQueryParams (db->pg_db, qstring, params.n,
+                                             params.types,
+                                             params.values,
+                                             params.lengths,
+                                             params.formats,
+                                             resultFormat);
+   if (!sent) {
+      db_err_printf (db, "Failed to send [%s]: %s\n", query->key,
+                         PQerrorMessage (db->pg_db));
+      PQsetnonblocking (db->pg_db, 0);
+      goto errorexit;
+   }
+
+   db->async = ASYNC_SENT;
+   error = false;
+
+errorexit:
+   pg_params_free (&params);
+   sqldb_free (tofree);
+   return !error;
+}
+
+static bool send_query (sqldb_t *db, const struct query_t *query,
+                                     const sqldb_param_t *args,
+                                     size_t nargs)
+{
+   sqldb_clearerr (db);
+
+   if (db->async!=ASYNC_NONE) {
+      db_err_printf (db, "Cannot send [%s]: the result of the previous "
+                         "query has not been retrieved\n", query->key);
+      return false;
+   }
+
+   if (db->type==sqldb_SQLITE) {
+      if (!(db->async_res = exec_query (db, query, args, nargs)))
+         return false;
+      db->async = ASYNC_READY;
+      return true;
+   }
+
+   if (db->pipeline || db->stream_res) {
+      db_err_printf (db, "Cannot send [%s] while a pipeline or a streaming "
+                         "result is active\n", query->key);
+      return false;
+   }
+
+   return pgdb_send (db, query, args, nargs);
+}
+
+bool sqldb_send (sqldb_t *db, const char *query, ...)
+{
+   va_list ap;
+
+   va_start (ap, query);
+   bool ret = sqldb_sendv (db, query, &ap);
+   va_end (ap);
+
+   return ret;
+}
+
+bool sqldb_sendv (sqldb_t *db, const char *query, va_list *ap)
+{
+   struct query_t q;
+   struct params_t params;
+
+   if (!db || !query)
+      return false;
+
+   query_init (&q, query);
+
+   if (!(params_collect (db, ap, &params)))
+      return false;
+
+   bool ret = send_query (db, &q, params.p, params.n);
+
+   params_free (&params);
+   return ret;
+}
+
+bool sqldb_send_params (sqldb_t *db, const char *query,
+                        const sqldb_param_t *params, size_t nparams)
+{
+   struct query_t q;
+
+   if (!db || !query || (nparams && !params))
+      return false;
+
+   query_init (&q, query);
+   return send_query (db, &q, params, nparams);
+}
+
+static sqldb_poll_t pgdb_consume (sqldb_t *db)
+{
+   PGconn *pg = db->pg_db;
+
+   // The input is read even while the query is still being written, as
+   // the server may be waiting for its output to be read.
+   int rc = PQflush (pg);
+   if (rc < 0 || !(PQconsumeInput (pg)))
+      goto failed;
+
+   if (rc > 0)
+      return sqldb_poll_WRITE;
+
+   while (!(PQisBusy (pg))) {
+      PGresult *r = PQgetResult (pg);
+      if (!r) {
+         PQsetnonblocking (pg, 0);
+         db->async = ASYNC_READY;
+         return sqldb_poll_OK;
+      }
+      // A single statement produces a single result.
+      if (db->async_pgr) {
+         PQclear (r);
+      } else {
+         db->async_pgr = r;
+      }
+   }
+
+   return sqldb_poll_READ;
+
+failed:
+   db_err_printf (db, "Failed to receive the result: [%s]\n",
+                      PQerrorMessage (pg));
+   PQsetnonblocking (pg, 0);
+   async_clear (db);
+   return sqldb_poll_FAILED;
+}
+
+sqldb_poll_t sqldb_consume (sqldb_t *db)
+{
+   if (!db)
+      return sqldb_poll_FAILED;
+
+   switch (db->async) {
+      case ASYNC_READY: return sqldb_poll_OK;
+      case ASYNC_SENT:  return pgdb_consume (db);
+      default:          break;
+   }
+
+   db_err_printf (db, "No query has been sent\n");
+   return sqldb_poll_FAILED;
+}
+
+static sqldb_res_t *pgdb_result (sqldb_t *db)
+{
+   sqldb_res_t *ret = NULL;
+   PGresult *r = db->async_pgr;
+
+   db->async_pgr = NULL;
+
+   if (!r) {
+      db_err_printf (db, "No result was received\n");
+      return NULL;
+   }
+
+   if (!(pgdb_status_ok (PQresultStatus (r)))) {
+      pgdb_sqlstate (db, r);
+      db_err_printf (db, "Bad postgres return status [%s]\n",
+                         PQresultErrorMessage (r));
+      PQclear (r);
+      return NULL;
+   }
+
+   if (!(ret = res_new (db))) {
+      PQclear (r);
+      return NULL;
+   }
+
+   ret->pgr = r;
+   pgdb_res_counts (db, ret);
+
+   return ret;
+}
+
+sqldb_res_t *sqldb_result (sqldb_t *db)
+{
+   sqldb_res_t *ret = NULL;
+
+   if (!db)
+      return NULL;
+
+   if (db->async!=ASYNC_READY) {
+      db_err_printf (db, "No result is ready; sqldb_consume() must first "
+                         "return sqldb_poll_OK\n");
+      return NULL;
+   }
+
+   sqldb_clearerr (db);
+
+   if (db->type==sqldb_SQLITE) {
+      ret = db->async_res;
+      db->async_res = NULL;
+   } else {
+      ret = pgdb_result (db);
+   }
+
+   db->async = ASYNC_NONE;
+   return ret;
+}
+
+/* *****************************************************************
+ * Transactions. A sqldb_tx_begin() within a transaction creates a
+ * savepoint, so that a callee can roll back its own work without ending
+ * the caller's transaction.
+ */
+
+// The delay before the first retry in sqldb_tx_retry(), doubled for each
+// further attempt up to the maximum.
+#define TX_RETRY_MIN_MS       (2)
+#define TX_RETRY_MAX_MS       (250)
+
+static const char *tx_begin_stmt (sqldb_dbtype_t type, sqldb_txmode_t mode)
+{
+   if (type==sqldb_SQLITE) {
+      switch (mode) {
+         case sqldb_tx_IMMEDIATE:   return "BEGIN IMMEDIATE;";
+         case sqldb_tx_EXCLUSIVE:   return "BEGIN EXCLUSIVE;";
+         default:                   return "BEGIN DEFERRED;";
+      }
+   }
+
+   switch (mode) {
+      case sqldb_tx_READ_COMMITTED:
+         return "BEGIN ISOLATION LEVEL READ COMMITTED;";
+      case sqldb_tx_REPEATABLE_READ:
+         return "BEGIN ISOLATION LEVEL REPEATABLE READ;";
+      case sqldb_tx_SERIALIZABLE:
+         return "BEGIN ISOLATION LEVEL SERIALIZABLE;";
+      default:
+         return "BEGIN;";
+   }
+}
+
+// The transaction may have been ended by a statement that did not go
+// through this API, or by the server.
+static void tx_sync (sqldb_t *db)
+{
+   if (!(pipeline_in_transaction (db)))
+      db->tx_depth = 0;
+}
+
+// True if the last error was caused by contention, in which case the
+// transaction may succeed when run again.
+static bool tx_retryable (sqldb_t *db)
+{
+   switch (db->type) {
+      case sqldb_SQLITE: {
+         int rc = sqlite3_errcode (db->sqlite_db) & 0xff;
+         return rc==SQLITE_BUSY || rc==SQLITE_LOCKED;
+      }
+
+      case sqldb_POSTGRES:
+         // serialization_failure and deadlock_detected
+         return (strcmp (db->pg_sqlstate, "40001"))==0
+             || (strcmp (db->pg_sqlstate, "40P01"))==0;
+
+      default:
+         return false;
+   }
+}
+
+bool sqldb_tx_begin (sqldb_t *db, sqldb_txmode_t mode)
+{
+   char savepoint[48];
+
+   if (!db)
+      return false;
+
+   sqldb_clearerr (db);
+
+   if (db->pipeline || db->stream_res) {
+      db_err_printf (db, "Cannot begin a transaction while a pipeline or a "
+                         "streaming result is active\n");
+      return false;
+   }
+
+   tx_sync (db);
+
+   if (!db->tx_depth && pipeline_in_transaction (db)) {
+      db_err_printf (db, "A transaction not started by sqldb_tx_begin() "
+                         "is already open\n");
+      return false;
+   }
+
+   if (!db->tx_depth) {
+      if (!(immediate_batch_one (db, tx_begin_stmt (db->type, mode))))
+         return false;
+   } else {
+      snprintf (savepoint, sizeof savepoint, "SAVEPOINT sqldb_tx_%u;",
+                                             db->tx_depth);
+      if (!(immediate_batch_one (db, savepoint)))
+         return false;
+   }
+
+   db->tx_depth++;
+   return true;
+}
+
+bool sqldb_tx_commit (sqldb_t *db)
+{
+   char savepoint[48];
+   bool ret = false;
+
+   if (!db)
+      return false;
+
+   sqldb_clearerr (db);
+   tx_sync (db);
+
+   if (!db->tx_depth) {
+      db_err_printf (db, "No transaction to commit\n");
+      return false;
+   }
+
+   uint64_t span = sqldb_span_begin ();
+
+   if (db->tx_depth > 1) {
+      snprintf (savepoint, sizeof savepoint, "RELEASE SAVEPOINT sqldb_tx_%u;",
+                                             db->tx_depth - 1);
+      if ((ret = immediate_batch_one (db, savepoint)))
+         db->tx_depth--;
+      span_record ("sqldb", "commit", NULL, span);
+      return ret;
+   }
+
+   // Postgres silently rolls back a COMMIT of a failed transaction.
+   if (db->type==sqldb_POSTGRES
+         && PQtransactionStatus (db->pg_db)==PQTRANS_INERROR) {
+      db_err_printf (db, "Transaction was rolled back after an earlier "
+                         "error\n");
+      immediate_batch_one (db, "ROLLBACK;");
+   } else {
+      ret = immediate_batch_one (db, "COMMIT;");
+   }
+
+   span_record ("sqldb", "commit", NULL, span);
+
+   // A failed sqlite commit (SQLITE_BUSY) leaves the transaction open so
+   // that the caller can retry the commit or roll it back.
+   tx_sync (db);
+   return ret;
+}
+
+bool sqldb_tx_rollback (sqldb_t *db)
+{
+   char savepoint[48];
+   bool ret = false;
+
+   if (!db)
+      return false;
+
+   sqldb_clearerr (db);
+   tx_sync (db);
+
+   if (!db->tx_depth) {
+      db_err_printf (db, "No transaction to roll back\n");
+      return false;
+   }
+
+   if (db->tx_depth > 1) {
+      snprintf (savepoint, sizeof savepoint,
+                "ROLLBACK TO SAVEPOINT sqldb_tx_%u;", db->tx_depth - 1);
+      ret = immediate_batch_one (db, savepoint);
+      snprintf (savepoint, sizeof savepoint,
+                "RELEASE SAVEPOINT sqldb_tx_%u;", db->tx_depth - 1);
+      ret = immediate_batch_one (db, savepoint) && ret;
+      db->tx_depth--;
+   } else {
+      ret = immediate_batch_one (db, "ROLLBACK;");
+   }
+
+   tx_sync (db);
+   return ret;
+}
+
+uint32_t sqldb_tx_depth (sqldb_t *db)
+{
+   if (!db)
+      return 0;
+
+   tx_sync (db);
+   return db->tx_depth;
+}
+
+bool sqldb_tx_retry (sqldb_t *db, sqldb_txmode_t mode, uint32_t max_attempts,
+                     sqldb_tx_fn_t *fn, void *ctx)
+{
+   if (!db || !fn)
+      return false;
+
+   // Only the outermost transaction can be retried: on postgres an error
+   // aborts the whole transaction, not only the savepoint.
+   bool nested = sqldb_tx_depth (db) > 0;
+   uint32_t delay_ms = TX_RETRY_MIN_MS;
+
+   for (uint32_t attempt=1; ; attempt++) {
+      // On sqlite an immediate or exclusive begin is itself contended.
+      bool begun = sqldb_tx_begin (db, mode);
+      uint32_t depth = db->tx_depth;
+
+      if (begun && (fn (db, ctx)) && (sqldb_tx_commit (db)))
+         return true;
+
+      bool retry = !nested && attempt < max_attempts && tx_retryable (db);
+
+      // Keep the error that caused the rollback.
+      char *lasterr = db->lasterr;
+      db->lasterr = NULL;
+      tx_sync (db);
+      if (begun && db->tx_depth >= depth)
+         sqldb_tx_rollback (db);
+      sqldb_free (db->lasterr);
+      db->lasterr = lasterr;
+
+      if (!retry)
+         return false;
+
+      // Jitter the delay so that competing writers do not retry in step.
+      uint32_t jitter = hash_buffer (attempt, &db, sizeof db) % (delay_ms + 1);
+      sqlite3_sleep (delay_ms / 2 + jitter / 2);
+      delay_ms = delay_ms * 2 > TX_RETRY_MAX_MS ? TX_RETRY_MAX_MS
+                                                : delay_ms * 2;
+   }
+}
+
+/* *****************************************************************
+ * Bulk execution. A single statement is executed once for each row of
+ * the caller's column arrays, inside a single transaction (or savepoint
+ * when the caller already has a transaction open).
+ */
+
+// The number of postgres statements sent before their results are read;
+// this bounds the memory used for buffered statements and results.
+#define EXEC_MANY_CHUNK       (1024)
+
+struct many_col_t {
+   sqldb_coltype_t   type;
+   const char       *array;
+   const uint32_t   *lens;
+   size_t            size;
+};
+
+static size_t many_col_size (sqldb_coltype_t type)
+{
+   switch (type) {
+      case sqldb_col_UINT32:
+      case sqldb_col_INT32:      return sizeof (int32_t);
+      case sqldb_col_UINT64:
+      case sqldb_col_INT64:
+      case sqldb_col_DATETIME:   return sizeof (int64_t);
+      case sqldb_col_TEXT:
+      case sqldb_col_BLOB:       return sizeof (const void *);
+      case sqldb_col_NULL:       return 0;
+      default:                   return (size_t)-1;
+   }
+}
+
+// Reads the column tuples up to sqldb_col_UNKNOWN. A statement without
+// parameters has no columns, in which case *cols is left NULL.
+static bool many_cols (sqldb_t *db, va_list *ap, struct many_col_t **cols,
+                                                 size_t *ncols)
+{
+   struct many_col_t *ret = NULL;
+   size_t n = 0;
+
+   sqldb_coltype_t coltype = va_arg (*ap, sqldb_coltype_t);
+   while (coltype!=sqldb_col_UNKNOWN) {
+      struct many_col_t *tmp = sqldb_realloc (ret, (n + 1) * sizeof *ret);
+      if (!tmp) {
+         SQLDB_OOM ("exec_many columns");
+         goto errorexit;
+      }
+      ret = tmp;
+
+      ret[n].type = coltype;
+      ret[n].array = va_arg (*ap, const char *);
+      ret[n].lens = coltype==sqldb_col_BLOB
+                  ? va_arg (*ap, const uint32_t *)
+                  : NULL;
+      ret[n].size = many_col_size (coltype);
+
+      if (ret[n].size==(size_t)-1
+            || (ret[n].size && !ret[n].array)
+            || (coltype==sqldb_col_BLOB && !ret[n].lens)) {
+         db_err_printf (db, "Column %zu: unknown type %u or no array\n",
+                            n, coltype);
+         goto errorexit;
+      }
+
+      n++;
+      coltype = va_arg (*ap, sqldb_coltype_t);
+   }
+
+   *cols = ret;
+   *ncols = n;
+   return true;
+
+errorexit:
+   sqldb_free (ret);
+   return false;
+}
+
+static const void *many_value (const struct many_col_t *col, size_t row)
+{
+   return col->array ? col->array + row * col->size : NULL;
+}
+
+static const uint32_t *many_bloblen (const struct many_col_t *col,
+                                     size_t row)
+{
+   return col->lens ? &col->lens[row] : NULL;
+}
+
+static bool sqlitedb_exec_many (sqldb_t *db, const struct query_t *query,
+                                size_t nrows,
+                                const struct many_col_t *cols,
+                                size_t ncols,
+                                size_t *failed_row)
+{
+   bool error = true;
+   size_t row = 0;
+   sqldb_res_t *res = sqldb_calloc (1, sizeof *res);
+
+   if (!res) {
+      SQLDB_OOM (query->key);
+      return false;
+   }
+
+   res->type = sqldb_SQLITE;
+   res->dbcon = db;
+
+   if (!(sqlitedb_prepare (db, res, query)))
+      goto errorexit;
+
+   sqlite3_stmt *stmt = res->sqlite_stmt;
+
+   for (row=0; row<nrows; row++) {
+      sqlite3_reset (stmt);
+
+      // The caller's arrays outlive the step, so nothing is copied.
+      for (size_t i=0; i<ncols; i++) {
+         if ((sqlitedb_bind (stmt, i + 1, cols[i].type,
+                                          many_value (&cols[i], row),
+                                          many_bloblen (&cols[i], row),
+                                          SQLITE_STATIC))!=SQLITE_OK) {
+            db_err_printf (db, "Row %zu: unable to bind %zu [%s]\n",
+                               row, i + 1, sqlite3_errmsg (db->sqlite_db));
+            goto errorexit;
+         }
+      }
+
+      int rc = sqlite3_step (stmt);
+      if (rc!=SQLITE_DONE && rc!=SQLITE_ROW) {
+         db_err_printf (db, "Row %zu failed [%s]\n[%s]\n",
+                            row, sqlite3_errmsg (db->sqlite_db), query->key);
+         goto errorexit;
+      }
+   }
+
+   error = false;
+
+errorexit:
+   if (error)
+      *failed_row = row;
+
+   if (res->sqlite_stmt) {
+      sqlite3_reset (res->sqlite_stmt);
+      sqlite3_clear_bindings (res->sqlite_stmt);
+   }
+   sqldb_res_del (res);
+
+   return !error;
+}
+
+static bool pgdb_exec_many (sqldb_t *db, const struct query_t *query,
+                            size_t nrows,
+                            const struct many_col_t *cols,
+                            size_t ncols,
+                            size_t *failed_row)
+{
+   bool error = true;
+   PGconn *pg = db->pg_db;
+   struct pg_params_t params = { 0 };
+   struct stmt_cache_t *entry = NULL;
+   char *tofree = NULL;
+   const char *qstring = NULL;
+   size_t row = 0;
+   size_t failed = (size_t)-1;
+
+   if (!(pg_params_alloc (&params, ncols)))
+      goto errorexit;
+
+   // The types are the same in every row.
+   for (size_t i=0; i<ncols; i++) {
+      pg_param (&params, i, cols[i].type, many_value (&cols[i], 0),
+                                          many_bloblen (&cols[i], 0));
+   }
+   pg_params_sign (&params);
+
+   pgdb_dealloc_flush (db);
+
+   if ((entry = stmt_cache_find (db, query, params.sig))) {
+      db->cache_hits++;
+   } else {
+      db->cache_misses++;
+      if (!(qstring = query_native (db->type, query, &tofree)))
+         goto errorexit;
+      entry = pgdb_prepare (db, query, qstring, &params);
+   }
+
+#ifdef LIBPQ_HAS_PIPELINING
+   if (!(PQenterPipelineMode (pg))) {
+      db_err_printf (db, "Failed to enter pipeline mode [%s]\n",
+                         PQerrorMessage (pg));
+      goto errorexit;
+   }
+
+   size_t start = 0;
+   while (start < nrows && failed==(size_t)-1) {
+      size_t end = start + EXEC_MANY_CHUNK;
+      if (end > nrows)
+         end = nrows;
+
+      for (row=start; row<end; row++) {
+         for (size_t i=0; i<ncols; i++) {
+            pg_param (&params, i, cols[i].type, many_value (&cols[i], row),
+                                                many_bloblen (&cols[i], row));
+         }
+         int sent = entry
+            ? PQsendQueryPrepared (pg, entry->pg_name, params.n,
+                                   params.values, params.lengths,
+                                   params.formats, 0)
+            : PQsendQueryParams (pg, qstring, params.n, params.types,
+                                 params.values, params.lengths,
+                                 params.formats, 0);
+         if (!sent)
+            break;
+      }
+
+      // While it waits to write, libpq reads incoming results so that a
+      // large chunk cannot deadlock against the server.
+      if (row < end || !(PQpipelineSync (pg)) || (PQflush (pg))!=0) {
+         db_err_printf (db, "Failed to send row %zu [%s]\n",
+                            row, PQerrorMessage (pg));
+         failed = row;
+         break;
+      }
+
+      // Each row produces a result followed by a NULL, then the sync
+      // produces its own result.
+      for (row=start; row<=end; row++) {
+         PGresult *r = PQgetResult (pg);
+         ExecStatusType rs = r ? PQresultStatus (r) : PGRES_FATAL_ERROR;
+         if (row==end) {
+            if (rs!=PGRES_PIPELINE_SYNC && failed==(size_t)-1) {
+               db_err_printf (db, "Pipeline did not sync [%s]\n",
+                                  PQerrorMessage (pg));
+               failed = end;
+            }
+            PQclear (r);
+            break;
+         }
+         if (rs!=PGRES_COMMAND_OK && rs!=PGRES_TUPLES_OK
+                                  && failed==(size_t)-1) {
+            db_err_printf (db, "Row %zu failed [%s]\n[%s]\n", row,
+                               r ? PQresultErrorMessage (r)
+                                 : PQerrorMessage (pg),
+                               query->key);
+            failed = row;
+         }
+         PQclear (r);
+         if (r)
+            PQclear (PQgetResult (pg));
+      }
+
+      start = end;
+   }
+
+   if (!(PQexitPipelineMode (pg)) && failed==(size_t)-1) {
+      db_err_printf (db, "Failed to exit pipeline mode [%s]\n",
+                         PQerrorMessage (pg));
+      failed = nrows;
+   }
+#else
+   for (row=0; row<nrows && failed==(size_t)-1; row++) {
+      for (size_t i=0; i<ncols; i++) {
+         pg_param (&params, i, cols[i].type, many_value (&cols[i], row),
+                                             many_bloblen (&cols[i], row));
+      }
+      PGresult *r = entry
+         ? PQexecPrepared (pg, entry->pg_name, params.n, params.values,
+                           params.lengths, params.formats, 0)
+         : PQexecParams (pg, qstring, params.n, params.types, params.values,
+                         params.lengths, params.formats, 0);
+      ExecStatusType rs = r ? PQresultStatus (r) : PGRES_FATAL_ERROR;
+      if (rs!=PGRES_COMMAND_OK && rs!=PGRES_TUPLES_OK) {
+         db_err_printf (db, "Row %zu failed [%s]\n[%s]\n", row,
+                            r ? PQresultErrorMessage (r)
+                              : PQerrorMessage (pg),
+                            query->key);
+         failed = row;
+      }
+      PQclear (r);
+   }
+#endif
+
+   if (failed!=(size_t)-1) {
+      *failed_row = failed;
+      goto errorexit;
+   }
+
+   error = false;
+
+errorexit:
+   pg_params_free (&params);
+   sqldb_free (tofree);
+
+   return !error;
+}
+
+// Start a unit of work that is applied atomically: a transaction, or a
+// savepoint when the caller already has a transaction open.
+static bool atomic_begin (sqldb_t *db, const char *what, bool *own_tx)
+{
+   if (db->pipeline || db->stream_res) {
+      db_err_printf (db, "Cannot execute [%s] while a pipeline or a "
+                         "streaming result is active\n", what);
+      return false;
+   }
+
+   *own_tx = !(pipeline_in_transaction (db));
+   return immediate_batch_one (db, *own_tx ? "BEGIN;"
+                                           : "SAVEPOINT sqldb_atomic;");
+}
+
+static bool atomic_commit (sqldb_t *db, bool own_tx)
+{
+   return immediate_batch_one (db, own_tx ? "COMMIT;"
+                                          : "RELEASE SAVEPOINT sqldb_atomic;");
+}
+
+static void atomic_rollback (sqldb_t *db, bool own_tx)
+{
+   // Keep the error that caused the rollback.
+   char *lasterr = db->lasterr;
+   db->lasterr = NULL;
+   if (own_tx) {
+      immediate_batch_one (db, "ROLLBACK;");
+   } else {
+      immediate_batch_one (db, "ROLLBACK TO SAVEPOINT sqldb_atomic;");
+      immediate_batch_one (db, "RELEASE SAVEPOINT sqldb_atomic;");
+   }
+   sqldb_free (db->lasterr);
+   db->lasterr = lasterr;
+}
+
+bool sqldb_exec_manyv (sqldb_t *db, const char *query, size_t nrows,
+                                    size_t *failed_row,
+                                    va_list *ap)
+{
+   bool error = true;
+   struct many_col_t *cols = NULL;
+   size_t ncols = 0;
+   size_t failed = (size_t)-1;
+   bool started = false;
+   bool own_tx = false;
+   struct query_t q;
+
+   if (!db || !query)
+      return false;
+
+   sqldb_clearerr (db);
+
+   if (!(many_cols (db, ap, &cols, &ncols)))
+      goto errorexit;
+
+   if (!nrows) {
+      error = false;
+      goto errorexit;
+   }
+
+   query_init (&q, query);
+
+   // The rows are all applied or none are.
+   if (!(atomic_begin (db, query, &own_tx)))
+      goto errorexit;
+   started = true;
+
+   bool ok = false;
+   switch (db->type) {
+      case sqldb_SQLITE:   ok = sqlitedb_exec_many (db, &q, nrows, cols, ncols,
+                                                    &failed);
+                           break;
+
+      case sqldb_POSTGRES: ok = pgdb_exec_many (db, &q, nrows, cols, ncols,
+                                                &failed);
+                           break;
+
+      default:             db_err_printf (db, "(%i) Unknown type\n", db->type);
+                           break;
+   }
+
+   if (!ok || !(atomic_commit (db, own_tx)))
+      goto errorexit;
+   started = false;
+
+   db->nchanges = nrows;
+   error = false;
+
+errorexit:
+   if (started)
+      atomic_rollback (db, own_tx);
+
+   if (failed_row)
+      *failed_row = error ? failed : (size_t)-1;
+
+   sqldb_free (cols);
+
+   return !error;
+}
+
+bool sqldb_exec_many (sqldb_t *db, const char *query, size_t nrows,
+                                   size_t *failed_row, ...)
+{
+   va_list ap;
+
+   va_start (ap, failed_row);
+   bool ret = sqldb_exec_manyv (db, query, nrows, failed_row, &ap);
+   va_end (ap);
+
+   return ret;
+}
+
+/* *****************************************************************
+ * Bulk loading. Rows are read from the caller's source and loaded
+ * with COPY on postgres and with a single prepared INSERT on sqlite, all
+ * within a single transaction (or savepoint).
+ */
+
+// The default number of rows between progress reports.
+#define BULK_PROGRESS_ROWS    (100000)
+
+// The number of bytes of COPY data buffered before it is sent.
+#define BULK_COPY_BUFSIZE     (64 * 1024)
+
+struct bulk_buf_t {
+   char    *data;
+   size_t   len;
+   size_t   size;
+};
+
+struct bulk_t {
+   sqldb_t                *db;
+   const sqldb_bulk_src_t *src;
+   size_t                  ncols;
+
+   // The current row.
+   const char            **fields;
+   size_t                 *lens;
+
+   // Used when reading delimited text; every field of the current row
+   // is nul-terminated in line.
+   struct bulk_buf_t       line;
+   size_t                 *offsets;
+   uint64_t                lineno;
+
+   uint64_t                nrows;
+   uint64_t                next_report;
+   struct timespec         start;
+};
+
+static bool bulk_buf_put (struct bulk_buf_t *buf, const void *src,
+                                                  size_t len)
+{
+   if (buf->len + len > buf->size) {
+      size_t newsize = buf->size ? buf->size * 2 : 1024;
+      while (newsize < buf->len + len)
+         newsize *= 2;
+
+      char *tmp = sqldb_realloc (buf->data, newsize);
+      if (!tmp) {
+         SQLDB_OOM ("Bulk buffer");
+         return false;
+      }
+      buf->data = tmp;
+      buf->size = newsize;
+   }
+   memcpy (&buf->data[buf->len], src, len);
+   buf->len += len;
+   return true;
+}
+
+static bool bulk_buf_putc (struct bulk_buf_t *buf, char c)
+{
+   return bulk_buf_put (buf, &c, 1);
+}
+
+static double bulk_elapsed (const struct bulk_t *bulk)
+{
+   struct timespec now;
+   clock_gettime (CLOCK_MONOTONIC, &now);
+   return (now.tv_sec - bulk->start.tv_sec)
+        + (now.tv_nsec - bulk->start.tv_nsec) / 1e9;
+}
+
+static void bulk_progress (struct bulk_t *bulk, bool final)
+{
+   const sqldb_bulk_src_t *src = bulk->src;
+
+   if (!src->progress || (!final && bulk->nrows < bulk->next_report))
+      return;
+
+   bulk->next_report = bulk->nrows + (src->progress_rows ? src->progress_rows
+                                                         : BULK_PROGRESS_ROWS);
+
+   double elapsed = bulk_elapsed (bulk);
+   src->progress (src->progress_ctx, bulk->nrows,
+                  elapsed > 0 ? bulk->nrows / elapsed : 0);
+}
+
+// Reads a single record of delimited text into bulk->line. A field may be
+// quoted with '"' in which case it may contain the delimiter, newlines and
+// doubled quotes. An unquoted empty field is NULL. Returns 1 when a record
+// was read, 0 at the end of the input and -1 on error.
+static int bulk_read_record (struct bulk_t *bulk)
+{
+   FILE *inf = bulk->src->inf;
+   char delim = bulk->src->delim ? bulk->src->delim : ',';
+   size_t nfields = 0;
+   bool quoted = false;
+   bool was_quoted = false;
+   int c;
+
+   bulk->line.len = 0;
+   bulk->lineno++;
+
+   if ((c = getc (inf))==EOF)
+      return 0;
+
+   for (;;) {
+      if (quoted) {
+         if (c==EOF) {
+            db_err_printf (bulk->db, "Line %" PRIu64 ": unterminated quote\n",
+                                     bulk->lineno);
+            return -1;
+         }
+         if (c=='"') {
+            if ((c = getc (inf))!='"') {
+               quoted = false;
+               continue;
+            }
+         }
+         if (c=='\n')
+            bulk->lineno++;
+         if (!(bulk_buf_putc (&bulk->line, c)))
+            return -1;
+         c = getc (inf);
+         continue;
+      }
+
+      if (c==delim || c=='\n' || c==EOF) {
+         // Remove the CR of a CRLF line ending.
+         if (c!=delim && !was_quoted
+               && bulk->line.len > bulk->offsets[nfields]
+               && bulk->line.data[bulk->line.len - 1]=='\r') {
+            bulk->line.len--;
+         }
+         bulk->lens[nfields] = bulk->line.len - bulk->offsets[nfields];
+         bulk->fields[nfields] = (bulk->lens[nfields] || was_quoted)
+                               ? "" : NULL;
+         if (!(bulk_buf_putc (&bulk->line, 0)))
+            return -1;
+         nfields++;
+
+         if (c!=delim)
+            break;
+
+         if (nfields==bulk->ncols) {
+            db_err_printf (bulk->db, "Line %" PRIu64 ": more than %zu "
+                                     "fields\n", bulk->lineno, bulk->ncols);
+            return -1;
+         }
+         bulk->offsets[nfields] = bulk->line.len;
+         was_quoted = false;
+         c = getc (inf);
+         continue;
+      }
+
+      if (c=='"' && bulk->line.len==bulk->offsets[nfields]) {
+         quoted = was_quoted = true;
+      } else if (!(bulk_buf_putc (&bulk->line, c))) {
+         return -1;
+      }
+      c = getc (inf);
+   }
+
+   if (nfields!=bulk->ncols) {
+      db_err_printf (bulk->db, "Line %" PRIu64 ": expected %zu fields, "
+                               "found %zu\n",
+                               bulk->lineno, bulk->ncols, nfields);
+      return -1;
+   }
+
+   // The line buffer may have moved while it was being filled.
+   for (size_t i=0; i<nfields; i++) {
+      if (bulk->fields[i])
+         bulk->fields[i] = &bulk->line.data[bulk->offsets[i]];
+   }
+
+   return 1;
+}
+
+// Reads the next row into bulk->fields and bulk->lens. Returns 1 when a
+// row was read, 0 at the end of the input and -1 on error.
+static int bulk_next (struct bulk_t *bulk)
+{
+   const sqldb_bulk_src_t *src = bulk->src;
+   int rc;
+
+   bulk_progress (bulk, false);
+
+   if (src->reader) {
+      rc = src->reader (src->reader_ctx, bulk->ncols, bulk->fields,
+                                                      bulk->lens);
+      if (rc < 0) {
+         db_err_printf (bulk->db, "Row %" PRIu64 ": rejected by reader\n",
+                                  bulk->nrows);
+      }
+   } else {
+      bulk->offsets[0] = 0;
+      rc = bulk_read_record (bulk);
+   }
+
+   return rc;
+}
+
+static bool sqlitedb_bulk_load (struct bulk_t *bulk, const char *table,
+                                                     const char **columns)
+{
+   bool error = true;
+   sqldb_t *db = bulk->db;
+   struct bulk_buf_t query = { 0 };
+   sqlite3_stmt *stmt = NULL;
+   char tmp[32];
+   int rc;
+
+   if (!(bulk_buf_put (&query, "insert into ", 12))
+         || !(bulk_buf_put (&query, table, strlen (table)))
+         || !(bulk_buf_put (&query, " (", 2)))
+      goto errorexit;
+
+   for (size_t i=0; i<bulk->ncols; i++) {
+      if ((i && !(bulk_buf_put (&query, ", ", 2)))
+            || !(bulk_buf_put (&query, columns[i], strlen (columns[i]))))
+         goto errorexit;
+   }
+
+   if (!(bulk_buf_put (&query, ") values (", 10)))
+      goto errorexit;
+
+   for (size_t i=0; i<bulk->ncols; i++) {
+      snprintf (tmp, sizeof tmp, "%s?%zu", i ? ", " : "", i + 1);
+      if (!(bulk_buf_put (&query, tmp, strlen (tmp))))
+         goto errorexit;
+   }
+
+   if (!(bulk_buf_put (&query, ");", 3)))
+      goto errorexit;
+
+   if ((sqlite3_prepare_v2 (db->sqlite_db, query.data, -1, &stmt,
+                                           NULL))!=SQLITE_OK) {
+      db_err_printf (db, "Failed to prepare [%s]: %s\n",
+                         query.data, sqlite3_errmsg (db->sqlite_db));
+      goto errorexit;
+   }
+
+   while ((rc = bulk_next (bulk))==1) {
+      for (size_t i=0; i<bulk->ncols; i++) {
+         int brc = bulk->fields[i]
+            ? sqlite3_bind_text (stmt, i + 1, bulk->fields[i], bulk->lens[i],
+                                 SQLITE_STATIC)
+            : sqlite3_bind_null (stmt, i + 1);
+         if (brc!=SQLITE_OK) {
+            db_err_printf (db, "Row %" PRIu64 ": unable to bind %zu [%s]\n",
+                               bulk->nrows, i + 1,
+                               sqlite3_errmsg (db->sqlite_db));
+            goto errorexit;
+         }
+      }
+
+      if ((sqlite3_step (stmt))!=SQLITE_DONE) {
+         db_err_printf (db, "Row %" PRIu64 " rejected [%s]\n",
+                            bulk->nrows, sqlite3_errmsg (db->sqlite_db));
+         goto errorexit;
+      }
+      sqlite3_reset (stmt);
+      bulk->nrows++;
+   }
+
+   if (rc < 0)
+      goto errorexit;
+
+   error = false;
+
+errorexit:
+   sqlite3_finalize (stmt);
+   sqldb_free (query.data);
+
+   return !error;
+}
+
+// Appends a single field to the buffer in the postgres COPY text format.
+static bool pg_copy_field (struct bulk_buf_t *buf, const char *field,
+                                                   size_t len)
+{
+   if (!field)
+      return bulk_buf_put (buf, "\\N", 2);
+
+   size_t start = 0;
+   for (size_t i=0; i<len; i++) {
+      const char *esc = NULL;
+      switch (field[i]) {
+         case '\\':  esc = "\\\\";  break;
+         case '\t':  esc = "\\t";   break;
+         case '\n':  esc = "\\n";   break;
+         case '\r':  esc = "\\r";   break;
+         default:                   continue;
+      }
+      if (!(bulk_buf_put (buf, &field[start], i - start))
+            || !(bulk_buf_put (buf, esc, 2)))
+         return false;
+      start = i + 1;
+   }
+   return bulk_buf_put (buf, &field[start], len - start);
+}
+
+static bool pgdb_bulk_load (struct bulk_t *bulk, const char *table,
+                                                 const char **columns)
+{
+   bool error = true;
+   sqldb_t *db = bulk->db;
+   PGconn *pg = db->pg_db;
+   struct bulk_buf_t buf = { 0 };
+   PGresult *r = NULL;
+   bool copying = false;
+   int rc;
+
+   if (!(bulk_buf_put (&buf, "COPY ", 5))
+         || !(bulk_buf_put (&buf, table, strlen (table)))
+         || !(bulk_buf_put (&buf, " (", 2)))
+      goto errorexit;
+
+   for (size_t i=0; i<bulk->ncols; i++) {
+      if ((i && !(bulk_buf_put (&buf, ", ", 2)))
+            || !(bulk_buf_put (&buf, columns[i], strlen (columns[i]))))
+         goto errorexit;
+   }
+
+   if (!(bulk_buf_put (&buf, ") FROM STDIN;", 14)))
+      goto errorexit;
+
+   r = PQexec (pg, buf.data);
+   if (PQresultStatus (r)!=PGRES_COPY_IN) {
+      db_err_printf (db, "Failed to start [%s]: %s\n",
+                         buf.data, PQresultErrorMessage (r));
+      goto errorexit;
+   }
+   PQclear (r);
+   r = NULL;
+   copying = true;
+   buf.len = 0;
+
+   while ((rc = bulk_next (bulk))==1) {
+      for (size_t i=0; i<bulk->ncols; i++) {
+         if ((i && !(bulk_buf_putc (&buf, '\t')))
+               || !(pg_copy_field (&buf, bulk->fields[i], bulk->lens[i])))
+            goto errorexit;
+      }
+      if (!(bulk_buf_putc (&buf, '\n')))
+         goto errorexit;
+      bulk->nrows++;
+
+      if (buf.len >= BULK_COPY_BUFSIZE) {
+         if ((PQputCopyData (pg, buf.data, buf.len))!=1) {
+            db_err_printf (db, "Failed to send COPY data [%s]\n",
+                               PQerrorMessage (pg));
+            goto errorexit;
+         }
+         buf.len = 0;
+      }
+   }
+
+   if (rc < 0)
+      goto errorexit;
+
+   if (buf.len && (PQputCopyData (pg, buf.data, buf.len))!=1) {
+      db_err_printf (db, "Failed to send COPY data [%s]\n",
+                         PQerrorMessage (pg));
+      goto errorexit;
+   }
+
+   // Rows the server rejects are only reported when the COPY ends.
+   copying = false;
+   if ((PQputCopyEnd (pg, NULL))!=1
+         || PQresultStatus ((r = PQgetResult (pg)))!=PGRES_COMMAND_OK) {
+      db_err_printf (db, "COPY into [%s] failed: %s\n", table,
+                         r ? PQresultErrorMessage (r) : PQerrorMessage (pg));
+      goto errorexit;
+   }
+
+   error = false;
+
+errorexit:
+   if (copying)
+      PQputCopyEnd (pg, "Bulk load aborted");
+
+   // The COPY is not over until libpq has no more results.
+   if (copying || r) {
+      PQclear (r);
+      while ((r = PQgetResult (pg)))
+         PQclear (r);
+   }
+
+   sqldb_free (buf.data);
+
+   return !error;
+}
+
+int64_t sqldb_bulk_load (sqldb_t *db, const char *table,
+                                      const char **columns,
+                                      const sqldb_bulk_src_t *src)
+{
+   bool error = true;
+   bool started = false;
+   bool own_tx = false;
+   struct bulk_t bulk;
+
+   memset (&bulk, 0, sizeof bulk);
+
+   if (!db || !table || !columns || !src)
+      return -1;
+
+   sqldb_clearerr (db);
+
+   for (bulk.ncols=0; columns[bulk.ncols]; bulk.ncols++) {
+      if (!(valid_db_identifier (columns[bulk.ncols]))) {
+         db_err_printf (db, "Invalid column name [%s]\n", columns[bulk.ncols]);
+         return -1;
+      }
+   }
+
+   if (!bulk.ncols || !(valid_db_identifier (table))
+                   || (!src->reader && !src->inf)) {
+      db_err_printf (db, "Invalid bulk load into [%s] (%zu columns)\n",
+                         table, bulk.ncols);
+      return -1;
+   }
+
+   bulk.db = db;
+   bulk.src = src;
+
+   size_t ncols = bulk.ncols;
+   if (!(bulk.fields = sqldb_calloc (ncols, sizeof *bulk.fields))
+         || !(bulk.lens = sqldb_calloc (ncols, sizeof *bulk.lens))
+         || !(bulk.offsets = sqldb_calloc (ncols, sizeof *bulk.offsets))) {
+      SQLDB_OOM (table);
+      goto errorexit;
+   }
+
+   if (!src->reader && src->header && bulk_read_record (&bulk) < 0)
+      goto errorexit;
+
+   if (!(atomic_begin (db, table, &own_tx)))
+      goto errorexit;
+   started = true;
+
+   clock_gettime (CLOCK_MONOTONIC, &bulk.start);
+   bulk.next_report = src->progress_rows ? src->progress_rows
+                                         : BULK_PROGRESS_ROWS;
+
+   bool ok = false;
+   switch (db->type) {
+      case sqldb_SQLITE:   ok = sqlitedb_bulk_load (&bulk, table, columns);
+                           break;
+
+      case sqldb_POSTGRES: ok = pgdb_bulk_load (&bulk, table, columns);
+                           break;
+
+      default:             db_err_printf (db, "(%i) Unknown type\n", db->type);
+                           break;
+   }
+
+   if (!ok || !(atomic_commit (db, own_tx)))
+      goto errorexit;
+   started = false;
+
+   bulk_progress (&bulk, true);
+
+   db->nchanges = bulk.nrows;
+   error = false;
+
+errorexit:
+   if (started)
+      atomic_rollback (db, own_tx);
+
+   sqldb_free (bulk.fields);
+   sqldb_free (bulk.lens);
+   sqldb_free (bulk.offsets);
+   sqldb_free (bulk.line.data);
+
+   return error ? -1 : (int64_t)bulk.nrows;
+}
+
+bool sqldb_batch (sqldb_t *db, ...)
+{
+   bool ret;
+   va_list ap;
+
+   if (!db)
+      return false;
+
+   va_start (ap, db);
+
+   if (db->pipeline) {
+      const char *qstring = NULL;
+      ret = true;
+      while (ret && (qstring = va_arg (ap, const char *))) {
+         ret = pipeline_batch_one (db, qstring);
+      }
+      va_end (ap);
+      return ret;
+   }
+
+   switch (db->type) {
+
+      case sqldb_SQLITE:   ret = sqlitedb_batch (db, ap);   break;
+
+      case sqldb_POSTGRES: ret = pgdb_batch (db, ap);       break;
+
+      default:             db_err_printf (db, "(%i) Format unsupported\n",
+                                              db->type);
+                           ret = false;
+                           break;
+   }
+   va_end (ap);
+   return ret;
+}
+
+/* *****************************************************************
+ * Batch files. The file is read in large blocks (or memory-mapped when it
+ * is a regular file) and split into statements on each ';' that is not
+ * within a literal, a quoted identifier, a comment or a dollar-quoted
+ * string.
+ */
+
+// The least number of bytes read from the file at a time.
+#define BATCHFILE_BLOCK       (256 * 1024)
+
+// The bytes that must be buffered beyond the scan position before a
+// construct is scanned: enough for the longest dollar-quote tag.
+#define BATCHFILE_LOOKAHEAD   (66)
+
+// The default number of statements between progress reports.
+#define BATCHFILE_PROGRESS    (1000)
+
+struct splitter_t {
+   FILE     *inf;
+   char     *buf;
+   size_t    len;
+   size_t    size;
+   bool      eof;
+   bool      mapped;
+
+   // The current statement is buf[start..pos), and offset is the offset
+   // in the file of buf[0].
+   size_t    start;
+   size_t    pos;
+   uint64_t  offset;
+   bool      has_sql;
+};
+
+// Discards the statements already returned and reads more of the file.
+static bool splitter_fill (sqldb_t *db, struct splitter_t *sp)
+{
+   if (sp->start) {
+      memmove (sp->buf, &sp->buf[sp->start], sp->len - sp->start);
+      sp->offset += sp->start;
+      sp->len -= sp->start;
+      sp->pos -= sp->start;
+      sp->start = 0;
+   }
+
+   // Reading at least as much as is already buffered keeps the rescanning
+   // of a construct that spans many blocks linear.
+   size_t want = sp->len > BATCHFILE_BLOCK ? sp->len : BATCHFILE_BLOCK;
+   if (sp->size - sp->len < want) {
+      char *tmp = sqldb_realloc (sp->buf, sp->len + want);
+      if (!tmp) {
+         SQLDB_OOM ("Batchfile buffer");
+         return false;
+      }
+      sp->buf = tmp;
+      sp->size = sp->len + want;
+   }
+
+   size_t nbytes = fread (&sp->buf[sp->len], 1, want, sp->inf);
+   sp->len += nbytes;
+   if (nbytes < want) {
+      if (ferror (sp->inf)) {
+         db_err_printf (db, "Failed to read batchfile at offset %" PRIu64 "\n",
+                            sp->offset + sp->len);
+         return false;
+      }
+      sp->eof = true;
+   }
+
+   return true;
+}
+
+// Finds the end of the next statement, which is then
+// buf[start..pos). Returns 1 when a statement was found, 0 at the end of
+// the file and -1 on error.
+static int splitter_next (sqldb_t *db, struct splitter_t *sp)
+{
+   sp->start = sp->pos;
+   sp->has_sql = false;
+
+   for (;;) {
+      while (sp->pos < sp->len) {
+         if (!sp->eof && sp->len - sp->pos < BATCHFILE_LOOKAHEAD)
+            break;
+
+         size_t next = skip_non_sql (sp->buf, sp->len, sp->pos);
+         if (next!=sp->pos) {
+            // The construct may continue in the part not yet read.
+            if (next==sp->len && !sp->eof)
+               break;
+            sp->pos = next;
+            continue;
+         }
+
+         char c = sp->buf[sp->pos++];
+         if (c==';')
+            return 1;
+
+         if (c!=' ' && c!='\t' && c!='\r' && c!='\n')
+            sp->has_sql = true;
+      }
+
+      if (sp->eof)
+         return sp->pos > sp->start ? 1 : 0;
+
+      if (!(splitter_fill (db, sp)))
+         return -1;
+   }
+}
+
+bool sqldb_batchfile_ex (sqldb_t *db, FILE *inf,
+                         const sqldb_batchfile_opts_t *opts)
+{
+   static const sqldb_batchfile_opts_t defaults = { 0 };
+   bool error = true;
+   bool started = false;
+   bool own_tx = false;
+   struct splitter_t sp;
+   struct bulk_buf_t stmt = { 0 };
+   uint64_t nstmts = 0;
+   uint64_t total = 0;
+   int rc = 0;
+
+   memset (&sp, 0, sizeof sp);
+   sp.inf = inf;
+
+   if (!db || !inf)
+      return false;
+
+   if (!opts)
+      opts = &defaults;
+
+   uint64_t interval = opts->progress_stmts ? opts->progress_stmts
+                                            : BATCHFILE_PROGRESS;
+
+#ifndef PLATFORM_Windows
+   struct stat sb;
+   if ((fstat (fileno (inf), &sb))==0 && S_ISREG (sb.st_mode)) {
+      total = sb.st_size;
+      // Only a file that has not been read from can be mapped, as stdio
+      // may have buffered some of it.
+      if (sb.st_size > 0 && (ftello (inf))==0) {
+         void *map = mmap (NULL, sb.st_size, PROT_READ, MAP_PRIVATE,
+                           fileno (inf), 0);
+         if (map!=MAP_FAILED) {
+            madvise (map, sb.st_size, MADV_SEQUENTIAL);
+            sp.buf = map;
+            sp.len = sb.st_size;
+            sp.eof = true;
+            sp.mapped = true;
+         }
+      }
+   }
+#endif
+
+   if (opts->transaction) {
+      if (!(atomic_begin (db, "batchfile", &own_tx)))
+         goto errorexit;
+      started = true;
+   }
+
+   while ((rc = splitter_next (db, &sp))==1) {
+      stmt.len = 0;
+      if (!(bulk_buf_put (&stmt, &sp.buf[sp.start], sp.pos - sp.start))
+            || !(bulk_buf_putc (&stmt, 0)))
+         goto errorexit;
+
+      // A trigger body contains statements of its own.
+      while (db->type==sqldb_SQLITE && !(sqlite3_complete (stmt.data))
+               && (sp.pos < sp.len || !sp.eof)) {
+         bool has_sql = sp.has_sql;
+         if ((rc = splitter_next (db, &sp))!=1)
+            break;
+         stmt.len--;
+         if (!(bulk_buf_put (&stmt, &sp.buf[sp.start], sp.pos - sp.start))
+               || !(bulk_buf_putc (&stmt, 0)))
+            goto errorexit;
+         sp.has_sql = sp.has_sql || has_sql;
+      }
+
+      if (rc < 0)
+         goto errorexit;
+
+      if (!sp.has_sql)
+         continue;
+
+      if (!(sqldb_batch (db, stmt.data, NULL))) {
+         char *cause = db->lasterr;
+         db->lasterr = NULL;
+         db_err_printf (db, "Batchfile statement %" PRIu64 " failed: %s\n",
+                            nstmts + 1, cause ? cause : "");
+         sqldb_free (cause);
+         goto errorexit;
+      }
+
+      nstmts++;
+      if (opts->progress && nstmts % interval==0) {
+         opts->progress (opts->progress_ctx, nstmts, sp.offset + sp.pos,
+                                                     total);
+      }
+   }
+
+   if (rc < 0)
+      goto errorexit;
+
+   if (started) {
+      if (!(atomic_commit (db, own_tx)))
+         goto errorexit;
+      started = false;
+   }
+
+   if (opts->progress)
+      opts->progress (opts->progress_ctx, nstmts, sp.offset + sp.pos, total);
+
+   error = false;
+
+errorexit:
+   if (started)
+      atomic_rollback (db, own_tx);
+
+#ifndef PLATFORM_Windows
+   if (sp.mapped) {
+      munmap (sp.buf, sp.len);
+      sp.buf = NULL;
+      fseeko (inf, 0, SEEK_END);
+   }
+#endif
+   sqldb_free (sp.buf);
+   sqldb_free (stmt.data);
+
+   return !error;
+}
+
+bool sqldb_batchfile (sqldb_t *db, FILE *inf)
+{
+   return sqldb_batchfile_ex (db, inf, NULL);
+}
+
+static int sqlite_res_step (sqldb_res_t *res)
+{
+   if (res->sqlite_done)
+      return 0;
+
+   int rc = sqlite3_step (res->sqlite_stmt);
+
+   if (rc==SQLITE_DONE) {
+      res->sqlite_done = true;
+      return 0;
+   }
+
+   if (rc!=SQLITE_ROW) {
+      res_seterr (res, sqlite3_errstr (rc));
+      return -1;
+   }
+
+   return 1;
+}
+
+static int pgdb_res_step (sqldb_res_t *res)
+{
+   if (res->current_row + 1 < res->nrows) {
+      res->current_row++;
+      return 1;
+   }
+
+   res->current_row = res->nrows;
+
+   return res->streaming ? pgdb_stream_next (res) : 0;
+}
+
+static int res_step (sqldb_res_t *res)
+{
+   int ret = -1;
+
+   if (res->row_pending) {
+      res->row_pending = false;
+      return 1;
+   }
+
+   switch (res->type) {
+      case sqldb_SQLITE:   ret = sqlite_res_step (res);  break;
+      case sqldb_POSTGRES: ret = pgdb_res_step (res);    break;
+      default:             ret = -1;                     break;
+   }
+
+   if (ret==-1) {
+      PROG_ERR ("sqldb_res error: %s\n", sqldb_res_lasterr (res));
+   }
+
+   return ret;
+}
+
+int sqldb_res_step (sqldb_res_t *res)
+{
+   if (!res)
+      return -1;
+
+   uint64_t span = sqldb_span_begin ();
+   int ret = res_step (res);
+   stats_step (res, ret==1, ret==0);
+   span_record ("sqldb", "step", span_detail (res), span);
+
+   return ret;
+}
+
+static uint64_t convert_ISO8601_to_uint64 (const char *src)
+{
+   struct tm tm;
+
+   memset (&tm, 0, sizeof tm);
+
+   if ((sscanf (src, "%4d-%2d-%2d %2d:%2d:%2d", &tm.tm_year,
+                                                &tm.tm_mon,
+                                                &tm.tm_mday,
+                                                &tm.tm_hour,
+                                                &tm.tm_min,
+                                                &tm.tm_sec)) != 6)
+      return (uint64_t)-1;
+
+   tm.tm_year -= 1900;
+   tm.tm_mon -= 1;
+
+   return mktime (&tm);
+}
+
+uint32_t sqlite_scan (sqldb_res_t *res, va_list *ap)
+{
+   uint32_t ret = 0;
+
+   if (!res)
+      return (uint32_t)-1;
+
+   sqlite3_stmt *stmt = res->sqlite_stmt;
+
+   sqldb_coltype_t coltype = va_arg (*ap, sqldb_coltype_t);
+
+   int numcols = sqlite3_column_count (stmt);
+
+   while (coltype!=sqldb_col_UNKNOWN && numcols--) {
+
+      void *dst = va_arg (*ap, void *);
+      uint32_t *blen;
+      const void *tmp;
+      char *tmpstring = NULL;
+
+      switch (coltype) {
+
+         case sqldb_col_UNKNOWN:
+            res_err_printf (res, "Possibly corrupt stack");
+            // TODO: Store value in result
+            return (uint32_t)-1;
+
+         case sqldb_col_UINT32:
+         case sqldb_col_INT32:
+            *(uint32_t *)dst = (uint32_t)sqlite3_column_int64 (stmt, ret);
+            break;
+
+         case sqldb_col_DATETIME:
+            tmp = sqlite3_column_text (stmt, ret);
+            *(uint64_t *)dst = convert_ISO8601_to_uint64 (tmp);
+            if ((*(uint64_t *)dst) == (uint64_t)-1)
+               return (uint32_t)-1;
+            break;
+
+         case sqldb_col_UINT64:
+         case sqldb_col_INT64:
+            *(uint64_t *)dst = sqlite3_column_int64 (stmt, ret);
+            break;
+
+         case sqldb_col_TEXT:
+            tmpstring = ((char *)sqlite3_column_text (stmt, ret));
+            *(char **)dst = res_strdup (res, tmpstring);
+            if (!(*(char **)dst)) {
+               SQLDB_OOM (sqlite3_column_text (stmt, ret));
+               return (uint32_t)-1;
+            }
+            res->stats_bytes += sqlite3_column_bytes (stmt, ret);
+            break;
+
+         case sqldb_col_BLOB:
+            blen = va_arg (*ap, uint32_t *);
+            tmp = sqlite3_column_blob (stmt, ret);
+            *blen = sqlite3_column_bytes (stmt, ret);
+            *(void **)dst = res_malloc (res, *blen);
+            if (!dst) {
+               SQLDB_OOM ("Blob type");
+               return (uint32_t)-1;
+            }
+            memcpy (*(void **)dst, tmp, *blen);
+            res->stats_bytes += *blen;
+            break;
+
+         case sqldb_col_NULL:
+            res_err_printf (res, "Error: NULL type not supported\n");
+            // TODO: Store value in result
+            return (uint32_t)-1;
+
+      }
+      coltype = va_arg (*ap, sqldb_coltype_t);
+      ret++;
+   }
+
+   return ret;
+}
+
+/* *****************************************************************
+ * Postgres binary results. With sqldb_FLAG_BINARY set the server sends
+ * each column in its binary (network byte order) representation, which
+ * is decoded here according to the column type instead of being parsed
+ * from text.
+ */
+
+static uint64_t pg_get_u64 (const unsigned char *src, int len)
+{
+   uint64_t ret = 0;
+
+   for (int i=0; i<len; i++) {
+      ret = (ret << 8) | src[i];
+   }
+
+   return ret;
+}
+
+static bool pg_oid_is_text (Oid oid)
+{
+   return oid==PG_OID_TEXT || oid==PG_OID_VARCHAR
+                           || oid==PG_OID_BPCHAR
+                           || oid==PG_OID_NAME;
+}
+
+// Decodes a binary integer (or boolean, or text) column into a 64-bit
+// integer, sign-extending the smaller signed types.
+static bool pgdb_binary_int (sqldb_res_t *res, int row, int index,
+                                                     int64_t *dst)
+{
+   const unsigned char *value = (const unsigned char *)
+                                 PQgetvalue (res->pgr, row, index);
+   int len = PQgetlength (res->pgr, row, index);
+   Oid oid = PQftype (res->pgr, index);
+
+   if ((PQgetisnull (res->pgr, row, index))) {
+      res_err_printf (res, "Column %i is NULL\n", index);
+      return false;
+   }
+
+   switch (oid) {
+      case PG_OID_BOOL: if (len!=1) break;
+                        *dst = value[0];
+                        return true;
+
+      case PG_OID_INT2: if (len!=2) break;
+                        *dst = (int16_t)pg_get_u64 (value, len);
+                        return true;
+
+      case PG_OID_INT4: if (len!=4) break;
+                        *dst = (int32_t)pg_get_u64 (value, len);
+                        return true;
+
+      case PG_OID_OID:  if (len!=4) break;
+                        *dst = (uint32_t)pg_get_u64 (value, len);
+                        return true;
+
+      case PG_OID_INT8: if (len!=8) break;
+                        *dst = (int64_t)pg_get_u64 (value, len);
+                        return true;
+
+      default:          if (!(pg_oid_is_text (oid)))
+                           break;
+                        if ((sscanf ((const char *)value, "%" SCNi64, dst))!=1)
+                           break;
+                        return true;
+   }
+
+   res_err_printf (res, "Cannot convert column %i (type %u) to an integer\n",
+                        index, (unsigned)oid);
+   return false;
+}
+
+// Timestamps are returned in the same form as the text conversion: a
+// timestamp without a time zone is taken to be in local time.
+static bool pgdb_binary_datetime (sqldb_res_t *res, int row, int index,
+                                                          uint64_t *dst)
+{
+   const unsigned char *value = (const unsigned char *)
+                                 PQgetvalue (res->pgr, row, index);
+   int len = PQgetlength (res->pgr, row, index);
+   Oid oid = PQftype (res->pgr, index);
+
+   if ((oid!=PG_OID_TIMESTAMP && oid!=PG_OID_TIMESTAMPTZ) || len!=8) {
+      res_err_printf (res, "Cannot convert column %i (type %u) to a datetime\n",
+                           index, (unsigned)oid);
+      return false;
+   }
+
+   int64_t usecs = (int64_t)pg_get_u64 (value, len);
+   int64_t secs = usecs / 1000000 - (usecs % 1000000 < 0 ? 1 : 0);
+
+   if (oid==PG_OID_TIMESTAMPTZ) {
+      *dst = secs + PG_EPOCH_OFFSET;
+      return true;
+   }
+
+   // mktime() normalises the out of range day and seconds fields.
+   struct tm tm;
+   int64_t days = secs / 86400 - (secs % 86400 < 0 ? 1 : 0);
+
+   memset (&tm, 0, sizeof tm);
+   tm.tm_year = 100;
+   tm.tm_mday = 1 + days;
+   tm.tm_sec = secs - days * 86400;
+
+   *dst = mktime (&tm);
+   return true;
+}
+
+static bool pgdb_binary_text (sqldb_res_t *res, int row, int index,
+                                                      char **dst)
+{
+   const char *value = PQgetvalue (res->pgr, row, index);
+   Oid oid = PQftype (res->pgr, index);
+   int64_t i64;
+   char tmp[24];
+
+   if ((PQgetisnull (res->pgr, row, index))
+         || pg_oid_is_text (oid)) {
+      // The value is always terminated by libpq.
+      *dst = res_strdup (res, value);
+   } else {
+      if (!(pgdb_binary_int (res, row, index, &i64)))
+         return false;
+      snprintf (tmp, sizeof tmp, "%" PRIi64, i64);
+      *dst = res_strdup (res, tmp);
+   }
+
+   if (!*dst) {
+      SQLDB_OOM (value);
+      return false;
+   }
+
+   return true;
+}
 
-errorexit:
-   if (error) {
-      sqldb_res_del (ret);
-      ret = NULL;
+static bool pgdb_blob (sqldb_res_t *res, int index, void **dst,
+                                                    uint32_t *blen)
+{
+   const char *value = PQgetvalue (res->pgr, res->current_row, index);
+   unsigned char *tmp = NULL;
+   size_t len = 0;
+
+   if ((PQfformat (res->pgr, index))==1) {
+      len = PQgetlength (res->pgr, res->current_row, index);
+      if ((*dst = res_malloc (res, len + 1)))
+         memcpy (*dst, value, len);
+   } else {
+      if ((tmp = PQunescapeBytea ((const unsigned char *)value, &len))
+            && (*dst = res_malloc (res, len + 1)))
+         memcpy (*dst, tmp, len);
+      PQfreemem (tmp);
    }
-   return ret;
+
+   if (!*dst) {
+      SQLDB_OOM ("Blob type");
+      return false;
+   }
+
+   *blen = len;
+   return true;
 }
 
-static sqldb_res_t *pgdb_exec (sqldb_t *db, char *qstring, va_list *ap)
+uint32_t pgdb_scan (sqldb_res_t *res, va_list *ap)
 {
-   bool error = true;
-   int nParams = 0;
-   sqldb_res_t *ret = NULL;
+   uint32_t ret = 0;
 
-   char **paramValues = NULL;
+   if (!res)
+      return (uint32_t)-1;
 
-   static const Oid *paramTypes = NULL;
-   static const int *paramLengths = NULL;
-   static const int *paramFormats = NULL;
+   sqldb_coltype_t coltype = va_arg (*ap, sqldb_coltype_t);
 
-   va_list ac;
-   va_copy (ac, (*ap));
-   sqldb_coltype_t coltype = va_arg (ac, sqldb_coltype_t);
-   while (coltype!=sqldb_col_UNKNOWN) {
-      nParams++;
-      const void *ignore = va_arg (ac, const void *);
-      ignore = ignore;
-      coltype = va_arg (ac, sqldb_coltype_t);
-   }
-   va_end (ac);
+   int numcols = PQnfields (res->pgr);
+   int index = 0;
 
+   while (coltype!=sqldb_col_UNKNOWN && numcols--) {
 
-   ret = malloc (sizeof *ret);
-   if (!ret)
-      goto errorexit;
-   memset (ret, 0, sizeof *ret);
+      void *dst = va_arg (*ap, void *);
 
-   paramValues = malloc ((sizeof *paramValues) * (nParams + 1));
-   if (!paramValues)
-      goto errorexit;
-   memset (paramValues, 0, (sizeof *paramValues) * (nParams + 1));
+      int32_t  i32;
+      uint32_t u32;
+      int64_t  i64;
+      uint64_t u64;
 
-   ret->type = sqldb_POSTGRES;
+      int row = res->current_row;
+      if (row < 0 || row >= res->nrows)
+         return (uint32_t)-1;
 
-   size_t index = 0;
-   coltype = va_arg (*ap, sqldb_coltype_t);
-   while (coltype!=sqldb_col_UNKNOWN) {
-      uint32_t *v_uint;
-      uint64_t *v_uint64;
-      int32_t *v_int;
-      int64_t *v_int64;
-      char **v_text;
-      void *v_blob;
-      void *v_ptr;
-      uint32_t *v_bloblen;
-
-      char intstr[42];
-      char *value = intstr;
+      const char *value = PQgetvalue (res->pgr, row, index);
+      if (!value)
+         return (uint32_t)-1;
+
+      bool binary = (PQfformat (res->pgr, index))==1;
 
       switch (coltype) {
+
          case sqldb_col_UNKNOWN:
-            db_err_printf (db, "Impossible error\n");
-            goto errorexit;
+            res_err_printf (res, "Possibly corrupt stack");
+            // TODO: Store value in result
+            return (uint32_t)-1;
 
          case sqldb_col_UINT32:
-            v_uint = va_arg (*ap, uint32_t *);
-            sprintf (intstr, "%i", *v_uint);
+            if (binary) {
+               if (!(pgdb_binary_int (res, row, index, &i64)))
+                  return (uint32_t)-1;
+               u32 = i64;
+            } else if ((sscanf (value, "%u", &u32))!=1) {
+               return (uint32_t)-1;
+            }
+            *(uint32_t *)dst = u32;
             break;
 
          case sqldb_col_INT32:
-            v_int = va_arg (*ap, int32_t *);
-            sprintf (intstr, "%i", *v_int);
+            if (binary) {
+               if (!(pgdb_binary_int (res, row, index, &i64)))
+                  return (uint32_t)-1;
+               i32 = i64;
+            } else if ((sscanf (value, "%i", &i32))!=1) {
+               return (uint32_t)-1;
+            }
+            *(int32_t *)dst = i32;
             break;
 
          case sqldb_col_UINT64:
-            v_uint64 = va_arg (*ap, uint64_t *);
-            sprintf (intstr, "%" PRIu64, *v_uint64);
+            if (binary) {
+               if (!(pgdb_binary_int (res, row, index, &i64)))
+                  return (uint32_t)-1;
+               u64 = i64;
+            } else if ((sscanf (value, "%" SCNu64, &u64))!=1) {
+               return (uint32_t)-1;
+            }
+            *(uint64_t *)dst = u64;
             break;
 
          case sqldb_col_INT64:
-            v_int64 = va_arg (*ap, int64_t *);
-            sprintf (intstr, "%" PRIi64, *v_int64);
+            if (binary) {
+               if (!(pgdb_binary_int (res, row, index, &i64)))
+                  return (uint32_t)-1;
+            } else if ((sscanf (value, "%" SCNi64, &i64))!=1) {
+               return (uint32_t)-1;
+            }
+            *(int64_t *)dst = i64;
             break;
 
-         case sqldb_col_DATETIME:
-            // TODO: ???
-
          case sqldb_col_TEXT:
-            v_text = va_arg (*ap, char **);
-            value = *v_text;
+            if (binary) {
+               if (!(pgdb_binary_text (res, row, index, dst)))
+                  return (uint32_t)-1;
+            } else if ((*(char **)dst = res_strdup (res, value))==NULL) {
+               return (uint32_t)-1;
+            }
+            res->stats_bytes += PQgetlength (res->pgr, row, index);
+            break;
+
+         case sqldb_col_DATETIME:
+            if (binary) {
+               if (!(pgdb_binary_datetime (res, row, index, dst)))
+                  return (uint32_t)-1;
+               break;
+            }
+            *(uint64_t *)dst = convert_ISO8601_to_uint64 (value);
+            if ((*(uint64_t *)dst) == (uint64_t)-1)
+               return (uint32_t)-1;
             break;
 
          case sqldb_col_BLOB:
-            v_blob = va_arg (*ap, void *);
-            v_bloblen = va_arg (*ap, uint32_t *);
-            // TODO: ???
-            v_bloblen = v_bloblen;
-            v_blob = v_blob;
-            value = NULL;
+            if (!(pgdb_blob (res, index, dst, va_arg (*ap, uint32_t *))))
+               return (uint32_t)-1;
+            res->stats_bytes += PQgetlength (res->pgr, row, index);
             break;
 
          case sqldb_col_NULL:
-            v_ptr = va_arg (*ap, void *); // Discard the next argument
-            v_ptr = v_ptr;
-            value = NULL;
-            break;
+            res_err_printf (res, "Error: NULL type not supported\n");
+            // TODO: Store value in result
+            return (uint32_t)-1;
 
-         default:
-            db_err_printf (db, "Unknown column type: %u\n", coltype);
-            break;
       }
-
-      paramValues[index++] = lstr_dup (value);
       coltype = va_arg (*ap, sqldb_coltype_t);
+      index++;
+      ret++;
    }
 
-   ret->pgr = PQexecParams (db->pg_db, qstring, nParams,
-                                                paramTypes,
-                           (const char *const *)paramValues,
-                                                paramLengths,
-                                                paramFormats,
-                                                0);
-   if (!ret->pgr) {
-      db_err_printf (db, "Possible OOM error (pg)\n[%s]\n", qstring);
-      goto errorexit;
-   }
-
-   ExecStatusType rs = PQresultStatus (ret->pgr);
-   if (rs != PGRES_COMMAND_OK && rs != PGRES_TUPLES_OK) {
-      db_err_printf (db, "Bad postgres return status [%s]\n[%s]\n",
-                          PQresultErrorMessage (ret->pgr),
-                          qstring);
-      goto errorexit;
-   }
-
-   ret->current_row = 0;
-   ret->nrows = PQntuples (ret->pgr);
-   const char *tmp = PQcmdTuples (ret->pgr);
-   if (tmp) {
-      sscanf (tmp, "%" PRIu64, &db->nchanges);
-   } else {
-      db->nchanges = 0;
-   }
-
-   Oid last_id = PQoidValue (ret->pgr);
-   ret->last_id = last_id == InvalidOid ? (uint64_t)-1 : last_id;
-
-   error = false;
-
-errorexit:
-
-   for (int i=0; paramValues && i<nParams; i++) {
-      free (paramValues[i]);
-   }
-   free (paramValues);
-
-   if (error) {
-      sqldb_res_del (ret);
-      ret = NULL;
-   }
    return ret;
 }
 
-sqldb_res_t *sqldb_exec (sqldb_t *db, const char *query, ...)
+uint32_t sqldb_scan_columns (sqldb_res_t *res, ...)
 {
-   sqldb_res_t *ret = NULL;
+   uint32_t ret = 0;
    va_list ap;
 
-   va_start (ap, query);
-   ret = sqldb_execv (db, query, &ap);
+   va_start (ap, res);
+   ret = sqldb_scan_columnsv (res, &ap);
    va_end (ap);
 
    return ret;
 }
 
-sqldb_res_t *sqldb_execv (sqldb_t *db, const char *query, va_list *ap)
+uint32_t sqldb_scan_columnsv (sqldb_res_t *res, va_list *ap)
 {
-   bool error = true;
-   sqldb_res_t *ret = NULL;
-   char *qstring = NULL;
-
-   if (!db || !query)
-      return NULL;
-
-   qstring = fix_string (db->type, query);
-   if (!qstring) {
-      SQLDB_OOM (query);
-      goto errorexit;
-   }
-
-   sqldb_clearerr (db);
-
-   switch (db->type) {
-      case sqldb_SQLITE:   ret = sqlitedb_exec (db, qstring, ap);       break;
-      case sqldb_POSTGRES: ret = pgdb_exec (db, qstring, ap);           break;
-      default:             db_err_printf (db, "(%i) Unknown type\n", db->type);
-                           goto errorexit;
-   }
-   if (!ret) {
-      // db_err_printf (db, "Failed to execute stmt [%s]\n", qstring);
-      goto errorexit;
-   }
-
-   ret->dbcon = db;
-   error = false;
+   uint32_t ret = (uint32_t)-1;
+   uint64_t span = sqldb_span_begin ();
 
-errorexit:
-   free (qstring);
-   if (error) {
-      sqldb_res_del (ret);
-      ret = NULL;
+   switch (res->type) {
+      case sqldb_SQLITE:   ret = sqlite_scan (res, ap);  break;
+      case sqldb_POSTGRES: ret = pgdb_scan (res, ap);    break;
+      default:             ret = (uint32_t)-1;           break;
    }
-   return ret;
-}
-
-uint64_t sqldb_exec_ignore (sqldb_t *db, const char *query, ...)
-{
-   va_list ap;
 
-   va_start (ap, query);
-   uint64_t ret = sqldb_exec_ignorev (db, query, &ap);
-   va_end (ap);
+   span_record ("sqldb", "scan", span_detail (res), span);
 
    return ret;
 }
 
-uint64_t sqldb_exec_ignorev (sqldb_t *db, const char *query, va_list *ap)
+static bool sqlite_column_view (sqldb_res_t *res, uint32_t index,
+                                sqldb_colview_t *dst)
 {
-   uint64_t ret = (uint64_t)-1;
-
-   sqldb_res_t *res = NULL;
+   sqlite3_stmt *stmt = res->sqlite_stmt;
 
-   if (!(res = sqldb_execv (db, query, ap)))
-      goto errorexit;
+   // No row is available before the first step or after the last.
+   if (index >= (uint32_t)sqlite3_data_count (stmt))
+      return false;
 
-   if ((sqldb_res_step (res))==-1)
-      goto errorexit;
+   switch (sqlite3_column_type (stmt, index)) {
+      case SQLITE_NULL: dst->is_null = true;
+                        return true;
 
-   ret = sqldb_res_last_id (res);
+      case SQLITE_BLOB: dst->ptr = sqlite3_column_blob (stmt, index);
+                        break;
 
-errorexit:
-   if (res && res->lasterr) {
-      db_err_printf (res->dbcon, "Error in [%s]: %s\n", query, res->lasterr);
+      default:          dst->ptr = (const char *)sqlite3_column_text (stmt,
+                                                                      index);
+                        break;
    }
-   sqldb_res_del (res);
 
-   return ret;
+   // The length must be retrieved after the value has been converted.
+   dst->len = sqlite3_column_bytes (stmt, index);
+   if (!dst->ptr)
+      dst->ptr = "";
 
+   return true;
 }
 
-
-static bool sqlitedb_batch (sqldb_t *db, va_list ap)
+static bool pgdb_column_view (sqldb_res_t *res, uint32_t index,
+                              sqldb_colview_t *dst)
 {
-   bool ret = true;
-   if (!db->sqlite_db)
+   if (res->current_row < 0 || res->current_row >= res->nrows
+         || index >= (uint32_t)PQnfields (res->pgr))
       return false;
 
-   char *qstring = va_arg (ap, char *);
-
-   while (ret && qstring) {
-      char *errmsg = NULL;
-      int rc = sqlite3_exec (db->sqlite_db, qstring, NULL, NULL, &errmsg);
-
-      if (rc!=SQLITE_OK) {
-         ret = false;
-         db_err_printf (db, "DB exec failure [%s]\n[%s]\n", qstring, errmsg);
-      }
-
-      sqlite3_free (errmsg);
-      qstring = va_arg (ap, char *);
+   if ((PQgetisnull (res->pgr, res->current_row, index))) {
+      dst->is_null = true;
+      return true;
    }
 
-   return ret;
+   dst->ptr = PQgetvalue (res->pgr, res->current_row, index);
+   dst->len = PQgetlength (res->pgr, res->current_row, index);
+
+   return true;
 }
 
-static bool pgdb_batch (sqldb_t *db, va_list ap)
+bool sqldb_res_column_view (sqldb_res_t *res, uint32_t index,
+                            sqldb_colview_t *dst)
 {
-   bool ret = true;
+   bool ret = false;
 
-   if (!db->pg_db)
+   if (!res || !dst)
       return false;
 
-   char *qstring = va_arg (ap, char *);
-
-   while (ret && qstring) {
-      PGresult *result = PQexec (db->pg_db, qstring);
-      if (!result) {
-         db_err_printf (db, "PGSQL - OOM error\n[%s]\n", qstring);
-         ret = false;
-         break;
-      }
-      ExecStatusType rc = PQresultStatus (result);
-      if (rc == PGRES_BAD_RESPONSE || rc == PGRES_FATAL_ERROR) {
-         const char *rc_msg = PQresStatus (rc),
-                    *res_msg = PQresultErrorMessage (result);
-
-         db_err_printf (db, "pgdb_batch: Bad postgres result[%s]\n[%s]\n[%s]\n",
-                            rc_msg,
-                            res_msg,
-                            qstring);
-         ret = false;
-         PQclear (result);
-         break;
-      }
+   dst->ptr = NULL;
+   dst->len = 0;
+   dst->is_null = false;
 
-      PQclear (result);
-      qstring =  va_arg (ap, char *);
+   switch (res->type) {
+      case sqldb_SQLITE:   ret = sqlite_column_view (res, index, dst);  break;
+      case sqldb_POSTGRES: ret = pgdb_column_view (res, index, dst);    break;
+      default:             ret = false;                                 break;
    }
 
+   if (!ret)
+      res_err_printf (res, "Column %u is not available\n", index);
+
+   res->stats_bytes += dst->len;
+
    return ret;
 }
 
+/* *****************************************************************
+ * Batch fetching. Rows are decoded a batch at a time into the caller's
+ * column arrays; for postgres each column is decoded in its own loop
+ * over all the rows in the batch.
+ */
 
-bool sqldb_batch (sqldb_t *db, ...)
+static bool batch_is_bytes (sqldb_coltype_t type)
 {
-   bool ret;
-   va_list ap;
-
-   if (!db)
-      return false;
+   return type==sqldb_col_TEXT || type==sqldb_col_BLOB;
+}
 
-   va_start (ap, db);
+static void batch_set_null (sqldb_colbatch_t *col, uint32_t row)
+{
+   if (col->nulls)
+      col->nulls[row / 8] |= (uint8_t)(1 << (row % 8));
+}
 
-   switch (db->type) {
+static bool batch_check (sqldb_res_t *res, sqldb_colbatch_t *cols,
+                                           uint32_t ncols,
+                                           uint32_t max_rows)
+{
+   for (uint32_t i=0; i<ncols; i++) {
+      switch (cols[i].type) {
+         case sqldb_col_UINT32:
+         case sqldb_col_INT32:
+         case sqldb_col_UINT64:
+         case sqldb_col_INT64:
+         case sqldb_col_DATETIME:
+            if (!cols[i].ints)
+               break;
+            goto nextcol;
 
-      case sqldb_SQLITE:   ret = sqlitedb_batch (db, ap);   break;
+         case sqldb_col_TEXT:
+         case sqldb_col_BLOB:
+            if (!cols[i].offsets || !cols[i].bytes)
+               break;
+            cols[i].offsets[0] = 0;
+            goto nextcol;
 
-      case sqldb_POSTGRES: ret = pgdb_batch (db, ap);       break;
+         default:
+            break;
+      }
+      res_err_printf (res, "Column %u: unsupported type %u or missing "
+                           "destination\n", i, cols[i].type);
+      return false;
 
-      default:             db_err_printf (db, "(%i) Format unsupported\n",
-                                              db->type);
-                           ret = false;
-                           break;
+nextcol:
+      if (cols[i].nulls)
+         memset (cols[i].nulls, 0, (max_rows + 7) / 8);
    }
-   va_end (ap);
-   return ret;
+
+   return true;
 }
 
-static char *push_char (char **dst, size_t *len, char c)
+static int64_t sqlite_fetch_batch (sqldb_res_t *res, sqldb_colbatch_t *cols,
+                                                     uint32_t ncols,
+                                                     uint32_t max_rows)
 {
-   char *tmp = realloc ((*dst), (*len)+2);
-   if (!tmp) {
-      return NULL;
-   }
-   (*dst) = tmp;
-   (*dst)[(*len)] = c & 0xff;
-   (*dst)[(*len)+1] = 0;
-   (*len)++;
+   sqlite3_stmt *stmt = res->sqlite_stmt;
+   uint32_t n = 0;
 
-   return (*dst);
-}
+   if (ncols > (uint32_t)sqlite3_column_count (stmt)) {
+      res_err_printf (res, "Requested %u columns from %i\n", ncols,
+                           sqlite3_column_count (stmt));
+      return -1;
+   }
 
-static char *read_stmt (FILE *inf)
-{
-   char *ret = NULL;
-   size_t len = 0;
-   int c = 0;
-   int pc = 0;
-   char cquote = 0;
-   bool comment = false;
-
-   while (!feof (inf) && !ferror (inf) && ((c = fgetc (inf))!=EOF)) {
-
-      if (c=='\n')
-         comment = false;
-
-      if (c=='-' && pc=='-')
-         comment = true;
-
-      if (!cquote) {
-         if (c == '\'') cquote = '\'';
-         if (c == '"')  cquote = '"';
-         if (c == ';' && !comment) {
-            // We can probably do without the terminating ';' here, we are
-            // returning a full statement anyway and the caller will
-            // execute if immediately, hence there is no reason to free
-            // ret and return NULL.
-            ret = push_char (&ret, &len, c);
+   while (n < max_rows) {
+      if (!res->row_pending) {
+         int rc = sqlite_res_step (res);
+         if (rc==0)
             break;
-         }
-      } else {
-         if (c == '\'' || c == '"')
-            cquote = 0;
+         if (rc < 0)
+            return -1;
       }
 
-      if (!(ret = push_char (&ret, &len, c))) {
-         free (ret);
-         return NULL;
+      // The row is only decoded if all of its values fit.
+      res->row_pending = true;
+      for (uint32_t i=0; i<ncols; i++) {
+         if (!(batch_is_bytes (cols[i].type)))
+            continue;
+         if (cols[i].type==sqldb_col_BLOB)
+            sqlite3_column_blob (stmt, i);
+         else
+            sqlite3_column_text (stmt, i);
+         size_t len = sqlite3_column_bytes (stmt, i);
+         if (cols[i].offsets[n] + len > cols[i].bytes_len)
+            goto done;
+      }
+      res->row_pending = false;
+
+      for (uint32_t i=0; i<ncols; i++) {
+         sqldb_colbatch_t *col = &cols[i];
+         bool isnull = sqlite3_column_type (stmt, i)==SQLITE_NULL;
+         const void *src;
+         size_t len;
+
+         if (isnull)
+            batch_set_null (col, n);
+
+         switch (col->type) {
+            case sqldb_col_DATETIME:
+               src = sqlite3_column_text (stmt, i);
+               col->ints[n] = isnull ? 0
+                                     : (int64_t)convert_ISO8601_to_uint64 (src);
+               break;
+
+            case sqldb_col_TEXT:
+            case sqldb_col_BLOB:
+               src = col->type==sqldb_col_BLOB
+                        ? sqlite3_column_blob (stmt, i)
+                        : (const void *)sqlite3_column_text (stmt, i);
+               len = sqlite3_column_bytes (stmt, i);
+               if (len)
+                  memcpy (&col->bytes[col->offsets[n]], src, len);
+               col->offsets[n + 1] = col->offsets[n] + len;
+               break;
+
+            default:
+               col->ints[n] = sqlite3_column_int64 (stmt, i);
+               break;
+         }
       }
+      n++;
+   }
 
-      pc = c;
+done:
+   if (n==0 && res->row_pending) {
+      res_err_printf (res, "A single row does not fit in the batch\n");
+      return -1;
    }
 
-   return ret;
+   return n;
 }
 
-bool sqldb_batchfile (sqldb_t *db, FILE *inf)
+// Decodes count rows, starting at row first of the postgres result, into
+// the column at offset n of the batch.
+static bool pgdb_batch_column (sqldb_res_t *res, sqldb_colbatch_t *col,
+                                                 int index,
+                                                 int first,
+                                                 uint32_t count,
+                                                 uint32_t n)
 {
-   char *stmt = NULL;
+   PGresult *pgr = res->pgr;
+   bool binary = (PQfformat (pgr, index))==1;
+   int64_t *ints = col->ints ? &col->ints[n] : NULL;
 
-   while ((stmt = read_stmt (inf))) {
-      printf ("FOUND STATEMENT: [%s]\n", stmt);
-      if (!(sqldb_batch (db, stmt, NULL))) {
-         db_err_printf (db, "Batchfile statement failed: \n%s\n", stmt);
-         free (stmt);
-         return false;
+   for (uint32_t r=0; r<count; r++) {
+      if ((PQgetisnull (pgr, first + r, index)))
+         batch_set_null (col, n + r);
+   }
+
+   switch (col->type) {
+      case sqldb_col_TEXT:
+      case sqldb_col_BLOB:
+         for (uint32_t r=0; r<count; r++) {
+            uint32_t len = PQgetlength (pgr, first + r, index);
+            uint32_t offs = col->offsets[n + r];
+            memcpy (&col->bytes[offs], PQgetvalue (pgr, first + r, index),
+                    len);
+            col->offsets[n + r + 1] = offs + len;
+         }
+         return true;
+
+      case sqldb_col_DATETIME:
+         for (uint32_t r=0; r<count; r++) {
+            uint64_t u64 = 0;
+            if ((PQgetisnull (pgr, first + r, index))) {
+               u64 = 0;
+            } else if (binary) {
+               if (!(pgdb_binary_datetime (res, first + r, index, &u64)))
+                  return false;
+            } else {
+               u64 = convert_ISO8601_to_uint64 (PQgetvalue (pgr, first + r,
+                                                                 index));
+            }
+            ints[r] = u64;
+         }
+         return true;
+
+      default:
+         break;
+   }
+
+   if (!binary) {
+      for (uint32_t r=0; r<count; r++) {
+         ints[r] = strtoll (PQgetvalue (pgr, first + r, index), NULL, 10);
+      }
+      return true;
+   }
+
+   // The fixed-width binary types are decoded without any per-row
+   // dispatch.
+   Oid oid = PQftype (pgr, index);
+   int width = oid==PG_OID_INT8 ? 8
+             : oid==PG_OID_INT4 ? 4
+             : oid==PG_OID_INT2 ? 2 : 0;
+   if (!width) {
+      for (uint32_t r=0; r<count; r++) {
+         if (!(PQgetisnull (pgr, first + r, index))
+               && !(pgdb_binary_int (res, first + r, index, &ints[r])))
+            return false;
       }
+      return true;
+   }
 
-      free (stmt);
+   for (uint32_t r=0; r<count; r++) {
+      const unsigned char *v = (const unsigned char *)
+                                 PQgetvalue (pgr, first + r, index);
+      uint64_t u64 = PQgetlength (pgr, first + r, index)==width
+                   ? pg_get_u64 (v, width) : 0;
+      ints[r] = width==8 ? (int64_t)u64
+              : width==4 ? (int64_t)(int32_t)u64
+                         : (int64_t)(int16_t)u64;
    }
+
    return true;
 }
 
-static int sqlite_res_step (sqldb_res_t *res)
+static int64_t pgdb_fetch_batch (sqldb_res_t *res, sqldb_colbatch_t *cols,
+                                                   uint32_t ncols,
+                                                   uint32_t max_rows)
 {
-   int rc = sqlite3_step (res->sqlite_stmt);
-
-   if (rc==SQLITE_DONE)
-      return 0;
+   uint32_t n = 0;
 
-   if (rc!=SQLITE_ROW) {
-      res_seterr (res, sqlite3_errstr (rc));
+   if (ncols > (uint32_t)PQnfields (res->pgr)) {
+      res_err_printf (res, "Requested %u columns from %i\n", ncols,
+                           PQnfields (res->pgr));
       return -1;
    }
 
-   return 1;
-}
+   while (n < max_rows) {
+      int first = res->row_pending ? res->current_row : res->current_row + 1;
 
-static int pgdb_res_step (sqldb_res_t *res)
-{
-   return res->nrows - res->current_row ? 1 : 0;
-}
+      // Only a streaming result has more rows than those in hand.
+      if (first >= res->nrows) {
+         res->current_row = res->nrows - 1;
+         res->row_pending = false;
+         int rc = res_step (res);
+         if (rc==0)
+            break;
+         if (rc < 0)
+            return -1;
+         res->row_pending = true;
+         continue;
+      }
 
-int sqldb_res_step (sqldb_res_t *res)
-{
-   int ret = -1;
-   if (!res)
-      return ret;
+      uint32_t count = res->nrows - first;
+      if (count > max_rows - n)
+         count = max_rows - n;
+
+      // Only the rows whose values all fit are decoded.
+      for (uint32_t i=0; i<ncols; i++) {
+         if (!(batch_is_bytes (cols[i].type)))
+            continue;
+         size_t used = cols[i].offsets[n];
+         for (uint32_t r=0; r<count; r++) {
+            used += PQgetlength (res->pgr, first + r, i);
+            if (used > cols[i].bytes_len) {
+               count = r;
+               break;
+            }
+         }
+      }
 
-   switch (res->type) {
-      case sqldb_SQLITE:   ret = sqlite_res_step (res);  break;
-      case sqldb_POSTGRES: ret = pgdb_res_step (res);    break;
-      default:             ret = -1;                     break;
-   }
+      if (!count) {
+         res->current_row = first;
+         res->row_pending = true;
+         if (!n) {
+            res_err_printf (res, "A single row does not fit in the batch\n");
+            return -1;
+         }
+         break;
+      }
 
-   if (ret==-1) {
-      PROG_ERR ("sqldb_res error: %s\n", sqldb_res_lasterr (res));
+      for (uint32_t i=0; i<ncols; i++) {
+         if (!(pgdb_batch_column (res, &cols[i], i, first, count, n)))
+            return -1;
+      }
+
+      res->current_row = first + count - 1;
+      res->row_pending = false;
+      n += count;
    }
 
-   return ret;
+   return n;
 }
 
-static uint64_t convert_ISO8601_to_uint64 (const char *src)
+int64_t sqldb_res_fetch_batch (sqldb_res_t *res, sqldb_colbatch_t *cols,
+                                                 uint32_t ncols,
+                                                 uint32_t max_rows)
 {
-   struct tm tm;
+   int64_t ret = -1;
 
-   memset (&tm, 0, sizeof tm);
+   if (!res || !cols || !ncols || !max_rows)
+      return -1;
 
-   if ((sscanf (src, "%4d-%2d-%2d %2d:%2d:%2d", &tm.tm_year,
-                                                &tm.tm_mon,
-                                                &tm.tm_mday,
-                                                &tm.tm_hour,
-                                                &tm.tm_min,
-                                                &tm.tm_sec)) != 6)
-      return (uint64_t)-1;
+   if (!(batch_check (res, cols, ncols, max_rows)))
+      return -1;
 
-   tm.tm_year -= 1900;
-   tm.tm_mon -= 1;
+   switch (res->type) {
+      case sqldb_SQLITE:   ret = sqlite_fetch_batch (res, cols, ncols,
+                                                     max_rows);
+                           break;
 
-   return mktime (&tm);
-}
+      case sqldb_POSTGRES: ret = pgdb_fetch_batch (res, cols, ncols,
+                                                   max_rows);
+                           break;
 
-uint32_t sqlite_scan (sqldb_res_t *res, va_list *ap)
-{
-   uint32_t ret = 0;
+      default:             ret = -1;
+                           break;
+   }
 
-   if (!res)
-      return (uint32_t)-1;
+   for (uint32_t i=0; ret > 0 && i<ncols; i++) {
+      if (batch_is_bytes (cols[i].type))
+         res->stats_bytes += cols[i].offsets[ret] - cols[i].offsets[0];
+   }
+   if (ret >= 0)
+      stats_step (res, ret, ret==0);
 
-   sqlite3_stmt *stmt = res->sqlite_stmt;
+   return ret;
+}
 
-   sqldb_coltype_t coltype = va_arg (*ap, sqldb_coltype_t);
+/* *****************************************************************
+ * Struct mapping. A field map is compiled once from the caller's
+ * description of a struct and then used to decode every row of a result
+ * directly into an array of those structs. The array and all of its
+ * strings are returned in a single allocation: while the rows are being
+ * fetched each TEXT member holds the offset (plus one) of its string in a
+ * separate buffer, and the members are turned into pointers once the
+ * strings have been appended to the array.
+ */
 
-   int numcols = sqlite3_column_count (stmt);
+enum field_op_t {
+   FIELD_INT32,
+   FIELD_INT64,
+   FIELD_DATETIME,
+   FIELD_TEXT,
+};
 
-   while (coltype!=sqldb_col_UNKNOWN && numcols--) {
+struct field_t {
+   enum field_op_t op;
+   bool            is_unsigned;
+   uint32_t        column;
+   size_t          offset;
+};
 
-      void *dst = va_arg (*ap, void *);
-      uint32_t *blen;
-      const void *tmp;
-      char *tmpstring = NULL;
+struct sqldb_fieldmap_t {
+   size_t          struct_size;
+   uint32_t        ncolumns;      // One more than the highest column used
+   size_t          nfields;
+   struct field_t *fields;
+   unsigned char  *zero;          // A struct with every member zeroed
+};
 
-      switch (coltype) {
+sqldb_fieldmap_t *sqldb_fieldmap_new (size_t struct_size,
+                                      const sqldb_field_t *fields,
+                                      size_t nfields)
+{
+   sqldb_fieldmap_t *ret = NULL;
 
-         case sqldb_col_UNKNOWN:
-            res_err_printf (res, "Possibly corrupt stack");
-            // TODO: Store value in result
-            return (uint32_t)-1;
+   if (!struct_size || !fields || !nfields) {
+      PROG_ERR ("Invalid field map [%zu bytes, %zu fields]\n",
+                  struct_size, nfields);
+      return NULL;
+   }
 
+   for (size_t i=0; i<nfields; i++) {
+      size_t size = 0;
+      switch (fields[i].type) {
          case sqldb_col_UINT32:
-         case sqldb_col_INT32:
-            *(uint32_t *)dst = sqlite3_column_int (stmt, ret);
-            break;
-
-         case sqldb_col_DATETIME:
-            tmp = sqlite3_column_text (stmt, ret);
-            *(uint64_t *)dst = convert_ISO8601_to_uint64 (tmp);
-            if ((*(uint64_t *)dst) == (uint64_t)-1)
-               return (uint32_t)-1;
-            break;
-
+         case sqldb_col_INT32:      size = sizeof (int32_t);   break;
          case sqldb_col_UINT64:
          case sqldb_col_INT64:
-            *(uint64_t *)dst = sqlite3_column_int (stmt, ret);
-            break;
-
-         case sqldb_col_TEXT:
-            tmpstring = ((char *)sqlite3_column_text (stmt, ret));
-            *(char **)dst = lstr_dup (tmpstring ? tmpstring : "");
-            if (!(*(char **)dst)) {
-               SQLDB_OOM (sqlite3_column_text (stmt, ret));
-               return (uint32_t)-1;
-            }
-            break;
-
-         case sqldb_col_BLOB:
-            blen = va_arg (*ap, uint32_t *);
-            tmp = sqlite3_column_blob (stmt, ret);
-            *blen = sqlite3_column_bytes (stmt, ret);
-            *(void **)dst = malloc ((*blen));
-            if (!dst) {
-               SQLDB_OOM ("Blob type");
-               return (uint32_t)-1;
-            }
-            memcpy (*(void **)dst, tmp, *blen);
-            break;
+         case sqldb_col_DATETIME:   size = sizeof (int64_t);   break;
+         case sqldb_col_TEXT:       size = sizeof (char *);    break;
+         default:                   break;
+      }
+      if (!size || fields[i].size!=size
+                || fields[i].offset > struct_size - size) {
+         PROG_ERR ("Field %zu (column %u): unsupported type %u or size %zu "
+                   "at offset %zu\n", i, fields[i].column, fields[i].type,
+                   fields[i].size, fields[i].offset);
+         return NULL;
+      }
+   }
 
-         case sqldb_col_NULL:
-            res_err_printf (res, "Error: NULL type not supported\n");
-            // TODO: Store value in result
-            return (uint32_t)-1;
+   size_t fields_len = nfields * sizeof *ret->fields;
+   if (!(ret = sqldb_calloc (1, sizeof *ret + fields_len + struct_size))) {
+      SQLDB_OOM ("Field map");
+      return NULL;
+   }
 
+   ret->fields = (struct field_t *)&ret[1];
+   ret->zero = (unsigned char *)ret->fields + fields_len;
+   ret->struct_size = struct_size;
+   ret->nfields = nfields;
+
+   for (size_t i=0; i<nfields; i++) {
+      struct field_t *f = &ret->fields[i];
+      switch (fields[i].type) {
+         case sqldb_col_UINT32:     f->is_unsigned = true;
+                                    // Fallthrough
+         case sqldb_col_INT32:      f->op = FIELD_INT32;       break;
+         case sqldb_col_UINT64:     f->is_unsigned = true;
+                                    // Fallthrough
+         case sqldb_col_INT64:      f->op = FIELD_INT64;       break;
+         case sqldb_col_DATETIME:   f->op = FIELD_DATETIME;    break;
+         default:                   f->op = FIELD_TEXT;        break;
       }
-      coltype = va_arg (*ap, sqldb_coltype_t);
-      ret++;
+      f->column = fields[i].column;
+      f->offset = fields[i].offset;
+      if (f->column >= ret->ncolumns)
+         ret->ncolumns = f->column + 1;
    }
 
    return ret;
 }
 
-uint32_t pgdb_scan (sqldb_res_t *res, va_list *ap)
+void sqldb_fieldmap_del (sqldb_fieldmap_t *map)
 {
-   uint32_t ret = 0;
-
-   if (!res)
-      return (uint32_t)-1;
-
-   sqldb_coltype_t coltype = va_arg (*ap, sqldb_coltype_t);
+   sqldb_free (map);
+}
 
-   int numcols = PQnfields (res->pgr);
-   int index = 0;
+// Decodes an integer or DATETIME column of the current row; NULL is
+// decoded as zero.
+static bool field_int (sqldb_res_t *res, const struct field_t *field,
+                                         int64_t *dst)
+{
+   uint32_t index = field->column;
+   uint64_t u64 = 0;
+
+   *dst = 0;
+
+   if (res->type==sqldb_SQLITE) {
+      sqlite3_stmt *stmt = res->sqlite_stmt;
+      if ((sqlite3_column_type (stmt, index))==SQLITE_NULL)
+         return true;
+      if (field->op!=FIELD_DATETIME) {
+         *dst = sqlite3_column_int64 (stmt, index);
+         return true;
+      }
+      u64 = convert_ISO8601_to_uint64 ((const char *)
+                                       sqlite3_column_text (stmt, index));
+   } else {
+      int row = res->current_row;
+      const char *value = PQgetvalue (res->pgr, row, index);
+      bool binary = (PQfformat (res->pgr, index))==1;
+
+      if ((PQgetisnull (res->pgr, row, index)))
+         return true;
+
+      if (field->op!=FIELD_DATETIME) {
+         if (binary)
+            return pgdb_binary_int (res, row, index, dst);
+         if (field->is_unsigned
+               ? (sscanf (value, "%" SCNu64, &u64))==1
+               : (sscanf (value, "%" SCNi64, dst))==1) {
+            if (field->is_unsigned)
+               *dst = (int64_t)u64;
+            return true;
+         }
+         res_err_printf (res, "Column %u is not an integer [%s]\n",
+                              index, value);
+         return false;
+      }
 
-   while (coltype!=sqldb_col_UNKNOWN && numcols--) {
+      if (binary)
+         return pgdb_binary_datetime (res, row, index, (uint64_t *)dst);
+      u64 = convert_ISO8601_to_uint64 (value);
+   }
 
-      void *dst = va_arg (*ap, void *);
+   if (u64==(uint64_t)-1) {
+      res_err_printf (res, "Column %u is not a datetime\n", index);
+      return false;
+   }
 
-      int32_t  i32;
-      uint32_t u32;
-      int64_t  i64;
-      uint64_t u64;
+   *dst = (int64_t)u64;
+   return true;
+}
 
-      const char *value = PQgetvalue (res->pgr, res->current_row, index++);
-      if (!value)
-         return (uint32_t)-1;
+// Appends a TEXT column of the current row to the strings buffer and
+// stores its offset (plus one, or zero if the value is NULL) in dst.
+static bool field_text (sqldb_res_t *res, const struct field_t *field,
+                                          struct bulk_buf_t *strings,
+                                          uintptr_t *dst)
+{
+   sqldb_colview_t view;
+   char tmp[24];
 
-      switch (coltype) {
+   *dst = 0;
 
-         case sqldb_col_UNKNOWN:
-            res_err_printf (res, "Possibly corrupt stack");
-            // TODO: Store value in result
-            return (uint32_t)-1;
+   if (!(sqldb_res_column_view (res, field->column, &view)))
+      return false;
 
-         case sqldb_col_UINT32:
-            if ((sscanf (value, "%u", &u32))!=1)
-               return (uint32_t)-1;
-            *(uint32_t *)dst = u32;
-            break;
+   if (view.is_null)
+      return true;
 
-         case sqldb_col_INT32:
-            if ((sscanf (value, "%i", &i32))!=1)
-               return (uint32_t)-1;
-            *(uint32_t *)dst = i32;
-            break;
+   // Binary postgres integers are converted to text, as when scanned.
+   if (res->type==sqldb_POSTGRES
+         && (PQfformat (res->pgr, field->column))==1
+         && !(pg_oid_is_text (PQftype (res->pgr, field->column)))) {
+      int64_t i64;
+      if (!(pgdb_binary_int (res, res->current_row, field->column, &i64)))
+         return false;
+      view.len = snprintf (tmp, sizeof tmp, "%" PRIi64, i64);
+      view.ptr = tmp;
+   }
 
-         case sqldb_col_UINT64:
-            if ((sscanf (value, "%" PRIu64, &u64))!=1)
-               return (uint32_t)-1;
-            *(uint32_t *)dst = u64;
-            break;
+   *dst = strings->len + 1;
+   return bulk_buf_put (strings, view.ptr, view.len)
+          && bulk_buf_putc (strings, 0);
+}
 
-         case sqldb_col_INT64:
-            if ((sscanf (value, "%" PRIu64, &i64))!=1)
-               return (uint32_t)-1;
-            *(uint32_t *)dst = i64;
-            break;
+int64_t sqldb_res_fetch_structs (sqldb_res_t *res,
+                                 const sqldb_fieldmap_t *map,
+                                 void **dst)
+{
+   bool error = true;
+   struct bulk_buf_t rows = { 0 };
+   struct bulk_buf_t strings = { 0 };
+   int64_t nrows = 0;
+   int rc;
 
-         case sqldb_col_TEXT:
-            if ((*(char **)dst = lstr_dup (value))==NULL)
-               return (uint32_t)-1;
-            break;
+   if (!res || !map || !dst)
+      return -1;
 
-         case sqldb_col_DATETIME:
-            *(uint64_t *)dst = convert_ISO8601_to_uint64 (value);
-            if ((*(uint64_t *)dst) == (uint64_t)-1)
-               return (uint32_t)-1;
-            break;
+   *dst = NULL;
 
-         case sqldb_col_BLOB:
-            res_err_printf (res, "Error: BLOB type not supported\n");
-            // TODO: Store value in result
-            return (uint32_t)-1;
+   uint32_t ncolumns = res->type==sqldb_SQLITE
+                     ? (uint32_t)sqlite3_column_count (res->sqlite_stmt)
+                     : (uint32_t)PQnfields (res->pgr);
+   if (map->ncolumns > ncolumns) {
+      res_err_printf (res, "Field map requires %u columns, result has %u\n",
+                           map->ncolumns, ncolumns);
+      goto errorexit;
+   }
 
-         case sqldb_col_NULL:
-            res_err_printf (res, "Error: NULL type not supported\n");
-            // TODO: Store value in result
-            return (uint32_t)-1;
+   while ((rc = sqldb_res_step (res))==1) {
+      if (!(bulk_buf_put (&rows, map->zero, map->struct_size)))
+         goto errorexit;
 
+      unsigned char *row = (unsigned char *)&rows.data[rows.len
+                                                       - map->struct_size];
+      for (size_t i=0; i<map->nfields; i++) {
+         const struct field_t *field = &map->fields[i];
+         unsigned char *member = row + field->offset;
+         int64_t i64;
+         uintptr_t offs;
+
+         switch (field->op) {
+            case FIELD_INT32:
+               if (!(field_int (res, field, &i64)))
+                  goto errorexit;
+               int32_t i32 = (int32_t)i64;
+               memcpy (member, &i32, sizeof i32);
+               break;
+
+            case FIELD_INT64:
+            case FIELD_DATETIME:
+               if (!(field_int (res, field, &i64)))
+                  goto errorexit;
+               memcpy (member, &i64, sizeof i64);
+               break;
+
+            case FIELD_TEXT:
+               if (!(field_text (res, field, &strings, &offs)))
+                  goto errorexit;
+               memcpy (member, &offs, sizeof offs);
+               break;
+         }
       }
-      coltype = va_arg (*ap, sqldb_coltype_t);
-      ret++;
+      nrows++;
    }
 
-   res->current_row++;
-   return ret;
-}
-
-uint32_t sqldb_scan_columns (sqldb_res_t *res, ...)
-{
-   uint32_t ret = 0;
-   va_list ap;
+   if (rc < 0 || !nrows)
+      goto done;
 
-   va_start (ap, res);
-   ret = sqldb_scan_columnsv (res, &ap);
-   va_end (ap);
+   char *block = sqldb_realloc (rows.data, rows.len + strings.len);
+   if (!block) {
+      SQLDB_OOM ("Struct rows");
+      goto errorexit;
+   }
+   rows.data = block;
+
+   char *strbase = block + rows.len;
+   if (strings.len)
+      memcpy (strbase, strings.data, strings.len);
+
+   for (int64_t r=0; r<nrows; r++) {
+      unsigned char *row = (unsigned char *)block + r * map->struct_size;
+      for (size_t i=0; i<map->nfields; i++) {
+         if (map->fields[i].op!=FIELD_TEXT)
+            continue;
+         uintptr_t offs;
+         memcpy (&offs, row + map->fields[i].offset, sizeof offs);
+         char *ptr = offs ? strbase + offs - 1 : NULL;
+         memcpy (row + map->fields[i].offset, &ptr, sizeof ptr);
+      }
+   }
 
-   return ret;
-}
+   *dst = block;
+   rows.data = NULL;
 
-uint32_t sqldb_scan_columnsv (sqldb_res_t *res, va_list *ap)
-{
-   uint32_t ret = (uint32_t)-1;
+done:
+   error = rc < 0;
 
-   switch (res->type) {
-      case sqldb_SQLITE:   ret = sqlite_scan (res, ap);  break;
-      case sqldb_POSTGRES: ret = pgdb_scan (res, ap);    break;
-      default:             ret = (uint32_t)-1;           break;
-   }
+errorexit:
+   sqldb_free (rows.data);
+   sqldb_free (strings.data);
 
-   return ret;
+   return error ? -1 : nrows;
 }
 
 uint32_t sqldb_exec_and_fetch (sqldb_t *db, const char *query, ...)
@@ -1425,6 +7246,9 @@ uint32_t sqldb_exec_and_fetch (sqldb_t *db, const char *query, ...)
       goto errorexit;
    }
 
+   // The values outlive the result, so they are never placed in its
+   // arena.
+   res->arena.enabled = false;
    ret = sqldb_scan_columnsv (res, &ap);
 
 errorexit:
@@ -1439,17 +7263,17 @@ void sqldb_res_del (sqldb_res_t *res)
    if (!res)
       return;
 
-   sqldb_res_clearerr (res);
+   res_release (res);
+   arena_free (&res->arena);
+   sqldb_free (res);
+}
 
-   switch (res->type) {
-      case sqldb_SQLITE:   sqlite3_finalize (res->sqlite_stmt);         break;
-      case sqldb_POSTGRES: PQclear (res->pgr);                          break;
-      default:             res_err_printf (res, "(%i) Unknown type\n",
-                                                res->type);
-                           // TODO: Store value in result
-                           break;
-   }
-   free (res);
+void sqldb_res_reset (sqldb_res_t *res)
+{
+   if (!res)
+      return;
+
+   res_release (res);
 }
 
 void sqldb_print (sqldb_t *db, FILE *outf)
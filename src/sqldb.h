@@ -19,6 +19,7 @@
 
 typedef struct sqldb_t sqldb_t;
 typedef struct sqldb_res_t sqldb_res_t;
+typedef struct sqldb_tmpl_t sqldb_tmpl_t;
 
 typedef enum {
    sqldb_UNKNOWN = 0,
@@ -38,6 +39,217 @@ typedef enum {
    sqldb_col_NULL
 } sqldb_coltype_t;
 
+// A borrowed view of a single column in the current row of a result. The
+// memory belongs to the result; see sqldb_res_column_view().
+typedef struct {
+   const char *ptr;        // The value, or NULL if the value is NULL
+   size_t      len;        // The length of the value in bytes
+   bool        is_null;    // True if the value is NULL
+} sqldb_colview_t;
+
+// A single parameter for sqldb_exec_params(). The value is held in the
+// struct: integers in the member of v that matches the type, a DATETIME
+// (seconds since the epoch) in v.i64, and a TEXT (nul-terminated) or BLOB
+// value as a pointer in v.ptr, with the length of a BLOB in len.
+//
+// TEXT and BLOB values are copied by sqlite unless flags includes
+// sqldb_PARAM_BORROWED, in which case the data must remain valid and
+// unchanged until the result is deleted. Postgres never copies them.
+typedef struct {
+   sqldb_coltype_t type;
+   uint32_t        flags;  // sqldb_PARAM_* flags
+   uint32_t        len;    // The length of a BLOB in bytes
+   union {
+      int32_t      i32;
+      uint32_t     u32;
+      int64_t      i64;
+      uint64_t     u64;
+      const void  *ptr;
+   } v;
+} sqldb_param_t;
+
+// A single column of a batch of rows, see sqldb_res_fetch_batch(). All
+// the arrays are provided by the caller.
+typedef struct {
+   sqldb_coltype_t type;   // The type to decode the column as
+   int64_t   *ints;        // Integer and DATETIME values, one per row
+   uint32_t  *offsets;     // TEXT and BLOB values, one more than the rows:
+   char      *bytes;       //    row i is bytes[offsets[i]..offsets[i+1])
+   size_t     bytes_len;   // The size of the bytes array
+   uint8_t   *nulls;       // Optional bitmap, bit (i%8) of byte (i/8) set
+                           //    if the value in row i is NULL
+} sqldb_colbatch_t;
+
+// Describes one member of a caller's struct that receives a column of a
+// result, see sqldb_fieldmap_new(). The member must be exactly the size
+// of the type: int32_t or uint32_t for the 32-bit types, int64_t or
+// uint64_t for the 64-bit types and DATETIME, and char * for TEXT.
+typedef struct {
+   uint32_t        column; // The index of the column in the result
+   sqldb_coltype_t type;   // The type to decode the column as
+   size_t          offset; // offsetof() the member
+   size_t          size;   // sizeof the member
+} sqldb_field_t;
+
+typedef struct sqldb_fieldmap_t sqldb_fieldmap_t;
+
+// Reads the next row for sqldb_bulk_load(). The reader stores a pointer to
+// each of the ncols fields in fields[] and its length in lens[]; a NULL
+// pointer is a NULL value. The fields are text and must remain valid until
+// the reader is next called. Returns 1 when a row was read, 0 at the end
+// of the input and -1 to abort the load.
+typedef int (sqldb_bulk_reader_t) (void *ctx, size_t ncols,
+                                   const char **fields, size_t *lens);
+
+// Reports the progress of sqldb_bulk_load().
+typedef void (sqldb_bulk_progress_t) (void *ctx, uint64_t nrows,
+                                      double rows_per_sec);
+
+// The source of the rows for sqldb_bulk_load(): either a reader or a
+// FILE * of delimited text. In delimited text a field may be quoted with
+// '"' to include the delimiter, newlines or doubled quotes, and an empty
+// unquoted field is NULL.
+typedef struct {
+   sqldb_bulk_reader_t   *reader;        // Reads the rows, or NULL to use inf
+   void                  *reader_ctx;
+   FILE                  *inf;           // Delimited text
+   char                   delim;         // ',' (the default) or '\t'
+   bool                   header;        // Skip the first record of inf
+   sqldb_bulk_progress_t *progress;      // Optional progress callback
+   void                  *progress_ctx;
+   uint64_t               progress_rows; // Rows between progress reports
+} sqldb_bulk_src_t;
+
+// The locking mode (sqlite) or isolation level (postgres) of a transaction,
+// see sqldb_tx_begin().
+typedef enum {
+   sqldb_tx_DEFAULT = 0,
+   sqldb_tx_DEFERRED,         // sqlite: locks are taken on first use
+   sqldb_tx_IMMEDIATE,        // sqlite: the write lock is taken at once
+   sqldb_tx_EXCLUSIVE,        // sqlite: readers are locked out as well
+   sqldb_tx_READ_COMMITTED,   // postgres isolation levels
+   sqldb_tx_REPEATABLE_READ,
+   sqldb_tx_SERIALIZABLE,
+} sqldb_txmode_t;
+
+// The body of a transaction run by sqldb_tx_retry(). Returns false to roll
+// back the transaction.
+typedef bool (sqldb_tx_fn_t) (sqldb_t *db, void *ctx);
+
+typedef enum {
+   sqldb_poll_FAILED = -1, // Connection failed
+   sqldb_poll_OK = 0,      // Connection is complete
+   sqldb_poll_READ,        // Waiting for the socket to become readable
+   sqldb_poll_WRITE,       // Waiting for the socket to become writable
+} sqldb_poll_t;
+
+// Options for opening a sqlite connection, see sqldb_open_ex(). A zeroed
+// struct leaves every setting at the sqlite default. Postgres connections
+// ignore these options.
+typedef struct {
+   const char *journal_mode;     // "WAL", "DELETE", "TRUNCATE", "MEMORY", ...
+   const char *synchronous;      // "OFF", "NORMAL", "FULL" or "EXTRA"
+   const char *temp_store;       // "DEFAULT", "FILE" or "MEMORY"
+   int64_t     mmap_size;        // Bytes of the file to memory-map
+   int64_t     cache_size;       // Page cache: pages if positive, KiB if
+                                 //    negative
+   uint32_t    busy_timeout_ms;  // How long to wait for a locked database
+   bool        readonly;         // Open the database read-only
+   bool        nomutex;          // The connection is only ever used by one
+                                 //    thread at a time
+} sqldb_opts_t;
+
+// Reports the progress of sqldb_batchfile_ex(): the statements executed
+// and the bytes of the file consumed so far, and the size of the file (or
+// zero if the size is not known).
+typedef void (sqldb_batchfile_progress_t) (void *ctx, uint64_t nstmts,
+                                           uint64_t nbytes,
+                                           uint64_t total_bytes);
+
+// Options for sqldb_batchfile_ex(). A zeroed struct gives the behaviour of
+// sqldb_batchfile().
+typedef struct {
+   bool                        transaction;    // Run the file in a single
+                                               //    transaction
+   sqldb_batchfile_progress_t *progress;       // Optional progress callback
+   void                       *progress_ctx;
+   uint64_t                    progress_stmts; // Statements between reports
+} sqldb_batchfile_opts_t;
+
+// Statement counters, see sqldb_stats_counters().
+typedef struct {
+   uint64_t  nqueries;     // Statements executed
+   uint64_t  nerrors;      // Statements that failed to execute
+   uint64_t  nprepares;    // Statements prepared (statement cache misses)
+   uint64_t  nrows;        // Rows stepped through
+   uint64_t  nbytes;       // Bytes scanned as TEXT or BLOB, viewed with
+                           //    sqldb_res_column_view() or fetched in
+                           //    batches
+} sqldb_counters_t;
+
+// The phases of a statement that are timed. Every phase is timed from the
+// start of the call to the sqldb_exec() function.
+typedef enum {
+   sqldb_TIMING_PREPARE = 0,  // Preparing the statement (cache misses only)
+   sqldb_TIMING_EXECUTE,      // Returning from the sqldb_exec() function
+   sqldb_TIMING_FIRST_ROW,    // The first sqldb_res_step()
+   sqldb_TIMING_DRAIN,        // The sqldb_res_step() that found no more rows
+   sqldb_TIMING_COUNT
+} sqldb_timing_t;
+
+// A latency histogram in microseconds. Each power of two is divided into
+// 8 buckets, so the values are recorded to within 12.5%; values of over
+// 2^35us are recorded in the last bucket.
+#define sqldb_HIST_NBUCKETS      (272)
+
+typedef struct {
+   uint64_t  count;
+   uint64_t  total_us;
+   uint64_t  max_us;
+   uint64_t  buckets[sqldb_HIST_NBUCKETS];
+} sqldb_hist_t;
+
+// The statistics for all the statements with the same query string, or
+// with the same tag (see sqldb_stats_tag()).
+typedef struct {
+   const char       *label;   // See sqldb_stats_label(), or the query
+   const char       *query;   // The query, or the tag
+   sqldb_counters_t  counters;
+   sqldb_hist_t      timings[sqldb_TIMING_COUNT];
+} sqldb_stats_entry_t;
+
+typedef struct {
+   sqldb_counters_t     totals;
+   size_t               nentries;
+   sqldb_stats_entry_t *entries;
+} sqldb_stats_t;
+
+// A statement that ran for longer than the threshold given to
+// sqldb_set_trace().
+typedef struct {
+   const char *query;      // The statement, see sqldb_set_trace()
+   const char *params;     // The parameters, e.g. "$1=42 $2='bob'", or
+                           //    NULL (see sqldb_set_trace())
+   uint64_t    elapsed_us; // The time taken by the statement
+} sqldb_trace_t;
+
+typedef void (sqldb_trace_fn_t) (sqldb_t *db, const sqldb_trace_t *trace,
+                                 void *ctx);
+
+// Connection flags, see sqldb_flags_set().
+#define sqldb_FLAG_STREAMING     (0x00000001)
+#define sqldb_FLAG_BINARY        (0x00000002)
+#define sqldb_FLAG_ARENA         (0x00000004)
+
+// Parameter flags, see sqldb_param_t.
+#define sqldb_PARAM_BORROWED     (0x00000001)
+
+// Allocator hooks, see sqldb_set_allocator(). Each is called with the
+// context that was registered with it.
+typedef void *(sqldb_malloc_fn_t) (void *ctx, size_t len);
+typedef void *(sqldb_realloc_fn_t) (void *ctx, void *ptr, size_t len);
+typedef void (sqldb_free_fn_t) (void *ctx, void *ptr);
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -48,6 +260,33 @@ extern "C" {
    // Return random bytes
    void sqldb_random_bytes (void *dst, size_t len);
 
+   // Replaces the allocator used by the library (including the sqldb_auth,
+   // sqldb_pool and sqldb_worker modules) and by sqlite. This must be
+   // called before any other function in the library, and in particular
+   // before any connection is opened. Passing NULL for all three functions
+   // restores the system allocator. Returns false if the functions are
+   // incomplete, if sqlite refused them, or if any connection is open or
+   // any memory allocated by the library has not been freed.
+   //
+   // Postgres connections and the results that they receive are
+   // allocated by libpq, which cannot be given an allocator.
+   //
+   // Memory that the library returns to the caller to be freed (strings
+   // from sqldb_scan_columns(), arrays from sqldb_res_fetch_structs(),
+   // etc.) must be freed with sqldb_free() when an allocator has been set.
+   bool sqldb_set_allocator (sqldb_malloc_fn_t *malloc_fn,
+                             sqldb_realloc_fn_t *realloc_fn,
+                             sqldb_free_fn_t *free_fn,
+                             void *ctx);
+
+   // Allocate and free memory using the allocator set with
+   // sqldb_set_allocator(). These behave as their standard library
+   // counterparts do.
+   void *sqldb_malloc (size_t len);
+   void *sqldb_calloc (size_t nmemb, size_t len);
+   void *sqldb_realloc (void *ptr, size_t len);
+   void sqldb_free (void *ptr);
+
 
    // When type==sqlite:      Creates a new sqlite3 database using dbname
    //                         as the filename. The db parameter is ignored.
@@ -59,14 +298,248 @@ extern "C" {
    // NULL on error.
    sqldb_t *sqldb_open (const char *dbname, sqldb_dbtype_t type);
 
+   // Fills opts with the options used by sqldb_open(), which are tuned for
+   // servers: WAL journal mode, synchronous=NORMAL, in-memory temporary
+   // tables, a 256MiB memory map, a 64MiB page cache and a 5s busy
+   // timeout. The connection keeps sqlite's serialized threading mode;
+   // callers that never use a connection from two threads at once may set
+   // nomutex to skip the per-call locking.
+   void sqldb_opts_default (sqldb_opts_t *opts);
+
+   // Identical to sqldb_open(), except that the sqlite connection is opened
+   // with the specified options. When opts is NULL the defaults from
+   // sqldb_opts_default() are used.
+   sqldb_t *sqldb_open_ex (const char *dbname, sqldb_dbtype_t type,
+                           const sqldb_opts_t *opts);
+
+   // Starts opening a connection to the database without blocking, so
+   // that multiple connections can be established in parallel. Returns
+   // NULL on error. The connection must not be used until
+   // sqldb_open_poll() returns sqldb_poll_OK.
+   //
+   // For sqlite the database is opened immediately (as with sqldb_open()).
+   sqldb_t *sqldb_open_start (const char *dbname, sqldb_dbtype_t type);
+
+   // Advances a connection started with sqldb_open_start() without
+   // blocking. Returns sqldb_poll_OK when the connection is ready for
+   // use, sqldb_poll_FAILED when the connection failed (the caller must
+   // still call sqldb_close()) or one of sqldb_poll_READ/sqldb_poll_WRITE
+   // to indicate what the caller should wait for on sqldb_socket() before
+   // calling this function again.
+   sqldb_poll_t sqldb_open_poll (sqldb_t *db);
+
+   // Returns the socket used by the connection, or -1 if the connection
+   // has no socket (sqlite).
+   int sqldb_socket (sqldb_t *db);
+
+   // Sends a query without waiting for its result, so that a connection
+   // can be serviced from an event loop. The query and parameters are the
+   // same as for sqldb_exec() and sqldb_exec_params(). Returns false if
+   // the query could not be sent.
+   //
+   // After sending, the caller calls sqldb_consume() whenever the socket
+   // (see sqldb_socket()) is ready, until it returns sqldb_poll_OK, and
+   // then retrieves the result with sqldb_result(). Only a single query
+   // may be outstanding on a connection, and no other statement may be
+   // executed on the connection until its result has been retrieved.
+   //
+   // The result of a postgres query is received in its entirety; the
+   // sqldb_FLAG_STREAMING flag is ignored. A sqlite query is executed by
+   // sqldb_send() itself.
+   bool sqldb_send (sqldb_t *db, const char *query, ...);
+   bool sqldb_sendv (sqldb_t *db, const char *query, va_list *ap);
+   bool sqldb_send_params (sqldb_t *db, const char *query,
+                           const sqldb_param_t *params, size_t nparams);
+
+   // Reads whatever is available of the result of a query sent with
+   // sqldb_send(), without blocking. Returns sqldb_poll_OK when the result
+   // is ready for sqldb_result(), sqldb_poll_READ or sqldb_poll_WRITE to
+   // indicate what the caller should wait for on sqldb_socket() before
+   // calling this function again, or sqldb_poll_FAILED if the result
+   // could not be received (in which case there is no result to
+   // retrieve).
+   sqldb_poll_t sqldb_consume (sqldb_t *db);
+
+   // Retrieves the result of a query sent with sqldb_send() once
+   // sqldb_consume() has returned sqldb_poll_OK. The result is used in the
+   // same way as a result from sqldb_exec(). Returns NULL if the query
+   // failed, with the error available from sqldb_lasterr().
+   sqldb_res_t *sqldb_result (sqldb_t *db);
+
+   // Checks that the connection is still usable and returns it to a
+   // clean state by rolling back any transaction that was left open.
+   // Returns false if the connection is broken and must be closed.
+   bool sqldb_healthcheck (sqldb_t *db);
+
    // Get the database type of the specified database object. Returns
    // sqldb_UNKNOWN on error.
    sqldb_dbtype_t sqldb_type (sqldb_t *db);
 
+   // Sets or clears the specified flags on the connection and returns the
+   // flags that were in effect before the call. sqldb_flags() returns the
+   // flags currently in effect. The flags are:
+   //
+   // sqldb_FLAG_STREAMING: Results for postgres queries are received from
+   //    the server as the caller steps through them, instead of the entire
+   //    result being buffered in memory before sqldb_exec() returns. This
+   //    keeps the memory used for large results constant. While a
+   //    streaming result still has rows to be read no other statement can
+   //    be executed on the connection; the caller must step through all
+   //    the rows or delete the result first. Errors that occur after the
+   //    first row are reported by sqldb_res_step() returning -1. This flag
+   //    has no effect on sqlite, which always steps through results.
+   //
+   // sqldb_FLAG_BINARY: Results for postgres queries are received in the
+   //    binary format and decoded directly according to the column types
+   //    passed to sqldb_scan_columns(), instead of being parsed from text.
+   //    Integer (including boolean and oid), timestamp, bytea and text
+   //    columns are supported; a column of any other type can only be
+   //    scanned in text mode. This flag has no effect on sqlite.
+   //
+   // sqldb_FLAG_ARENA: Results are allocated together with an arena, and
+   //    the TEXT and BLOB values scanned from them with
+   //    sqldb_scan_columns() are placed in that arena instead of being
+   //    malloced individually. These values belong to the result: the
+   //    caller must not free them, and they remain valid only until the
+   //    result is reset or deleted. The flag is taken from the connection
+   //    when the result is created and is kept when the result is reused
+   //    with sqldb_res_exec(). It has no effect on
+   //    sqldb_exec_and_fetch(), whose values outlive the result.
+   uint32_t sqldb_flags (sqldb_t *db);
+   uint32_t sqldb_flags_set (sqldb_t *db, uint32_t flags);
+   uint32_t sqldb_flags_clear (sqldb_t *db, uint32_t flags);
+
    // Close the connection to the database. All resources will be freed
    // except existing sqldb_res_t objects.
    void sqldb_close (sqldb_t *db);
 
+   // Each connection keeps a cache of prepared statements, keyed on the
+   // query string passed to the exec functions, so that repeated queries
+   // are not parsed and planned on every execution. For sqlite the
+   // statement handles are reset and reused; for postgres named
+   // server-side prepared statements are used, one for each set of
+   // parameter types that the query is executed with. Postgres statements
+   // evicted from the cache are deallocated on the server once the
+   // connection is next used outside of a transaction.
+   //
+   // Sets the maximum number of statements kept in the cache for this
+   // connection and returns the previous maximum. The cache is emptied
+   // by this call. A size of zero disables the cache. The default is 32.
+   size_t sqldb_stmt_cache_size (sqldb_t *db, size_t nstmts);
+
+   // Retrieves the number of cache hits, cache misses and the number of
+   // statements currently in the cache. Any of the destination pointers
+   // may be NULL.
+   void sqldb_stmt_cache_stats (sqldb_t *db, uint64_t *hits,
+                                             uint64_t *misses,
+                                             size_t   *nstmts);
+
+   // Statement statistics are collected for the statements executed with
+   // the sqldb_exec() family of functions (including the _ignore(),
+   // _and_fetch(), template and sqldb_res_exec() variants) on all
+   // connections. Pipelines, sqldb_exec_many(), sqldb_bulk_load() and
+   // postgres queries sent with sqldb_send() are not included.
+   //
+   // Enables or disables the collection of statistics and returns the
+   // previous setting. Collection is disabled by default, as every
+   // statement then updates counters shared by all threads.
+   bool sqldb_stats_enable (bool enable);
+
+   // Records the statements executed with exactly the query string query
+   // under label instead of under the query string, e.g. to name the
+   // queries of an application. Only the first label for a query is
+   // kept. Labels can only be set while statistics are enabled. Returns
+   // false if statistics are disabled or the statistics table is full.
+   //
+   // The table holds 512 distinct query strings (and tags) and entries
+   // are never removed; once it is full the statements of new queries
+   // are only counted in the totals. Applications that build their query
+   // strings should tag them with sqldb_stats_tag() instead.
+   bool sqldb_stats_label (const char *query, const char *label);
+
+   // Records every statement subsequently executed on the connection
+   // under tag instead of under its query string, until the tag is
+   // replaced or removed with a NULL tag. Returns false if the tag could
+   // not be copied.
+   bool sqldb_stats_tag (sqldb_t *db, const char *tag);
+
+   // Retrieves the counters for a single connection or, when db is NULL,
+   // the totals for all connections. Results can outlive their
+   // connections, so rows and bytes are only counted in the totals.
+   void sqldb_stats_counters (sqldb_t *db, sqldb_counters_t *dst);
+
+   // Retrieves a snapshot of the totals and of the statistics for every
+   // query that has been executed. The snapshot and its strings are in a
+   // single allocation that the caller must free with sqldb_free().
+   // Returns NULL on error.
+   sqldb_stats_t *sqldb_stats_snapshot (void);
+
+   // Zeroes the counters for the connection or, when db is NULL, the
+   // totals and the statistics for every query. Labels are kept.
+   void sqldb_stats_reset (sqldb_t *db);
+
+   // Returns the latency (in microseconds) that the specified percentage
+   // (from 0 to 100) of the values in the histogram were at or below.
+   uint64_t sqldb_hist_percentile (const sqldb_hist_t *hist, double pct);
+
+   // Writes a readable summary of the snapshot to outf (or stdout when
+   // outf is NULL), one block of lines for each query, with the count,
+   // mean, p50, p90, p99 and maximum for each timing.
+   void sqldb_stats_dump (const sqldb_stats_t *stats, FILE *outf);
+
+   // Sets a function that is called with ctx for every statement on the
+   // connection that takes threshold_us microseconds or more, replacing
+   // any previous one; a NULL fn removes it. The function is called on the
+   // thread that ran the statement, and the trace is only valid for the
+   // duration of the call.
+   //
+   // For sqlite the time is measured by sqlite itself (see
+   // SQLITE_TRACE_PROFILE) from the first step of a statement until it is
+   // finished or reset, and every statement on the connection is traced.
+   // The query is the statement as prepared, with the values of the
+   // parameters substituted into it, so params is always NULL.
+   //
+   // For postgres the time is measured around the execution of the
+   // statements executed with the sqldb_exec() family of functions, until
+   // the (first) result is received. The query is the string that was
+   // passed to the function.
+   //
+   // When redact is set the values of the parameters are not included in
+   // the trace, as they may contain passwords or personal details: the
+   // sqlite query is passed as it was written and the postgres params hold
+   // only the types of the parameters.
+   //
+   // Returns false on error.
+   bool sqldb_set_trace (sqldb_t *db, sqldb_trace_fn_t *fn, void *ctx,
+                                      uint64_t threshold_us, bool redact);
+
+   // The timeline records the spans of time spent in the library, so that
+   // they can be viewed on a timeline in a trace viewer (chrome://tracing,
+   // Perfetto, etc). The spans that are recorded are opening connections,
+   // executing, preparing, binding, stepping, scanning, committing and
+   // every sqldb_auth function (with its hashing and updates), each with
+   // the thread that it ran on. The spans are kept in a ring buffer, so
+   // only the most recent ones are kept.
+   //
+   // Enables the timeline with room for nspans spans, or disables it when
+   // nspans is zero. Recorded spans are discarded. This must not be
+   // called while other threads are using the library. Returns false on
+   // error, in which case the timeline is disabled.
+   bool sqldb_timeline_enable (size_t nspans);
+
+   // Writes the recorded spans to outf (or stdout when outf is NULL) in
+   // the Chrome trace-event JSON format, oldest first. Spans that are
+   // being recorded while the timeline is written may be left out.
+   // Returns false on error.
+   bool sqldb_timeline_dump (FILE *outf);
+
+   // Records spans for the timeline from other modules. The start returned
+   // by sqldb_span_begin() is zero when the timeline is disabled. The
+   // category and name must be string literals, or at least remain valid
+   // until the timeline is disabled.
+   uint64_t sqldb_span_begin (void);
+   void sqldb_span_end (const char *cat, const char *name, uint64_t start);
+
    // Return a description of the last error that occurred. The caller
    // must not free this string. NULL will be returned if no
    // error message is available.
@@ -102,7 +575,15 @@ extern "C" {
    // database. See explanation of tuple format in scan_columns below.
    //
    // Parameters in querystring are of the format "#n" where n is the
-   // number of the parameter.
+   // number of the parameter. A '#' within a string literal or a comment
+   // is not a parameter. See also sqldb_tmpl_new() below.
+   //
+   // The parameter for a BLOB is a pointer to the pointer to the data,
+   // followed by an extra (uint32_t *) for the length of the data. The
+   // parameter for a DATETIME is the number of seconds since the epoch.
+   // On postgres integer, DATETIME and BLOB parameters are sent in the
+   // binary format as int4 (32-bit), int8 (64-bit), timestamptz and
+   // bytea respectively; TEXT parameters are typed by the server.
    //
    // Returns a result object (that may be empty if the query returned no
    // results) on success or NULL on error.
@@ -118,6 +599,187 @@ extern "C" {
    uint64_t sqldb_exec_ignore (sqldb_t *db, const char *query, ...);
    uint64_t sqldb_exec_ignorev (sqldb_t *db, const char *query, va_list *ap);
 
+   // Identical to sqldb_exec() and sqldb_exec_ignore(), except that the
+   // nparams parameters are given as an array rather than as variadic
+   // tuples. This is the form to use from other languages, and it
+   // executes a statement with up to 16 parameters without allocating
+   // memory for them. The variadic functions collect their tuples into
+   // such an array and then execute it.
+   sqldb_res_t *sqldb_exec_params (sqldb_t *db, const char *query,
+                                   const sqldb_param_t *params,
+                                   size_t nparams);
+   uint64_t sqldb_exec_params_ignore (sqldb_t *db, const char *query,
+                                      const sqldb_param_t *params,
+                                      size_t nparams);
+
+   // Begin a transaction. The mode is a sqlite locking mode or a postgres
+   // isolation level; sqlite transactions are always serializable so the
+   // isolation levels begin a deferred transaction, and postgres has no
+   // locking modes so those begin a transaction at the default isolation
+   // level.
+   //
+   // When a transaction started by this function is already open, a
+   // savepoint is created instead (and mode is ignored), so calls may be
+   // nested. Every successful sqldb_tx_begin() must be matched by a call to
+   // sqldb_tx_commit() or sqldb_tx_rollback(), which end the innermost
+   // savepoint or, at the outermost level, the transaction.
+   //
+   // Statements executed between sqldb_tx_begin() and sqldb_tx_commit()
+   // share a single commit, and hence on sqlite a single fsync.
+   bool sqldb_tx_begin (sqldb_t *db, sqldb_txmode_t mode);
+   bool sqldb_tx_commit (sqldb_t *db);
+   bool sqldb_tx_rollback (sqldb_t *db);
+
+   // Returns the number of sqldb_tx_begin() calls still open, which is
+   // zero when no transaction is open.
+   uint32_t sqldb_tx_depth (sqldb_t *db);
+
+   // Run fn in a transaction and commit it. When fn or the commit fails
+   // because of contention (SQLITE_BUSY/SQLITE_LOCKED on sqlite, or a
+   // serialization failure or deadlock on postgres) the transaction is
+   // rolled back and run again, after an increasing delay, up to a total
+   // of max_attempts times. Any other failure rolls back the transaction
+   // and is returned immediately.
+   //
+   // When called within a transaction fn is run in a savepoint and is
+   // never retried, as the contention aborts the enclosing transaction.
+   bool sqldb_tx_retry (sqldb_t *db, sqldb_txmode_t mode,
+                        uint32_t max_attempts,
+                        sqldb_tx_fn_t *fn, void *ctx);
+
+   // Execute a single statement once for every row of a set of column
+   // arrays. Each parameter is given as a tuple of the type and an array
+   // of nrows elements of that type (uint32_t[], int64_t[], const char *[],
+   // etc). A BLOB parameter takes a further array of uint32_t lengths, and
+   // a NULL parameter takes an array that is ignored. A statement without
+   // parameters takes no tuples and is executed nrows times.
+   //
+   // The statement is prepared once. On postgres the rows are pipelined
+   // in chunks when libpq supports pipelines, so the database is not
+   // waited on for each row.
+   //
+   // All the rows are executed in a single transaction, or in a savepoint
+   // if a transaction is already open, so that either every row is applied
+   // or none are. On error false is returned and, if failed_row is not
+   // NULL, the index of the first row that failed (or (size_t)-1 if no row
+   // failed) is stored in failed_row.
+   bool sqldb_exec_many (sqldb_t *db, const char *query, size_t nrows,
+                                      size_t *failed_row, ...);
+   bool sqldb_exec_manyv (sqldb_t *db, const char *query, size_t nrows,
+                                       size_t *failed_row, va_list *ap);
+
+   // Load every row from src into the specified columns (a NULL-terminated
+   // array of names) of table. On postgres the rows are sent with COPY and
+   // on sqlite they are inserted with a single prepared statement. Every
+   // value is sent as text and converted by the database.
+   //
+   // The load is a single transaction, or a savepoint if a transaction is
+   // already open: the first row that the reader, the parser or the
+   // database rejects aborts the load and no rows are loaded. On postgres
+   // a row rejected by the database is only reported once all the rows
+   // have been sent.
+   //
+   // Returns the number of rows loaded, or -1 on error.
+   int64_t sqldb_bulk_load (sqldb_t *db, const char *table,
+                                         const char **columns,
+                                         const sqldb_bulk_src_t *src);
+
+   // A query template is a query string that has been compiled once so
+   // that executing it does no further scanning or copying of the query.
+   // The query is tokenised so that a '#' within a string literal, a
+   // quoted identifier, a dollar-quoted string or a comment is left
+   // untouched.
+   //
+   // Parameters may be numbered ("#1", "#2", ...) or named ("#email").
+   // Named parameters are numbered in order of first appearance, after
+   // the highest numbered parameter in the query, and the same name may
+   // appear more than once. Arguments for a template are given as tuples
+   // in parameter-number order, the same as for sqldb_exec().
+   //
+   // Returns NULL on error (malformed parameter reference or OOM). The
+   // template does not depend on any connection and may be shared by
+   // multiple connections.
+   sqldb_tmpl_t *sqldb_tmpl_new (const char *query);
+   void sqldb_tmpl_del (sqldb_tmpl_t *tmpl);
+
+   // Returns the number of parameters the template expects.
+   uint32_t sqldb_tmpl_nparams (const sqldb_tmpl_t *tmpl);
+
+   // Returns the parameter number of the named parameter (without the
+   // leading '#'), or zero if the template has no such parameter.
+   uint32_t sqldb_tmpl_param_index (const sqldb_tmpl_t *tmpl,
+                                    const char *name);
+
+   // Returns the query as it will be sent to the specified backend. The
+   // caller must not free the returned string.
+   const char *sqldb_tmpl_query (const sqldb_tmpl_t *tmpl,
+                                 sqldb_dbtype_t type);
+
+   // Identical to sqldb_exec(), sqldb_exec_ignore() and their _params()
+   // forms, except that the query is a compiled template.
+   sqldb_res_t *sqldb_exec_tmpl (sqldb_t *db, const sqldb_tmpl_t *tmpl, ...);
+   sqldb_res_t *sqldb_exec_tmplv (sqldb_t *db, const sqldb_tmpl_t *tmpl,
+                                               va_list *ap);
+   uint64_t sqldb_exec_tmpl_ignore (sqldb_t *db, const sqldb_tmpl_t *tmpl,
+                                                 ...);
+   uint64_t sqldb_exec_tmpl_ignorev (sqldb_t *db, const sqldb_tmpl_t *tmpl,
+                                                  va_list *ap);
+   sqldb_res_t *sqldb_exec_tmpl_params (sqldb_t *db, const sqldb_tmpl_t *tmpl,
+                                        const sqldb_param_t *params,
+                                        size_t nparams);
+   uint64_t sqldb_exec_tmpl_params_ignore (sqldb_t *db,
+                                           const sqldb_tmpl_t *tmpl,
+                                           const sqldb_param_t *params,
+                                           size_t nparams);
+
+   // A pipeline sends many statements to the database without waiting for
+   // the result of each one. On postgres (when libpq supports pipelines)
+   // all the statements queued between _begin() and _end() are sent
+   // together and the results are read in a single round trip; other
+   // backends execute each statement as it is queued.
+   //
+   // Unless the connection is already in a transaction, the statements in
+   // a pipeline form a single transaction: if any statement fails then
+   // the statements after it are not executed and the earlier ones are
+   // rolled back. Within a caller's transaction a failure leaves the
+   // transaction for the caller to roll back.
+   //
+   // While a pipeline is active sqldb_batch() queues its statements in
+   // the pipeline (on postgres each string must be a single statement),
+   // and the sqldb_exec() family of functions must not be used on a
+   // postgres connection. Statements in a pipeline return no rows.
+   //
+   // Starts a new pipeline, discarding the results of the previous one.
+   // Returns false on error.
+   bool sqldb_pipeline_begin (sqldb_t *db);
+
+   // Queues a statement in the pipeline; the query and tuples are the same
+   // as for sqldb_exec(). Returns false only if the statement could not
+   // be queued. Errors from executing the statement are reported by
+   // sqldb_pipeline_end() and sqldb_pipeline_result().
+   bool sqldb_pipeline_queue (sqldb_t *db, const char *query, ...);
+   bool sqldb_pipeline_queuev (sqldb_t *db, const char *query, va_list *ap);
+   bool sqldb_pipeline_queue_params (sqldb_t *db, const char *query,
+                                     const sqldb_param_t *params,
+                                     size_t nparams);
+
+   // Ends the pipeline, waiting for all the queued statements to
+   // complete. Returns true only if every statement succeeded; on failure
+   // sqldb_lasterr() describes the first statement that failed.
+   bool sqldb_pipeline_end (sqldb_t *db);
+
+   // Returns the number of statements queued in the last pipeline.
+   size_t sqldb_pipeline_count (sqldb_t *db);
+
+   // Retrieves the outcome of the statement at index (counting from zero
+   // in the order they were queued) of the last pipeline. Returns true if
+   // the statement succeeded, with the number of affected rows stored in
+   // nchanges. Returns false if it failed, with the error message stored
+   // in errmsg. The caller must not free errmsg, which remains valid until
+   // the next pipeline is started. Either destination may be NULL.
+   bool sqldb_pipeline_result (sqldb_t *db, size_t index,
+                               uint64_t *nchanges, const char **errmsg);
+
    // Executes a batch of statements and returns no results. Multiple
    // statements can be specified, ending with a NULL pointer. Each
    // statement may be composed of multiple statements itself, with each
@@ -148,12 +810,22 @@ extern "C" {
    // care.
    bool sqldb_batchfile (sqldb_t *db, FILE *inf);
 
-   // Returns 0 if no rows are available, 1 if a row is available and -1
-   // if an error occurred.
+   // Identical to sqldb_batchfile(), with options. The statements are split
+   // on each ';' outside of literals, quoted identifiers, comments and
+   // dollar-quoted strings (and, on sqlite, trigger bodies), and a regular
+   // file is memory-mapped if nothing has been read from it yet. When
+   // opts->transaction is set either every statement in the file is
+   // applied or none are.
+   bool sqldb_batchfile_ex (sqldb_t *db, FILE *inf,
+                            const sqldb_batchfile_opts_t *opts);
+
+   // Advances to the next row of the result. Returns 0 if no rows are
+   // available, 1 if a row is available and -1 if an error occurred.
    int sqldb_res_step (sqldb_res_t *res);
 
-   // Scans in all the columns in the current row. Returns the number of
-   // columns scanned in.
+   // Scans in all the columns in the current row, which is the row that
+   // the last call to sqldb_res_step() advanced to. Scanning does not
+   // advance to the next row. Returns the number of columns scanned in.
    //
    // Each variadic argument is a tuple consisting of the column type (see
    // enum above) and a pointer to a destination to store the data read.
@@ -169,6 +841,70 @@ extern "C" {
    uint32_t sqldb_scan_columns (sqldb_res_t *res, ...);
    uint32_t sqldb_scan_columnsv (sqldb_res_t *res, va_list *ap);
 
+   // Retrieves a view of the column at index (starting at zero) in the
+   // current row without copying it. The view points into memory owned by
+   // the result and remains valid only until the next call to
+   // sqldb_res_step() or sqldb_res_del(). Text values are terminated with
+   // a nul character. A NULL value is distinguished from an empty string
+   // by the is_null field.
+   //
+   // Values are in the form that the backend returns them: sqlite
+   // converts numbers to text, and postgres returns the binary
+   // representation when sqldb_FLAG_BINARY is set.
+   //
+   // Returns false if there is no current row or no such column.
+   bool sqldb_res_column_view (sqldb_res_t *res, uint32_t index,
+                               sqldb_colview_t *dst);
+
+   // Fetches up to max_rows rows from the result into the first ncols
+   // columns described by cols, one element in cols for each column.
+   // Integer columns (all sizes, as well as DATETIME) are stored in the
+   // ints array, which must hold max_rows values; unsigned values are
+   // stored as their bit pattern. TEXT and BLOB values are stored, without
+   // terminators, one after the other in the bytes array, with offsets
+   // (which must hold max_rows + 1 values) marking where each one starts.
+   // NULL values are stored as zero (or as an empty value) and, if nulls
+   // is not NULL, are flagged in the null bitmap, which must hold
+   // (max_rows + 7) / 8 bytes.
+   //
+   // Values are taken as the backend returns them (see
+   // sqldb_res_column_view() above). A row whose TEXT or BLOB values do
+   // not fit in the remaining bytes is left for the next call.
+   //
+   // Returns the number of rows fetched, zero when there are no more rows,
+   // or -1 on error (including when a single row does not fit). Fetching
+   // starts at the row after the current row and may be mixed with
+   // sqldb_res_step().
+   int64_t sqldb_res_fetch_batch (sqldb_res_t *res, sqldb_colbatch_t *cols,
+                                                    uint32_t ncols,
+                                                    uint32_t max_rows);
+
+   // Compile a description of a struct of struct_size bytes, one element
+   // of fields for each member that receives a column, into a field map
+   // for sqldb_res_fetch_structs(). Columns that are not described are
+   // ignored, and members that are not described are zeroed. Returns NULL
+   // if a field has an unsupported type or size, or does not fit in the
+   // struct. A field map may be shared by multiple connections.
+   sqldb_fieldmap_t *sqldb_fieldmap_new (size_t struct_size,
+                                         const sqldb_field_t *fields,
+                                         size_t nfields);
+   void sqldb_fieldmap_del (sqldb_fieldmap_t *map);
+
+   // Steps through every remaining row of the result, decoding each one
+   // into the next struct of an array as described by map. On success the
+   // array is stored in dst and the number of rows is returned; when there
+   // are no rows dst is set to NULL. NULL values are decoded as zero, or
+   // as a NULL pointer for TEXT members.
+   //
+   // The array and every string that its TEXT members point to are in a
+   // single allocation, so the caller frees everything with a single
+   // call to sqldb_free (*dst).
+   //
+   // Returns -1 on error, in which case dst is set to NULL.
+   int64_t sqldb_res_fetch_structs (sqldb_res_t *res,
+                                    const sqldb_fieldmap_t *map,
+                                    void **dst);
+
    // This is a bit of a tricky function. It executes the given query
    // using all the arguments in (...) as pairs of {type,value} until it
    // reaches type_UNKNOWN. It then fetches the results into tuples
@@ -190,6 +926,24 @@ extern "C" {
    // it.
    void sqldb_res_del (sqldb_res_t *res);
 
+   // Releases the statement, the arena contents and the error message of
+   // the result without freeing the result itself, so that it can be
+   // used again with sqldb_res_exec().
+   void sqldb_res_reset (sqldb_res_t *res);
+
+   // Identical to sqldb_exec() and sqldb_exec_params(), except that the
+   // query is executed into an existing result (which is first reset)
+   // instead of a new one being allocated. The result may have been
+   // created on any connection. Returns false on error, in which case
+   // the error is available from sqldb_lasterr() and the result is left
+   // reset; it must still be deleted with sqldb_res_del().
+   bool sqldb_res_exec (sqldb_t *db, sqldb_res_t *res, const char *query, ...);
+   bool sqldb_res_execv (sqldb_t *db, sqldb_res_t *res, const char *query,
+                         va_list *ap);
+   bool sqldb_res_exec_params (sqldb_t *db, sqldb_res_t *res,
+                               const char *query,
+                               const sqldb_param_t *params, size_t nparams);
+
    // For diagnostics during development
    void sqldb_print (sqldb_t *db, FILE *outf);
 
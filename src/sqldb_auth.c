@@ -3,10 +3,12 @@
 #include <string.h>
 #include <time.h>
 #include <stdint.h>
+#include <stddef.h>
 #include <inttypes.h>
 
 #include <sys/types.h>
 #include <unistd.h>
+#include <pthread.h>
 
 #include "sqldb_auth.h"
 #include "sqldb_auth_query.h"
@@ -19,6 +21,70 @@
 
 #define SVALID(s)   ((s && s[0]))
 
+// Ends the span of an sqldb_auth function on the timeline (see
+// sqldb_timeline_enable()), passing its result through.
+static bool span_end (const char *name, uint64_t start, bool ret)
+{
+   sqldb_span_end ("auth", name, start);
+   return ret;
+}
+
+// Executes the query with exactly the specified connection flags in
+// effect, restoring the caller's flags afterwards. Listings may return an
+// unbounded number of rows, so they are streamed from the server instead
+// of being buffered in their entirety. Results that are read using column
+// views rely on the values being in text form, and strings that are
+// scanned for the caller must not be placed in an arena.
+static sqldb_res_t *exec_flags (sqldb_t *db, uint32_t flags,
+                                const char *qstring, ...)
+{
+   va_list ap;
+
+   va_start (ap, qstring);
+   uint32_t prev = sqldb_flags_clear (db, (uint32_t)-1);
+   sqldb_flags_set (db, flags);
+   sqldb_res_t *ret = sqldb_execv (db, qstring, &ap);
+   sqldb_flags_clear (db, (uint32_t)-1);
+   sqldb_flags_set (db, prev);
+   va_end (ap);
+
+   return ret;
+}
+
+// Retrieves views of the first ncols columns of the current row. None of
+// the columns may be NULL.
+static bool scan_views (sqldb_res_t *res, sqldb_colview_t *dst,
+                                          uint32_t ncols)
+{
+   for (uint32_t i=0; i<ncols; i++) {
+      if (!(sqldb_res_column_view (res, i, &dst[i])) || dst[i].is_null)
+         return false;
+   }
+
+   return true;
+}
+
+static char *view_strdup (const sqldb_colview_t *view)
+{
+   char *ret = sqldb_malloc (view->len + 1);
+   if (!ret)
+      return NULL;
+
+   memcpy (ret, view->ptr, view->len);
+   ret[view->len] = 0;
+
+   return ret;
+}
+
+static bool view_uint64 (const sqldb_colview_t *view, uint64_t *dst)
+{
+   char *end = NULL;
+
+   *dst = strtoull (view->ptr, &end, 10);
+
+   return end && end!=view->ptr && !*end;
+}
+
 static bool make_password_hash (char dst[65], const char  sz_salt[65],
                                               const char *new_email,
                                               const char *nick,
@@ -37,7 +103,7 @@ static bool make_password_hash (char dst[65], const char  sz_salt[65],
             + strlen (password)
             + 1;
 
-   if (!(tmp = malloc (tmplen)))
+   if (!(tmp = sqldb_malloc (tmplen)))
       goto errorexit;
 
    strcpy (tmp, sz_salt);
@@ -45,7 +111,9 @@ static bool make_password_hash (char dst[65], const char  sz_salt[65],
    strcat (tmp, nick);
    strcat (tmp, password);
 
+   uint64_t span = sqldb_span_begin ();
    calc_sha_256 (hash, tmp, tmplen);
+   sqldb_span_end ("auth", "sha256", span);
 
 #define STRINGIFY(dst,dstlen,src,srclen)    do {\
    for (size_t i=0; i<srclen && (i*2)<dstlen; i++) {\
@@ -59,13 +127,15 @@ static bool make_password_hash (char dst[65], const char  sz_salt[65],
 
 errorexit:
 
-   free (tmp);
+   sqldb_free (tmp);
 
    return !error;
 }
 
 bool sqldb_auth_initdb (sqldb_t *db)
 {
+   uint64_t span = sqldb_span_begin ();
+
    bool error = true;
    const char *init_sqlite_stmt = NULL,
               *create_tables_stmt = NULL;
@@ -91,7 +161,7 @@ bool sqldb_auth_initdb (sqldb_t *db)
 
 errorexit:
 
-   return !error;
+   return span_end (__func__, span, !error);
 }
 
 bool sqldb_auth_session_valid (sqldb_t     *db,
@@ -101,14 +171,17 @@ bool sqldb_auth_session_valid (sqldb_t     *db,
                                uint64_t    *flags_dst,
                                uint64_t    *id_dst)
 {
+   uint64_t span = sqldb_span_begin ();
+
    bool error = true;
    const char *qstring = NULL;
    sqldb_res_t *res = NULL;
 
-    char       *l_nick_dst = NULL;
-    char       *l_email_dst = NULL;
-    uint64_t    l_flags_dst = 0;
-    uint64_t    l_id_dst = 0;
+   sqldb_colview_t cols[4];
+   char       *l_nick_dst = NULL;
+   char       *l_email_dst = NULL;
+   uint64_t    l_flags_dst = 0;
+   uint64_t    l_id_dst = 0;
 
    if (!db || !SVALID (session_id))
       goto errorexit;
@@ -118,8 +191,8 @@ bool sqldb_auth_session_valid (sqldb_t     *db,
       goto errorexit;
    }
 
-   if (!(res = sqldb_exec (db, qstring, sqldb_col_TEXT, &session_id,
-                                        sqldb_col_UNKNOWN))) {
+   if (!(res = exec_flags (db, 0, qstring, sqldb_col_TEXT, &session_id,
+                                           sqldb_col_UNKNOWN))) {
       LOG_ERR ("Failed to execute session query for session [%s]\n%s\n",
                 session_id, sqldb_lasterr (db));
       goto errorexit;
@@ -131,16 +204,21 @@ bool sqldb_auth_session_valid (sqldb_t     *db,
       goto errorexit;
    }
 
-   if ((sqldb_scan_columns (res, sqldb_col_TEXT,    &l_email_dst,
-                                 sqldb_col_TEXT,    &l_nick_dst,
-                                 sqldb_col_UINT64,  &l_flags_dst,
-                                 sqldb_col_UINT64,  &l_id_dst,
-                                 sqldb_col_UNKNOWN)) != 4) {
+   if (!(scan_views (res, cols, 4))
+         || !(view_uint64 (&cols[2], &l_flags_dst))
+         || !(view_uint64 (&cols[3], &l_id_dst))) {
       LOG_ERR ("Failed to scan 4 columns in for session [%s]\n",
                session_id);
       goto errorexit;
    }
 
+   // Only the strings that the caller asked for are copied.
+   if ((email_dst && !(l_email_dst = view_strdup (&cols[0])))
+         || (nick_dst && !(l_nick_dst = view_strdup (&cols[1])))) {
+      LOG_ERR ("OOM scanning session [%s]\n", session_id);
+      goto errorexit;
+   }
+
    if (email_dst) {
       (*email_dst) = l_email_dst;
       l_email_dst = NULL;
@@ -161,11 +239,12 @@ bool sqldb_auth_session_valid (sqldb_t     *db,
 
 errorexit:
 
-   free (l_nick_dst);
+   sqldb_free (l_email_dst);
+   sqldb_free (l_nick_dst);
 
    sqldb_res_del (res);
 
-   return !error;
+   return span_end (__func__, span, !error);
 }
 
 bool sqldb_auth_session_authenticate (sqldb_t    *db,
@@ -173,15 +252,15 @@ bool sqldb_auth_session_authenticate (sqldb_t    *db,
                                       const char *password,
                                       char        sess_id_dst[65])
 {
+   uint64_t span = sqldb_span_begin ();
+
    bool error = true;
    const char *qstring = NULL;
    uint64_t rc = 0;
    size_t retries = 0;
    sqldb_res_t *res = NULL;
 
-   char *salt = NULL,
-        *nick = NULL,
-        *dbhash = NULL;
+   sqldb_colview_t cols[3];
 
    char phash[65];
    uint8_t sess_id_bin[32];
@@ -196,8 +275,8 @@ bool sqldb_auth_session_authenticate (sqldb_t    *db,
       goto errorexit;
    }
 
-   if (!(res = sqldb_exec (db, qstring, sqldb_col_TEXT, &email,
-                                        sqldb_col_UNKNOWN))) {
+   if (!(res = exec_flags (db, 0, qstring, sqldb_col_TEXT, &email,
+                                           sqldb_col_UNKNOWN))) {
       LOG_ERR ("Failed to execute [%s] with #1=[%s]\n%s\n",
                qstring, email, sqldb_lasterr (db));
       goto errorexit;
@@ -209,26 +288,24 @@ bool sqldb_auth_session_authenticate (sqldb_t    *db,
       goto errorexit;
    }
 
-   if (!(sqldb_scan_columns (res, sqldb_col_TEXT, &salt,
-                                  sqldb_col_TEXT, &nick,
-                                  sqldb_col_TEXT, &dbhash,
-                                  sqldb_col_UNKNOWN))) {
+   if (!(scan_views (res, cols, 3))) {
       LOG_ERR ("Failed to scan columns set for [%s] #1 = %s: %s\n",
             qstring, email, sqldb_lasterr (db));
       goto errorexit;
    }
 
-   sqldb_res_del (res);
-   res = NULL;
-
-   if (!(make_password_hash (phash, salt, email, nick, password))) {
+   if (!(make_password_hash (phash, cols[0].ptr, email, cols[1].ptr,
+                                    password))) {
       LOG_ERR ("Failed to make password hash for [%s]\n", email);
       goto errorexit;
    }
 
-   if ((strncmp (dbhash, phash, sizeof phash))!=0)
+   if ((strncmp (cols[2].ptr, phash, sizeof phash))!=0)
       goto errorexit;
 
+   sqldb_res_del (res);
+   res = NULL;
+
    if (!(qstring = sqldb_auth_query ("user_update_session_id"))) {
       LOG_ERR ("Failed to find query-string for [user_update_session_id]\n");
       goto errorexit;
@@ -236,6 +313,7 @@ bool sqldb_auth_session_authenticate (sqldb_t    *db,
 
    // Make 100 attempts at most to generate a session ID that is unique.
    // We give up after that (something is wrong).
+   uint64_t update_span = sqldb_span_begin ();
    for (retries=0; retries<100; retries++) {
       sqldb_random_bytes (sess_id_bin, 32);
       memset (sess_id_dst, 0, 65);
@@ -249,6 +327,7 @@ bool sqldb_auth_session_authenticate (sqldb_t    *db,
       if (rc != (uint64_t)-1)
          break;
    }
+   sqldb_span_end ("auth", "session_id_update", update_span);
 
    if (rc == (uint64_t)-1) {
       LOG_ERR ("Failed to update db with new session ID after %zu attempts "
@@ -261,27 +340,25 @@ bool sqldb_auth_session_authenticate (sqldb_t    *db,
 
 errorexit:
 
-   free (salt);
-   free (nick);
-   free (dbhash);
-
    sqldb_res_del (res);
 
-   return !error;
+   return span_end (__func__, span, !error);
 }
 
 bool sqldb_auth_session_invalidate (sqldb_t      *db,
                                     const char   *email,
                                     const char    session_id[65])
 {
+   uint64_t span = sqldb_span_begin ();
+
    const char *qstring = NULL;
    uint64_t rc = 0;
 
    if (!db || !SVALID (email) || !SVALID (session_id))
-      return false;
+      return span_end (__func__, span, false);
 
    if (!(qstring = sqldb_auth_query ("session_invalidate")))
-      return false;
+      return span_end (__func__, span, false);
 
    rc = sqldb_exec_ignore (db, qstring, sqldb_col_TEXT, &email,
                                         sqldb_col_TEXT, &session_id,
@@ -291,24 +368,24 @@ bool sqldb_auth_session_invalidate (sqldb_t      *db,
       LOG_ERR ("Failed to invalidate session [%s/%s]: %s\n",
                email, session_id,
                sqldb_lasterr (db));
-      return false;
+      return span_end (__func__, span, false);
    }
 
-   return true;
+   return span_end (__func__, span, true);
 
 }
 
 bool sqldb_auth_user_password_valid (sqldb_t *db, const char *email,
                                                   const char *password)
 {
+   uint64_t span = sqldb_span_begin ();
+
    bool valid = false;
 
    const char *qstring = NULL;
    sqldb_res_t *res = NULL;
 
-   char *l_salt = NULL,
-        *l_nick = NULL,
-        *l_hash = NULL;
+   sqldb_colview_t cols[3];
 
    char calc_hash[65];
 
@@ -320,8 +397,8 @@ bool sqldb_auth_user_password_valid (sqldb_t *db, const char *email,
       goto errorexit;
    }
 
-   if (!(res = sqldb_exec (db, qstring, sqldb_col_TEXT, &email,
-                                        sqldb_col_UNKNOWN))) {
+   if (!(res = exec_flags (db, 0, qstring, sqldb_col_TEXT, &email,
+                                           sqldb_col_UNKNOWN))) {
       LOG_ERR ("Failed to execute password-valid query for email [%s]\n%s\n",
                 email, sqldb_lasterr (db));
       goto errorexit;
@@ -333,27 +410,25 @@ bool sqldb_auth_user_password_valid (sqldb_t *db, const char *email,
       goto errorexit;
    }
 
-   if ((sqldb_scan_columns (res, sqldb_col_TEXT, &l_salt,
-                                 sqldb_col_TEXT, &l_nick,
-                                 sqldb_col_TEXT, &l_hash,
-                                 sqldb_col_UNKNOWN)) != 3) {
+   if (!(scan_views (res, cols, 3))) {
       LOG_ERR ("Failed to scan 3 columns in for email [%s]\n",
                email);
       goto errorexit;
    }
 
-   if (!(make_password_hash (calc_hash, l_salt, email, l_nick, password))) {
+   if (!(make_password_hash (calc_hash, cols[0].ptr, email, cols[1].ptr,
+                                        password))) {
       LOG_ERR ("Failed to generate password salt for [%s]\n", email);
       goto errorexit;
    }
 
-   if ((strcmp (l_hash, calc_hash))==0)
+   if ((strcmp (cols[2].ptr, calc_hash))==0)
       valid = true;
 
 errorexit:
 
    sqldb_res_del (res);
-   return valid;
+   return span_end (__func__, span, valid);
 }
 
 uint64_t sqldb_auth_user_create (sqldb_t    *db,
@@ -361,6 +436,8 @@ uint64_t sqldb_auth_user_create (sqldb_t    *db,
                                  const char *nick,
                                  const char *password)
 {
+   uint64_t span = sqldb_span_begin ();
+
    bool error = true;
    uint64_t ret = (uint64_t)-1;
    const char *qstring = NULL;
@@ -388,20 +465,23 @@ uint64_t sqldb_auth_user_create (sqldb_t    *db,
 
 errorexit:
 
+   sqldb_span_end ("auth", __func__, span);
    return error ? (uint64_t)-1 : ret;
 }
 
 
 bool sqldb_auth_user_rm (sqldb_t *db, const char *email)
 {
+   uint64_t span = sqldb_span_begin ();
+
    const char *qstring = NULL;
    uint64_t rc = 0;
 
    if (!db || !email || !email[0])
-      return false;
+      return span_end (__func__, span, false);
 
    if (!(qstring = sqldb_auth_query ("user_rm")))
-      return false;
+      return span_end (__func__, span, false);
 
    rc = sqldb_exec_ignore (db, qstring, sqldb_col_TEXT, &email,
                                         sqldb_col_UNKNOWN);
@@ -409,10 +489,10 @@ bool sqldb_auth_user_rm (sqldb_t *db, const char *email)
    if (rc==(uint64_t)-1) {
       LOG_ERR ("Failed to remove group [%s]: %s\n", email,
                                                     sqldb_lasterr (db));
-      return false;
+      return span_end (__func__, span, false);
    }
 
-   return true;
+   return span_end (__func__, span, true);
 }
 
 bool sqldb_auth_user_info (sqldb_t    *db,
@@ -422,6 +502,8 @@ bool sqldb_auth_user_info (sqldb_t    *db,
                            char      **nick_dst,
                            char        session_dst[65])
 {
+   uint64_t span = sqldb_span_begin ();
+
    bool error = true;
    const char *qstring = NULL;
    sqldb_res_t *res = NULL;
@@ -432,15 +514,15 @@ bool sqldb_auth_user_info (sqldb_t    *db,
    char      *l_nick_dst = NULL;
 
    if (!db || !email)
-      return false;
+      return span_end (__func__, span, false);
 
    if (!(qstring = sqldb_auth_query ("user_info"))) {
       LOG_ERR ("Qstring failure: Failed to find user_info qstring\n");
       goto errorexit;
    }
 
-   if (!(res = sqldb_exec (db, qstring, sqldb_col_TEXT, &email,
-                                        sqldb_col_UNKNOWN))) {
+   if (!(res = exec_flags (db, 0, qstring, sqldb_col_TEXT, &email,
+                                          sqldb_col_UNKNOWN))) {
       LOG_ERR ("Exec failure: [%s]\n", qstring);
       goto errorexit;
    }
@@ -477,34 +559,156 @@ bool sqldb_auth_user_info (sqldb_t    *db,
 
 errorexit:
 
-   free (tmp_sess);
-   free (l_nick_dst);
+   sqldb_free (tmp_sess);
+   sqldb_free (l_nick_dst);
    sqldb_res_del (res);
 
-   return !error;
+   return span_end (__func__, span, !error);
 }
 
-static bool reset_arrayptr (int caller, void *arrayptr, ...)
+// The rows of the listings. Each listing is decoded into a single array
+// of sqldb_auth_user_t or sqldb_auth_group_t, which is either handed to
+// the caller or copied into the caller's parallel arrays.
+static const sqldb_field_t user_fields[] = {
+   { 0, sqldb_col_TEXT,   offsetof (sqldb_auth_user_t, email),
+                          sizeof ((sqldb_auth_user_t *)0)->email },
+   { 1, sqldb_col_TEXT,   offsetof (sqldb_auth_user_t, nick),
+                          sizeof ((sqldb_auth_user_t *)0)->nick },
+   { 2, sqldb_col_UINT64, offsetof (sqldb_auth_user_t, id),
+                          sizeof ((sqldb_auth_user_t *)0)->id },
+   { 3, sqldb_col_UINT64, offsetof (sqldb_auth_user_t, flags),
+                          sizeof ((sqldb_auth_user_t *)0)->flags },
+};
+
+static const sqldb_field_t group_fields[] = {
+   { 0, sqldb_col_TEXT,   offsetof (sqldb_auth_group_t, name),
+                          sizeof ((sqldb_auth_group_t *)0)->name },
+   { 1, sqldb_col_TEXT,   offsetof (sqldb_auth_group_t, description),
+                          sizeof ((sqldb_auth_group_t *)0)->description },
+   { 2, sqldb_col_UINT64, offsetof (sqldb_auth_group_t, id),
+                          sizeof ((sqldb_auth_group_t *)0)->id },
+};
+
+#define NFIELDS(f)      (sizeof f / sizeof f[0])
+
+// The field maps are compiled on first use and shared by every
+// connection for the life of the process. A map that could not be
+// compiled is left NULL.
+static pthread_once_t maps_once = PTHREAD_ONCE_INIT;
+static sqldb_fieldmap_t *user_map;
+static sqldb_fieldmap_t *group_map;
+static sqldb_fieldmap_t *group_name_map;
+
+static void maps_init (void)
 {
-   size_t i=0;
+   user_map = sqldb_fieldmap_new (sizeof (sqldb_auth_user_t),
+                                  user_fields, NFIELDS (user_fields));
+   group_map = sqldb_fieldmap_new (sizeof (sqldb_auth_group_t),
+                                   group_fields, NFIELDS (group_fields));
+   // For the listings that return only the name of each group.
+   group_name_map = sqldb_fieldmap_new (sizeof (sqldb_auth_group_t),
+                                        group_fields, 1);
+}
 
-   if (!arrayptr)
-      return true;
+// Fetches every row of res into a single allocation of structs, see
+// sqldb_res_fetch_structs(). Returns the number of rows or -1 on error.
+static int64_t fetch_rows (sqldb_res_t *res, sqldb_fieldmap_t **map,
+                                             void **dst)
+{
+   pthread_once (&maps_once, maps_init);
 
-   va_list ap;
+   if (!*map) {
+      LOG_ERR ("Failed to compile field map\n");
+      return -1;
+   }
+
+   int64_t ret = sqldb_res_fetch_structs (res, *map, dst);
+   if (ret < 0)
+      LOG_ERR ("Failed to fetch rows: %s\n", sqldb_res_lasterr (res));
+
+   return ret;
+}
+
+static void free_strings (char ***dst)
+{
+   if (!dst)
+      return;
+
+   for (size_t i=0; *dst && (*dst)[i]; i++) {
+      sqldb_free ((*dst)[i]);
+   }
+   sqldb_free (*dst);
+   *dst = NULL;
+}
+
+static void free_ints (uint64_t **dst)
+{
+   if (!dst)
+      return;
 
-   va_start (ap, arrayptr);
+   sqldb_free (*dst);
+   *dst = NULL;
+}
+
+// Copies the TEXT member at offset in each of the nrows structs into a
+// new NULL-terminated array of strings, which replaces the array in dst.
+// NULL values are copied as empty strings.
+static bool rows_strings (char ***dst, const void *rows, int64_t nrows,
+                                       size_t struct_size,
+                                       size_t offset)
+{
+   char **ret = NULL;
+
+   if (!dst)
+      return true;
+
+   if (!(ret = sqldb_calloc (nrows + 1, sizeof *ret))) {
+      LOG_ERR ("OOM error\n");
+      return false;
+   }
 
-   do {
-      free (*(char ***)arrayptr);
-      if (!(*(char ***)arrayptr = malloc (sizeof **(char ***)arrayptr))) {
-         LOG_ERR ("Memory allocation #%zu failure: %i\n", i, caller);
+   for (int64_t i=0; i<nrows; i++) {
+      const char *src;
+      memcpy (&src, (const char *)rows + i * struct_size + offset,
+                    sizeof src);
+      if (!src)
+         src = "";
+      if (!(ret[i] = sqldb_malloc (strlen (src) + 1))) {
+         LOG_ERR ("OOM error\n");
+         free_strings (&ret);
          return false;
       }
-      (*(char ***)arrayptr)[0] = NULL;
-      i++;
-   } while ((arrayptr = va_arg (ap, void ***))!=NULL);
+      strcpy (ret[i], src);
+   }
+
+   free_strings (dst);
+   *dst = ret;
+   return true;
+}
+
+// Copies the uint64_t member at offset in each of the nrows structs into a
+// new array, which replaces the array in dst.
+static bool rows_ints (uint64_t **dst, const void *rows, int64_t nrows,
+                                       size_t struct_size,
+                                       size_t offset)
+{
+   uint64_t *ret = NULL;
+
+   if (!dst)
+      return true;
+
+   if (!(ret = sqldb_calloc (nrows + 1, sizeof *ret))) {
+      LOG_ERR ("OOM error\n");
+      return false;
+   }
 
+   for (int64_t i=0; i<nrows; i++) {
+      memcpy (&ret[i], (const char *)rows + i * struct_size + offset,
+                       sizeof ret[i]);
+   }
+
+   free_ints (dst);
+   *dst = ret;
    return true;
 }
 
@@ -513,15 +717,15 @@ bool sqldb_auth_user_membership (sqldb_t    *db,
                                  uint64_t   *nitems_dst,
                                  char     ***groups_dst)
 {
+   uint64_t span = sqldb_span_begin ();
+
    bool error = true;
 
-   uint64_t nitems = 0;
    const char *qstring;
 
    sqldb_res_t *res = NULL;
-
-   if (!(reset_arrayptr (__LINE__, groups_dst, NULL)))
-      goto errorexit;
+   sqldb_auth_group_t *rows = NULL;
+   int64_t nrows = 0;
 
    if (nitems_dst)
       *nitems_dst = 0;
@@ -533,51 +737,38 @@ bool sqldb_auth_user_membership (sqldb_t    *db,
       goto errorexit;
    }
 
-   if (!(res = sqldb_exec (db, qstring, sqldb_col_TEXT, &email,
-                                        sqldb_col_UNKNOWN))) {
+   if (!(res = exec_flags (db, sqldb_FLAG_STREAMING, qstring,
+                                              sqldb_col_TEXT, &email,
+                                              sqldb_col_UNKNOWN))) {
       printf ("Failed to execute [%s]: %s\n", qstring, sqldb_lasterr (db));
       goto errorexit;
    }
 
-   while (sqldb_res_step (res) == 1) {
-      uint64_t newlen = nitems + 1;
-      if (groups_dst) {
-         char *gname = NULL;
-         char **tmp = realloc (*groups_dst, (newlen + 1) * (sizeof *tmp));
-         if (!tmp)
-            goto errorexit;
-         (*groups_dst) = tmp;
-         tmp[newlen - 1] = NULL;
-         tmp[newlen] = NULL;
-         if ((sqldb_scan_columns (res, sqldb_col_TEXT,   &gname,
-                                       sqldb_col_UNKNOWN))!=1)
-            goto errorexit;
-         tmp[nitems] = gname;
-      }
-      nitems++;
-   }
+   // Only the name of each group is returned.
+   if ((nrows = fetch_rows (res, &group_name_map, (void **)&rows)) < 0)
+      goto errorexit;
+
+   if (!(rows_strings (groups_dst, rows, nrows, sizeof *rows,
+                                   offsetof (sqldb_auth_group_t, name))))
+      goto errorexit;
 
-   *nitems_dst = nitems;
+   if (nitems_dst)
+      *nitems_dst = nrows;
 
    error = false;
 
 errorexit:
 
+   sqldb_free (rows);
    sqldb_res_del (res);
 
    if (error) {
-      for (size_t i=0; groups_dst && *groups_dst && (*groups_dst)[i]; i++) {
-         free ((*groups_dst)[i]);
-      }
-      if (groups_dst) {
-         free (*groups_dst);
-         *groups_dst = NULL;
-      }
+      free_strings (groups_dst);
       if (nitems_dst)
          *nitems_dst = 0;
    }
 
-   return !error;
+   return span_end (__func__, span, !error);
 }
 
 bool sqldb_auth_user_mod (sqldb_t    *db,
@@ -586,6 +777,8 @@ bool sqldb_auth_user_mod (sqldb_t    *db,
                           const char *nick,
                           const char *password)
 {
+   uint64_t span = sqldb_span_begin ();
+
    const char *qstring = NULL;
 
    uint8_t  salt[32];
@@ -600,10 +793,10 @@ bool sqldb_auth_user_mod (sqldb_t    *db,
    if (!db ||
        !old_email    || !new_email    || !nick    || !password ||
        !old_email[0] || !new_email[0] || !nick[0] || !password[0])
-      return false;
+      return span_end (__func__, span, false);
 
    if (!(qstring = sqldb_auth_query ("user_mod")))
-      return false;
+      return span_end (__func__, span, false);
 
    sqldb_random_bytes (salt, sizeof salt);
    STRINGIFY (sz_salt, sizeof sz_salt, salt, 32);
@@ -611,7 +804,7 @@ bool sqldb_auth_user_mod (sqldb_t    *db,
 
 
    if (!(make_password_hash (sz_hash, sz_salt, new_email, nick, password)))
-      return false;
+      return span_end (__func__, span, false);
 
    ret = sqldb_exec_ignore (db, qstring, sqldb_col_TEXT,    &old_email,
                                          sqldb_col_TEXT,    &new_email,
@@ -623,10 +816,10 @@ bool sqldb_auth_user_mod (sqldb_t    *db,
    if (ret==(uint64_t)-1) {
       LOG_ERR ("Failed to modify user [%s]: %s\n", old_email,
                                                    sqldb_lasterr (db));
-      return false;
+      return span_end (__func__, span, false);
    }
 
-   return true;
+   return span_end (__func__, span, true);
 }
 
 
@@ -660,13 +853,19 @@ static bool sqldb_auth_user_flags (sqldb_t *db, const char *qname,
 bool sqldb_auth_user_flags_set (sqldb_t *db, const char *email,
                                              uint64_t flags)
 {
-   return sqldb_auth_user_flags (db, "user_flags_set", email, flags);
+   uint64_t span = sqldb_span_begin ();
+   bool ret = sqldb_auth_user_flags (db, "user_flags_set", email, flags);
+
+   return span_end (__func__, span, ret);
 }
 
 bool sqldb_auth_user_flags_clear (sqldb_t *db, const char *email,
                                                uint64_t flags)
 {
-   return sqldb_auth_user_flags (db, "user_flags_clear", email, flags);
+   uint64_t span = sqldb_span_begin ();
+   bool ret = sqldb_auth_user_flags (db, "user_flags_clear", email, flags);
+
+   return span_end (__func__, span, ret);
 }
 
 
@@ -674,6 +873,8 @@ uint64_t sqldb_auth_group_create (sqldb_t    *db,
                                   const char *name,
                                   const char *description)
 {
+   uint64_t span = sqldb_span_begin ();
+
    uint64_t ret = (uint64_t)-1;
    const char *qstring = NULL;
 
@@ -697,15 +898,18 @@ uint64_t sqldb_auth_group_create (sqldb_t    *db,
 
 errorexit:
 
+   sqldb_span_end ("auth", __func__, span);
    return ret;
 }
 
 bool sqldb_auth_group_rm (sqldb_t *db, const char *name)
 {
+   uint64_t span = sqldb_span_begin ();
+
    const char *qstring = sqldb_auth_query ("group_rm");
 
    if (!db || !(SVALID (name)))
-      return false;
+      return span_end (__func__, span, false);
 
    uint64_t rc = sqldb_exec_ignore (db, qstring, sqldb_col_TEXT, &name,
                                                  sqldb_col_UNKNOWN);
@@ -713,10 +917,10 @@ bool sqldb_auth_group_rm (sqldb_t *db, const char *name)
    if (rc==(uint64_t)-1) {
       LOG_ERR ("Failed to remove group [%s]: %s\n", name,
                                                     sqldb_lasterr (db));
-      return false;
+      return span_end (__func__, span, false);
    }
 
-   return true;
+   return span_end (__func__, span, true);
 }
 
 bool sqldb_auth_group_info (sqldb_t    *db,
@@ -724,6 +928,8 @@ bool sqldb_auth_group_info (sqldb_t    *db,
                             uint64_t   *id_dst,
                             char      **description_dst)
 {
+   uint64_t span = sqldb_span_begin ();
+
    bool error = true;
    const char *qstring = NULL;
    sqldb_res_t *res = NULL;
@@ -732,15 +938,15 @@ bool sqldb_auth_group_info (sqldb_t    *db,
    char      *l_description_dst = NULL;
 
    if (!db || !name)
-      return false;
+      return span_end (__func__, span, false);
 
    if (!(qstring = sqldb_auth_query ("group_info"))) {
       LOG_ERR ("Qstring failure: Failed to find group_info qstring\n");
       goto errorexit;
    }
 
-   if (!(res = sqldb_exec (db, qstring, sqldb_col_TEXT, &name,
-                                        sqldb_col_UNKNOWN))) {
+   if (!(res = exec_flags (db, 0, qstring, sqldb_col_TEXT, &name,
+                                          sqldb_col_UNKNOWN))) {
       LOG_ERR ("Exec failure: [%s]\n", qstring);
       goto errorexit;
    }
@@ -769,11 +975,11 @@ bool sqldb_auth_group_info (sqldb_t    *db,
 
 errorexit:
 
-   free (l_description_dst);
+   sqldb_free (l_description_dst);
 
    sqldb_res_del (res);
 
-   return !error;
+   return span_end (__func__, span, !error);
 
 }
 
@@ -782,17 +988,19 @@ bool sqldb_auth_group_mod (sqldb_t    *db,
                            const char *newname,
                            const char *description)
 {
+   uint64_t span = sqldb_span_begin ();
+
    uint64_t rc = 0;
    const char *qstring = NULL;
 
    if (!db ||
        !SVALID (oldname) || !SVALID (newname) || !SVALID (description))
-      return false;
+      return span_end (__func__, span, false);
 
    if (!(qstring = sqldb_auth_query ("group_mod"))) {
       LOG_ERR ("Failed to find query_string [group_mod]: %s\n",
                 sqldb_lasterr (db));
-      return false;
+      return span_end (__func__, span, false);
    }
 
    rc = sqldb_exec_ignore (db, qstring, sqldb_col_TEXT, &oldname,
@@ -803,22 +1011,24 @@ bool sqldb_auth_group_mod (sqldb_t    *db,
    if (rc==(uint64_t)-1) {
       LOG_ERR ("Failed to modify group [%s]: %s\n", oldname,
                                                     sqldb_lasterr (db));
-      return false;
+      return span_end (__func__, span, false);
    }
 
-   return true;
+   return span_end (__func__, span, true);
 }
 
 bool sqldb_auth_group_adduser (sqldb_t    *db,
                                const char *name, const char *email)
 {
+   uint64_t span = sqldb_span_begin ();
+
    const char *qstring = NULL;
    uint64_t rc = 0;
 
    if (!(qstring = sqldb_auth_query ("group_adduser"))) {
       LOG_ERR ("Failed to find query_string [group_adduser]: %s\n",
                 sqldb_lasterr (db));
-      return false;
+      return span_end (__func__, span, false);
    }
 
    rc = sqldb_exec_ignore (db, qstring, sqldb_col_TEXT, &email,
@@ -829,20 +1039,22 @@ bool sqldb_auth_group_adduser (sqldb_t    *db,
                email,
                name,
                sqldb_lasterr (db));
-      return false;
+      return span_end (__func__, span, false);
    }
 
-   return true;
+   return span_end (__func__, span, true);
 }
 
 bool sqldb_auth_group_rmuser (sqldb_t    *db,
                               const char *name, const char *email)
 {
+   uint64_t span = sqldb_span_begin ();
+
    const char *qstring = NULL;
    uint64_t rc = 0;
 
    if (!(qstring = sqldb_auth_query ("group_rmuser")))
-      return false;
+      return span_end (__func__, span, false);
 
    rc = sqldb_exec_ignore (db, qstring, sqldb_col_TEXT, &name,
                                         sqldb_col_TEXT, &email,
@@ -851,23 +1063,84 @@ bool sqldb_auth_group_rmuser (sqldb_t    *db,
    if (rc==(uint64_t)-1) {
       LOG_ERR ("Failed to remove user from group [%s/%s]: %s\n",
                email, name, sqldb_lasterr (db));
+      return span_end (__func__, span, false);
+   }
+
+   return span_end (__func__, span, true);
+}
+
+// Executes the named group membership query once for each email in a
+// single pipeline. The adduser query takes the email first, the rmuser
+// query takes the group name first.
+static bool group_users_pipelined (sqldb_t *db, const char *qname,
+                                   bool email_first, const char *name,
+                                   const char **emails, size_t nemails)
+{
+   const char *qstring = NULL;
+   bool ret = true;
+
+   if (!(qstring = sqldb_auth_query (qname))) {
+      LOG_ERR ("Failed to find query_string [%s]: %s\n",
+                qname, sqldb_lasterr (db));
       return false;
    }
 
-   return true;
+   if (!(sqldb_pipeline_begin (db))) {
+      LOG_ERR ("Failed to start pipeline: %s\n", sqldb_lasterr (db));
+      return false;
+   }
+
+   for (size_t i=0; ret && i<nemails; i++) {
+      const char *p1 = email_first ? emails[i] : name,
+                 *p2 = email_first ? name : emails[i];
+      ret = sqldb_pipeline_queue (db, qstring, sqldb_col_TEXT, &p1,
+                                               sqldb_col_TEXT, &p2,
+                                               sqldb_col_UNKNOWN);
+   }
+
+   if (!(sqldb_pipeline_end (db)))
+      ret = false;
+
+   for (size_t i=0; !ret && i<sqldb_pipeline_count (db); i++) {
+      const char *errmsg = NULL;
+      if (!(sqldb_pipeline_result (db, i, NULL, &errmsg))) {
+         LOG_ERR ("[%s] failed for [%s/%s]: %s\n", qname,
+                  emails[i], name, errmsg);
+      }
+   }
+
+   return ret;
 }
 
-bool sqldb_auth_user_find (sqldb_t    *db,
-                           const char *email_pattern,
-                           const char *nick_pattern,
-                           uint64_t   *nitems_dst,
-                           char     ***emails_dst,
-                           char     ***nicks_dst,
-                           uint64_t  **flags_dst,
-                           uint64_t  **ids_dst)
+bool sqldb_auth_group_addusers (sqldb_t    *db,
+                                const char *name,
+                                const char **emails, size_t nemails)
+{
+   uint64_t span = sqldb_span_begin ();
+   bool ret = group_users_pipelined (db, "group_adduser", true,
+                                     name, emails, nemails);
+
+   return span_end (__func__, span, ret);
+}
+
+bool sqldb_auth_group_rmusers (sqldb_t    *db,
+                               const char *name,
+                               const char **emails, size_t nemails)
+{
+   uint64_t span = sqldb_span_begin ();
+   bool ret = group_users_pipelined (db, "group_rmuser", false,
+                                     name, emails, nemails);
+
+   return span_end (__func__, span, ret);
+}
+
+// Decodes the users that match the patterns into a single allocation.
+// Returns the number of users or -1 on error.
+static int64_t user_find_rows (sqldb_t *db, const char *email_pattern,
+                                            const char *nick_pattern,
+                                            sqldb_auth_user_t **dst)
 {
 #define BASE_QS      "SELECT c_email, c_nick, c_id, c_flags FROM t_user "
-   bool error = true;
    const char *qstrings[] = {
       BASE_QS ";",
       BASE_QS " WHERE c_email like #1;",
@@ -886,6 +1159,9 @@ bool sqldb_auth_user_find (sqldb_t    *db,
                    col3 = sqldb_col_UNKNOWN;
 
    sqldb_res_t *res = NULL;
+   int64_t nrows = -1;
+
+   *dst = NULL;
 
    if (!(SVALID (email_pattern)) && !(SVALID (nick_pattern))) {
       qstring = qstrings[0];
@@ -911,124 +1187,85 @@ bool sqldb_auth_user_find (sqldb_t    *db,
       col1 = sqldb_col_TEXT;
    }
 
-   if (!(res = sqldb_exec (db, qstring, col1, &p1, col2, &p2, col3)))
-      goto errorexit;
+   if ((res = exec_flags (db, sqldb_FLAG_STREAMING, qstring,
+                                              col1, &p1, col2, &p2, col3)))
+      nrows = fetch_rows (res, &user_map, (void **)dst);
 
-   *nitems_dst = 0;
+   sqldb_res_del (res);
 
-   if (!(reset_arrayptr (__LINE__, emails_dst, nicks_dst,
-                                   ids_dst, flags_dst,
-                                   NULL)))
-      goto errorexit;
+   return nrows;
+}
 
-   while (sqldb_res_step (res) == 1) {
-      char *email, *nick;
-      uint64_t id, flag;
-
-      uint64_t newlen = *nitems_dst + 1;
-      if (emails_dst) {
-         char **tmp = realloc (*emails_dst, (newlen + 1) * (sizeof *tmp));
-         if (!tmp)
-            goto errorexit;
-         tmp[newlen - 1] = NULL;
-         tmp[newlen] = NULL;
-         *emails_dst = tmp;
-      }
-      if (nicks_dst) {
-         char **tmp = realloc (*nicks_dst, (newlen + 1) * (sizeof *tmp));
-         if (!tmp)
-            goto errorexit;
-         tmp[newlen - 1] = NULL;
-         tmp[newlen] = NULL;
-         *nicks_dst = tmp;
-      }
-      if (ids_dst) {
-         uint64_t *tmp = realloc ((*ids_dst), (newlen + 1) * (sizeof *tmp));
-         if (!tmp)
-            goto errorexit;
-         *ids_dst = tmp;
-      }
-      if (flags_dst) {
-         uint64_t *tmp = realloc ((*flags_dst), (newlen + 1) * (sizeof *tmp));
-         if (!tmp)
-            goto errorexit;
-         *flags_dst = tmp;
-      }
+int64_t sqldb_auth_user_find_rows (sqldb_t            *db,
+                                   const char         *email_pattern,
+                                   const char         *nick_pattern,
+                                   sqldb_auth_user_t **dst)
+{
+   uint64_t span = sqldb_span_begin ();
 
-      if ((sqldb_scan_columns (res, sqldb_col_TEXT,   &email,
-                                    sqldb_col_TEXT,   &nick,
-                                    sqldb_col_UINT64, &id,
-                                    sqldb_col_UINT64, &flag,
-                                    sqldb_col_UNKNOWN))!=4)
-         goto errorexit;
+   int64_t ret = dst ? user_find_rows (db, email_pattern, nick_pattern, dst)
+                     : -1;
 
-      if (emails_dst) {
-         (*emails_dst)[newlen - 1] = email;
-      } else {
-         free (email);
-      }
+   sqldb_span_end ("auth", __func__, span);
+   return ret;
+}
 
-      if (nicks_dst) {
-         (*nicks_dst)[newlen - 1] = nick;
-      } else {
-         free (nick);
-      }
+bool sqldb_auth_user_find (sqldb_t    *db,
+                           const char *email_pattern,
+                           const char *nick_pattern,
+                           uint64_t   *nitems_dst,
+                           char     ***emails_dst,
+                           char     ***nicks_dst,
+                           uint64_t  **flags_dst,
+                           uint64_t  **ids_dst)
+{
+   uint64_t span = sqldb_span_begin ();
 
-      if (ids_dst) {
-         (*ids_dst)[newlen - 1] = id;
-      }
+   bool error = true;
+   sqldb_auth_user_t *rows = NULL;
+   int64_t nrows = 0;
 
-      if (flags_dst) {
-         (*flags_dst)[newlen - 1] = flag;
-      }
+   *nitems_dst = 0;
 
-      *nitems_dst = newlen;
-   }
+   if ((nrows = user_find_rows (db, email_pattern, nick_pattern,
+                                    &rows)) < 0)
+      goto errorexit;
+
+   if (!(rows_strings (emails_dst, rows, nrows, sizeof *rows,
+                                   offsetof (sqldb_auth_user_t, email)))
+         || !(rows_strings (nicks_dst, rows, nrows, sizeof *rows,
+                                       offsetof (sqldb_auth_user_t, nick)))
+         || !(rows_ints (ids_dst, rows, nrows, sizeof *rows,
+                                  offsetof (sqldb_auth_user_t, id)))
+         || !(rows_ints (flags_dst, rows, nrows, sizeof *rows,
+                                    offsetof (sqldb_auth_user_t, flags))))
+      goto errorexit;
+
+   *nitems_dst = nrows;
 
    error = false;
 
 errorexit:
 
    if (error) {
-      if (emails_dst) {
-         for (size_t i=0; emails_dst && *emails_dst && (*emails_dst)[i]; i++) {
-            free ((*emails_dst)[i]);
-         }
-         free (*emails_dst); *emails_dst = NULL;
-      }
-
-      if (nicks_dst) {
-         for (size_t i=0; nicks_dst && *nicks_dst && (*nicks_dst)[i]; i++) {
-            free ((*nicks_dst)[i]);
-         }
-         free (*nicks_dst); *nicks_dst = NULL;
-      }
-
-      if (ids_dst) {
-         free (*ids_dst); *ids_dst = NULL;
-      }
-
-      if (flags_dst) {
-         free (*flags_dst); *flags_dst = NULL;
-      }
-
+      free_strings (emails_dst);
+      free_strings (nicks_dst);
+      free_ints (ids_dst);
+      free_ints (flags_dst);
    }
 
-   sqldb_res_del (res);
+   sqldb_free (rows);
 
-   return !error;
+   return span_end (__func__, span, !error);
 }
 
-bool sqldb_auth_group_find (sqldb_t    *db,
-                            const char *name_pattern,
-                            const char *description_pattern,
-                            uint64_t   *nitems_dst,
-                            char     ***names_dst,
-                            char     ***descriptions_dst,
-                            uint64_t  **ids_dst)
+// Decodes the groups that match the patterns into a single allocation.
+// Returns the number of groups or -1 on error.
+static int64_t group_find_rows (sqldb_t *db, const char *name_pattern,
+                                             const char *description_pattern,
+                                             sqldb_auth_group_t **dst)
 {
 #define BASE_QS      "SELECT c_name, c_description, c_id FROM t_group "
-   bool error = true;
    const char *qstrings[] = {
       BASE_QS ";",
       BASE_QS " WHERE c_name like #1;",
@@ -1047,6 +1284,9 @@ bool sqldb_auth_group_find (sqldb_t    *db,
                    col3 = sqldb_col_UNKNOWN;
 
    sqldb_res_t *res = NULL;
+   int64_t nrows = -1;
+
+   *dst = NULL;
 
    if (!(SVALID (name_pattern)) && !(SVALID (description_pattern))) {
       qstring = qstrings[0];
@@ -1072,233 +1312,168 @@ bool sqldb_auth_group_find (sqldb_t    *db,
       col1 = sqldb_col_TEXT;
    }
 
-   if (!(res = sqldb_exec (db, qstring, col1, &p1, col2, &p2, col3))) {
+   if (!(res = exec_flags (db, sqldb_FLAG_STREAMING, qstring,
+                                              col1, &p1, col2, &p2, col3))) {
       LOG_ERR ("Failed to execute [%s]\n", qstring);
-      goto errorexit;
+      return -1;
    }
 
-   *nitems_dst = 0;
+   nrows = fetch_rows (res, &group_map, (void **)dst);
 
-   if (!(reset_arrayptr (__LINE__, names_dst, descriptions_dst, ids_dst,
-                                   NULL)))
-      goto errorexit;
+   sqldb_res_del (res);
 
+   return nrows;
+}
 
-   while (sqldb_res_step (res) == 1) {
-      char *name, *description;
-      uint64_t id;
+int64_t sqldb_auth_group_find_rows (sqldb_t             *db,
+                                    const char          *name_pattern,
+                                    const char          *description_pattern,
+                                    sqldb_auth_group_t **dst)
+{
+   uint64_t span = sqldb_span_begin ();
 
-      uint32_t ncols = 0;
+   int64_t ret = dst ? group_find_rows (db, name_pattern,
+                                            description_pattern, dst)
+                     : -1;
 
-      uint64_t newlen = *nitems_dst + 1;
-      if (names_dst) {
-         char **tmp = realloc (*names_dst, (newlen + 1) * (sizeof *tmp));
-         if (!tmp) {
-            LOG_ERR ("OOM error\n");
-            goto errorexit;
-         }
-         tmp[newlen - 1] = NULL;
-         tmp[newlen] = NULL;
-         *names_dst = tmp;
-      }
-      if (descriptions_dst) {
-         char **tmp = realloc (*descriptions_dst, (newlen + 1) * (sizeof *tmp));
-         if (!tmp) {
-            LOG_ERR ("OOM error\n");
-            goto errorexit;
-         }
-         tmp[newlen - 1] = NULL;
-         tmp[newlen] = NULL;
-         *descriptions_dst = tmp;
-      }
-      if (ids_dst) {
-         uint64_t *tmp = realloc ((*ids_dst), (newlen + 1) * (sizeof *tmp));
-         if (!tmp) {
-            LOG_ERR ("OOM error\n");
-            goto errorexit;
-         }
-         *ids_dst = tmp;
-      }
+   sqldb_span_end ("auth", __func__, span);
+   return ret;
+}
 
-      if ((ncols = (sqldb_scan_columns (res, sqldb_col_TEXT,   &name,
-                                             sqldb_col_TEXT,   &description,
-                                             sqldb_col_UINT64, &id,
-                                             sqldb_col_UNKNOWN)))!=3) {
-         LOG_ERR ("Scan failure [%u, expected 3]\n", ncols);
-         goto errorexit;
-      }
+bool sqldb_auth_group_find (sqldb_t    *db,
+                            const char *name_pattern,
+                            const char *description_pattern,
+                            uint64_t   *nitems_dst,
+                            char     ***names_dst,
+                            char     ***descriptions_dst,
+                            uint64_t  **ids_dst)
+{
+   uint64_t span = sqldb_span_begin ();
 
-      if (names_dst) {
-         (*names_dst)[newlen - 1] = name;
-      } else {
-         free (name);
-      }
+   bool error = true;
+   sqldb_auth_group_t *rows = NULL;
+   int64_t nrows = 0;
 
-      if (descriptions_dst) {
-         (*descriptions_dst)[newlen - 1] = description;
-      } else {
-         free (description);
-      }
+   *nitems_dst = 0;
 
-      if (ids_dst) {
-         (*ids_dst)[newlen - 1] = id;
-      }
+   if ((nrows = group_find_rows (db, name_pattern, description_pattern,
+                                     &rows)) < 0)
+      goto errorexit;
 
-      *nitems_dst = newlen;
-   }
+   if (!(rows_strings (names_dst, rows, nrows, sizeof *rows,
+                                  offsetof (sqldb_auth_group_t, name)))
+         || !(rows_strings (descriptions_dst, rows, nrows, sizeof *rows,
+                              offsetof (sqldb_auth_group_t, description)))
+         || !(rows_ints (ids_dst, rows, nrows, sizeof *rows,
+                                  offsetof (sqldb_auth_group_t, id))))
+      goto errorexit;
+
+   *nitems_dst = nrows;
 
    error = false;
 
 errorexit:
 
    if (error) {
-      if (names_dst) {
-         for (size_t i=0; names_dst && (*names_dst) && (*names_dst)[i]; i++) {
-            free ((*names_dst)[i]);
-         }
-         free (*names_dst); *names_dst = NULL;
-      }
-
-      if (descriptions_dst) {
-         for (size_t i=0; descriptions_dst && (*descriptions_dst) && (*descriptions_dst)[i]; i++) {
-            free ((*descriptions_dst)[i]);
-         }
-         free (*descriptions_dst); *descriptions_dst = NULL;
-      }
+      free_strings (names_dst);
+      free_strings (descriptions_dst);
+      free_ints (ids_dst);
    }
 
-   sqldb_res_del (res);
+   sqldb_free (rows);
 
-   return !error;
+   return span_end (__func__, span, !error);
 
 }
 
-bool sqldb_auth_group_membership (sqldb_t    *db,
-                                  const char *name,
-                                  uint64_t   *nitems_dst,
-                                  char     ***emails_dst,
-                                  char     ***nicks_dst,
-                                  uint64_t  **flags_dst,
-                                  uint64_t  **ids_dst)
-
+// Decodes the members of the group into a single allocation. Returns the
+// number of members or -1 on error.
+static int64_t group_membership_rows (sqldb_t *db, const char *name,
+                                      sqldb_auth_user_t **dst)
 {
-   bool error = true;
-
    const char *qstring = NULL;
    sqldb_res_t *res = NULL;
+   int64_t nrows = -1;
+
+   *dst = NULL;
 
    if (!(qstring = sqldb_auth_query ("group_membership"))) {
-      goto errorexit;
+      return -1;
    }
 
-   if (!(res = sqldb_exec (db, qstring, sqldb_col_TEXT, &name,
-                                        sqldb_col_UNKNOWN))) {
+   if (!(res = exec_flags (db, sqldb_FLAG_STREAMING, qstring,
+                                              sqldb_col_TEXT, &name,
+                                              sqldb_col_UNKNOWN))) {
       LOG_ERR ("Failed to execute [%s]: %s\n", qstring, sqldb_lasterr (db));
-      goto errorexit;
+      return -1;
    }
 
-   *nitems_dst = 0;
+   nrows = fetch_rows (res, &user_map, (void **)dst);
 
-   if (!(reset_arrayptr (__LINE__, emails_dst, nicks_dst,
-                                   ids_dst, flags_dst, NULL)))
-      goto errorexit;
+   sqldb_res_del (res);
 
-   while (sqldb_res_step (res) == 1) {
-      char *email, *nick;
-      uint64_t id, flag;
-
-      uint64_t newlen = *nitems_dst + 1;
-      if (emails_dst) {
-         char **tmp = realloc (*emails_dst, (newlen + 1) * (sizeof *tmp));
-         if (!tmp)
-            goto errorexit;
-         tmp[newlen - 1] = NULL;
-         tmp[newlen] = NULL;
-         *emails_dst = tmp;
-      }
-      if (nicks_dst) {
-         char **tmp = realloc (*nicks_dst, (newlen + 1) * (sizeof *tmp));
-         if (!tmp)
-            goto errorexit;
-         tmp[newlen - 1] = NULL;
-         tmp[newlen] = NULL;
-         *nicks_dst = tmp;
-      }
-      if (ids_dst) {
-         uint64_t *tmp = realloc ((*ids_dst), (newlen + 1) * (sizeof *tmp));
-         if (!tmp)
-            goto errorexit;
-         *ids_dst = tmp;
-      }
-      if (flags_dst) {
-         uint64_t *tmp = realloc ((*flags_dst), (newlen + 1) * (sizeof *tmp));
-         if (!tmp)
-            goto errorexit;
-         *flags_dst = tmp;
-      }
+   return nrows;
+}
 
-      if ((sqldb_scan_columns (res, sqldb_col_TEXT,   &email,
-                                    sqldb_col_TEXT,   &nick,
-                                    sqldb_col_UINT64, &id,
-                                    sqldb_col_UINT64, &flag,
-                                    sqldb_col_UNKNOWN))!=4)
-         goto errorexit;
+int64_t sqldb_auth_group_membership_rows (sqldb_t            *db,
+                                          const char         *name,
+                                          sqldb_auth_user_t **dst)
+{
+   uint64_t span = sqldb_span_begin ();
 
-      if (emails_dst) {
-         (*emails_dst)[newlen - 1] = email;
-      } else {
-         free (email);
-      }
+   int64_t ret = dst ? group_membership_rows (db, name, dst) : -1;
 
-      if (nicks_dst) {
-         (*nicks_dst)[newlen - 1] = nick;
-      } else {
-         free (nick);
-      }
+   sqldb_span_end ("auth", __func__, span);
+   return ret;
+}
 
-      if (ids_dst) {
-         (*ids_dst)[newlen - 1] = id;
-      }
+bool sqldb_auth_group_membership (sqldb_t    *db,
+                                  const char *name,
+                                  uint64_t   *nitems_dst,
+                                  char     ***emails_dst,
+                                  char     ***nicks_dst,
+                                  uint64_t  **flags_dst,
+                                  uint64_t  **ids_dst)
 
-      if (flags_dst) {
-         (*flags_dst)[newlen - 1] = flag;
-      }
+{
+   uint64_t span = sqldb_span_begin ();
 
-      *nitems_dst = newlen;
-   }
+   bool error = true;
 
-   error = false;
+   sqldb_auth_user_t *rows = NULL;
+   int64_t nrows = 0;
 
-errorexit:
+   *nitems_dst = 0;
 
-   if (error) {
-      if (emails_dst) {
-         for (size_t i=0; emails_dst && *emails_dst && (*emails_dst)[i]; i++) {
-            free ((*emails_dst)[i]);
-         }
-         free (*emails_dst); *emails_dst = NULL;
-      }
+   if ((nrows = group_membership_rows (db, name, &rows)) < 0)
+      goto errorexit;
 
-      if (nicks_dst) {
-         for (size_t i=0; nicks_dst && *nicks_dst && (*nicks_dst)[i]; i++) {
-            free ((*nicks_dst)[i]);
-         }
-         free (*nicks_dst); *nicks_dst = NULL;
-      }
+   if (!(rows_strings (emails_dst, rows, nrows, sizeof *rows,
+                                   offsetof (sqldb_auth_user_t, email)))
+         || !(rows_strings (nicks_dst, rows, nrows, sizeof *rows,
+                                       offsetof (sqldb_auth_user_t, nick)))
+         || !(rows_ints (ids_dst, rows, nrows, sizeof *rows,
+                                  offsetof (sqldb_auth_user_t, id)))
+         || !(rows_ints (flags_dst, rows, nrows, sizeof *rows,
+                                    offsetof (sqldb_auth_user_t, flags))))
+      goto errorexit;
 
-      if (ids_dst) {
-         free (*ids_dst); *ids_dst = NULL;
-      }
+   *nitems_dst = nrows;
 
-      if (flags_dst) {
-         free (*flags_dst); *flags_dst = NULL;
-      }
+   error = false;
+
+errorexit:
 
+   if (error) {
+      free_strings (emails_dst);
+      free_strings (nicks_dst);
+      free_ints (ids_dst);
+      free_ints (flags_dst);
    }
 
-   sqldb_res_del (res);
+   sqldb_free (rows);
 
-   return !error;
+   return span_end (__func__, span, !error);
 }
 
 bool sqldb_auth_perms_grant_user (sqldb_t    *db,
@@ -1306,16 +1481,18 @@ bool sqldb_auth_perms_grant_user (sqldb_t    *db,
                                   const char *resource,
                                   uint64_t    perms)
 {
+   uint64_t span = sqldb_span_begin ();
+
    const char *qstring = NULL;
    uint64_t rc = 0;
 
    if (!db ||
        !SVALID (resource) || !SVALID (email))
-      return false;
+      return span_end (__func__, span, false);
 
    if (!(qstring = sqldb_auth_query ("perms_user_grant"))) {
       LOG_ERR ("Failed to find query string [perms_user_grant]\n");
-      return false;
+      return span_end (__func__, span, false);
    }
 
    rc = sqldb_exec_ignore (db, qstring, sqldb_col_TEXT,     &resource,
@@ -1326,10 +1503,10 @@ bool sqldb_auth_perms_grant_user (sqldb_t    *db,
    if (rc == (uint64_t)-1) {
       LOG_ERR ("Failed to execute [%s]:\n%s\n", qstring,
                                                 sqldb_lasterr (db));
-      return false;
+      return span_end (__func__, span, false);
    }
 
-   return true;
+   return span_end (__func__, span, true);
 }
 
 bool sqldb_auth_perms_revoke_user (sqldb_t   *db,
@@ -1337,16 +1514,18 @@ bool sqldb_auth_perms_revoke_user (sqldb_t   *db,
                                    const char *resource,
                                    uint64_t    perms)
 {
+   uint64_t span = sqldb_span_begin ();
+
    const char *qstring = NULL;
    uint64_t rc = 0;
 
    if (!db ||
        !SVALID (resource) || !SVALID (email))
-      return false;
+      return span_end (__func__, span, false);
 
    if (!(qstring = sqldb_auth_query ("perms_user_revoke"))) {
       LOG_ERR ("Failed to find query string [perms_user_revoke]\n");
-      return false;
+      return span_end (__func__, span, false);
    }
 
    rc = sqldb_exec_ignore (db, qstring, sqldb_col_TEXT,     &resource,
@@ -1357,10 +1536,10 @@ bool sqldb_auth_perms_revoke_user (sqldb_t   *db,
    if (rc == (uint64_t)-1) {
       LOG_ERR ("Failed to execute [%s]:\n%s\n", qstring,
                                                 sqldb_lasterr (db));
-      return false;
+      return span_end (__func__, span, false);
    }
 
-   return true;
+   return span_end (__func__, span, true);
 }
 
 bool sqldb_auth_perms_grant_group (sqldb_t    *db,
@@ -1368,16 +1547,18 @@ bool sqldb_auth_perms_grant_group (sqldb_t    *db,
                                    const char *resource,
                                    uint64_t    perms)
 {
+   uint64_t span = sqldb_span_begin ();
+
    const char *qstring = NULL;
    uint64_t rc = 0;
 
    if (!db ||
        !SVALID (resource) || !SVALID (name))
-      return false;
+      return span_end (__func__, span, false);
 
    if (!(qstring = sqldb_auth_query ("perms_group_grant"))) {
       LOG_ERR ("Failed to find query string [perms_group_grant]\n");
-      return false;
+      return span_end (__func__, span, false);
    }
 
    rc = sqldb_exec_ignore (db, qstring, sqldb_col_TEXT,     &resource,
@@ -1388,10 +1569,10 @@ bool sqldb_auth_perms_grant_group (sqldb_t    *db,
    if (rc == (uint64_t)-1) {
       LOG_ERR ("Failed to execute [%s]:\n%s\n", qstring,
                                                 sqldb_lasterr (db));
-      return false;
+      return span_end (__func__, span, false);
    }
 
-   return true;
+   return span_end (__func__, span, true);
 }
 
 bool sqldb_auth_perms_revoke_group (sqldb_t   *db,
@@ -1399,16 +1580,18 @@ bool sqldb_auth_perms_revoke_group (sqldb_t   *db,
                                     const char *resource,
                                     uint64_t    perms)
 {
+   uint64_t span = sqldb_span_begin ();
+
    const char *qstring = NULL;
    uint64_t rc = 0;
 
    if (!db ||
        !SVALID (resource) || !SVALID (name))
-      return false;
+      return span_end (__func__, span, false);
 
    if (!(qstring = sqldb_auth_query ("perms_group_revoke"))) {
       LOG_ERR ("Failed to find query string [perms_group_revoke]\n");
-      return false;
+      return span_end (__func__, span, false);
    }
 
    rc = sqldb_exec_ignore (db, qstring, sqldb_col_TEXT,     &resource,
@@ -1419,10 +1602,10 @@ bool sqldb_auth_perms_revoke_group (sqldb_t   *db,
    if (rc == (uint64_t)-1) {
       LOG_ERR ("Failed to execute [%s]:\n%s\n", qstring,
                                                 sqldb_lasterr (db));
-      return false;
+      return span_end (__func__, span, false);
    }
 
-   return true;
+   return span_end (__func__, span, true);
 }
 
 bool sqldb_auth_perms_get_user (sqldb_t      *db,
@@ -1430,13 +1613,15 @@ bool sqldb_auth_perms_get_user (sqldb_t      *db,
                                 const char   *email,
                                 const char   *resource)
 {
+   uint64_t span = sqldb_span_begin ();
+
    bool error = true;
    sqldb_res_t *res = NULL;
    const char *qstring = NULL;
 
    if (!db || !perms_dst ||
        !SVALID (resource) || !SVALID (email))
-      return false;
+      return span_end (__func__, span, false);
 
    if (!(qstring = sqldb_auth_query ("perms_get_user"))) {
       LOG_ERR ("Failed to find query for [perms_get_user]\n");
@@ -1475,7 +1660,7 @@ errorexit:
 
    sqldb_res_del (res);
 
-   return !error;
+   return span_end (__func__, span, !error);
 }
 
 bool sqldb_auth_perms_get_group (sqldb_t     *db,
@@ -1483,13 +1668,15 @@ bool sqldb_auth_perms_get_group (sqldb_t     *db,
                                  const char  *name,
                                  const char  *resource)
 {
+   uint64_t span = sqldb_span_begin ();
+
    bool error = true;
    sqldb_res_t *res = NULL;
    const char *qstring = NULL;
 
    if (!db || !perms_dst ||
        !SVALID (resource) || !SVALID (name))
-      return false;
+      return span_end (__func__, span, false);
 
    if (!(qstring = sqldb_auth_query ("perms_get_group"))) {
       LOG_ERR ("Failed to find query for [perms_get_group]\n");
@@ -1528,7 +1715,7 @@ errorexit:
 
    sqldb_res_del (res);
 
-   return !error;
+   return span_end (__func__, span, !error);
 }
 
 bool sqldb_auth_perms_get_all (sqldb_t    *db,
@@ -1536,6 +1723,8 @@ bool sqldb_auth_perms_get_all (sqldb_t    *db,
                                const char *email,
                                const char *resource)
 {
+   uint64_t span = sqldb_span_begin ();
+
    bool error = true;
    sqldb_res_t *res = NULL;
    const char *qstring = NULL;
@@ -1543,7 +1732,7 @@ bool sqldb_auth_perms_get_all (sqldb_t    *db,
 
    if (!db || !perms_dst ||
        !SVALID (resource) || !SVALID (email))
-      return false;
+      return span_end (__func__, span, false);
 
    if (!(sqldb_auth_perms_get_user (db, perms_dst, email, resource))) {
       LOG_ERR ("Failed to get permissions for user [%s]\n", email);
@@ -1590,5 +1779,5 @@ errorexit:
 
    sqldb_res_del (res);
 
-   return !error;
+   return span_end (__func__, span, !error);
 }
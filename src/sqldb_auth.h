@@ -36,6 +36,22 @@
  * properly authorised.
  */
 
+// A single user or group record, as returned by the listings that hand
+// the caller every record in a single allocation, e.g.
+// sqldb_auth_user_find_rows().
+typedef struct {
+   char       *email;
+   char       *nick;
+   uint64_t    id;
+   uint64_t    flags;
+} sqldb_auth_user_t;
+
+typedef struct {
+   char       *name;
+   char       *description;
+   uint64_t    id;
+} sqldb_auth_group_t;
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -188,6 +204,18 @@ extern "C" {
    bool sqldb_auth_group_rmuser (sqldb_t    *db,
                                  const char *name, const char *email);
 
+   // Add (or remove) each of the nemails users specified in the emails
+   // array to (or from) the specified group. All the statements are sent
+   // in a single pipeline (see sqldb_pipeline_begin()), so either all of
+   // the users are added (or removed) or none are. Returns true on
+   // success and false on failure.
+   bool sqldb_auth_group_addusers (sqldb_t    *db,
+                                   const char *name,
+                                   const char **emails, size_t nemails);
+   bool sqldb_auth_group_rmusers (sqldb_t    *db,
+                                  const char *name,
+                                  const char **emails, size_t nemails);
+
 
    ///////////////////////////////////////////////////////////////////////
 
@@ -217,6 +245,16 @@ extern "C" {
                               uint64_t  **flags_dst,
                               uint64_t  **ids_dst);
 
+   // As sqldb_auth_user_find(), but the users are returned as an array of
+   // structs in dst. The array and all of its strings are in a single
+   // allocation that the caller frees with a single call to
+   // sqldb_free (*dst); dst is set to NULL when no users match. Returns
+   // the number of users, or -1 on error.
+   int64_t sqldb_auth_user_find_rows (sqldb_t            *db,
+                                      const char         *email_pattern,
+                                      const char         *nick_pattern,
+                                      sqldb_auth_user_t **dst);
+
    // Generates a list of group records from the database that match the
    // email_pattern or the nick_pattern. If either pattern is NULL it is
    // ignored.
@@ -242,6 +280,13 @@ extern "C" {
                                char     ***descriptions_dst,
                                uint64_t  **ids_dst);
 
+   // As sqldb_auth_group_find(), but the groups are returned as an array
+   // of structs in a single allocation, see sqldb_auth_user_find_rows().
+   int64_t sqldb_auth_group_find_rows (sqldb_t             *db,
+                                       const char          *name_pattern,
+                                       const char          *description_pattern,
+                                       sqldb_auth_group_t **dst);
+
    // Generates a list of records containing all users who are members of
    // the specified group.
    //
@@ -266,6 +311,13 @@ extern "C" {
                                      uint64_t  **flags_dst,
                                      uint64_t  **ids_dst);
 
+   // As sqldb_auth_group_membership(), but the members are returned as an
+   // array of structs in a single allocation, see
+   // sqldb_auth_user_find_rows().
+   int64_t sqldb_auth_group_membership_rows (sqldb_t            *db,
+                                             const char         *name,
+                                             sqldb_auth_user_t **dst);
+
    ///////////////////////////////////////////////////////////////////////
 
    // Grant the specified permissions to the specified user for the
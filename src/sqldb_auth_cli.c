@@ -59,9 +59,9 @@
 static void string_array_free (char **sarr)
 {
    for (size_t i=0; sarr && sarr[i]; i++) {
-      free (sarr[i]);
+      sqldb_free (sarr[i]);
    }
-   free (sarr);
+   sqldb_free (sarr);
 }
 
 static char **string_array_append (char ***dst, const char *s1, const char *s2)
@@ -72,7 +72,7 @@ static char **string_array_append (char ***dst, const char *s1, const char *s2)
    for (size_t i=0; (*dst) && (*dst)[i]; i++)
       nstr++;
 
-   char **tmp = realloc (*dst, (sizeof **dst) * (nstr + 2));
+   char **tmp = sqldb_realloc (*dst, (sizeof **dst) * (nstr + 2));
    if (!tmp)
       goto errorexit;
 
@@ -80,7 +80,7 @@ static char **string_array_append (char ***dst, const char *s1, const char *s2)
    (*dst)[nstr] = NULL;
    (*dst)[nstr+1] = NULL;
 
-   char *scopy = malloc (strlen (s1) + strlen (s2) + 1);
+   char *scopy = sqldb_malloc (strlen (s1) + strlen (s2) + 1);
    if (!scopy)
       goto errorexit;
 
@@ -157,9 +157,9 @@ static size_t process_args (int argc, char **argv,
 
    size_t ret = 0;
 
-   free (*args);
-   free (*lopts);
-   free (*sopts);
+   sqldb_free (*args);
+   sqldb_free (*lopts);
+   sqldb_free (*sopts);
 
    *args = NULL;
    *lopts = NULL;
@@ -359,12 +359,14 @@ static void print_help_msg (const char *cmd)
 ""
 
 #define GROUP_ADDUSER_MSG    \
-"  group_adduser <name> <email>",\
-"     Add the user specified by <email> to the group specified by <name>.",\
+"  group_adduser <name> <email [email ...]>",\
+"     Add the users specified by one or more <email> to the group specified",\
+"     by <name>. Either all of the users are added or none are.",\
 ""
 #define GROUP_RMUSER_MSG    \
-"  group_rmuser <name> <email>",\
-"     Remove the user specified by <email> from the group specified by <name>.",\
+"  group_rmuser <name> <email [email ...]>",\
+"     Remove the users specified by one or more <email> from the group",\
+"     specified by <name>. Either all of the users are removed or none are.",\
 ""
 #define GROUP_MEMBERS_MSG    \
 "  group_members <name>",\
@@ -489,6 +491,29 @@ static void print_help_msg (const char *cmd)
 "     Specifies the format to display permission or flag bits in. Defaults to",
 "     binary.",
 "",
+" --read-only",
+"     Open the sqlite database read-only.",
+"",
+" --sqlite-journal=<WAL | DELETE | TRUNCATE | PERSIST | MEMORY | OFF>",
+"     The sqlite journal mode. Defaults to 'WAL'.",
+"",
+" --sqlite-synchronous=<OFF | NORMAL | FULL | EXTRA>",
+"     The sqlite synchronous level. Defaults to 'NORMAL'.",
+"",
+" --sqlite-temp-store=<DEFAULT | FILE | MEMORY>",
+"     Where sqlite stores temporary tables. Defaults to 'MEMORY'.",
+"",
+" --sqlite-mmap-size=<bytes>",
+"     How much of the sqlite database to memory-map, or 0 to disable memory",
+"     mapping. Defaults to 268435456 (256MiB).",
+"",
+" --sqlite-cache-size=<size>",
+"     The sqlite page cache size in pages when positive or in KiB when",
+"     negative. Defaults to -65536 (64MiB).",
+"",
+" --sqlite-busy-timeout=<milliseconds>",
+"     How long to wait for a locked sqlite database. Defaults to 5000.",
+"",
 "",
 "----------------",
 "GENERAL COMMANDS",
@@ -576,6 +601,7 @@ PERMS_MSG,
 /* ******************************************************************** */
 
 static sqldb_t *g_db = NULL;
+static sqldb_opts_t g_opts;
 
 /* ******************************************************************** */
 
@@ -642,7 +668,7 @@ static bool cmd_init (char **args)
       goto errorexit;
    }
 
-   if (!(db = sqldb_open (args[2], dbtype))) {
+   if (!(db = sqldb_open_ex (args[2], dbtype, &g_opts))) {
       PROG_ERR ("Unable to open database - %s\n", sqldb_lasterr (db));
       goto errorexit;
    }
@@ -699,13 +725,13 @@ static bool cmd_session_valid (char **args)
 
    if (sqldb_auth_session_valid (g_db, args[1], &email, &nick, &flags, &id)) {
       printf ("true:%s:%s:%" PRIu64 ":%" PRIu64 "\n", email, nick, flags, id);
-      free (email);
-      free (nick);
+      sqldb_free (email);
+      sqldb_free (nick);
       return true;
    }
 
-   free (email);
-   free (nick);
+   sqldb_free (email);
+   sqldb_free (nick);
    printf ("false\n");
    return false;
 }
@@ -754,7 +780,7 @@ static bool cmd_user_info (char **args)
       printf ("--------------------------\n");
    }
 
-   free (nick);
+   sqldb_free (nick);
    return ret;
 }
 
@@ -790,14 +816,14 @@ static bool cmd_user_find (char **args)
    }
 
    for (uint64_t i=0; i<nitems; i++) {
-      free (emails[i]);
-      free (nicks[i]);
+      sqldb_free (emails[i]);
+      sqldb_free (nicks[i]);
    }
 
-   free (emails);
-   free (nicks);
-   free (ids);
-   free (flags);
+   sqldb_free (emails);
+   sqldb_free (nicks);
+   sqldb_free (ids);
+   sqldb_free (flags);
 
    return ret;
 }
@@ -869,7 +895,7 @@ static bool cmd_group_info (char **args)
       printf ("--------------------------\n");
    }
 
-   free (descr);
+   sqldb_free (descr);
    return ret;
 }
 
@@ -904,25 +930,35 @@ static bool cmd_group_find (char **args)
    }
 
    for (uint64_t i=0; i<nitems; i++) {
-      free (names[i]);
-      free (descrs[i]);
+      sqldb_free (names[i]);
+      sqldb_free (descrs[i]);
    }
 
-   free (names);
-   free (descrs);
-   free (ids);
+   sqldb_free (names);
+   sqldb_free (descrs);
+   sqldb_free (ids);
+
+   return ret;
+}
 
+static size_t count_args (char **args)
+{
+   size_t ret = 0;
+   while (args[ret])
+      ret++;
    return ret;
 }
 
 static bool cmd_group_adduser (char **args)
 {
-   return sqldb_auth_group_adduser (g_db, args[1], args[2]);
+   return sqldb_auth_group_addusers (g_db, args[1], (const char **)&args[2],
+                                     count_args (&args[2]));
 }
 
 static bool cmd_group_rmuser (char **args)
 {
-   return sqldb_auth_group_rmuser (g_db, args[1], args[2]);
+   return sqldb_auth_group_rmusers (g_db, args[1], (const char **)&args[2],
+                                    count_args (&args[2]));
 }
 
 static bool cmd_group_members (char **args)
@@ -948,14 +984,14 @@ static bool cmd_group_members (char **args)
    }
 
    for (uint64_t i=0; i<nitems; i++) {
-      free (emails[i]);
-      free (nicks[i]);
+      sqldb_free (emails[i]);
+      sqldb_free (nicks[i]);
    }
 
-   free (emails);
-   free (nicks);
-   free (ids);
-   free (flags);
+   sqldb_free (emails);
+   sqldb_free (nicks);
+   sqldb_free (ids);
+   sqldb_free (flags);
 
    return ret;
 }
@@ -1141,8 +1177,8 @@ int main (int argc, char **argv)
       { "group_info",            cmd_group_info,         2, 2     },
       { "group_find",            cmd_group_find,         3, 3     },
 
-      { "group_adduser",         cmd_group_adduser,      3, 3     },
-      { "group_rmuser",          cmd_group_rmuser,       3, 3     },
+      { "group_adduser",         cmd_group_adduser,      3, 68    },
+      { "group_rmuser",          cmd_group_rmuser,       3, 68    },
       { "group_members",         cmd_group_members,      2, 2     },
 
       { "grant_user",            cmd_grant_user,         4, 68    },
@@ -1163,7 +1199,14 @@ int main (int argc, char **argv)
               *opt_dbtype = NULL,
               *opt_dbconn = NULL,
               *opt_display_bits = NULL,
-              *opt_verbose = NULL;
+              *opt_verbose = NULL,
+              *opt_journal = NULL,
+              *opt_synchronous = NULL,
+              *opt_temp_store = NULL,
+              *opt_mmap_size = NULL,
+              *opt_cache_size = NULL,
+              *opt_busy_timeout = NULL,
+              *opt_read_only = NULL;
    char **args = NULL, **lopts = NULL, **sopts = NULL;
    size_t nopts = 0;
    size_t nargs = 0;
@@ -1182,6 +1225,29 @@ int main (int argc, char **argv)
    opt_dbconn = find_opt (lopts, "database", sopts, 'D');
    opt_display_bits = find_opt (lopts, "display-bits", sopts, 'd');
    opt_verbose = find_opt (lopts, "verbose", sopts, 'v');
+   opt_journal = find_opt (lopts, "sqlite-journal", NULL, 0);
+   opt_synchronous = find_opt (lopts, "sqlite-synchronous", NULL, 0);
+   opt_temp_store = find_opt (lopts, "sqlite-temp-store", NULL, 0);
+   opt_mmap_size = find_opt (lopts, "sqlite-mmap-size", NULL, 0);
+   opt_cache_size = find_opt (lopts, "sqlite-cache-size", NULL, 0);
+   opt_busy_timeout = find_opt (lopts, "sqlite-busy-timeout", NULL, 0);
+   opt_read_only = find_opt (lopts, "read-only", NULL, 0);
+
+   sqldb_opts_default (&g_opts);
+   if (opt_journal)
+      g_opts.journal_mode = opt_journal;
+   if (opt_synchronous)
+      g_opts.synchronous = opt_synchronous;
+   if (opt_temp_store)
+      g_opts.temp_store = opt_temp_store;
+   if (opt_mmap_size)
+      g_opts.mmap_size = strtoll (opt_mmap_size, NULL, 0);
+   if (opt_cache_size)
+      g_opts.cache_size = strtoll (opt_cache_size, NULL, 0);
+   if (opt_busy_timeout)
+      g_opts.busy_timeout_ms = strtoul (opt_busy_timeout, NULL, 0);
+   if (opt_read_only)
+      g_opts.readonly = true;
 
    if (opt_display_bits) {
       disp_perms_func = NULL;
@@ -1289,7 +1355,7 @@ int main (int argc, char **argv)
    if ((strcmp (cmd->cmd, "create"))==0) {
 
       if (dbtype==sqldb_POSTGRES) {
-         if (!(g_db = sqldb_open (dbname, dbtype))) {
+         if (!(g_db = sqldb_open_ex (dbname, dbtype, &g_opts))) {
             PROG_ERR ("Unable to open [%s] database using [%s] connection\n"
                       "Error:%s\n",
                       opt_dbtype, opt_dbconn, sqldb_lasterr (g_db));
@@ -1308,7 +1374,7 @@ int main (int argc, char **argv)
 
 
    /* Open the specified database, using the specified type. */
-   if (!(g_db = sqldb_open (dbname, dbtype))) {
+   if (!(g_db = sqldb_open_ex (dbname, dbtype, &g_opts))) {
       PROG_ERR ("Unable to open [%s] database using [%s] connection\n"
                 "Error:%s\n", opt_dbtype, opt_dbconn, sqldb_lasterr (g_db));
       goto errorexit;
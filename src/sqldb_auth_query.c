@@ -1,7 +1,9 @@
 
 #include <string.h>
 #include <stdio.h>
+#include <stdatomic.h>
 
+#include "sqldb.h"
 #include "sqldb_auth_query.h"
 
 
@@ -245,10 +247,20 @@ static const struct {
 
 static size_t stmts_len = sizeof stmts / sizeof stmts[0];
 
+// Set once the statement's statistics are labelled with its name.
+static atomic_bool labelled[sizeof stmts / sizeof stmts[0]];
+
 const char *sqldb_auth_query (const char *qname)
 {
    for (size_t i=0; i<stmts_len; i++) {
       if (strcmp (stmts[i].name, qname)==0) {
+         // Statistics for the statement are reported under its name.
+         // The label is only recorded while statistics are enabled, so
+         // this is retried until it has been.
+         if (!(atomic_load_explicit (&labelled[i], memory_order_relaxed))
+               && (sqldb_stats_label (stmts[i].stmt, stmts[i].name))) {
+            atomic_store_explicit (&labelled[i], true, memory_order_relaxed);
+         }
          return stmts[i].stmt;
       }
    }
@@ -10,6 +10,7 @@
 #define TESTDB_SQLITE    ("/tmp/testdb.sql3")
 #define TESTDB_POSTGRES  ("postgresql://lelanthran:a@localhost:5432/lelanthran")
 #define TEST_BATCHFILE   ("test-file.sql")
+#define TIMELINE_FILE    ("/tmp/sqldb_auth_timeline.json")
 
 #define PROG_ERR(...)      do {\
       fprintf (stderr, ":%s:%d: ", __FILE__, __LINE__);\
@@ -98,6 +99,21 @@ static bool list_users (sqldb_t *db)
 
    printf ("Found %" PRIu64 " users\n", nitems);
 
+   // The struct listing must return the same users in the same order.
+   sqldb_auth_user_t *rows = NULL;
+   int64_t nrows = sqldb_auth_user_find_rows (db, "t%", NULL, &rows);
+   bool same = nrows==(int64_t)nitems;
+   for (int64_t i=0; same && i<nrows; i++) {
+      same = rows[i].id==ids[i] && rows[i].flags==flags[i]
+          && (strcmp (rows[i].email, emails[i]))==0
+          && (strcmp (rows[i].nick, nicks[i]))==0;
+   }
+   sqldb_free (rows);
+   if (!same) {
+      PROG_ERR ("Struct listing differs [%" PRIi64 " users]\n", nrows);
+      goto errorexit;
+   }
+
    for (uint64_t i=0; i<nitems; i++) {
       uint64_t n_id = 0, n_flags = 0;
       char *n_nick = NULL;
@@ -114,15 +130,15 @@ static bool list_users (sqldb_t *db)
       printf ("I[%" PRIu64 "][%" PRIu64 "][%s][%s]\n",
                n_id, n_flags, n_nick, sess);
 
-      free (emails[i]);
-      free (nicks[i]);
-      free (n_nick);
+      sqldb_free (emails[i]);
+      sqldb_free (nicks[i]);
+      sqldb_free (n_nick);
    }
 
-   free (ids);
-   free (flags);
-   free (emails);
-   free (nicks);
+   sqldb_free (ids);
+   sqldb_free (flags);
+   sqldb_free (emails);
+   sqldb_free (nicks);
 
    error = false;
 
@@ -218,14 +234,14 @@ static bool list_groups (sqldb_t *db)
 
       printf ("I[%" PRIu64 "][%s][%s]\n", n_id, names[i], n_descr);
 
-      free (n_descr);
-      free (names[i]);
-      free (descrs[i]);
+      sqldb_free (n_descr);
+      sqldb_free (names[i]);
+      sqldb_free (descrs[i]);
    }
 
-   free (ids);
-   free (names);
-   free (descrs);
+   sqldb_free (ids);
+   sqldb_free (names);
+   sqldb_free (descrs);
 
    error = false;
 
@@ -271,13 +287,13 @@ static bool list_memberships (sqldb_t *db)
                goto errorexit;
             }
          }
-         free (emails[j]);
-         free (nicks[j]);
+         sqldb_free (emails[j]);
+         sqldb_free (nicks[j]);
       }
-      free (emails);
-      free (nicks);
-      free (ids);
-      free (flags);
+      sqldb_free (emails);
+      sqldb_free (nicks);
+      sqldb_free (ids);
+      sqldb_free (flags);
 
       emails = NULL;
       nicks = NULL;
@@ -312,13 +328,13 @@ static bool list_memberships (sqldb_t *db)
          printf (">>%" PRIu64 ", %" PRIu64 " %s, %s\n", ids[j], flags[j],
                                                         emails[j],
                                                         nicks[j]);
-         free (emails[j]);
-         free (nicks[j]);
+         sqldb_free (emails[j]);
+         sqldb_free (nicks[j]);
       }
-      free (emails);
-      free (nicks);
-      free (ids);
-      free (flags);
+      sqldb_free (emails);
+      sqldb_free (nicks);
+      sqldb_free (ids);
+      sqldb_free (flags);
 
       emails = NULL;
       nicks = NULL;
@@ -349,10 +365,10 @@ static bool list_user_membership (sqldb_t *db)
       printf ("[%s/%" PRIu64 "]:", users[i].email, n_groups);
       for (size_t i=0; groups && groups[i]; i++) {
          printf (" %s", groups[i]);
-         free (groups[i]);
+         sqldb_free (groups[i]);
       }
       printf ("\n");
-      free (groups);
+      sqldb_free (groups);
       groups = NULL;
    }
 
@@ -361,9 +377,9 @@ static bool list_user_membership (sqldb_t *db)
 errorexit:
 
    for (size_t i=0; groups && groups[i]; i++) {
-      free (groups[i]);
+      sqldb_free (groups[i]);
    }
-   free (groups);
+   sqldb_free (groups);
 
    return !error;
 }
@@ -376,6 +392,7 @@ int main (int argc, char **argv)
    const char *dbname = NULL;
 
    sqldb_t *db = NULL;
+   FILE *timeline = NULL;
 
    PROG_ERR ("Testing sqldb_auth version [%s]\n", SQLDB_VERSION);
    if (argc <= 1) {
@@ -398,6 +415,12 @@ int main (int argc, char **argv)
       return EXIT_FAILURE;
    }
 
+   // The timeline of the test can be loaded into a trace viewer.
+   if (!(sqldb_timeline_enable (64 * 1024))) {
+      PROG_ERR ("Failed to enable the timeline\n");
+      goto errorexit;
+   }
+
    if (!(db = sqldb_open (dbname, dbtype))) {
       PROG_ERR ("Unable to open database - (%m) %s\n", sqldb_lasterr (db));
       goto errorexit;
@@ -440,10 +463,20 @@ int main (int argc, char **argv)
       goto errorexit;
    }
 
+   if (!(timeline = fopen (TIMELINE_FILE, "w"))
+         || !(sqldb_timeline_dump (timeline))) {
+      PROG_ERR ("Failed to write the timeline to [%s]\n", TIMELINE_FILE);
+      goto errorexit;
+   }
+
    ret = EXIT_SUCCESS;
 
 errorexit:
 
+   if (timeline)
+      fclose (timeline);
+   sqldb_timeline_enable (0);
+
    sqldb_close (db);
 
    return ret;
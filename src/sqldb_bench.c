@@ -0,0 +1,524 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <inttypes.h>
+#include <time.h>
+
+#include "sqldb.h"
+#include "sqldb_auth.h"
+#include "sqldb_auth_query.h"
+#include "sqldb_query.h"
+#include "sha-256.h"
+
+// Microbenchmarks for the hot paths of the library. The results are
+// written to stdout as JSON, one benchmark per line, so that two runs can
+// be compared with:
+//
+//    sqldb_bench [-t MILLISECONDS] [FILTER] > new.json
+//    sqldb_bench compare old.json new.json [THRESHOLD_PERCENT]
+//
+// Each benchmark is repeated until it has run for at least the specified
+// time (200ms by default). Only benchmarks whose names contain FILTER are
+// run. The compare mode exits with a failure when any benchmark is slower
+// than the threshold (10% by default) or allocates more.
+
+#define PROG_ERR(...)      do {\
+      fprintf (stderr, "%s:%i: ", __FILE__, __LINE__);\
+      fprintf (stderr, __VA_ARGS__);\
+} while (0)
+
+#define BENCH_ROWS         (100)
+#define BENCH_MIN_MS       (200)
+#define BENCH_THRESHOLD    (10.0)
+#define BENCH_NAME_LEN     (64)
+#define BENCH_MAX          (64)
+
+#define BENCH_EMAIL        ("bench@example.com")
+#define BENCH_PASSWORD     ("bench-password")
+
+static const char *auth_names[] = {
+   "session_valid", "session_invalidate", "password_valid", "user_create",
+   "user_mod", "user_rm", "user_info", "user_group_membership",
+   "user_flags_set", "user_flags_clear", "user_salt_nick_hash",
+   "user_update_session_id", "group_create", "group_mod", "group_rm",
+   "group_info", "group_adduser", "group_rmuser", "group_membership",
+   "perms_user_grant", "perms_user_revoke", "perms_group_grant",
+   "perms_group_revoke", "perms_get_user", "perms_get_group",
+   "perms_get_all",
+};
+#define NAUTH_NAMES        (sizeof auth_names / sizeof auth_names[0])
+
+/* *****************************************************************
+ * Every allocation made by the library and by sqlite is counted.
+ */
+
+static struct {
+   uint64_t nmalloc;
+   uint64_t nrealloc;
+} g_counts;
+
+static void *count_malloc (void *ctx, size_t len)
+{
+   (void)ctx;
+   g_counts.nmalloc++;
+   return malloc (len);
+}
+
+static void *count_realloc (void *ctx, void *ptr, size_t len)
+{
+   (void)ctx;
+   g_counts.nrealloc++;
+   return realloc (ptr, len);
+}
+
+static void count_free (void *ctx, void *ptr)
+{
+   (void)ctx;
+   free (ptr);
+}
+
+static uint64_t clock_ns (void)
+{
+   struct timespec ts;
+   clock_gettime (CLOCK_MONOTONIC, &ts);
+   return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* *****************************************************************
+ * The benchmarks. Each runs at least nops operations and returns the
+ * number of operations that it ran, or zero on error.
+ */
+
+struct bench_ctx_t {
+   sqldb_t              *db;
+   struct sqldb_query_t  queries[NAUTH_NAMES * 2];
+   size_t                nqueries;
+
+   // For the exec_scan benchmarks
+   sqldb_coltype_t       type;
+   const char           *query;
+};
+
+typedef uint64_t (bench_fn_t) (struct bench_ctx_t *ctx, uint64_t nops);
+
+// Results are accumulated here so that the work is not optimised away.
+static volatile uint64_t g_sink;
+
+// Queries on the uncached execution path are compiled by fix_string(),
+// which is sqldb_tmpl_new() followed by sqldb_tmpl_del().
+static uint64_t bench_fix_string (struct bench_ctx_t *ctx, uint64_t nops)
+{
+   const char *query = sqldb_auth_query ("user_update_session_id");
+
+   (void)ctx;
+   for (uint64_t i=0; i<nops; i++) {
+      sqldb_tmpl_t *tmpl = sqldb_tmpl_new (query);
+      if (!tmpl)
+         return 0;
+      g_sink += sqldb_tmpl_nparams (tmpl);
+      sqldb_tmpl_del (tmpl);
+   }
+
+   return nops;
+}
+
+// Every operation is a single make_hash(), called by sqldb_query_init()
+// for each query.
+static uint64_t bench_make_hash (struct bench_ctx_t *ctx, uint64_t nops)
+{
+   uint64_t ret = 0;
+
+   while (ret < nops) {
+      sqldb_query_init (ctx->queries, ctx->nqueries);
+      ret += ctx->nqueries;
+   }
+
+   return ret;
+}
+
+static uint64_t bench_query_find (struct bench_ctx_t *ctx, uint64_t nops)
+{
+   for (uint64_t i=0; i<nops; i++) {
+      const char *qstring = sqldb_query_find (ctx->queries, ctx->nqueries,
+                                              sqldb_POSTGRES,
+                                              auth_names[i % NAUTH_NAMES]);
+      if (!qstring[0])
+         return 0;
+      g_sink += qstring[0];
+   }
+
+   return nops;
+}
+
+static uint64_t bench_auth_query (struct bench_ctx_t *ctx, uint64_t nops)
+{
+   (void)ctx;
+   for (uint64_t i=0; i<nops; i++) {
+      g_sink += sqldb_auth_query (auth_names[i % NAUTH_NAMES])[0];
+   }
+
+   return nops;
+}
+
+// The input is the length of a typical salt, email, nick and password.
+static uint64_t bench_sha_256 (struct bench_ctx_t *ctx, uint64_t nops)
+{
+   uint8_t input[128];
+   uint8_t hash[32];
+
+   (void)ctx;
+   memset (input, 'x', sizeof input);
+   for (uint64_t i=0; i<nops; i++) {
+      input[0] = (uint8_t)i;
+      calc_sha_256 (hash, input, sizeof input);
+      g_sink += hash[0];
+   }
+
+   return nops;
+}
+
+// make_password_hash() is internal to sqldb_auth, so it is measured
+// through sqldb_auth_user_password_valid(), which fetches the salt and
+// then calls it.
+static uint64_t bench_password_valid (struct bench_ctx_t *ctx, uint64_t nops)
+{
+   for (uint64_t i=0; i<nops; i++) {
+      if (!(sqldb_auth_user_password_valid (ctx->db, BENCH_EMAIL,
+                                                     BENCH_PASSWORD)))
+         return 0;
+   }
+
+   return nops;
+}
+
+// Every operation is a whole execution: the query is executed and all of
+// its BENCH_ROWS rows are stepped through and scanned. The allocations
+// made per execution therefore do not depend on the number of operations.
+static uint64_t bench_exec_scan (struct bench_ctx_t *ctx, uint64_t nops)
+{
+   uint64_t ret = 0;
+
+   while (ret < nops) {
+      sqldb_res_t *res = sqldb_exec (ctx->db, ctx->query, sqldb_col_UNKNOWN);
+      int rc = 0;
+
+      if (!res)
+         return 0;
+
+      while ((rc = sqldb_res_step (res))==1) {
+         uint64_t value = 0;
+         void *ptr = NULL;
+         uint32_t len = 0;
+         uint32_t nscanned = 0;
+
+         switch (ctx->type) {
+            case sqldb_col_TEXT:
+               nscanned = sqldb_scan_columns (res, ctx->type, &ptr,
+                                                   sqldb_col_UNKNOWN);
+               break;
+
+            case sqldb_col_BLOB:
+               nscanned = sqldb_scan_columns (res, ctx->type, &ptr, &len,
+                                                   sqldb_col_UNKNOWN);
+               break;
+
+            default:
+               nscanned = sqldb_scan_columns (res, ctx->type, &value,
+                                                   sqldb_col_UNKNOWN);
+               break;
+         }
+
+         g_sink += value + len;
+         sqldb_free (ptr);
+         if (nscanned!=1) {
+            rc = -1;
+            break;
+         }
+      }
+
+      sqldb_res_del (res);
+      if (rc!=0)
+         return 0;
+      ret++;
+   }
+
+   return ret;
+}
+
+static const struct {
+   const char      *name;
+   bench_fn_t      *fn;
+   sqldb_coltype_t  type;
+   const char      *query;
+} benches[] = {
+   { "fix_string",            bench_fix_string,     0, NULL },
+   { "make_hash",             bench_make_hash,      0, NULL },
+   { "sqldb_query_find",      bench_query_find,     0, NULL },
+   { "sqldb_auth_query",      bench_auth_query,     0, NULL },
+   { "calc_sha_256",          bench_sha_256,        0, NULL },
+   { "make_password_hash",    bench_password_valid, 0, NULL },
+   { "exec_scan_INT32",       bench_exec_scan,      sqldb_col_INT32,
+                                 "select c_int from bench;" },
+   { "exec_scan_UINT32",      bench_exec_scan,      sqldb_col_UINT32,
+                                 "select c_int from bench;" },
+   { "exec_scan_INT64",       bench_exec_scan,      sqldb_col_INT64,
+                                 "select c_big from bench;" },
+   { "exec_scan_UINT64",      bench_exec_scan,      sqldb_col_UINT64,
+                                 "select c_big from bench;" },
+   { "exec_scan_DATETIME",    bench_exec_scan,      sqldb_col_DATETIME,
+                                 "select c_dt from bench;" },
+   { "exec_scan_TEXT",        bench_exec_scan,      sqldb_col_TEXT,
+                                 "select c_text from bench;" },
+   { "exec_scan_BLOB",        bench_exec_scan,      sqldb_col_BLOB,
+                                 "select c_blob from bench;" },
+};
+
+static bool bench_setup (struct bench_ctx_t *ctx)
+{
+   char query[256];
+
+   snprintf (query, sizeof query,
+             "insert into bench "
+             "with recursive n (x) as "
+             "   (select 1 union all select x + 1 from n where x < %i) "
+             "select x, x * 1000000007, datetime (x, 'unixepoch'), "
+             "       'text value ' || x, randomblob (64) from n;",
+             BENCH_ROWS);
+
+   if (!(ctx->db = sqldb_open (":memory:", sqldb_SQLITE))
+         || !(sqldb_batch (ctx->db, "create table bench (c_int int, "
+                                    "c_big int, c_dt text, c_text text, "
+                                    "c_blob blob);",
+                                    query,
+                                    NULL))) {
+      PROG_ERR ("Failed to create the database: %s\n",
+                  sqldb_lasterr (ctx->db));
+      return false;
+   }
+
+   if (!(sqldb_auth_initdb (ctx->db))
+         || (sqldb_auth_user_create (ctx->db, BENCH_EMAIL, "bench",
+                                              BENCH_PASSWORD))==(uint64_t)-1) {
+      PROG_ERR ("Failed to create the auth user: %s\n",
+                  sqldb_lasterr (ctx->db));
+      return false;
+   }
+
+   for (size_t i=0; i<NAUTH_NAMES; i++) {
+      const char *qstring = sqldb_auth_query (auth_names[i]);
+      ctx->queries[ctx->nqueries++] = (struct sqldb_query_t) {
+         sqldb_SQLITE, auth_names[i], qstring, 0,
+      };
+      ctx->queries[ctx->nqueries++] = (struct sqldb_query_t) {
+         sqldb_POSTGRES, auth_names[i], qstring, 0,
+      };
+   }
+   sqldb_query_init (ctx->queries, ctx->nqueries);
+
+   return true;
+}
+
+// Runs the benchmark with more operations each time until it takes at
+// least min_ns, and reports the last run.
+static bool bench_run (struct bench_ctx_t *ctx, size_t index,
+                       uint64_t min_ns, const char *sep)
+{
+   uint64_t nops = 1;
+   uint64_t ndone = 0;
+   uint64_t elapsed = 0;
+   uint64_t nallocs = 0;
+
+   ctx->type = benches[index].type;
+   ctx->query = benches[index].query;
+
+   for (;;) {
+      memset (&g_counts, 0, sizeof g_counts);
+      uint64_t start = clock_ns ();
+      ndone = benches[index].fn (ctx, nops);
+      elapsed = clock_ns () - start;
+      nallocs = g_counts.nmalloc + g_counts.nrealloc;
+
+      if (!ndone) {
+         PROG_ERR ("Benchmark [%s] failed: %s\n", benches[index].name,
+                     sqldb_lasterr (ctx->db));
+         return false;
+      }
+
+      if (elapsed >= min_ns)
+         break;
+
+      // Aim for 20% over the minimum, growing by between 2x and 100x.
+      uint64_t next = elapsed ? (uint64_t)((double)ndone * min_ns * 1.2
+                                             / elapsed)
+                              : ndone * 100;
+      nops = next < ndone * 2 ? ndone * 2
+           : next > ndone * 100 ? ndone * 100
+           : next;
+   }
+
+   printf ("%s{\"name\": \"%s\", \"iterations\": %" PRIu64
+           ", \"ns_per_op\": %.2f, \"allocs_per_op\": %.2f"
+           ", \"ops_per_sec\": %.2f}",
+           sep, benches[index].name, ndone,
+           (double)elapsed / ndone,
+           (double)nallocs / ndone,
+           (double)ndone * 1e9 / elapsed);
+   fflush (stdout);
+
+   return true;
+}
+
+/* *****************************************************************
+ * Comparing two runs.
+ */
+
+struct result_t {
+   char   name[BENCH_NAME_LEN];
+   double ns_per_op;
+   double allocs_per_op;
+};
+
+// Reads the results written by a previous run; each benchmark is on a
+// line of its own. Returns the number read, or -1 on error.
+static int results_read (const char *fname, struct result_t *dst, int max)
+{
+   char line[512];
+   int ret = 0;
+   FILE *inf = fopen (fname, "r");
+
+   if (!inf) {
+      PROG_ERR ("Failed to open [%s]: %m\n", fname);
+      return -1;
+   }
+
+   while (ret < max && fgets (line, sizeof line, inf)) {
+      const char *start = strstr (line, "{\"name\"");
+      if (!start)
+         continue;
+
+      if ((sscanf (start, "{\"name\": \"%63[^\"]\", \"iterations\": %*u"
+                          ", \"ns_per_op\": %lf, \"allocs_per_op\": %lf",
+                          dst[ret].name,
+                          &dst[ret].ns_per_op,
+                          &dst[ret].allocs_per_op))!=3) {
+         PROG_ERR ("Unrecognised result in [%s]: %s", fname, line);
+         ret = -1;
+         break;
+      }
+      ret++;
+   }
+
+   fclose (inf);
+   return ret;
+}
+
+static int bench_compare (const char *oldfile, const char *newfile,
+                          double threshold)
+{
+   struct result_t olds[BENCH_MAX];
+   struct result_t news[BENCH_MAX];
+   int nolds = results_read (oldfile, olds, BENCH_MAX);
+   int nnews = results_read (newfile, news, BENCH_MAX);
+   size_t nregressions = 0;
+
+   if (nolds < 0 || nnews < 0)
+      return EXIT_FAILURE;
+
+   printf ("%-24s %12s %12s %9s %10s %10s\n", "benchmark", "old ns/op",
+           "new ns/op", "change", "old alloc", "new alloc");
+
+   for (int i=0; i<nnews; i++) {
+      const struct result_t *old = NULL;
+      const struct result_t *new = &news[i];
+
+      for (int j=0; j<nolds && !old; j++) {
+         if ((strcmp (olds[j].name, new->name))==0)
+            old = &olds[j];
+      }
+
+      if (!old) {
+         printf ("%-24s %12s %12.2f %9s %10s %10.2f   new\n", new->name,
+                 "-", new->ns_per_op, "-", "-", new->allocs_per_op);
+         continue;
+      }
+
+      double change = old->ns_per_op > 0
+                    ? (new->ns_per_op - old->ns_per_op) * 100.0
+                        / old->ns_per_op
+                    : 0.0;
+      bool regressed = change > threshold
+                     || new->allocs_per_op > old->allocs_per_op + 0.005;
+
+      printf ("%-24s %12.2f %12.2f %+8.1f%% %10.2f %10.2f%s\n", new->name,
+              old->ns_per_op, new->ns_per_op, change,
+              old->allocs_per_op, new->allocs_per_op,
+              regressed ? "   REGRESSED" : "");
+      if (regressed)
+         nregressions++;
+   }
+
+   printf ("%zu regression(s) with a threshold of %.1f%%\n", nregressions,
+           threshold);
+
+   return nregressions ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+int main (int argc, char **argv)
+{
+   int ret = EXIT_FAILURE;
+
+   static struct bench_ctx_t ctx;
+   uint64_t min_ms = BENCH_MIN_MS;
+   const char *filter = "";
+   const char *sep = "\n";
+
+   if (argc > 1 && (strcmp (argv[1], "compare"))==0) {
+      if (argc < 4) {
+         fprintf (stderr, "Usage: %s compare OLD.json NEW.json "
+                          "[THRESHOLD_PERCENT]\n", argv[0]);
+         return EXIT_FAILURE;
+      }
+      return bench_compare (argv[2], argv[3],
+                            argc > 4 ? strtod (argv[4], NULL)
+                                     : BENCH_THRESHOLD);
+   }
+
+   for (int i=1; i<argc; i++) {
+      if ((strcmp (argv[i], "-t"))==0 && i + 1 < argc) {
+         min_ms = strtoull (argv[++i], NULL, 10);
+         continue;
+      }
+      filter = argv[i];
+   }
+
+   if (!(sqldb_set_allocator (count_malloc, count_realloc, count_free,
+                              NULL))) {
+      PROG_ERR ("Failed to set the allocator\n");
+      goto errorexit;
+   }
+
+   if (!(bench_setup (&ctx)))
+      goto errorexit;
+
+   printf ("{\n\"version\": \"%s\",\n\"benchmarks\": [", SQLDB_VERSION);
+   for (size_t i=0; i<sizeof benches / sizeof benches[0]; i++) {
+      if (!(strstr (benches[i].name, filter)))
+         continue;
+
+      if (!(bench_run (&ctx, i, min_ms * 1000000, sep)))
+         goto errorexit;
+      sep = ",\n";
+   }
+   printf ("\n]\n}\n");
+
+   ret = EXIT_SUCCESS;
+
+errorexit:
+   sqldb_close (ctx.db);
+
+   return ret;
+}
+
@@ -0,0 +1,620 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <inttypes.h>
+#include <time.h>
+#include <stdatomic.h>
+
+#include <unistd.h>
+#include <pthread.h>
+
+#include "sqldb.h"
+#include "sqldb_auth.h"
+
+// A load generator for the sqldb_auth module, used to size hardware and
+// to check that throughput scales with the number of threads:
+//
+//    sqldb_loadgen [--option=value ...] sqlite   /path/to/file.sql3
+//    sqldb_loadgen [--option=value ...] postgres postgresql://...
+//
+// The database is first seeded through the sqldb_auth functions with
+// users, groups, memberships and per-resource permissions; an sqlite
+// database is recreated, a postgres database must exist and be empty.
+// Every user is then given a session, after which each thread, with its
+// own connection, runs a random mix of session validations, logins,
+// permission lookups and user searches for the users that it owns. The
+// throughput and latency percentiles of each operation are reported.
+//
+// Options (with their defaults):
+//    --users=1000         Users to seed
+//    --groups=50          Groups to seed
+//    --memberships=3      Groups that each user is a member of
+//    --resources=10       Resources that permissions are granted on
+//    --threads=4          Threads, each with its own connection
+//    --seconds=10         Duration of the run
+//    --mix=80,5,10,5      Relative weights of session_valid,
+//                         session_authenticate, perms_get_all and
+//                         user_find
+//    --no-seed            Use the database seeded by an earlier run with
+//                         the same users, groups and resources
+
+#define PROG_ERR(...)      do {\
+      fprintf (stderr, "%s:%i: ", __FILE__, __LINE__);\
+      fprintf (stderr, __VA_ARGS__);\
+} while (0)
+
+enum op_t {
+   OP_SESSION_VALID = 0,
+   OP_AUTHENTICATE,
+   OP_PERMS,
+   OP_FIND,
+   OP_COUNT
+};
+
+static const char *op_names[] = {
+   "session_valid", "session_authenticate", "perms_get_all", "user_find",
+};
+
+struct config_t {
+   sqldb_dbtype_t  dbtype;
+   const char     *dbname;
+   size_t          nusers;
+   size_t          ngroups;
+   size_t          nmemberships;
+   size_t          nresources;
+   size_t          nthreads;
+   uint64_t        seconds;
+   uint32_t        mix[OP_COUNT];
+   bool            seed;
+};
+
+// The latency of every operation, in nanoseconds.
+struct samples_t {
+   uint64_t *ns;
+   size_t    n;
+   size_t    max;
+   uint64_t  nerrors;
+};
+
+struct thread_t {
+   pthread_t              thread;
+   size_t                 index;
+   const struct config_t *config;
+
+   // The session of every user; a thread only uses those of the users
+   // that it owns.
+   char                 (*sessions)[65];
+
+   struct samples_t       samples[OP_COUNT];
+   bool                   failed;
+};
+
+static atomic_bool g_stop;
+
+static uint64_t clock_ns (void)
+{
+   struct timespec ts;
+   clock_gettime (CLOCK_MONOTONIC, &ts);
+   return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// xorshift64*
+static uint64_t rng_next (uint64_t *state)
+{
+   *state ^= *state >> 12;
+   *state ^= *state << 25;
+   *state ^= *state >> 27;
+   return *state * 0x2545f4914f6cdd1dULL;
+}
+
+static void make_email (char *dst, size_t len, size_t user)
+{
+   snprintf (dst, len, "user%zu@loadgen.test", user);
+}
+
+static void make_password (char *dst, size_t len, size_t user)
+{
+   snprintf (dst, len, "password-%zu", user);
+}
+
+static bool samples_add (struct samples_t *samples, uint64_t ns, bool ok)
+{
+   if (!ok)
+      samples->nerrors++;
+
+   if (samples->n >= samples->max) {
+      size_t newmax = samples->max ? samples->max * 2 : 4096;
+      uint64_t *tmp = realloc (samples->ns, newmax * sizeof *tmp);
+      if (!tmp)
+         return false;
+      samples->ns = tmp;
+      samples->max = newmax;
+   }
+
+   samples->ns[samples->n++] = ns;
+   return true;
+}
+
+/* *****************************************************************
+ * Seeding
+ */
+
+static bool seed (sqldb_t *db, const struct config_t *config)
+{
+   bool error = true;
+   char email[64], nick[32], password[32], group[32], resource[32];
+
+   if (!(sqldb_auth_initdb (db))) {
+      PROG_ERR ("Failed to create the tables (the database must be "
+                "empty): %s\n", sqldb_lasterr (db));
+      return false;
+   }
+
+   if (!(sqldb_tx_begin (db, sqldb_tx_DEFAULT))) {
+      PROG_ERR ("Failed to start the seeding: %s\n", sqldb_lasterr (db));
+      return false;
+   }
+
+   for (size_t i=0; i<config->ngroups; i++) {
+      snprintf (group, sizeof group, "group%zu", i);
+      snprintf (resource, sizeof resource, "resource%zu",
+                i % config->nresources);
+      if ((sqldb_auth_group_create (db, group, "Load generator group"))
+               ==(uint64_t)-1
+            || !(sqldb_auth_perms_grant_group (db, group, resource,
+                                               1ULL << (i % 64)))) {
+         PROG_ERR ("Failed to seed group [%s]: %s\n", group,
+                     sqldb_lasterr (db));
+         goto errorexit;
+      }
+   }
+
+   for (size_t i=0; i<config->nusers; i++) {
+      make_email (email, sizeof email, i);
+      make_password (password, sizeof password, i);
+      snprintf (nick, sizeof nick, "user%zu", i);
+
+      if ((sqldb_auth_user_create (db, email, nick, password))==(uint64_t)-1) {
+         PROG_ERR ("Failed to seed user [%s]: %s\n", email,
+                     sqldb_lasterr (db));
+         goto errorexit;
+      }
+
+      // sqldb_auth_perms_get_all() fails for users without a grant of
+      // their own on the resource, so every user gets one on each.
+      for (size_t j=0; j<config->nresources; j++) {
+         snprintf (resource, sizeof resource, "resource%zu", j);
+         if (!(sqldb_auth_perms_grant_user (db, email, resource,
+                                            1ULL << ((i + j) % 64)))) {
+            PROG_ERR ("Failed to grant [%s] to [%s]: %s\n", resource,
+                        email, sqldb_lasterr (db));
+            goto errorexit;
+         }
+      }
+
+      for (size_t j=0; j<config->nmemberships; j++) {
+         snprintf (group, sizeof group, "group%zu",
+                   (i * 7 + j) % config->ngroups);
+         if (!(sqldb_auth_group_adduser (db, group, email))) {
+            PROG_ERR ("Failed to add [%s] to [%s]: %s\n", email, group,
+                        sqldb_lasterr (db));
+            goto errorexit;
+         }
+      }
+   }
+
+   if (!(sqldb_tx_commit (db))) {
+      PROG_ERR ("Failed to commit the seeding: %s\n", sqldb_lasterr (db));
+      goto errorexit;
+   }
+
+   error = false;
+
+errorexit:
+   if (error)
+      sqldb_tx_rollback (db);
+
+   return !error;
+}
+
+static bool login_all (sqldb_t *db, const struct config_t *config,
+                       char (*sessions)[65])
+{
+   char email[64], password[32];
+
+   if (!(sqldb_tx_begin (db, sqldb_tx_DEFAULT))) {
+      PROG_ERR ("Failed to start the logins: %s\n", sqldb_lasterr (db));
+      return false;
+   }
+
+   for (size_t i=0; i<config->nusers; i++) {
+      make_email (email, sizeof email, i);
+      make_password (password, sizeof password, i);
+      if (!(sqldb_auth_session_authenticate (db, email, password,
+                                             sessions[i]))) {
+         PROG_ERR ("Failed to log in [%s] (was the database seeded with "
+                   "the same options?): %s\n", email, sqldb_lasterr (db));
+         sqldb_tx_rollback (db);
+         return false;
+      }
+   }
+
+   return sqldb_tx_commit (db);
+}
+
+/* *****************************************************************
+ * The load
+ */
+
+static bool run_op (sqldb_t *db, struct thread_t *thread, enum op_t op,
+                    size_t user, uint64_t *rng)
+{
+   const struct config_t *config = thread->config;
+   char email[64], password[32], resource[32], pattern[32];
+   uint64_t perms = 0, nitems = 0;
+   char **emails = NULL, **nicks = NULL;
+   uint64_t *flags = NULL, *ids = NULL;
+   bool ret = false;
+
+   make_email (email, sizeof email, user);
+
+   switch (op) {
+      case OP_SESSION_VALID:
+         return sqldb_auth_session_valid (db, thread->sessions[user],
+                                          NULL, NULL, NULL, NULL);
+
+      case OP_AUTHENTICATE:
+         make_password (password, sizeof password, user);
+         return sqldb_auth_session_authenticate (db, email, password,
+                                                 thread->sessions[user]);
+
+      case OP_PERMS:
+         snprintf (resource, sizeof resource, "resource%" PRIu64,
+                   rng_next (rng) % config->nresources);
+         return sqldb_auth_perms_get_all (db, &perms, email, resource);
+
+      case OP_FIND:
+         snprintf (pattern, sizeof pattern, "user%zu@%%", user);
+         ret = sqldb_auth_user_find (db, pattern, NULL, &nitems, &emails,
+                                     &nicks, &flags, &ids) && nitems==1;
+         for (size_t i=0; emails && emails[i]; i++) {
+            sqldb_free (emails[i]);
+         }
+         for (size_t i=0; nicks && nicks[i]; i++) {
+            sqldb_free (nicks[i]);
+         }
+         sqldb_free (emails);
+         sqldb_free (nicks);
+         sqldb_free (flags);
+         sqldb_free (ids);
+         return ret;
+
+      default:
+         return false;
+   }
+}
+
+static void *thread_run (void *arg)
+{
+   struct thread_t *thread = arg;
+   const struct config_t *config = thread->config;
+   sqldb_t *db = NULL;
+
+   uint64_t rng = (thread->index + 1) * 0x9e3779b97f4a7c15ULL;
+   uint32_t total = 0;
+   size_t nowned = (config->nusers - thread->index - 1)
+                     / config->nthreads + 1;
+
+   for (size_t i=0; i<OP_COUNT; i++) {
+      total += config->mix[i];
+   }
+
+   if (!(db = sqldb_open (config->dbname, config->dbtype))) {
+      PROG_ERR ("Thread %zu failed to connect\n", thread->index);
+      thread->failed = true;
+      return NULL;
+   }
+
+   while (!(atomic_load_explicit (&g_stop, memory_order_relaxed))) {
+      uint32_t pick = rng_next (&rng) % total;
+      enum op_t op = OP_SESSION_VALID;
+      while (pick >= config->mix[op]) {
+         pick -= config->mix[op];
+         op++;
+      }
+
+      size_t user = thread->index
+                  + config->nthreads * (rng_next (&rng) % nowned);
+
+      uint64_t start = clock_ns ();
+      bool ok = run_op (db, thread, op, user, &rng);
+      if (!(samples_add (&thread->samples[op], clock_ns () - start, ok))) {
+         PROG_ERR ("Out of memory in thread %zu\n", thread->index);
+         thread->failed = true;
+         break;
+      }
+   }
+
+   sqldb_close (db);
+   return NULL;
+}
+
+/* *****************************************************************
+ * Reporting
+ */
+
+static int cmp_u64 (const void *lhs, const void *rhs)
+{
+   uint64_t l = *(const uint64_t *)lhs, r = *(const uint64_t *)rhs;
+   return l < r ? -1 : l > r;
+}
+
+// The sample that pct percent of the samples are at or below, in
+// microseconds.
+static double percentile_us (const struct samples_t *samples, double pct)
+{
+   if (!samples->n)
+      return 0.0;
+
+   size_t rank = (size_t)(pct / 100.0 * samples->n + 0.999999);
+   if (rank < 1)
+      rank = 1;
+   if (rank > samples->n)
+      rank = samples->n;
+
+   return samples->ns[rank - 1] / 1000.0;
+}
+
+static void report_line (const char *name, struct samples_t *samples,
+                         double seconds)
+{
+   qsort (samples->ns, samples->n, sizeof *samples->ns, cmp_u64);
+
+   printf ("%-22s %10zu %8" PRIu64 " %10.1f %9.1f %9.1f %9.1f %9.1f\n",
+           name, samples->n, samples->nerrors, samples->n / seconds,
+           percentile_us (samples, 50), percentile_us (samples, 99),
+           percentile_us (samples, 99.9),
+           percentile_us (samples, 100));
+}
+
+static bool report (struct thread_t *threads, const struct config_t *config,
+                    double seconds)
+{
+   struct samples_t merged[OP_COUNT + 1];
+   bool error = true;
+
+   memset (merged, 0, sizeof merged);
+
+   for (size_t i=0; i<config->nthreads; i++) {
+      for (size_t op=0; op<OP_COUNT; op++) {
+         const struct samples_t *src = &threads[i].samples[op];
+         for (size_t s=0; s<src->n; s++) {
+            if (!(samples_add (&merged[op], src->ns[s], true))
+                  || !(samples_add (&merged[OP_COUNT], src->ns[s], true)))
+               goto errorexit;
+         }
+         merged[op].nerrors += src->nerrors;
+         merged[OP_COUNT].nerrors += src->nerrors;
+      }
+   }
+
+   printf ("%zu threads, %zu users, %zu groups, %zu resources, %.1fs\n",
+           config->nthreads, config->nusers, config->ngroups,
+           config->nresources, seconds);
+   printf ("%-22s %10s %8s %10s %9s %9s %9s %9s\n", "operation", "count",
+           "errors", "ops/sec", "p50(us)", "p99(us)", "p999(us)", "max(us)");
+   for (size_t op=0; op<OP_COUNT; op++) {
+      report_line (op_names[op], &merged[op], seconds);
+   }
+   report_line ("total", &merged[OP_COUNT], seconds);
+
+   error = false;
+
+errorexit:
+   for (size_t op=0; op<=OP_COUNT; op++) {
+      free (merged[op].ns);
+   }
+
+   if (error)
+      PROG_ERR ("Out of memory while reporting\n");
+
+   return !error;
+}
+
+/* *****************************************************************
+ * Options
+ */
+
+static bool parse_args (struct config_t *config, int argc, char **argv)
+{
+   size_t npositional = 0;
+
+   for (int i=1; i<argc; i++) {
+      const char *arg = argv[i];
+      const char *value = strchr (arg, '=');
+      size_t *dst = NULL;
+
+      if (arg[0]!='-' || arg[1]!='-') {
+         if (npositional==0) {
+            if ((strcmp (arg, "sqlite"))==0)
+               config->dbtype = sqldb_SQLITE;
+            if ((strcmp (arg, "postgres"))==0)
+               config->dbtype = sqldb_POSTGRES;
+         }
+         if (npositional==1)
+            config->dbname = arg;
+         npositional++;
+         continue;
+      }
+
+      if ((strcmp (arg, "--no-seed"))==0) {
+         config->seed = false;
+         continue;
+      }
+
+      if (!value) {
+         fprintf (stderr, "Option [%s] needs a value\n", arg);
+         return false;
+      }
+      value++;
+
+      if ((strncmp (arg, "--mix=", 6))==0) {
+         if ((sscanf (value, "%u,%u,%u,%u", &config->mix[0],
+                                             &config->mix[1],
+                                             &config->mix[2],
+                                             &config->mix[3]))!=4) {
+            fprintf (stderr, "Option --mix needs four weights\n");
+            return false;
+         }
+         continue;
+      }
+
+      if ((strncmp (arg, "--users=", 8))==0)        dst = &config->nusers;
+      if ((strncmp (arg, "--groups=", 9))==0)       dst = &config->ngroups;
+      if ((strncmp (arg, "--memberships=", 14))==0) dst = &config->nmemberships;
+      if ((strncmp (arg, "--resources=", 12))==0)   dst = &config->nresources;
+      if ((strncmp (arg, "--threads=", 10))==0)     dst = &config->nthreads;
+      if ((strncmp (arg, "--seconds=", 10))==0) {
+         config->seconds = strtoull (value, NULL, 10);
+         continue;
+      }
+
+      if (!dst) {
+         fprintf (stderr, "Unknown option [%s]\n", arg);
+         return false;
+      }
+      *dst = strtoull (value, NULL, 10);
+   }
+
+   if (config->dbtype==sqldb_UNKNOWN || !config->dbname) {
+      fprintf (stderr, "Usage: sqldb_loadgen [--option=value ...] "
+                       "sqlite|postgres DBNAME\n");
+      return false;
+   }
+
+   uint32_t total = 0;
+   for (size_t i=0; i<OP_COUNT; i++) {
+      total += config->mix[i];
+   }
+
+   if (!config->nthreads || config->nusers < config->nthreads
+         || !config->ngroups || !config->nresources
+         || !config->seconds || !total) {
+      fprintf (stderr, "There must be at least one thread, group, "
+                       "resource, second and operation, and at least one "
+                       "user for every thread\n");
+      return false;
+   }
+
+   // A user's memberships are of distinct groups.
+   if (config->nmemberships > config->ngroups) {
+      fprintf (stderr, "There cannot be more memberships (%zu) than "
+                       "groups (%zu)\n", config->nmemberships,
+                       config->ngroups);
+      return false;
+   }
+
+   return true;
+}
+
+int main (int argc, char **argv)
+{
+   int ret = EXIT_FAILURE;
+
+   struct config_t config = {
+      sqldb_UNKNOWN, NULL, 1000, 50, 3, 10, 4, 10, { 80, 5, 10, 5 }, true,
+   };
+   sqldb_t *db = NULL;
+   char (*sessions)[65] = NULL;
+   struct thread_t *threads = NULL;
+   size_t nthreads = 0;
+
+   if (!(parse_args (&config, argc, argv)))
+      return EXIT_FAILURE;
+
+   if (config.dbtype==sqldb_SQLITE && config.seed) {
+      remove (config.dbname);
+      if (!(sqldb_create (NULL, config.dbname, config.dbtype))) {
+         PROG_ERR ("(%s) Could not create database\n", config.dbname);
+         goto errorexit;
+      }
+   }
+
+   if (!(db = sqldb_open (config.dbname, config.dbtype))) {
+      PROG_ERR ("Failed to open [%s]\n", config.dbname);
+      goto errorexit;
+   }
+
+   if (!(sessions = calloc (config.nusers, sizeof *sessions))
+         || !(threads = calloc (config.nthreads, sizeof *threads))) {
+      PROG_ERR ("Out of memory\n");
+      goto errorexit;
+   }
+
+   uint64_t start = clock_ns ();
+   if (config.seed && !(seed (db, &config)))
+      goto errorexit;
+
+   if (!(login_all (db, &config, sessions)))
+      goto errorexit;
+
+   printf ("Seeded and logged in %zu users in %.1fs\n", config.nusers,
+           (clock_ns () - start) / 1e9);
+
+   sqldb_close (db);
+   db = NULL;
+
+   start = clock_ns ();
+   for (size_t i=0; i<config.nthreads; i++) {
+      threads[i].index = i;
+      threads[i].config = &config;
+      threads[i].sessions = sessions;
+      if ((pthread_create (&threads[i].thread, NULL, thread_run,
+                           &threads[i]))!=0) {
+         PROG_ERR ("Failed to start thread %zu\n", i);
+         goto errorexit;
+      }
+      nthreads++;
+   }
+
+   sleep (config.seconds);
+
+   atomic_store (&g_stop, true);
+   for (size_t i=0; i<nthreads; i++) {
+      pthread_join (threads[i].thread, NULL);
+   }
+   nthreads = 0;
+
+   double seconds = (clock_ns () - start) / 1e9;
+
+   for (size_t i=0; i<config.nthreads; i++) {
+      if (threads[i].failed)
+         goto errorexit;
+   }
+
+   if (!(report (threads, &config, seconds)))
+      goto errorexit;
+
+   ret = EXIT_SUCCESS;
+
+errorexit:
+   atomic_store (&g_stop, true);
+   for (size_t i=0; i<nthreads; i++) {
+      pthread_join (threads[i].thread, NULL);
+   }
+
+   for (size_t i=0; threads && i<config.nthreads; i++) {
+      for (size_t op=0; op<OP_COUNT; op++) {
+         free (threads[i].samples[op].ns);
+      }
+   }
+   free (threads);
+   free (sessions);
+   sqldb_close (db);
+
+   return ret;
+}
+
@@ -0,0 +1,363 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include <pthread.h>
+
+#ifdef PLATFORM_Windows
+#include <winsock2.h>
+#define poll            WSAPoll
+#else
+#include <poll.h>
+#endif
+
+#include "sqldb_pool.h"
+
+#define SQLDB_OOM(s)          fprintf (stderr, "OOM [%s]\n", s)
+
+#ifdef DEBUG
+#define PROG_ERR(...)      do {\
+      fprintf (stderr, "%s:%d: ", __FILE__, __LINE__);\
+      fprintf (stderr, __VA_ARGS__);\
+} while (0)
+#else
+#define PROG_ERR(...)
+#endif
+
+// The longest time that sqldb_pool_new() will wait for the initial
+// connections to be established.
+#define POOL_CONNECT_TIMEOUT_MS     (30 * 1000)
+
+struct sqldb_pool_t {
+   char          *dbname;
+   sqldb_dbtype_t type;
+   size_t         nmin;
+   size_t         nmax;
+
+   pthread_mutex_t lock;
+   pthread_cond_t  cond;
+
+   // Idle connections are used in LIFO order so that the most recently
+   // used connection (which is most likely to be warm) is reused first.
+   sqldb_t      **idle;
+   size_t         nidle;
+
+   // All connections that are idle, in use or being established.
+   size_t         nopen;
+
+   sqldb_pool_stats_t stats;
+};
+
+static uint64_t clock_us (void)
+{
+   struct timespec ts;
+   clock_gettime (CLOCK_MONOTONIC, &ts);
+   return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// Open a connection for the pool, starting it without waiting when async
+// is set. A pooled connection is only ever held by one thread at a time,
+// so sqlite connections are opened without their mutex.
+static sqldb_t *pool_open (sqldb_pool_t *pool, bool async)
+{
+   sqldb_opts_t opts;
+
+   if (pool->type==sqldb_SQLITE) {
+      sqldb_opts_default (&opts);
+      opts.nomutex = true;
+      return sqldb_open_ex (pool->dbname, pool->type, &opts);
+   }
+
+   return async ? sqldb_open_start (pool->dbname, pool->type)
+                : sqldb_open (pool->dbname, pool->type);
+}
+
+// Establish pool->nmin connections in parallel and place them in the
+// idle list.
+static bool pool_warmup (sqldb_pool_t *pool)
+{
+   bool error = true;
+   size_t nconns = pool->nmin;
+   sqldb_t **conns = NULL;
+   struct pollfd *pfds = NULL;
+
+   if (!nconns)
+      return true;
+
+   if (!(conns = sqldb_calloc (nconns, sizeof *conns))
+         || !(pfds = sqldb_calloc (nconns, sizeof *pfds))) {
+      SQLDB_OOM (pool->dbname);
+      goto errorexit;
+   }
+
+   for (size_t i=0; i<nconns; i++) {
+      if (!(conns[i] = pool_open (pool, true))) {
+         PROG_ERR ("[%s] Failed to start connection %zu\n",
+                     pool->dbname, i);
+         goto errorexit;
+      }
+   }
+
+   uint64_t deadline = clock_us () + POOL_CONNECT_TIMEOUT_MS * 1000;
+
+   for (;;) {
+      nfds_t npending = 0;
+
+      for (size_t i=0; i<nconns; i++) {
+         switch (sqldb_open_poll (conns[i])) {
+            case sqldb_poll_OK:
+               continue;
+
+            case sqldb_poll_READ:
+               pfds[npending].events = POLLIN;
+               break;
+
+            case sqldb_poll_WRITE:
+               pfds[npending].events = POLLOUT;
+               break;
+
+            default:
+               PROG_ERR ("[%s] Connection %zu failed: %s\n",
+                           pool->dbname, i, sqldb_lasterr (conns[i]));
+               goto errorexit;
+         }
+         pfds[npending].fd = sqldb_socket (conns[i]);
+         pfds[npending].revents = 0;
+         npending++;
+      }
+
+      if (!npending)
+         break;
+
+      uint64_t now = clock_us ();
+      if (now >= deadline) {
+         PROG_ERR ("[%s] Timed out establishing %zu connections\n",
+                     pool->dbname, (size_t)npending);
+         goto errorexit;
+      }
+
+      int timeout_ms = (deadline - now) / 1000 + 1;
+      if ((poll (pfds, npending, timeout_ms)) < 0 && errno!=EINTR) {
+         PROG_ERR ("[%s] poll() failed: %m\n", pool->dbname);
+         goto errorexit;
+      }
+   }
+
+   for (size_t i=0; i<nconns; i++) {
+      pool->idle[pool->nidle++] = conns[i];
+      conns[i] = NULL;
+   }
+
+   pool->nopen = nconns;
+   pool->stats.ncreated = nconns;
+
+   error = false;
+
+errorexit:
+   for (size_t i=0; conns && i<nconns; i++) {
+      sqldb_close (conns[i]);
+   }
+   sqldb_free (conns);
+   sqldb_free (pfds);
+
+   return !error;
+}
+
+sqldb_pool_t *sqldb_pool_new (const char *dbname, sqldb_dbtype_t type,
+                              size_t nmin, size_t nmax)
+{
+   bool error = true;
+   sqldb_pool_t *ret = NULL;
+   pthread_condattr_t attr;
+
+   if (!dbname || !nmax || nmin > nmax) {
+      PROG_ERR ("Invalid pool parameters [%s:%zu-%zu]\n",
+                  dbname, nmin, nmax);
+      return NULL;
+   }
+
+   if (!(ret = sqldb_calloc (1, sizeof *ret))) {
+      SQLDB_OOM (dbname);
+      return NULL;
+   }
+
+   ret->type = type;
+   ret->nmin = nmin;
+   ret->nmax = nmax;
+
+   pthread_mutex_init (&ret->lock, NULL);
+
+   pthread_condattr_init (&attr);
+   pthread_condattr_setclock (&attr, CLOCK_MONOTONIC);
+   pthread_cond_init (&ret->cond, &attr);
+   pthread_condattr_destroy (&attr);
+
+   if (!(ret->dbname = sqldb_malloc (strlen (dbname) + 1))
+         || !(ret->idle = sqldb_calloc (nmax, sizeof *ret->idle))) {
+      SQLDB_OOM (dbname);
+      goto errorexit;
+   }
+   strcpy (ret->dbname, dbname);
+
+   if (!(pool_warmup (ret)))
+      goto errorexit;
+
+   error = false;
+
+errorexit:
+   if (error) {
+      sqldb_pool_del (ret);
+      ret = NULL;
+   }
+
+   return ret;
+}
+
+void sqldb_pool_del (sqldb_pool_t *pool)
+{
+   if (!pool)
+      return;
+
+   if (pool->stats.ninuse) {
+      PROG_ERR ("[%s] Deleting pool with %zu connections in use\n",
+                  pool->dbname, pool->stats.ninuse);
+   }
+
+   for (size_t i=0; i<pool->nidle; i++) {
+      sqldb_close (pool->idle[i]);
+   }
+
+   pthread_cond_destroy (&pool->cond);
+   pthread_mutex_destroy (&pool->lock);
+
+   sqldb_free (pool->idle);
+   sqldb_free (pool->dbname);
+   sqldb_free (pool);
+}
+
+sqldb_t *sqldb_pool_acquire (sqldb_pool_t *pool, uint32_t timeout_ms)
+{
+   sqldb_t *ret = NULL;
+   bool waited = false;
+   int rc = 0;
+
+   if (!pool)
+      return NULL;
+
+   uint64_t start = clock_us ();
+   struct timespec deadline;
+   clock_gettime (CLOCK_MONOTONIC, &deadline);
+   deadline.tv_sec += timeout_ms / 1000;
+   deadline.tv_nsec += (long)(timeout_ms % 1000) * 1000000;
+   if (deadline.tv_nsec >= 1000000000) {
+      deadline.tv_sec++;
+      deadline.tv_nsec -= 1000000000;
+   }
+
+   pthread_mutex_lock (&pool->lock);
+
+   for (;;) {
+      if (pool->nidle) {
+         ret = pool->idle[--pool->nidle];
+         break;
+      }
+
+      // Grow the pool. The slot is reserved before the lock is dropped so
+      // that concurrent callers cannot exceed nmax.
+      if (pool->nopen < pool->nmax) {
+         pool->nopen++;
+         pool->stats.nopening++;
+         pthread_mutex_unlock (&pool->lock);
+
+         ret = pool_open (pool, false);
+
+         pthread_mutex_lock (&pool->lock);
+         pool->stats.nopening--;
+         if (ret) {
+            pool->stats.ncreated++;
+         } else {
+            PROG_ERR ("[%s] Failed to open a new connection\n",
+                        pool->dbname);
+            pool->nopen--;
+            pool->stats.nfailed++;
+            pthread_cond_signal (&pool->cond);
+         }
+         break;
+      }
+
+      if (rc==ETIMEDOUT || timeout_ms==0) {
+         pool->stats.ntimeouts++;
+         break;
+      }
+
+      waited = true;
+      rc = pthread_cond_timedwait (&pool->cond, &pool->lock, &deadline);
+   }
+
+   if (ret) {
+      pool->stats.nacquired++;
+      pool->stats.ninuse++;
+   }
+
+   if (waited) {
+      uint64_t elapsed = clock_us () - start;
+      pool->stats.nwaits++;
+      pool->stats.wait_total_us += elapsed;
+      if (elapsed > pool->stats.wait_max_us)
+         pool->stats.wait_max_us = elapsed;
+   }
+
+   pthread_mutex_unlock (&pool->lock);
+
+   return ret;
+}
+
+void sqldb_pool_release (sqldb_pool_t *pool, sqldb_t *db)
+{
+   if (!pool || !db)
+      return;
+
+   // The check (and any rollback) is done without holding the lock.
+   bool healthy = sqldb_healthcheck (db);
+   if (!healthy) {
+      PROG_ERR ("[%s] Discarding broken connection: %s\n",
+                  pool->dbname, sqldb_lasterr (db));
+      sqldb_close (db);
+      db = NULL;
+   }
+
+   pthread_mutex_lock (&pool->lock);
+
+   pool->stats.ninuse--;
+
+   if (db) {
+      pool->idle[pool->nidle++] = db;
+   } else {
+      pool->nopen--;
+      pool->stats.ndestroyed++;
+      pool->stats.nunhealthy++;
+   }
+
+   pthread_cond_signal (&pool->cond);
+   pthread_mutex_unlock (&pool->lock);
+}
+
+void sqldb_pool_stats (sqldb_pool_t *pool, sqldb_pool_stats_t *dst)
+{
+   if (!dst)
+      return;
+
+   memset (dst, 0, sizeof *dst);
+
+   if (!pool)
+      return;
+
+   pthread_mutex_lock (&pool->lock);
+   *dst = pool->stats;
+   dst->nidle = pool->nidle;
+   pthread_mutex_unlock (&pool->lock);
+}
+
@@ -0,0 +1,76 @@
+
+#ifndef H_SQLDB_POOL
+#define H_SQLDB_POOL
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "sqldb.h"
+
+// A thread-safe pool of connections to a single database. Threads acquire
+// a connection from the pool, use it exclusively and then release it
+// back to the pool.
+//
+// The pool is created with a minimum number of connections that are all
+// established (in parallel) before the pool is returned to the caller.
+// Further connections, up to the maximum, are only established when an
+// acquire finds no idle connection. Every released connection is checked
+// with sqldb_healthcheck(); broken connections are closed and replaced
+// on demand.
+//
+// See the file sqldb_pool_test.c for an example of the usage.
+
+typedef struct sqldb_pool_t sqldb_pool_t;
+
+typedef struct {
+   size_t   nidle;         // Connections waiting in the pool
+   size_t   ninuse;        // Connections acquired and not yet released
+   size_t   nopening;      // Connections currently being established
+
+   uint64_t ncreated;      // Total connections established
+   uint64_t ndestroyed;    // Total connections closed
+   uint64_t nfailed;       // Connections that could not be established
+   uint64_t nunhealthy;    // Released connections that failed the check
+
+   uint64_t nacquired;     // Successful acquisitions
+   uint64_t ntimeouts;     // Acquisitions that timed out
+   uint64_t nwaits;        // Acquisitions that had to wait
+   uint64_t wait_total_us; // Total time spent waiting, in microseconds
+   uint64_t wait_max_us;   // Longest single wait, in microseconds
+} sqldb_pool_stats_t;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+   // Create a new pool of connections to the database dbname of the
+   // specified type. The first nmin connections are established before
+   // this function returns; no more than nmax connections are ever open
+   // at the same time. Returns NULL on error, including when any of the
+   // first nmin connections could not be established.
+   sqldb_pool_t *sqldb_pool_new (const char *dbname, sqldb_dbtype_t type,
+                                 size_t nmin, size_t nmax);
+
+   // Close all the connections in the pool and free the pool. All
+   // acquired connections must be released before calling this function.
+   void sqldb_pool_del (sqldb_pool_t *pool);
+
+   // Acquire a connection from the pool, waiting for at most timeout_ms
+   // milliseconds for a connection to become available. A timeout of
+   // zero does not wait at all. Returns NULL on timeout or error.
+   sqldb_t *sqldb_pool_acquire (sqldb_pool_t *pool, uint32_t timeout_ms);
+
+   // Return a connection to the pool. The caller must not use the
+   // connection after this call. Any open transaction on the connection
+   // is rolled back.
+   void sqldb_pool_release (sqldb_pool_t *pool, sqldb_t *db);
+
+   // Retrieve a snapshot of the statistics for the pool.
+   void sqldb_pool_stats (sqldb_pool_t *pool, sqldb_pool_stats_t *dst);
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif
+
@@ -0,0 +1,215 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include <pthread.h>
+
+#include "sqldb_pool.h"
+
+#define TESTDB_SQLITE    ("/tmp/testdb_pool.sql3")
+
+// This database must exist!
+#define EXISTDB_POSTGRES  ("postgresql://lelanthran:a@localhost:5432/lelanthran")
+
+#define PROG_ERR(...)      do {\
+      fprintf (stderr, "%s:%i: ", __FILE__, __LINE__);\
+      fprintf (stderr, __VA_ARGS__);\
+} while (0)
+
+#define POOL_MIN        (2)
+#define POOL_MAX        (4)
+#define NTHREADS        (8)
+#define NITERATIONS     (200)
+
+static void *worker (void *pool)
+{
+   uintptr_t nerrors = 0;
+
+   for (size_t i=0; i<NITERATIONS; i++) {
+      sqldb_t *db = sqldb_pool_acquire (pool, 5000);
+      if (!db) {
+         PROG_ERR ("Failed to acquire connection\n");
+         nerrors++;
+         continue;
+      }
+
+      uint32_t count = 0;
+      if ((sqldb_exec_and_fetch (db, "select count(*) from pool_test;",
+                                 sqldb_col_UNKNOWN,
+                                 sqldb_col_UINT32, &count,
+                                 sqldb_col_UNKNOWN))!=1 || count!=1) {
+         PROG_ERR ("Query failed [%u]: %s\n", count, sqldb_lasterr (db));
+         nerrors++;
+      }
+
+      sqldb_pool_release (pool, db);
+   }
+
+   return (void *)nerrors;
+}
+
+static void print_stats (sqldb_pool_t *pool, sqldb_pool_stats_t *stats)
+{
+   sqldb_pool_stats (pool, stats);
+   printf ("idle=%zu inuse=%zu opening=%zu created=%" PRIu64
+           " destroyed=%" PRIu64 " failed=%" PRIu64 " unhealthy=%" PRIu64
+           " acquired=%" PRIu64 " timeouts=%" PRIu64 " waits=%" PRIu64
+           " wait_total=%" PRIu64 "us wait_max=%" PRIu64 "us\n",
+           stats->nidle, stats->ninuse, stats->nopening,
+           stats->ncreated, stats->ndestroyed, stats->nfailed,
+           stats->nunhealthy, stats->nacquired, stats->ntimeouts,
+           stats->nwaits, stats->wait_total_us, stats->wait_max_us);
+}
+
+int main (int argc, char **argv)
+{
+   int ret = EXIT_FAILURE;
+
+   sqldb_dbtype_t dbtype = sqldb_UNKNOWN;
+   const char *dbname = NULL;
+   sqldb_t *db = NULL;
+   sqldb_pool_t *pool = NULL;
+   sqldb_t *conns[POOL_MAX];
+   sqldb_pool_stats_t stats;
+   pthread_t threads[NTHREADS];
+   size_t nthreads = 0;
+
+   memset (conns, 0, sizeof conns);
+
+   printf ("Testing sqldb_pool version [%s]\n", SQLDB_VERSION);
+
+   if (argc > 1 && (strcmp (argv[1], "sqlite"))==0) {
+      dbtype = sqldb_SQLITE;
+      dbname = TESTDB_SQLITE;
+   }
+
+   if (argc > 1 && (strcmp (argv[1], "postgres"))==0) {
+      dbtype = sqldb_POSTGRES;
+      dbname = EXISTDB_POSTGRES;
+   }
+
+   if (!dbname) {
+      fprintf (stderr, "Failed to specify one of 'sqlite' or 'postgres'\n");
+      return EXIT_FAILURE;
+   }
+
+   if (dbtype==sqldb_SQLITE) {
+      remove (dbname);
+      if (!(sqldb_create (NULL, dbname, dbtype))) {
+         PROG_ERR ("(%s) Could not create database\n", dbname);
+         goto errorexit;
+      }
+   }
+
+   if (!(db = sqldb_open (dbname, dbtype))
+         || !(sqldb_batch (db, "drop table if exists pool_test;",
+                               "create table pool_test (col_a int);",
+                               "insert into pool_test values (1);",
+                               NULL))) {
+      PROG_ERR ("Unable to prepare database - %s\n", sqldb_lasterr (db));
+      goto errorexit;
+   }
+   sqldb_close (db);
+   db = NULL;
+
+   if (!(pool = sqldb_pool_new (dbname, dbtype, POOL_MIN, POOL_MAX))) {
+      PROG_ERR ("Failed to create pool [%s]\n", dbname);
+      goto errorexit;
+   }
+
+   print_stats (pool, &stats);
+   if (stats.nidle!=POOL_MIN || stats.ncreated!=POOL_MIN) {
+      PROG_ERR ("Pool was not warmed up\n");
+      goto errorexit;
+   }
+
+   // Acquiring every connection must grow the pool to the maximum, after
+   // which an acquire must time out.
+   for (size_t i=0; i<POOL_MAX; i++) {
+      if (!(conns[i] = sqldb_pool_acquire (pool, 0))) {
+         PROG_ERR ("Failed to acquire connection %zu\n", i);
+         goto errorexit;
+      }
+   }
+
+   if ((sqldb_pool_acquire (pool, 50))) {
+      PROG_ERR ("Acquired more than the maximum connections\n");
+      goto errorexit;
+   }
+
+   print_stats (pool, &stats);
+   if (stats.ninuse!=POOL_MAX || stats.ntimeouts!=1 || stats.nwaits!=1) {
+      PROG_ERR ("Incorrect stats after timeout\n");
+      goto errorexit;
+   }
+
+   // A transaction left open must be rolled back on release.
+   if (!(sqldb_batch (conns[0], "BEGIN;",
+                                "insert into pool_test values (2);",
+                                NULL))) {
+      PROG_ERR ("Failed to start transaction: %s\n",
+                  sqldb_lasterr (conns[0]));
+      goto errorexit;
+   }
+
+   for (size_t i=0; i<POOL_MAX; i++) {
+      sqldb_pool_release (pool, conns[i]);
+      conns[i] = NULL;
+   }
+
+   // The write lock held by the transaction must have been released.
+   if (!(conns[0] = sqldb_pool_acquire (pool, 0))
+         || (sqldb_exec_ignore (conns[0], "delete from pool_test where col_a=2;",
+                                          sqldb_col_UNKNOWN))==(uint64_t)-1) {
+      PROG_ERR ("Transaction was not rolled back: %s\n",
+                  sqldb_lasterr (conns[0]));
+      goto errorexit;
+   }
+   sqldb_pool_release (pool, conns[0]);
+   conns[0] = NULL;
+
+   for (size_t i=0; i<NTHREADS; i++) {
+      if ((pthread_create (&threads[i], NULL, worker, pool))!=0) {
+         PROG_ERR ("Failed to start thread %zu\n", i);
+         goto errorexit;
+      }
+      nthreads++;
+   }
+
+   uintptr_t nerrors = 0;
+   for (size_t i=0; i<nthreads; i++) {
+      void *rc = NULL;
+      pthread_join (threads[i], &rc);
+      nerrors += (uintptr_t)rc;
+   }
+   nthreads = 0;
+
+   print_stats (pool, &stats);
+   if (nerrors || stats.ninuse || stats.ncreated > POOL_MAX
+               || stats.nacquired!=POOL_MAX + 1 + NTHREADS * NITERATIONS) {
+      PROG_ERR ("%" PRIuPTR " errors in worker threads\n", nerrors);
+      goto errorexit;
+   }
+
+   ret = EXIT_SUCCESS;
+
+errorexit:
+   for (size_t i=0; i<nthreads; i++) {
+      pthread_join (threads[i], NULL);
+   }
+
+   for (size_t i=0; i<POOL_MAX; i++) {
+      sqldb_pool_release (pool, conns[i]);
+   }
+
+   sqldb_pool_del (pool);
+   sqldb_close (db);
+
+   PROG_ERR ("XXX Test: %s XXX\n", ret==EXIT_SUCCESS ? "passed" : "failed");
+
+   return ret;
+}
+
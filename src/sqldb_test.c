@@ -3,9 +3,17 @@
 #include <stdlib.h>
 #include <stdbool.h>
 #include <string.h>
+#include <stddef.h>
 #include <inttypes.h>
 #include <time.h>
 
+#ifdef PLATFORM_Windows
+#include <winsock2.h>
+#define poll            WSAPoll
+#else
+#include <poll.h>
+#endif
+
 #include "sqldb.h"
 
 #define TESTDB_SQLITE    ("/tmp/testdb.sql3")
@@ -21,6 +29,119 @@
       fprintf (stderr, __VA_ARGS__);\
 } while (0)
 
+// Produces 1000 rows for the bulk loader, and rejects the row after that.
+static int bulk_reader (void *ctx, size_t ncols, const char **fields,
+                                                 size_t *lens)
+{
+   static char id[32];
+   uint32_t *row = ctx;
+
+   if (ncols!=2 || *row > 1000)
+      return -1;
+
+   snprintf (id, sizeof id, "%u", 20000 + *row);
+   fields[0] = id;
+   lens[0] = strlen (id);
+   fields[1] = NULL;
+   lens[1] = 0;
+
+   return (*row)++ < 1000 ? 1 : -1;
+}
+
+static void bulk_progress (void *ctx, uint64_t nrows, double rows_per_sec)
+{
+   (void)ctx;
+   printf ("Bulk loaded %" PRIu64 " rows [%.0f rows/s]\n", nrows,
+                                                        rows_per_sec);
+}
+
+// Fails the first attempt on contention, after which the competing
+// transaction is committed so that the next attempt succeeds.
+static bool tx_contended (sqldb_t *db, void *ctx)
+{
+   sqldb_t **other = ctx;
+   uint32_t id = 5400;
+
+   if ((sqldb_exec_ignore (db, "insert into one values (#1, 'Retried');",
+                               sqldb_col_UINT32, &id,
+                               sqldb_col_UNKNOWN))!=(uint64_t)-1)
+      return true;
+
+   if (*other) {
+      sqldb_tx_commit (*other);
+      sqldb_close (*other);
+      *other = NULL;
+   }
+   return false;
+}
+
+// Counts the allocations made through the allocator hooks.
+struct alloc_counts_t {
+   uint64_t nmalloc;
+   uint64_t nrealloc;
+   uint64_t nfree;
+};
+
+static void *count_malloc (void *ctx, size_t len)
+{
+   ((struct alloc_counts_t *)ctx)->nmalloc++;
+   return malloc (len);
+}
+
+static void *count_realloc (void *ctx, void *ptr, size_t len)
+{
+   ((struct alloc_counts_t *)ctx)->nrealloc++;
+   return realloc (ptr, len);
+}
+
+static void count_free (void *ctx, void *ptr)
+{
+   ((struct alloc_counts_t *)ctx)->nfree++;
+   free (ptr);
+}
+
+// Reads the timeline into dst, returning the number of spans in it (zero
+// if it could not be read).
+static size_t timeline_read (char *dst, size_t len)
+{
+   FILE *tmpf = tmpfile ();
+   size_t nread = 0;
+   size_t ret = 0;
+
+   if (!tmpf || !(sqldb_timeline_dump (tmpf)))
+      goto errorexit;
+
+   rewind (tmpf);
+   nread = fread (dst, 1, len - 1, tmpf);
+   dst[nread] = 0;
+
+   for (const char *s=dst; (s = strstr (s, "\"ph\":\"X\"")); s++) {
+      ret++;
+   }
+
+errorexit:
+   dst[nread] = 0;
+   if (tmpf)
+      fclose (tmpf);
+   return ret;
+}
+
+// Keeps the last statement traced, with its parameters.
+struct trace_log_t {
+   size_t ntraces;
+   char   text[512];
+};
+
+static void trace_log (sqldb_t *db, const sqldb_trace_t *trace, void *ctx)
+{
+   struct trace_log_t *log = ctx;
+
+   (void)db;
+   log->ntraces++;
+   snprintf (log->text, sizeof log->text, "%s %s", trace->query,
+             trace->params ? trace->params : "");
+}
+
 int main (int argc, char **argv)
 {
    static const char *create_stmts[] = {
@@ -42,6 +163,9 @@ NULL,
    sqldb_res_t *res = NULL;
 
    char **colnames = NULL;
+   sqldb_tmpl_t *tmpl = NULL;
+
+   struct alloc_counts_t counts = { 0, 0, 0 };
 
    printf ("Testing sqldb version [%s]\n", SQLDB_VERSION);
    if (argc <= 1) {
@@ -49,6 +173,12 @@ NULL,
       return EXIT_FAILURE;
    }
 
+   if (!(sqldb_set_allocator (count_malloc, count_realloc, count_free,
+                              &counts))) {
+      PROG_ERR ("Failed to set the allocator\n");
+      return EXIT_FAILURE;
+   }
+
    if ((strcmp (argv[1], "sqlite"))==0) {
       dbtype = sqldb_SQLITE;
       dbname = TESTDB_SQLITE;
@@ -92,6 +222,13 @@ NULL,
       goto errorexit;
    }
 
+   // Memory from the counting allocator is in use, so it must not be
+   // replaced.
+   if ((sqldb_set_allocator (NULL, NULL, NULL, NULL))) {
+      PROG_ERR ("Allocator replaced while a connection is open\n");
+      goto errorexit;
+   }
+
    for (size_t i=0; create_stmts[i]; i++) {
       sqldb_res_t *r = sqldb_exec (db, create_stmts[i], sqldb_col_UNKNOWN);
       if (!r) {
@@ -144,6 +281,10 @@ NULL,
       PROG_ERR ("(%s) Error during commit []\n", sqldb_lasterr (db));
       goto errorexit;
    }
+   if (sqldb_res_step (res)!=0) {
+      PROG_ERR ("(%s) Error during commit _step []\n", sqldb_lasterr (db));
+      goto errorexit;
+   }
    sqldb_res_del (res); res = NULL;
 
    /*
@@ -163,6 +304,20 @@ NULL,
 
    PROG_ERR ("Completed parameterised insertion\n");
 
+   // The parameterised insertion above should have been served from the
+   // statement cache after the first execution.
+   {
+      uint64_t hits = 0, misses = 0;
+      size_t nstmts = 0;
+      sqldb_stmt_cache_stats (db, &hits, &misses, &nstmts);
+      printf ("Statement cache: %" PRIu64 " hits, %" PRIu64 " misses, "
+              "%zu statements\n", hits, misses, nstmts);
+      if (hits < 24) {
+         PROG_ERR ("Statement cache was not used [%" PRIu64 " hits]\n", hits);
+         goto errorexit;
+      }
+   }
+
    if (!(inf = fopen (TEST_BATCHFILE, "r"))) {
       PROG_ERR ("Cannot open batchfile [%s] for reading: %m\n",
                   TEST_BATCHFILE);
@@ -175,6 +330,33 @@ NULL,
       goto errorexit;
    }
 
+   // A batchfile run in a transaction must be rolled back entirely when
+   // a statement fails.
+   {
+      FILE *tmpf = tmpfile ();
+      uint32_t count = 0;
+      sqldb_batchfile_opts_t opts = { .transaction = true };
+      if (!tmpf) {
+         PROG_ERR ("Failed to create batchfile\n");
+         goto errorexit;
+      }
+      fprintf (tmpf, "insert into one values (5500, 'a;b');\n"
+                     "-- insert into one values (5501, 'c');\n"
+                     "insert into one values (5500, 'd')");
+      rewind (tmpf);
+      bool ok = sqldb_batchfile_ex (db, tmpf, &opts);
+      fclose (tmpf);
+      sqldb_exec_and_fetch (db, "select count(*) from one "
+                                "where col_a >= 5500 and col_a < 5600;",
+                            sqldb_col_UNKNOWN,
+                            sqldb_col_UINT32, &count,
+                            sqldb_col_UNKNOWN);
+      if (ok || count!=0) {
+         PROG_ERR ("Failed batchfile was not rolled back [%u]\n", count);
+         goto errorexit;
+      }
+   }
+
    res = sqldb_exec (db, "select * from one;", sqldb_col_UNKNOWN);
    if (!res) {
       PROG_ERR ("(%s) Error during _exec []\n", sqldb_lasterr (db));
@@ -214,11 +396,11 @@ NULL,
                                            sqldb_col_UNKNOWN);
       if (num_scanned!=2) {
          PROG_ERR ("(%u) Incomplete scanning of columns\n", num_scanned);
-         free (stringvar);
+         sqldb_free (stringvar);
          goto errorexit;
       }
       printf ("Scanned in %u[%s]\n", intvar, stringvar);
-      free (stringvar);
+      sqldb_free (stringvar);
 
       rc = sqldb_res_step (res);
       if (rc==-1) {
@@ -243,12 +425,12 @@ NULL,
                sqldb_col_UNKNOWN); // End of dest pointers
       if (num_scanned != 2) {
          PROG_ERR ("[%u] Unexpected number of columns scanned\n", num_scanned);
-         free (stringvar);
+         sqldb_free (stringvar);
          goto errorexit;
       }
       printf ("Successfully scanned in single-step: [%u] : [%s]\n", intvar,
                                                                     stringvar);
-      free (stringvar);
+      sqldb_free (stringvar);
    }
    sqldb_res_del (res); res = NULL;
 
@@ -306,16 +488,831 @@ NULL,
       goto errorexit;
    }
 
+   // Test pipelines: the duplicate key in the first pipeline must cause
+   // the entire pipeline to be rolled back.
+   if (!(sqldb_pipeline_begin (db))) {
+      PROG_ERR ("(%s) Failed to start pipeline\n", sqldb_lasterr (db));
+      goto errorexit;
+   }
+   for (uint32_t i=0; i<10; i++) {
+      uint32_t u32 = 8000 + (i==5 ? 0 : i);
+      const char *string = "Pipelined";
+      if (!(sqldb_pipeline_queue (db, "insert into one values (#1, #2)",
+                                      sqldb_col_UINT32, &u32,
+                                      sqldb_col_TEXT,   &string,
+                                      sqldb_col_UNKNOWN))) {
+         PROG_ERR ("(%s) Failed to queue statement %u\n",
+                     sqldb_lasterr (db), i);
+         goto errorexit;
+      }
+   }
+   if ((sqldb_pipeline_end (db))) {
+      PROG_ERR ("Pipeline with a duplicate key succeeded\n");
+      goto errorexit;
+   }
+   printf ("Pipeline failed as expected: %s\n", sqldb_lasterr (db));
+   for (size_t i=0; i<sqldb_pipeline_count (db); i++) {
+      const char *errmsg = NULL;
+      bool ok = sqldb_pipeline_result (db, i, NULL, &errmsg);
+      if (ok != (i < 5)) {
+         PROG_ERR ("Unexpected result for pipeline statement %zu\n", i);
+         goto errorexit;
+      }
+   }
+
+   if (!(sqldb_pipeline_begin (db))
+         || !(sqldb_batch (db, "insert into one values (8100, 'Batch');",
+                               "insert into one values (8101, 'Batch');",
+                               NULL))
+         || !(sqldb_pipeline_queue (db, "update one set col_b=#1 "
+                                        "where col_a >= 8100;",
+                                        sqldb_col_TEXT, &stwo,
+                                        sqldb_col_UNKNOWN))
+         || !(sqldb_pipeline_end (db))) {
+      PROG_ERR ("(%s) Pipeline failed\n", sqldb_lasterr (db));
+      goto errorexit;
+   }
+   {
+      uint64_t nchanges = 0;
+      uint32_t count = 0;
+      sqldb_pipeline_result (db, 2, &nchanges, NULL);
+      sqldb_exec_and_fetch (db, "select count(*) from one "
+                                "where col_a >= 8000;",
+                            sqldb_col_UNKNOWN,
+                            sqldb_col_UINT32, &count,
+                            sqldb_col_UNKNOWN);
+      if (sqldb_pipeline_count (db)!=3 || nchanges!=2 || count!=2) {
+         PROG_ERR ("Incorrect pipeline results [%zu, %" PRIu64 ", %u]\n",
+                     sqldb_pipeline_count (db), nchanges, count);
+         goto errorexit;
+      }
+   }
+
+   // Test bulk execution: the duplicate key in the second call must
+   // cause none of its rows to be inserted.
+   {
+      uint32_t ids[100];
+      const char *names[100];
+      size_t failed_row = 0;
+      uint32_t count = 0;
+      for (uint32_t i=0; i<100; i++) {
+         ids[i] = 5000 + i;
+         names[i] = (i % 2) ? "Bulk odd" : "Bulk even";
+      }
+      if (!(sqldb_exec_many (db, "insert into one values (#1, #2);",
+                                 100, &failed_row,
+                                 sqldb_col_UINT32, ids,
+                                 sqldb_col_TEXT,   names,
+                                 sqldb_col_UNKNOWN))) {
+         PROG_ERR ("(%s) Bulk execution failed at row %zu\n",
+                     sqldb_lasterr (db), failed_row);
+         goto errorexit;
+      }
+      for (uint32_t i=0; i<10; i++) {
+         ids[i] = 5100 + i;
+      }
+      ids[7] = 5000;
+      if ((sqldb_exec_many (db, "insert into one values (#1, #2);",
+                                10, &failed_row,
+                                sqldb_col_UINT32, ids,
+                                sqldb_col_TEXT,   names,
+                                sqldb_col_UNKNOWN)) || failed_row!=7) {
+         PROG_ERR ("Bulk execution with a duplicate key failed at row %zu\n",
+                     failed_row);
+         goto errorexit;
+      }
+      printf ("Bulk execution failed as expected: %s\n", sqldb_lasterr (db));
+      sqldb_exec_and_fetch (db, "select count(*) from one "
+                                "where col_a >= 5000 and col_a < 5200;",
+                            sqldb_col_UNKNOWN,
+                            sqldb_col_UINT32, &count,
+                            sqldb_col_UNKNOWN);
+      if (count!=100) {
+         PROG_ERR ("Incorrect number of bulk rows [%u]\n", count);
+         goto errorexit;
+      }
+      if (!(sqldb_exec_many (db, "update one set col_b = 'Bulk even' "
+                                 "where col_a = 5000;",
+                                 3, &failed_row,
+                                 sqldb_col_UNKNOWN))) {
+         PROG_ERR ("(%s) Bulk execution without parameters failed\n",
+                     sqldb_lasterr (db));
+         goto errorexit;
+      }
+   }
+
+   // Test bulk loading from delimited text, including quoted fields and
+   // NULL values, and from a reader that rejects a row.
+   {
+      const char *columns[] = { "col_a", "col_b", NULL };
+      uint32_t count = 0;
+      uint32_t row = 0;
+      sqldb_bulk_src_t src = {
+         .delim = ',',
+         .header = true,
+         .progress = bulk_progress,
+         .progress_rows = 2,
+      };
+
+      if (!(src.inf = tmpfile ())) {
+         PROG_ERR ("Failed to create bulk load file\n");
+         goto errorexit;
+      }
+      fprintf (src.inf, "col_a,col_b\r\n"
+                        "5200,plain\r\n"
+                        "5201,\"quoted, \"\"comma\"\"\"\n"
+                        "5202,\n"
+                        "5203,\"\"\n");
+      rewind (src.inf);
+      int64_t nrows = sqldb_bulk_load (db, "one", columns, &src);
+      fclose (src.inf);
+      if (nrows!=4) {
+         PROG_ERR ("(%s) Bulk load failed [%" PRIi64 "]\n",
+                     sqldb_lasterr (db), nrows);
+         goto errorexit;
+      }
+      char *stringvar = NULL;
+      if ((sqldb_exec_and_fetch (db, "select col_b from one "
+                                     "where col_a=5201;",
+                                 sqldb_col_UNKNOWN,
+                                 sqldb_col_TEXT, &stringvar,
+                                 sqldb_col_UNKNOWN))!=1
+            || strcmp (stringvar, "quoted, \"comma\"")!=0) {
+         PROG_ERR ("Incorrect bulk loaded value [%s]\n", stringvar);
+         sqldb_free (stringvar);
+         goto errorexit;
+      }
+      sqldb_free (stringvar);
+      sqldb_exec_and_fetch (db, "select count(*) from one "
+                                "where col_a >= 5200 and col_b is null;",
+                            sqldb_col_UNKNOWN,
+                            sqldb_col_UINT32, &count,
+                            sqldb_col_UNKNOWN);
+      if (count!=1
+            || (sqldb_exec_ignore (db, "delete from one where col_b is null;",
+                                       sqldb_col_UNKNOWN))==(uint64_t)-1) {
+         PROG_ERR ("Incorrect number of bulk loaded NULLs [%u]\n", count);
+         goto errorexit;
+      }
+
+      memset (&src, 0, sizeof src);
+      src.reader = bulk_reader;
+      src.reader_ctx = &row;
+      src.progress = bulk_progress;
+      src.progress_rows = 500;
+      if ((sqldb_bulk_load (db, "one", columns, &src))!=-1 || row!=1001) {
+         PROG_ERR ("Bulk load with a rejected row succeeded [%u]\n", row);
+         goto errorexit;
+      }
+      printf ("Bulk load failed as expected: %s\n", sqldb_lasterr (db));
+      sqldb_exec_and_fetch (db, "select count(*) from one "
+                                "where col_a >= 20000;",
+                            sqldb_col_UNKNOWN,
+                            sqldb_col_UINT32, &count,
+                            sqldb_col_UNKNOWN);
+      if (count!=0) {
+         PROG_ERR ("Rejected bulk load was not rolled back [%u]\n", count);
+         goto errorexit;
+      }
+   }
+
+   // Test transactions: rolling back a nested transaction must only undo
+   // the work done since it began.
+   {
+      uint32_t ids[] = { 5300, 5301 };
+      uint32_t count = 0;
+      if (!(sqldb_tx_begin (db, sqldb_tx_IMMEDIATE))
+            || (sqldb_exec_ignore (db, "insert into one values (#1, 'Tx');",
+                                       sqldb_col_UINT32, &ids[0],
+                                       sqldb_col_UNKNOWN))==(uint64_t)-1
+            || !(sqldb_tx_begin (db, sqldb_tx_DEFAULT))
+            || sqldb_tx_depth (db)!=2
+            || (sqldb_exec_ignore (db, "insert into one values (#1, 'Tx');",
+                                       sqldb_col_UINT32, &ids[1],
+                                       sqldb_col_UNKNOWN))==(uint64_t)-1
+            || !(sqldb_tx_rollback (db))
+            || !(sqldb_tx_commit (db))
+            || sqldb_tx_depth (db)!=0
+            || sqldb_tx_commit (db)) {
+         PROG_ERR ("(%s) Nested transaction failed\n", sqldb_lasterr (db));
+         goto errorexit;
+      }
+      sqldb_exec_and_fetch (db, "select count(*) from one "
+                                "where col_a >= 5300 and col_a < 5400;",
+                            sqldb_col_UNKNOWN,
+                            sqldb_col_UINT32, &count,
+                            sqldb_col_UNKNOWN);
+      if (count!=1) {
+         PROG_ERR ("Incorrect rows after nested transaction [%u]\n", count);
+         goto errorexit;
+      }
+   }
+
+   // Test retrying a transaction that fails because another connection
+   // holds the write lock.
+   if (dbtype==sqldb_SQLITE) {
+      sqldb_t *other = sqldb_open (dbname, dbtype);
+      if (!other || !(sqldb_tx_begin (other, sqldb_tx_IMMEDIATE))
+            || !(sqldb_tx_retry (db, sqldb_tx_DEFERRED, 3,
+                                 tx_contended, &other))
+            || other) {
+         PROG_ERR ("(%s) Retried transaction failed\n", sqldb_lasterr (db));
+         sqldb_close (other);
+         goto errorexit;
+      }
+   }
+
+   // Test the sqlite open options: a read-only connection must be able to
+   // read but not write.
+   if (dbtype==sqldb_SQLITE) {
+      sqldb_opts_t opts;
+      uint32_t count = 0;
+      sqldb_opts_default (&opts);
+      opts.readonly = true;
+      opts.cache_size = 100;
+      sqldb_t *reader = sqldb_open_ex (dbname, dbtype, &opts);
+      if (!reader
+            || (sqldb_exec_and_fetch (reader, "select count(*) from one;",
+                                      sqldb_col_UNKNOWN,
+                                      sqldb_col_UINT32, &count,
+                                      sqldb_col_UNKNOWN))!=1
+            || count==0
+            || (sqldb_exec_ignore (reader, "delete from one;",
+                                           sqldb_col_UNKNOWN))!=(uint64_t)-1) {
+         PROG_ERR ("(%s) Read-only connection failed\n",
+                     sqldb_lasterr (reader));
+         sqldb_close (reader);
+         goto errorexit;
+      }
+      sqldb_close (reader);
+   }
+
+   // Test parameter arrays: a borrowed string must be bound without being
+   // copied and must be read back unchanged.
+   {
+      char name[] = "Param";
+      sqldb_param_t params[2];
+      memset (params, 0, sizeof params);
+      params[0].type = sqldb_col_UINT32;
+      params[0].v.u32 = 5600;
+      params[1].type = sqldb_col_TEXT;
+      params[1].flags = sqldb_PARAM_BORROWED;
+      params[1].v.ptr = name;
+
+      if ((sqldb_exec_params_ignore (db, "insert into one values (#1, #2);",
+                                         params, 2))==(uint64_t)-1
+            || !(res = sqldb_exec_params (db, "select col_b from one "
+                                              "where col_a=#1 and col_b=#2;",
+                                          params, 2))
+            || sqldb_res_step (res)!=1) {
+         PROG_ERR ("(%s) Failed to execute parameter array\n",
+                     sqldb_lasterr (db));
+         goto errorexit;
+      }
+
+      char *stringvar = NULL;
+      if ((sqldb_scan_columns (res, sqldb_col_TEXT, &stringvar,
+                                    sqldb_col_UNKNOWN))!=1
+            || strcmp (stringvar, name)!=0) {
+         PROG_ERR ("Incorrect parameter array result [%s]\n", stringvar);
+         sqldb_free (stringvar);
+         goto errorexit;
+      }
+      sqldb_free (stringvar);
+      sqldb_res_del (res); res = NULL;
+   }
+
+   // Test asynchronous execution: the result must be retrievable once the
+   // connection has been polled to completion, and nothing else may be
+   // sent before then.
+   {
+      uint32_t id = 5600;
+      char *stringvar = NULL;
+      sqldb_poll_t rc;
+      if (!(sqldb_send (db, "select col_b from one where col_a=#1;",
+                            sqldb_col_UINT32, &id,
+                            sqldb_col_UNKNOWN))
+            || (sqldb_send (db, "select 1;", sqldb_col_UNKNOWN))) {
+         PROG_ERR ("(%s) Failed to send query\n", sqldb_lasterr (db));
+         goto errorexit;
+      }
+      while ((rc = sqldb_consume (db))==sqldb_poll_READ
+                                      || rc==sqldb_poll_WRITE) {
+         struct pollfd pfd = {
+            .fd = sqldb_socket (db),
+            .events = rc==sqldb_poll_READ ? POLLIN : POLLOUT,
+         };
+         poll (&pfd, 1, 1000);
+      }
+      if (rc!=sqldb_poll_OK
+            || !(res = sqldb_result (db))
+            || sqldb_res_step (res)!=1
+            || (sqldb_scan_columns (res, sqldb_col_TEXT, &stringvar,
+                                         sqldb_col_UNKNOWN))!=1
+            || strcmp (stringvar, "Param")!=0) {
+         PROG_ERR ("(%s) Asynchronous query failed [%s]\n",
+                     sqldb_lasterr (db), stringvar);
+         sqldb_free (stringvar);
+         goto errorexit;
+      }
+      sqldb_free (stringvar);
+      sqldb_res_del (res); res = NULL;
+   }
+
+   // Test struct mapping: every row must be decoded into the array, whose
+   // strings are in the same allocation.
+   {
+      struct row_t {
+         uint32_t  id;
+         char     *name;
+      } *rows = NULL;
+      const sqldb_field_t fields[] = {
+         { 0, sqldb_col_UINT32, offsetof (struct row_t, id),
+                                sizeof rows->id },
+         { 1, sqldb_col_TEXT,   offsetof (struct row_t, name),
+                                sizeof rows->name },
+      };
+      sqldb_fieldmap_t *map = sqldb_fieldmap_new (sizeof *rows, fields, 2);
+      int64_t nrows = -1;
+      if (!map || !(res = sqldb_exec (db, "select col_a, col_b from one "
+                                          "where col_a >= 5000 "
+                                          "and col_a < 5200 "
+                                          "order by col_a;",
+                                      sqldb_col_UNKNOWN))
+            || (nrows = sqldb_res_fetch_structs (res, map,
+                                                 (void **)&rows))!=100
+            || rows[0].id!=5000 || rows[99].id!=5099
+            || !rows[99].name || strcmp (rows[99].name, "Bulk odd")!=0) {
+         PROG_ERR ("(%s) Struct mapping failed [%" PRIi64 "]\n",
+                     sqldb_lasterr (db), nrows);
+         sqldb_free (rows);
+         sqldb_fieldmap_del (map);
+         goto errorexit;
+      }
+      printf ("Mapped %" PRIi64 " rows, last [%u:%s]\n", nrows,
+              rows[99].id, rows[99].name);
+      sqldb_free (rows);
+      sqldb_fieldmap_del (map);
+      sqldb_res_del (res); res = NULL;
+   }
+
+   // Test result arenas and reuse: scanned strings belong to the result
+   // and the same result must be usable for the next query.
+   {
+      uint32_t id = 5600;
+      int64_t nrows = 0;
+      int rc = 0;
+      char *stringvar = NULL;
+      char *first = NULL;
+      sqldb_flags_set (db, sqldb_FLAG_ARENA);
+      if (!(res = sqldb_exec (db, "select col_b from one "
+                                  "where col_a >= 5000 and col_a < 5200 "
+                                  "order by col_a;",
+                              sqldb_col_UNKNOWN))) {
+         PROG_ERR ("(%s) Arena query failed\n", sqldb_lasterr (db));
+         sqldb_flags_clear (db, sqldb_FLAG_ARENA);
+         goto errorexit;
+      }
+      while ((rc = sqldb_res_step (res))==1) {
+         if ((sqldb_scan_columns (res, sqldb_col_TEXT, &stringvar,
+                                       sqldb_col_UNKNOWN))!=1)
+            break;
+         if (!first)
+            first = stringvar;
+         nrows++;
+      }
+      if (rc!=0 || nrows!=100 || strcmp (first, "Bulk even")!=0
+            || strcmp (stringvar, "Bulk odd")!=0
+            || !(sqldb_res_exec (db, res, "select col_b from one "
+                                          "where col_a=#1;",
+                                 sqldb_col_UINT32, &id,
+                                 sqldb_col_UNKNOWN))
+            || sqldb_res_step (res)!=1
+            || (sqldb_scan_columns (res, sqldb_col_TEXT, &stringvar,
+                                         sqldb_col_UNKNOWN))!=1
+            || strcmp (stringvar, "Param")!=0) {
+         PROG_ERR ("(%s) Arena result failed [%" PRIi64 "]\n",
+                     sqldb_lasterr (db), nrows);
+         sqldb_flags_clear (db, sqldb_FLAG_ARENA);
+         goto errorexit;
+      }
+      sqldb_res_del (res); res = NULL;
+
+      // The values from sqldb_exec_and_fetch() belong to the caller.
+      stringvar = NULL;
+      if ((sqldb_exec_and_fetch (db, "select col_b from one where col_a=#1;",
+                                     sqldb_col_UINT32, &id,
+                                     sqldb_col_UNKNOWN,
+                                     sqldb_col_TEXT, &stringvar,
+                                     sqldb_col_UNKNOWN))!=1
+            || strcmp (stringvar, "Param")!=0) {
+         PROG_ERR ("(%s) Fetch with arena failed\n", sqldb_lasterr (db));
+         sqldb_free (stringvar);
+         sqldb_flags_clear (db, sqldb_FLAG_ARENA);
+         goto errorexit;
+      }
+      sqldb_free (stringvar);
+      sqldb_flags_clear (db, sqldb_FLAG_ARENA);
+   }
+
+   // Test compiled templates: the '#' characters inside the literal and
+   // the comment must not be treated as parameters.
+   tmpl = sqldb_tmpl_new ("insert into one values (#id, '#1 ''#2''') "
+                          "/* #3 */ -- #4\n");
+   if (!tmpl || sqldb_tmpl_nparams (tmpl)!=1
+             || sqldb_tmpl_param_index (tmpl, "id")!=1) {
+      PROG_ERR ("Failed to compile template [%u params]\n",
+                  tmpl ? sqldb_tmpl_nparams (tmpl) : 0);
+      goto errorexit;
+   }
+   printf ("Template [%s]\n", sqldb_tmpl_query (tmpl, dbtype));
+
+   uint32_t tid = 7070;
+   if ((sqldb_exec_tmpl_ignore (db, tmpl, sqldb_col_UINT32, &tid,
+                                          sqldb_col_UNKNOWN))==(uint64_t)-1) {
+      PROG_ERR ("(%s) Failed to execute template\n", sqldb_lasterr (db));
+      goto errorexit;
+   }
+   sqldb_tmpl_del (tmpl);
+
+   tmpl = sqldb_tmpl_new ("select col_b from one where col_a=#id "
+                          "and col_a>=#id;");
+   if (!tmpl || sqldb_tmpl_nparams (tmpl)!=1) {
+      PROG_ERR ("Failed to compile template\n");
+      goto errorexit;
+   }
+   if (!(res = sqldb_exec_tmpl (db, tmpl, sqldb_col_UINT32, &tid,
+                                          sqldb_col_UNKNOWN))
+         || sqldb_res_step (res)!=1) {
+      PROG_ERR ("(%s) Failed to execute template\n", sqldb_lasterr (db));
+      goto errorexit;
+   }
+   {
+      char *stringvar = NULL;
+      if ((sqldb_scan_columns (res, sqldb_col_TEXT, &stringvar,
+                                    sqldb_col_UNKNOWN))!=1
+            || strcmp (stringvar, "#1 '#2'")!=0) {
+         PROG_ERR ("Template literal was modified [%s]\n", stringvar);
+         sqldb_free (stringvar);
+         goto errorexit;
+      }
+      printf ("Template literal preserved [%s]\n", stringvar);
+      sqldb_free (stringvar);
+   }
+   sqldb_res_del (res); res = NULL;
+
+   // Test streaming: every step must yield the next row and scanning must
+   // not advance the row.
+   sqldb_flags_set (db, sqldb_FLAG_STREAMING);
+   if (!(res = sqldb_exec (db, "select col_a from one where col_a >= 8000 "
+                               "order by col_a;",
+                               sqldb_col_UNKNOWN))) {
+      PROG_ERR ("(%s) Failed to execute streaming query\n",
+                  sqldb_lasterr (db));
+      goto errorexit;
+   }
+   for (uint32_t i=0; i<2; i++) {
+      uint32_t first = 0, second = 0;
+      if (sqldb_res_step (res)!=1
+            || sqldb_scan_columns (res, sqldb_col_UINT32, &first,
+                                        sqldb_col_UNKNOWN)!=1
+            || sqldb_scan_columns (res, sqldb_col_UINT32, &second,
+                                        sqldb_col_UNKNOWN)!=1
+            || first!=8100 + i || second!=first) {
+         PROG_ERR ("(%s) Incorrect streamed row %u [%u:%u]\n",
+                     sqldb_lasterr (db), i, first, second);
+         goto errorexit;
+      }
+   }
+   if (sqldb_res_step (res)!=0) {
+      PROG_ERR ("(%s) Streaming result did not end\n", sqldb_lasterr (db));
+      goto errorexit;
+   }
+   sqldb_res_del (res); res = NULL;
+   sqldb_flags_clear (db, sqldb_FLAG_STREAMING);
+
+   // Test 64-bit values, which must not be truncated, in binary mode.
+   sqldb_flags_set (db, sqldb_FLAG_BINARY);
+   {
+      uint64_t u64 = 0;
+      int64_t i64 = 0;
+      if ((sqldb_exec_and_fetch (db, "select 5000000000, -5000000000;",
+                                 sqldb_col_UNKNOWN,
+                                 sqldb_col_UINT64, &u64,
+                                 sqldb_col_INT64,  &i64,
+                                 sqldb_col_UNKNOWN))!=2
+            || u64!=5000000000 || i64!=-5000000000) {
+         PROG_ERR ("(%s) Incorrect 64-bit values [%" PRIu64 ":%" PRIi64 "]\n",
+                     sqldb_lasterr (db), u64, i64);
+         goto errorexit;
+      }
+   }
+   sqldb_flags_clear (db, sqldb_FLAG_BINARY);
+
+   // Test column views: NULL must be distinguishable from an empty string.
+   if (!(res = sqldb_exec (db, "select NULL, '', 'abc';", sqldb_col_UNKNOWN))
+         || sqldb_res_step (res)!=1) {
+      PROG_ERR ("(%s) Failed to execute view query\n", sqldb_lasterr (db));
+      goto errorexit;
+   }
+   {
+      sqldb_colview_t cols[3];
+      for (uint32_t i=0; i<3; i++) {
+         if (!(sqldb_res_column_view (res, i, &cols[i]))) {
+            PROG_ERR ("(%s) Failed to view column %u\n",
+                        sqldb_res_lasterr (res), i);
+            goto errorexit;
+         }
+      }
+      if (!cols[0].is_null || cols[1].is_null || cols[1].len!=0
+            || cols[2].len!=3 || strcmp (cols[2].ptr, "abc")!=0
+            || sqldb_res_column_view (res, 3, &cols[0])) {
+         PROG_ERR ("Incorrect column views\n");
+         goto errorexit;
+      }
+   }
+   sqldb_res_del (res); res = NULL;
+
+   // Test batch fetching: a small batch must return the same rows as
+   // stepping through the result.
+   {
+      int64_t sum = 0, nrows = 0, textlen = 0;
+      const char *bquery = "select col_a, col_b, NULL from one;";
+
+      if (!(res = sqldb_exec (db, bquery, sqldb_col_UNKNOWN))) {
+         PROG_ERR ("(%s) Failed to execute batch query\n", sqldb_lasterr (db));
+         goto errorexit;
+      }
+      while ((rc = sqldb_res_step (res))==1) {
+         uint32_t intvar = 0;
+         char *stringvar = NULL;
+         sqldb_scan_columns (res, sqldb_col_UINT32, &intvar,
+                                  sqldb_col_TEXT,   &stringvar,
+                                  sqldb_col_UNKNOWN);
+         sum += intvar;
+         textlen += strlen (stringvar);
+         nrows++;
+         sqldb_free (stringvar);
+      }
+      sqldb_res_del (res); res = NULL;
+
+      int64_t ints[3], nullints[3];
+      uint32_t offsets[4];
+      char bytes[16];
+      uint8_t nulls[3][1];
+      sqldb_colbatch_t cols[3] = {
+         { sqldb_col_INT64, ints,     NULL,    NULL,  0,            nulls[0] },
+         { sqldb_col_TEXT,  NULL,     offsets, bytes, sizeof bytes, nulls[1] },
+         { sqldb_col_INT64, nullints, NULL,    NULL,  0,            nulls[2] },
+      };
+      int64_t n, bsum = 0, bnrows = 0, btextlen = 0;
+
+      if (!(res = sqldb_exec (db, bquery, sqldb_col_UNKNOWN))) {
+         PROG_ERR ("(%s) Failed to execute batch query\n", sqldb_lasterr (db));
+         goto errorexit;
+      }
+      while ((n = sqldb_res_fetch_batch (res, cols, 3, 3)) > 0) {
+         for (int64_t i=0; i<n; i++) {
+            bsum += ints[i];
+         }
+         if (nulls[0][0] || nulls[1][0] || nulls[2][0]!=(1 << n) - 1) {
+            PROG_ERR ("Incorrect null bitmaps\n");
+            goto errorexit;
+         }
+         btextlen += offsets[n];
+         bnrows += n;
+      }
+      sqldb_res_del (res); res = NULL;
+
+      if (n < 0 || bnrows!=nrows || bsum!=sum || btextlen!=textlen) {
+         PROG_ERR ("Incorrect batch [%" PRIi64 ", %" PRIi64 ", %" PRIi64
+                   "] != [%" PRIi64 ", %" PRIi64 ", %" PRIi64 "]\n",
+                     bnrows, bsum, btextlen, nrows, sum, textlen);
+         goto errorexit;
+      }
+      printf ("Fetched %" PRIi64 " rows in batches\n", bnrows);
+   }
+
+   // Test the timeline: every phase of a statement must be recorded, and
+   // only the most recent spans are kept.
+   {
+      static char text[64 * 1024];
+      static const char *names[] = {
+         "exec", "prepare", "bind", "step", "scan", "commit",
+      };
+      uint32_t from = 5000, value = 0;
+
+      if (!(sqldb_timeline_enable (256))
+            || !(sqldb_tx_begin (db, sqldb_tx_DEFAULT))
+            || !(res = sqldb_exec (db, "select col_a from one "
+                                       "where col_a = #1 or col_a < 0;",
+                                       sqldb_col_UINT32, &from,
+                                       sqldb_col_UNKNOWN))
+            || sqldb_res_step (res)!=1
+            || sqldb_scan_columns (res, sqldb_col_UINT32, &value,
+                                        sqldb_col_UNKNOWN)!=1
+            || !(sqldb_tx_commit (db))) {
+         PROG_ERR ("(%s) Failed to record timeline\n", sqldb_lasterr (db));
+         goto errorexit;
+      }
+      sqldb_res_del (res); res = NULL;
+
+      size_t nspans = timeline_read (text, sizeof text);
+      printf ("Timeline (%zu spans): %s\n", nspans, text);
+      for (size_t i=0; i<sizeof names / sizeof names[0]; i++) {
+         char name[32];
+         snprintf (name, sizeof name, "\"name\":\"%s\"", names[i]);
+         if (!(strstr (text, name))) {
+            PROG_ERR ("No [%s] span in the timeline\n", names[i]);
+            goto errorexit;
+         }
+      }
+
+      if (!(sqldb_timeline_enable (4))) {
+         PROG_ERR ("Failed to resize the timeline\n");
+         goto errorexit;
+      }
+      for (size_t i=0; i<10; i++) {
+         sqldb_exec_ignore (db, "select col_a from one where col_a = #1;",
+                                sqldb_col_UINT32, &from,
+                                sqldb_col_UNKNOWN);
+      }
+      if ((nspans = timeline_read (text, sizeof text))!=4
+            || !(sqldb_timeline_enable (0))
+            || timeline_read (text, sizeof text)!=0) {
+         PROG_ERR ("Expected 4 and then 0 spans, got %zu\n", nspans);
+         goto errorexit;
+      }
+   }
+
+   // Test the trace: with a threshold of zero every statement is reported,
+   // with the values of its parameters unless they are redacted.
+   {
+      const char *query = "select col_a from one where col_b=#1;";
+      const char *secret = "trace_secret";
+      struct trace_log_t log;
+
+      memset (&log, 0, sizeof log);
+
+      for (size_t i=0; i<2; i++) {
+         bool redact = i==1;
+         if (!(sqldb_set_trace (db, trace_log, &log, 0, redact))
+               || (sqldb_exec_ignore (db, query, sqldb_col_TEXT, &secret,
+                                                 sqldb_col_UNKNOWN))
+                     ==(uint64_t)-1) {
+            PROG_ERR ("(%s) Failed to trace query\n", sqldb_lasterr (db));
+            goto errorexit;
+         }
+         printf ("Traced %zu: [%s]\n", log.ntraces, log.text);
+         if (log.ntraces!=i + 1
+               || (strstr (log.text, secret)==NULL)!=redact) {
+            PROG_ERR ("Incorrect trace [%s]\n", log.text);
+            goto errorexit;
+         }
+      }
+
+      // A threshold that no statement reaches, then no trace at all.
+      if (!(sqldb_set_trace (db, trace_log, &log, UINT64_MAX, false))
+            || (sqldb_exec_ignore (db, query, sqldb_col_TEXT, &secret,
+                                              sqldb_col_UNKNOWN))==(uint64_t)-1
+            || !(sqldb_set_trace (db, NULL, NULL, 0, false))
+            || (sqldb_exec_ignore (db, query, sqldb_col_TEXT, &secret,
+                                              sqldb_col_UNKNOWN))==(uint64_t)-1
+            || log.ntraces!=2) {
+         PROG_ERR ("Statements were traced [%zu]\n", log.ntraces);
+         goto errorexit;
+      }
+   }
+
+   // Unsigned parameters above INT32_MAX must not arrive as negative.
+   {
+      uint32_t big = 0xFFFFFFFF;
+      uint64_t value = 0;
+      if ((sqldb_exec_and_fetch (db, "select #1;",
+                                 sqldb_col_UINT32, &big,
+                                 sqldb_col_UNKNOWN,
+                                 sqldb_col_UINT64, &value,
+                                 sqldb_col_UNKNOWN))!=1
+            || value!=0xFFFFFFFF) {
+         PROG_ERR ("(%s) UINT32 parameter became [%" PRIu64 "]\n",
+                     sqldb_lasterr (db), value);
+         goto errorexit;
+      }
+   }
+
+   // Test the statistics: every execution, row and timing of the labelled
+   // query must have been recorded.
+   {
+      const char *query = "select col_a, col_b from one "
+                          "where col_a >= #1 and col_a < #2;";
+      uint32_t from = 5000, to = 5100;
+      sqldb_stats_t *stats = NULL;
+      const sqldb_stats_entry_t *entry = NULL;
+      int rc = 0;
+
+      if ((sqldb_stats_label (query, "stats_probe"))
+            || (sqldb_stats_enable (true))
+            || !(sqldb_stats_label (query, "stats_probe"))) {
+         PROG_ERR ("Statistics enabled by default, or failed to label\n");
+         goto errorexit;
+      }
+      // Differing queries under a single tag share one entry.
+      if (!(sqldb_stats_tag (db, "stats_tag"))
+            || (sqldb_exec_ignore (db, "select 1;", sqldb_col_UNKNOWN))
+                  ==(uint64_t)-1
+            || (sqldb_exec_ignore (db, "select 2;", sqldb_col_UNKNOWN))
+                  ==(uint64_t)-1
+            || !(sqldb_stats_tag (db, NULL))) {
+         PROG_ERR ("(%s) Failed to execute tagged queries\n",
+                     sqldb_lasterr (db));
+         goto errorexit;
+      }
+      for (size_t i=0; i<10; i++) {
+         if (!(res = sqldb_exec (db, query, sqldb_col_UINT32, &from,
+                                            sqldb_col_UINT32, &to,
+                                            sqldb_col_UNKNOWN))) {
+            PROG_ERR ("(%s) Failed to execute query\n", sqldb_lasterr (db));
+            goto errorexit;
+         }
+         while ((rc = sqldb_res_step (res))==1) {
+            sqldb_colview_t view;
+            sqldb_res_column_view (res, 1, &view);
+         }
+         sqldb_res_del (res); res = NULL;
+      }
+
+      if (!(stats = sqldb_stats_snapshot ())) {
+         PROG_ERR ("Failed to take a statistics snapshot\n");
+         goto errorexit;
+      }
+      const sqldb_stats_entry_t *tagged = NULL;
+      for (size_t i=0; i<stats->nentries; i++) {
+         if ((strcmp (stats->entries[i].label, "stats_probe"))==0)
+            entry = &stats->entries[i];
+         if ((strcmp (stats->entries[i].label, "stats_tag"))==0)
+            tagged = &stats->entries[i];
+      }
+      sqldb_stats_dump (stats, stdout);
+      if (rc!=0 || !entry || !tagged
+            || tagged->counters.nqueries!=2
+            || entry->counters.nqueries!=10
+            || entry->counters.nrows!=1000
+            || entry->counters.nbytes!=10 * 50 * (9 + 8)
+            || entry->timings[sqldb_TIMING_EXECUTE].count!=10
+            || entry->timings[sqldb_TIMING_FIRST_ROW].count!=10
+            || entry->timings[sqldb_TIMING_DRAIN].count!=10
+            || sqldb_hist_percentile (&entry->timings[sqldb_TIMING_DRAIN], 99)
+                  < sqldb_hist_percentile (&entry->timings[sqldb_TIMING_DRAIN],
+                                           50)
+            || stats->totals.nqueries < 10) {
+         PROG_ERR ("Incorrect statistics\n");
+         sqldb_free (stats);
+         goto errorexit;
+      }
+      sqldb_free (stats);
+
+      sqldb_counters_t counters;
+      sqldb_stats_reset (NULL);
+      sqldb_stats_counters (NULL, &counters);
+      if (counters.nqueries || !(stats = sqldb_stats_snapshot ())) {
+         PROG_ERR ("Statistics were not reset\n");
+         goto errorexit;
+      }
+      for (size_t i=0; i<stats->nentries; i++) {
+         if (stats->entries[i].counters.nqueries
+               || stats->entries[i].timings[sqldb_TIMING_EXECUTE].count) {
+            PROG_ERR ("Statistics for [%s] were not reset\n",
+                        stats->entries[i].label);
+            sqldb_free (stats);
+            goto errorexit;
+         }
+      }
+      sqldb_free (stats);
+   }
+
+   // Test the allocator hooks: both the library and sqlite must have
+   // allocated through them.
+   printf ("Allocations: malloc=%" PRIu64 " realloc=%" PRIu64
+           " free=%" PRIu64 "\n", counts.nmalloc, counts.nrealloc,
+           counts.nfree);
+   if (!counts.nmalloc || !counts.nfree
+         || (dbtype==sqldb_SQLITE && !counts.nrealloc)) {
+      PROG_ERR ("Allocator hooks were not used\n");
+      goto errorexit;
+   }
+
    ret = EXIT_SUCCESS;
 errorexit:
 
    if (inf)
       fclose (inf);
 
+   sqldb_tmpl_del (tmpl);
+
    for (size_t i=0; colnames && colnames[i]; i++) {
-      free (colnames[i]);
+      sqldb_free (colnames[i]);
    }
-   free (colnames);
+   sqldb_free (colnames);
 
    sqldb_res_del (res);
    sqldb_close (db);
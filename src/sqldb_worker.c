@@ -0,0 +1,471 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdatomic.h>
+
+#include <pthread.h>
+
+#ifndef PLATFORM_Windows
+#include <unistd.h>
+#include <fcntl.h>
+#endif
+
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
+
+#include "sqldb_worker.h"
+
+#define SQLDB_OOM(s)          fprintf (stderr, "OOM [%s]\n", s)
+
+#ifdef DEBUG
+#define PROG_ERR(...)      do {\
+      fprintf (stderr, "%s:%d: ", __FILE__, __LINE__);\
+      fprintf (stderr, __VA_ARGS__);\
+} while (0)
+#else
+#define PROG_ERR(...)
+#endif
+
+// A job is allocated when it is submitted, passes through a job queue to
+// a worker thread and then through the completion queue back to the
+// submitter, where it is freed once it has been collected.
+struct job_t {
+   _Atomic (struct job_t *) next;      // Link in the completion queue
+   struct job_t            *qnext;     // Link in a job queue
+
+   sqldb_job_fn_t          *fn;
+   void                    *ctx;
+   bool                     ok;
+};
+
+// The jobs waiting for a worker. Workers block on the queue, so it is
+// protected by a mutex rather than being lock-free.
+struct jobq_t {
+   pthread_mutex_t  lock;
+   pthread_cond_t   cond;
+   struct job_t    *head;
+   struct job_t    *tail;
+   bool             stop;
+};
+
+struct thread_t {
+   sqldb_worker_t  *worker;
+   struct jobq_t   *queue;
+   sqldb_t         *db;
+   pthread_t        tid;
+   bool             started;
+   bool             writer;
+};
+
+struct sqldb_worker_t {
+   struct jobq_t     writes;
+   struct jobq_t     reads;
+   size_t            nreaders;
+
+   // The writer is the first thread.
+   struct thread_t  *threads;
+   size_t            nthreads;
+
+   // The completion queue: an intrusive multiple-producer single-consumer
+   // queue. Producers only ever exchange the head; the consumer owns the
+   // tail. The stub node keeps the queue from ever being empty.
+   _Atomic (struct job_t *) done_head;
+   struct job_t     *done_tail;
+   struct job_t      done_stub;
+
+   // Readable while completions may be waiting. The descriptor is only
+   // written when signalled changes from false to true, so a burst of
+   // completions costs a single write.
+   int               fds[2];
+   atomic_bool       signalled;
+
+   atomic_uint_fast64_t nsubmitted;
+   uint64_t             ncompleted;
+   atomic_uint_fast64_t nfailed;
+   atomic_uint_fast64_t nwrites;
+   atomic_uint_fast64_t nreads;
+};
+
+/* *****************************************************************
+ * The notification descriptor: an eventfd on Linux, a pipe on other
+ * POSIX platforms and nothing on Windows.
+ */
+
+static bool notify_init (sqldb_worker_t *worker)
+{
+   worker->fds[0] = worker->fds[1] = -1;
+
+#if defined (__linux__)
+   if ((worker->fds[0] = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0)
+      return false;
+   worker->fds[1] = worker->fds[0];
+#elif !defined (PLATFORM_Windows)
+   if ((pipe (worker->fds))!=0)
+      return false;
+   for (int i=0; i<2; i++) {
+      fcntl (worker->fds[i], F_SETFL,
+             fcntl (worker->fds[i], F_GETFL) | O_NONBLOCK);
+      fcntl (worker->fds[i], F_SETFD, FD_CLOEXEC);
+   }
+#endif
+
+   return true;
+}
+
+static void notify_close (sqldb_worker_t *worker)
+{
+#ifndef PLATFORM_Windows
+   if (worker->fds[0] >= 0)
+      close (worker->fds[0]);
+   if (worker->fds[1] >= 0 && worker->fds[1]!=worker->fds[0])
+      close (worker->fds[1]);
+#endif
+   worker->fds[0] = worker->fds[1] = -1;
+}
+
+static void notify_signal (sqldb_worker_t *worker)
+{
+   if ((atomic_exchange (&worker->signalled, true)))
+      return;
+
+#ifndef PLATFORM_Windows
+   uint64_t one = 1;
+   // A full pipe is already readable, so a failed write is harmless.
+   if ((write (worker->fds[1], &one, sizeof one)) < 0) {
+      PROG_ERR ("Failed to signal completion: %m\n");
+   }
+#endif
+}
+
+// The descriptor is drained before signalled is cleared: a producer that
+// finds signalled set has already written, or is about to write, and that
+// write must not be consumed after the flag that suppresses the next one
+// has been cleared.
+static void notify_reset (sqldb_worker_t *worker)
+{
+#ifndef PLATFORM_Windows
+   uint64_t buf[8];
+   while ((read (worker->fds[0], buf, sizeof buf)) > 0)
+      ;
+#endif
+
+   atomic_store (&worker->signalled, false);
+}
+
+/* *****************************************************************
+ * The completion queue.
+ */
+
+static void done_push (sqldb_worker_t *worker, struct job_t *job)
+{
+   atomic_store (&job->next, NULL);
+   struct job_t *prev = atomic_exchange (&worker->done_head, job);
+   atomic_store (&prev->next, job);
+}
+
+// Returns NULL when the queue is empty, or when a producer has not yet
+// finished linking its job (which it will signal once it has).
+static struct job_t *done_pop (sqldb_worker_t *worker)
+{
+   struct job_t *tail = worker->done_tail;
+   struct job_t *next = atomic_load (&tail->next);
+
+   if (tail==&worker->done_stub) {
+      if (!next)
+         return NULL;
+      worker->done_tail = next;
+      tail = next;
+      next = atomic_load (&tail->next);
+   }
+
+   if (next) {
+      worker->done_tail = next;
+      return tail;
+   }
+
+   if (tail!=atomic_load (&worker->done_head))
+      return NULL;
+
+   // The tail is the last job; the stub is pushed behind it so that the
+   // tail can be unlinked.
+   done_push (worker, &worker->done_stub);
+
+   if ((next = atomic_load (&tail->next))) {
+      worker->done_tail = next;
+      return tail;
+   }
+
+   return NULL;
+}
+
+/* *****************************************************************
+ * The job queues and the worker threads.
+ */
+
+static void jobq_init (struct jobq_t *queue)
+{
+   pthread_mutex_init (&queue->lock, NULL);
+   pthread_cond_init (&queue->cond, NULL);
+}
+
+static void jobq_destroy (struct jobq_t *queue)
+{
+   pthread_cond_destroy (&queue->cond);
+   pthread_mutex_destroy (&queue->lock);
+}
+
+static void jobq_push (struct jobq_t *queue, struct job_t *job)
+{
+   job->qnext = NULL;
+
+   pthread_mutex_lock (&queue->lock);
+   if (queue->tail) {
+      queue->tail->qnext = job;
+   } else {
+      queue->head = job;
+   }
+   queue->tail = job;
+   pthread_cond_signal (&queue->cond);
+   pthread_mutex_unlock (&queue->lock);
+}
+
+// Waits for the next job. Returns NULL once the queue has been stopped
+// and every job in it has been taken.
+static struct job_t *jobq_pop (struct jobq_t *queue)
+{
+   struct job_t *ret = NULL;
+
+   pthread_mutex_lock (&queue->lock);
+
+   while (!queue->head && !queue->stop)
+      pthread_cond_wait (&queue->cond, &queue->lock);
+
+   if ((ret = queue->head)) {
+      queue->head = ret->qnext;
+      if (!queue->head)
+         queue->tail = NULL;
+   }
+
+   pthread_mutex_unlock (&queue->lock);
+
+   return ret;
+}
+
+static void jobq_stop (struct jobq_t *queue)
+{
+   pthread_mutex_lock (&queue->lock);
+   queue->stop = true;
+   pthread_cond_broadcast (&queue->cond);
+   pthread_mutex_unlock (&queue->lock);
+}
+
+static void *worker_main (void *arg)
+{
+   struct thread_t *thread = arg;
+   sqldb_worker_t *worker = thread->worker;
+   struct job_t *job = NULL;
+
+   while ((job = jobq_pop (thread->queue))) {
+      job->ok = job->fn (thread->db, job->ctx);
+
+      if (!job->ok)
+         atomic_fetch_add (&worker->nfailed, 1);
+      atomic_fetch_add (thread->writer ? &worker->nwrites
+                                       : &worker->nreads, 1);
+
+      done_push (worker, job);
+      notify_signal (worker);
+   }
+
+   return NULL;
+}
+
+sqldb_worker_t *sqldb_worker_new (const char *dbname, size_t nreaders,
+                                  const sqldb_opts_t *opts)
+{
+   bool error = true;
+   sqldb_worker_t *ret = NULL;
+   sqldb_opts_t wopts, ropts;
+
+   if (!dbname) {
+      PROG_ERR ("No database specified\n");
+      return NULL;
+   }
+
+   if (!(ret = sqldb_calloc (1, sizeof *ret))) {
+      SQLDB_OOM (dbname);
+      return NULL;
+   }
+
+   jobq_init (&ret->writes);
+   jobq_init (&ret->reads);
+   ret->nreaders = nreaders;
+
+   atomic_init (&ret->done_stub.next, NULL);
+   atomic_init (&ret->done_head, &ret->done_stub);
+   ret->done_tail = &ret->done_stub;
+   atomic_init (&ret->signalled, false);
+
+   if (!(notify_init (ret))) {
+      PROG_ERR ("[%s] Failed to create the notification descriptor: %m\n",
+                  dbname);
+      goto errorexit;
+   }
+
+   if (!(ret->threads = sqldb_calloc (nreaders + 1, sizeof *ret->threads))) {
+      SQLDB_OOM (dbname);
+      goto errorexit;
+   }
+
+   if (opts) {
+      wopts = *opts;
+   } else {
+      sqldb_opts_default (&wopts);
+   }
+   // Each connection is only ever used by the thread that owns it.
+   wopts.nomutex = true;
+   ropts = wopts;
+   ropts.readonly = true;
+
+   // The writer's connection is opened first so that the database (and,
+   // in WAL mode, its journal) exists before the readers open it.
+   for (size_t i=0; i<nreaders + 1; i++) {
+      struct thread_t *thread = &ret->threads[i];
+
+      thread->worker = ret;
+      thread->writer = i==0;
+      thread->queue = thread->writer ? &ret->writes : &ret->reads;
+      ret->nthreads++;
+
+      if (!(thread->db = sqldb_open_ex (dbname, sqldb_SQLITE,
+                                        thread->writer ? &wopts : &ropts))) {
+         PROG_ERR ("[%s] Failed to open connection %zu\n", dbname, i);
+         goto errorexit;
+      }
+
+      if ((pthread_create (&thread->tid, NULL, worker_main, thread))!=0) {
+         PROG_ERR ("[%s] Failed to start thread %zu\n", dbname, i);
+         goto errorexit;
+      }
+      thread->started = true;
+   }
+
+   error = false;
+
+errorexit:
+   if (error) {
+      sqldb_worker_del (ret);
+      ret = NULL;
+   }
+
+   return ret;
+}
+
+void sqldb_worker_del (sqldb_worker_t *worker)
+{
+   struct job_t *job = NULL;
+
+   if (!worker)
+      return;
+
+   jobq_stop (&worker->writes);
+   jobq_stop (&worker->reads);
+
+   for (size_t i=0; i<worker->nthreads; i++) {
+      if (worker->threads[i].started)
+         pthread_join (worker->threads[i].tid, NULL);
+      sqldb_close (worker->threads[i].db);
+   }
+
+   // Every producer has stopped, so the queue is consistent.
+   while ((job = done_pop (worker)))
+      sqldb_free (job);
+
+   notify_close (worker);
+   jobq_destroy (&worker->writes);
+   jobq_destroy (&worker->reads);
+
+   sqldb_free (worker->threads);
+   sqldb_free (worker);
+}
+
+bool sqldb_worker_submit (sqldb_worker_t *worker, bool write,
+                          sqldb_job_fn_t *fn, void *ctx)
+{
+   struct job_t *job = NULL;
+
+   if (!worker || !fn)
+      return false;
+
+   if (!(job = sqldb_calloc (1, sizeof *job))) {
+      SQLDB_OOM ("Worker job");
+      return false;
+   }
+
+   job->fn = fn;
+   job->ctx = ctx;
+
+   atomic_fetch_add (&worker->nsubmitted, 1);
+
+   jobq_push (write || !worker->nreaders ? &worker->writes : &worker->reads,
+              job);
+
+   return true;
+}
+
+size_t sqldb_worker_complete (sqldb_worker_t *worker,
+                              sqldb_completion_t *dst, size_t max)
+{
+   size_t ret = 0;
+   struct job_t *job = NULL;
+
+   if (!worker || !dst)
+      return 0;
+
+   // The descriptor is reset before the queue is read so that a job
+   // completed after the queue was found empty signals it again.
+   notify_reset (worker);
+
+   while (ret < max && (job = done_pop (worker))) {
+      dst[ret].ctx = job->ctx;
+      dst[ret].ok = job->ok;
+      sqldb_free (job);
+      ret++;
+   }
+
+   // Anything left behind must still be signalled. The flag was cleared
+   // by the reset, so either this call or a producer that set it since
+   // then writes to the descriptor.
+   if (ret==max)
+      notify_signal (worker);
+
+   worker->ncompleted += ret;
+
+   return ret;
+}
+
+int sqldb_worker_fd (sqldb_worker_t *worker)
+{
+   return worker ? worker->fds[0] : -1;
+}
+
+void sqldb_worker_stats (sqldb_worker_t *worker, sqldb_worker_stats_t *dst)
+{
+   if (!dst)
+      return;
+
+   memset (dst, 0, sizeof *dst);
+
+   if (!worker)
+      return;
+
+   dst->nsubmitted = atomic_load (&worker->nsubmitted);
+   dst->ncompleted = worker->ncompleted;
+   dst->nfailed = atomic_load (&worker->nfailed);
+   dst->nwrites = atomic_load (&worker->nwrites);
+   dst->nreads = atomic_load (&worker->nreads);
+}
+
@@ -0,0 +1,95 @@
+
+#ifndef H_SQLDB_WORKER
+#define H_SQLDB_WORKER
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "sqldb.h"
+
+// An execution service that runs sqlite work on dedicated threads, so
+// that a long-running statement does not block the thread (typically an
+// event loop) that submitted it.
+//
+// Every job is a function that is called on a worker thread with that
+// worker's connection. Jobs that write are run, in the order submitted,
+// by a single writer thread; jobs that only read are spread across a pool
+// of reader threads with read-only connections. Each completed job is
+// placed on a completion queue, from which the submitting thread collects
+// it. The completion queue is lock-free, and on POSIX platforms a file
+// descriptor becomes readable whenever completions are waiting, so that
+// it can be added to poll(), epoll, etc.
+//
+// Results and connections must not be used outside the job function: the
+// job must copy whatever it needs from the results into its context
+// before returning.
+//
+// See the file sqldb_worker_test.c for an example of the usage.
+
+typedef struct sqldb_worker_t sqldb_worker_t;
+
+// A job; db is the worker's connection and ctx is the context passed to
+// sqldb_worker_submit(). Returns false if the job failed.
+typedef bool (sqldb_job_fn_t) (sqldb_t *db, void *ctx);
+
+// A completed job.
+typedef struct {
+   void     *ctx;          // The context passed to sqldb_worker_submit()
+   bool      ok;           // The return value of the job function
+} sqldb_completion_t;
+
+typedef struct {
+   uint64_t  nsubmitted;   // Jobs submitted
+   uint64_t  ncompleted;   // Jobs collected with sqldb_worker_complete()
+   uint64_t  nfailed;      // Jobs that returned false
+   uint64_t  nwrites;      // Jobs run by the writer
+   uint64_t  nreads;       // Jobs run by the readers
+} sqldb_worker_stats_t;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+   // Create a new service for the sqlite database dbname, with a single
+   // writer thread and nreaders reader threads (reads are run by the
+   // writer when nreaders is zero). Every connection is opened with opts
+   // (the defaults from sqldb_opts_default() when opts is NULL) and
+   // without sqlite's mutex, as each is used only by its own thread; the
+   // readers' connections are opened read-only. Returns NULL on error,
+   // including when any of the connections could not be opened.
+   sqldb_worker_t *sqldb_worker_new (const char *dbname, size_t nreaders,
+                                     const sqldb_opts_t *opts);
+
+   // Wait for every submitted job to be run, then stop the threads, close
+   // the connections and free the service. Completions that have not
+   // been collected are discarded.
+   void sqldb_worker_del (sqldb_worker_t *worker);
+
+   // Submit a job to the writer (when write is true) or to the readers.
+   // Returns false if the job could not be queued, in which case it will
+   // never be run.
+   bool sqldb_worker_submit (sqldb_worker_t *worker, bool write,
+                             sqldb_job_fn_t *fn, void *ctx);
+
+   // Collect up to max completed jobs into dst without blocking. Returns
+   // the number of completions stored in dst. Only a single thread may
+   // collect completions.
+   size_t sqldb_worker_complete (sqldb_worker_t *worker,
+                                 sqldb_completion_t *dst, size_t max);
+
+   // Returns a file descriptor that is readable while completions may be
+   // waiting to be collected, or -1 if the platform has none. The caller
+   // must not read from or close the descriptor; it is reset by
+   // sqldb_worker_complete().
+   int sqldb_worker_fd (sqldb_worker_t *worker);
+
+   // Retrieve a snapshot of the statistics for the service.
+   void sqldb_worker_stats (sqldb_worker_t *worker,
+                            sqldb_worker_stats_t *dst);
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif
+
@@ -0,0 +1,279 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <inttypes.h>
+#include <errno.h>
+
+#include <poll.h>
+
+#include "sqldb_worker.h"
+
+#define TESTDB_SQLITE    ("/tmp/testdb_worker.sql3")
+
+#define PROG_ERR(...)      do {\
+      fprintf (stderr, "%s:%i: ", __FILE__, __LINE__);\
+      fprintf (stderr, __VA_ARGS__);\
+} while (0)
+
+#define NREADERS        (3)
+#define NWRITES         (200)
+#define NREADS          (400)
+#define BATCH           (16)
+#define NNOOPS          (1000)
+#define NROUNDS         (50)
+
+struct job_t {
+   uint32_t id;
+   uint32_t count;
+   bool     done;
+};
+
+static bool job_insert (sqldb_t *db, void *ctx)
+{
+   struct job_t *job = ctx;
+
+   return (sqldb_exec_ignore (db, "insert into worker_test values (#1);",
+                                  sqldb_col_UINT32, &job->id,
+                                  sqldb_col_UNKNOWN))!=(uint64_t)-1;
+}
+
+static bool job_count (sqldb_t *db, void *ctx)
+{
+   struct job_t *job = ctx;
+
+   return (sqldb_exec_and_fetch (db, "select count(*) from worker_test "
+                                     "where col_a <= #1;",
+                                     sqldb_col_UINT32, &job->id,
+                                     sqldb_col_UNKNOWN,
+                                     sqldb_col_UINT32, &job->count,
+                                     sqldb_col_UNKNOWN))==1;
+}
+
+// A read-only connection must refuse to write.
+static bool job_bad_write (sqldb_t *db, void *ctx)
+{
+   (void)ctx;
+   return (sqldb_exec_ignore (db, "insert into worker_test values (0);",
+                                  sqldb_col_UNKNOWN))!=(uint64_t)-1;
+}
+
+static bool job_noop (sqldb_t *db, void *ctx)
+{
+   (void)db;
+   (void)ctx;
+   return true;
+}
+
+// Wait on the descriptor until nexpected completions are collected. When
+// once is set the completions are only collected once per wakeup, so a
+// lost wakeup shows up as a timeout.
+static bool collect (sqldb_worker_t *worker, size_t nexpected, bool once,
+                     size_t *nfailed)
+{
+   sqldb_completion_t completions[BATCH];
+   size_t ncollected = 0;
+   struct pollfd pfd = { sqldb_worker_fd (worker), POLLIN, 0 };
+
+   *nfailed = 0;
+
+   while (ncollected < nexpected) {
+      size_t n = sqldb_worker_complete (worker, completions, BATCH);
+      for (size_t i=0; i<n; i++) {
+         struct job_t *job = completions[i].ctx;
+         if (job->done) {
+            PROG_ERR ("Job %u completed twice\n", job->id);
+            return false;
+         }
+         job->done = true;
+         if (!completions[i].ok)
+            (*nfailed)++;
+      }
+      ncollected += n;
+
+      if ((n && !once) || ncollected==nexpected)
+         continue;
+
+      int rc = poll (&pfd, 1, 5000);
+      if (rc < 0 && errno!=EINTR) {
+         PROG_ERR ("poll() failed: %m\n");
+         return false;
+      }
+      if (rc==0) {
+         PROG_ERR ("Timed out after %zu/%zu completions\n",
+                     ncollected, nexpected);
+         return false;
+      }
+   }
+
+   return true;
+}
+
+static void print_stats (sqldb_worker_t *worker, sqldb_worker_stats_t *stats)
+{
+   sqldb_worker_stats (worker, stats);
+   printf ("submitted=%" PRIu64 " completed=%" PRIu64 " failed=%" PRIu64
+           " writes=%" PRIu64 " reads=%" PRIu64 "\n",
+           stats->nsubmitted, stats->ncompleted, stats->nfailed,
+           stats->nwrites, stats->nreads);
+}
+
+int main (int argc, char **argv)
+{
+   int ret = EXIT_FAILURE;
+
+   sqldb_t *db = NULL;
+   sqldb_worker_t *worker = NULL;
+   sqldb_worker_stats_t stats;
+   struct job_t writes[NWRITES];
+   struct job_t reads[NREADS];
+   struct job_t bad;
+   struct job_t *noops = NULL;
+   size_t nfailed = 0;
+
+   memset (writes, 0, sizeof writes);
+   memset (reads, 0, sizeof reads);
+   memset (&bad, 0, sizeof bad);
+
+   printf ("Testing sqldb_worker version [%s]\n", SQLDB_VERSION);
+
+   if (argc < 2 || (strcmp (argv[1], "sqlite"))!=0) {
+      fprintf (stderr, "Failed to specify 'sqlite'\n");
+      return EXIT_FAILURE;
+   }
+
+   remove (TESTDB_SQLITE);
+   if (!(sqldb_create (NULL, TESTDB_SQLITE, sqldb_SQLITE))) {
+      PROG_ERR ("(%s) Could not create database\n", TESTDB_SQLITE);
+      goto errorexit;
+   }
+
+   if (!(db = sqldb_open (TESTDB_SQLITE, sqldb_SQLITE))
+         || !(sqldb_batch (db, "create table worker_test (col_a int);",
+                               NULL))) {
+      PROG_ERR ("Unable to prepare database - %s\n", sqldb_lasterr (db));
+      goto errorexit;
+   }
+   sqldb_close (db);
+   db = NULL;
+
+   if (!(worker = sqldb_worker_new (TESTDB_SQLITE, NREADERS, NULL))) {
+      PROG_ERR ("Failed to create worker [%s]\n", TESTDB_SQLITE);
+      goto errorexit;
+   }
+
+   if (sqldb_worker_fd (worker) < 0) {
+      PROG_ERR ("No notification descriptor\n");
+      goto errorexit;
+   }
+
+   for (size_t i=0; i<NWRITES; i++) {
+      writes[i].id = i + 1;
+      if (!(sqldb_worker_submit (worker, true, job_insert, &writes[i]))) {
+         PROG_ERR ("Failed to submit write %zu\n", i);
+         goto errorexit;
+      }
+   }
+
+   if (!(collect (worker, NWRITES, false, &nfailed)) || nfailed) {
+      PROG_ERR ("%zu writes failed\n", nfailed);
+      goto errorexit;
+   }
+
+   // Every write has been collected, so every read must see all of them.
+   for (size_t i=0; i<NREADS; i++) {
+      reads[i].id = i + 1;
+      if (!(sqldb_worker_submit (worker, false, job_count, &reads[i]))) {
+         PROG_ERR ("Failed to submit read %zu\n", i);
+         goto errorexit;
+      }
+   }
+
+   if (!(sqldb_worker_submit (worker, false, job_bad_write, &bad))) {
+      PROG_ERR ("Failed to submit bad write\n");
+      goto errorexit;
+   }
+
+   if (!(collect (worker, NREADS + 1, false, &nfailed)) || nfailed!=1) {
+      PROG_ERR ("Expected 1 failure, got %zu\n", nfailed);
+      goto errorexit;
+   }
+
+   for (size_t i=0; i<NREADS; i++) {
+      uint32_t expected = reads[i].id > NWRITES ? NWRITES : reads[i].id;
+      if (reads[i].count!=expected) {
+         PROG_ERR ("Read %u: expected %u rows, got %u\n",
+                     reads[i].id, expected, reads[i].count);
+         goto errorexit;
+      }
+   }
+
+   print_stats (worker, &stats);
+   if (stats.nsubmitted!=NWRITES + NREADS + 1
+         || stats.ncompleted!=stats.nsubmitted
+         || stats.nfailed!=1
+         || stats.nwrites!=NWRITES
+         || stats.nreads!=NREADS + 1) {
+      PROG_ERR ("Incorrect stats\n");
+      goto errorexit;
+   }
+
+   // Every thread completes jobs while they are being collected, so that
+   // the descriptor is signalled and reset concurrently.
+   if (!(noops = calloc (NNOOPS, sizeof *noops))) {
+      PROG_ERR ("OOM\n");
+      goto errorexit;
+   }
+   for (size_t round=0; round<NROUNDS; round++) {
+      memset (noops, 0, NNOOPS * sizeof *noops);
+      for (size_t i=0; i<NNOOPS; i++) {
+         noops[i].id = i + 1;
+         if (!(sqldb_worker_submit (worker, i % 4==0, job_noop,
+                                    &noops[i]))) {
+            PROG_ERR ("Failed to submit no-op %zu\n", i);
+            goto errorexit;
+         }
+      }
+
+      if (!(collect (worker, NNOOPS, true, &nfailed)) || nfailed) {
+         PROG_ERR ("Round %zu: %zu no-ops failed\n", round, nfailed);
+         goto errorexit;
+      }
+   }
+
+   // Jobs still queued when the service is deleted must be run.
+   for (size_t i=0; i<NWRITES; i++) {
+      writes[i].id = NWRITES + i + 1;
+      if (!(sqldb_worker_submit (worker, true, job_insert, &writes[i]))) {
+         PROG_ERR ("Failed to submit write %zu\n", i);
+         goto errorexit;
+      }
+   }
+   sqldb_worker_del (worker);
+   worker = NULL;
+
+   uint32_t count = 0;
+   if (!(db = sqldb_open (TESTDB_SQLITE, sqldb_SQLITE))
+         || (sqldb_exec_and_fetch (db, "select count(*) from worker_test;",
+                                   sqldb_col_UNKNOWN,
+                                   sqldb_col_UINT32, &count,
+                                   sqldb_col_UNKNOWN))!=1
+         || count!=NWRITES * 2) {
+      PROG_ERR ("Expected %u rows after shutdown, got %u\n",
+                  NWRITES * 2, count);
+      goto errorexit;
+   }
+
+   ret = EXIT_SUCCESS;
+
+errorexit:
+   sqldb_worker_del (worker);
+   sqldb_close (db);
+   free (noops);
+
+   PROG_ERR ("XXX Test: %s XXX\n", ret==EXIT_SUCCESS ? "passed" : "failed");
+
+   return ret;
+}
+
@@ -134,6 +134,11 @@ $VALGRIND $VGOPTS $PROG group_adduser Group-One ten@example.com
 $VALGRIND $VGOPTS $PROG group_rmuser Group-One three@example.com
 $VALGRIND $VGOPTS $PROG group_rmuser Group-One five@example.com
 
+# Add and remove several users at a time
+$VALGRIND $VGOPTS $PROG group_adduser Group-Two one@example.com two@example.com three@example.com
+$VALGRIND $VGOPTS $PROG group_rmuser Group-Two one@example.com three@example.com
+$VALGRIND $VGOPTS $PROG group_members Group-Two
+
 # List group membership
 $VALGRIND $VGOPTS $PROG group_members Group-One
 
@@ -25,8 +25,20 @@ echo Starting sqlite tests
 $VGRIND test-scripts/sqldb_test.elf sqlite   || die "SQLITE test failed"
 echo Sqlite tests passed.
 
+echo Starting sqlite pool tests
+$VGRIND test-scripts/sqldb_pool_test.elf sqlite   || die "SQLITE pool test failed"
+echo Sqlite pool tests passed.
+
+echo Starting sqlite worker tests
+$VGRIND test-scripts/sqldb_worker_test.elf sqlite   || die "SQLITE worker test failed"
+echo Sqlite worker tests passed.
+
 echo Starting postgres tests
 $VGRIND test-scripts/sqldb_test.elf postgres || die "PSQL test failed"
 echo Postgres tests passed.
 
+echo Starting postgres pool tests
+$VGRIND test-scripts/sqldb_pool_test.elf postgres || die "PSQL pool test failed"
+echo Postgres pool tests passed.
+
 exit 0;